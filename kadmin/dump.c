@@ -37,6 +37,291 @@
 
 extern int local_flag;
 
+/*
+ * Binary dump format: the magic, then a sequence of records each
+ * consisting of a four byte big-endian length followed by the DER
+ * encoded hdb_entry, terminated by a zero length record.
+ */
+
+#define BINARY_BLOCK_SIZE	(1024 * 1024)
+#define BINARY_QUEUE_SIZE	1024
+
+struct binary_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+};
+
+static krb5_error_code
+binary_append(struct binary_buf *b, const hdb_entry *ent)
+{
+    krb5_error_code ret;
+    krb5_data value;
+
+    ret = hdb_entry2value(context, ent, &value);
+    if (ret)
+	return ret;
+    if (value.length > 0xffffffff) {
+	krb5_data_free(&value);
+	return ERANGE;
+    }
+    if (b->len + 4 + value.length > b->size) {
+	size_t size = b->size ? b->size : BINARY_BLOCK_SIZE;
+	unsigned char *p;
+
+	while (size < b->len + 4 + value.length)
+	    size *= 2;
+	p = realloc(b->data, size);
+	if (p == NULL) {
+	    krb5_data_free(&value);
+	    return ENOMEM;
+	}
+	b->data = p;
+	b->size = size;
+    }
+    _krb5_put_int(b->data + b->len, value.length, 4);
+    memcpy(b->data + b->len + 4, value.data, value.length);
+    b->len += 4 + value.length;
+    krb5_data_free(&value);
+    return 0;
+}
+
+/* a short fwrite() need not set errno, that still is an error */
+
+static krb5_error_code
+binary_write(FILE *f, const void *data, size_t len)
+{
+    errno = 0;
+    if (fwrite(data, 1, len, f) != len)
+	return (ferror(f) && errno) ? errno : EIO;
+    return 0;
+}
+
+static krb5_error_code
+binary_flush(FILE *f, struct binary_buf *b)
+{
+    krb5_error_code ret;
+
+    if (b->len == 0)
+	return 0;
+    ret = binary_write(f, b->data, b->len);
+    if (ret == 0)
+	b->len = 0;
+    return ret;
+}
+
+struct binary_dump_arg {
+    FILE *out;
+    struct binary_buf buf;
+};
+
+static krb5_error_code
+binary_dump_entry(krb5_context ctx, HDB *db, hdb_entry_ex *entry, void *data)
+{
+    struct binary_dump_arg *arg = data;
+    krb5_error_code ret;
+
+    ret = binary_append(&arg->buf, &entry->entry);
+    if (ret == 0 && arg->buf.len >= BINARY_BLOCK_SIZE)
+	ret = binary_flush(arg->out, &arg->buf);
+    return ret;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+/*
+ * The backend only offers one iteration cursor, so the iterating
+ * thread hands entries over to a set of workers that encode them into
+ * private blocks; whole blocks are then written out under the output
+ * lock.
+ */
+
+struct binary_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    hdb_entry ents[BINARY_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    int done;
+    pthread_mutex_t out_lock;
+    FILE *out;
+    krb5_error_code ret;
+};
+
+static void
+binary_queue_set_error(struct binary_queue *q, krb5_error_code ret)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->ret == 0)
+	q->ret = ret;
+    q->done = 1;
+    pthread_cond_broadcast(&q->not_full);
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *
+binary_dump_worker(void *ptr)
+{
+    struct binary_queue *q = ptr;
+    struct binary_buf buf = { NULL, 0, 0 };
+    krb5_error_code ret = 0;
+    hdb_entry ent;
+
+    while (ret == 0) {
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->done)
+	    pthread_cond_wait(&q->not_empty, &q->lock);
+	if (q->count == 0 || q->ret) {
+	    pthread_mutex_unlock(&q->lock);
+	    break;
+	}
+	ent = q->ents[q->head];
+	q->head = (q->head + 1) % BINARY_QUEUE_SIZE;
+	q->count--;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+
+	ret = binary_append(&buf, &ent);
+	free_hdb_entry(&ent);
+	if (ret == 0 && buf.len >= BINARY_BLOCK_SIZE) {
+	    pthread_mutex_lock(&q->out_lock);
+	    ret = binary_flush(q->out, &buf);
+	    pthread_mutex_unlock(&q->out_lock);
+	}
+    }
+    if (ret == 0) {
+	pthread_mutex_lock(&q->out_lock);
+	ret = binary_flush(q->out, &buf);
+	pthread_mutex_unlock(&q->out_lock);
+    }
+    if (ret)
+	binary_queue_set_error(q, ret);
+    free(buf.data);
+    return NULL;
+}
+
+static krb5_error_code
+binary_queue_entry(krb5_context ctx, HDB *db, hdb_entry_ex *entry, void *data)
+{
+    struct binary_queue *q = data;
+    krb5_error_code ret;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == BINARY_QUEUE_SIZE && q->ret == 0)
+	pthread_cond_wait(&q->not_full, &q->lock);
+    ret = q->ret;
+    if (ret == 0) {
+	/* steal the entry, hdb_foreach frees what is left behind */
+	q->ents[(q->head + q->count) % BINARY_QUEUE_SIZE] = entry->entry;
+	memset(&entry->entry, 0, sizeof(entry->entry));
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+static krb5_error_code
+binary_dump_threaded(HDB *db, int flags, FILE *f, int nthreads)
+{
+    struct binary_queue *q;
+    pthread_t *threads;
+    krb5_error_code ret;
+    int i, started, err = 0;
+
+    q = calloc(1, sizeof(*q));
+    threads = calloc(nthreads, sizeof(threads[0]));
+    if (q == NULL || threads == NULL) {
+	free(q);
+	free(threads);
+	return ENOMEM;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_mutex_init(&q->out_lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->out = f;
+
+    for (started = 0; started < nthreads; started++) {
+	err = pthread_create(&threads[started], NULL, binary_dump_worker, q);
+	if (err)
+	    break;
+    }
+    if (started == 0) {
+	ret = err;
+    } else {
+	ret = hdb_foreach(context, db, flags, binary_queue_entry, q);
+	if (ret)
+	    binary_queue_set_error(q, ret);
+
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	for (i = 0; i < started; i++)
+	    pthread_join(threads[i], NULL);
+	if (ret == 0)
+	    ret = q->ret;
+    }
+
+    while (q->count) {
+	free_hdb_entry(&q->ents[q->head]);
+	q->head = (q->head + 1) % BINARY_QUEUE_SIZE;
+	q->count--;
+    }
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->out_lock);
+    pthread_mutex_destroy(&q->lock);
+    free(threads);
+    free(q);
+    return ret;
+}
+
+#endif /* ENABLE_PTHREAD_SUPPORT */
+
+static krb5_error_code
+binary_dump(HDB *db, int flags, FILE *f, int nthreads)
+{
+    struct binary_dump_arg arg;
+    unsigned char trailer[4];
+    krb5_error_code ret;
+
+    ret = binary_write(f, KADMIN_BINARY_DUMP_MAGIC,
+		       KADMIN_BINARY_DUMP_MAGIC_LEN);
+    if (ret)
+	return ret;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (nthreads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads > 8)
+	    nthreads = 8;
+    }
+    if (nthreads > 1) {
+	ret = binary_dump_threaded(db, flags, f, nthreads);
+    } else
+#endif
+    {
+	memset(&arg, 0, sizeof(arg));
+	arg.out = f;
+	ret = hdb_foreach(context, db, flags, binary_dump_entry, &arg);
+	if (ret == 0)
+	    ret = binary_flush(f, &arg.buf);
+	free(arg.buf.data);
+    }
+    if (ret)
+	return ret;
+
+    _krb5_put_int(trailer, 0, sizeof(trailer));
+    return binary_write(f, trailer, sizeof(trailer));
+}
+
 int
 dump(struct dump_options *opt, int argc, char **argv)
 {
@@ -44,6 +329,7 @@ dump(struct dump_options *opt, int argc, char **argv)
     FILE *f;
     struct hdb_print_entry_arg parg;
     HDB *db = NULL;
+    int flags = opt->decrypt_flag ? HDB_F_DECRYPT : 0;
 
     if (!local_flag) {
 	krb5_warnx(context, "dump is only available in local (-l) mode");
@@ -67,17 +353,26 @@ dump(struct dump_options *opt, int argc, char **argv)
 	goto out;
     }
 
+    if (opt->format_string && strcasecmp(opt->format_string, "binary") == 0) {
+	ret = binary_dump(db, flags, f, opt->threads_integer);
+	if (ret == 0 && fflush(f) != 0)
+	    ret = errno;
+	if (ret)
+	    krb5_warn(context, ret, "dump");
+	db->hdb_close(context, db);
+	goto out;
+    }
+
     if (!opt->format_string || strcmp(opt->format_string, "Heimdal") == 0) {
         parg.fmt = HDB_DUMP_HEIMDAL;
     } else if (opt->format_string && strcmp(opt->format_string, "MIT") == 0) {
         parg.fmt = HDB_DUMP_MIT;
         fprintf(f, "kdb5_util load_dump version 5\n"); /* 5||6, either way */
     } else {
-        krb5_errx(context, 1, "Supported dump formats: Heimdal and MIT");
+        krb5_errx(context, 1, "Supported dump formats: Heimdal, MIT and binary");
     }
     parg.out = f;
-    hdb_foreach(context, db, opt->decrypt_flag ? HDB_F_DECRYPT : 0,
-		hdb_print_entry, &parg);
+    hdb_foreach(context, db, flags, hdb_print_entry, &parg);
 
     db->hdb_close(context, db);
 out:
@@ -134,6 +134,11 @@ foreach_principal(const char *, int (*)(krb5_principal, void*),
 
 int parse_des_key (const char *, krb5_key_data *, const char **);
 
+/* dump.c, load.c */
+
+#define KADMIN_BINARY_DUMP_MAGIC	"\0hdbdump"
+#define KADMIN_BINARY_DUMP_MAGIC_LEN	8
+
 /* random_password.c */
 
 void
@@ -61,6 +61,70 @@ skip_next(char *p)
     return p;
 }
 
+/*
+ * Load a binary dump (see dump.c) from `f', positioned just after the
+ * magic.
+ */
+
+static int
+load_binary(const char *filename, FILE *f, HDB *db)
+{
+    krb5_error_code ret = 0;
+    unsigned char hdr[4];
+    unsigned char *buf = NULL;
+    size_t size = 0;
+    unsigned long line = 0;
+    unsigned long len;
+    krb5_data value;
+    hdb_entry_ex ent;
+
+    setvbuf(f, NULL, _IOFBF, 1024 * 1024);
+    while (1) {
+	line++;
+	if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) {
+	    krb5_warnx(context, "%s: truncated binary dump at record %lu",
+		       filename, line);
+	    ret = HDB_ERR_NOENTRY;
+	    break;
+	}
+	_krb5_get_int(hdr, &len, sizeof(hdr));
+	if (len == 0)
+	    break;
+	if (len > size) {
+	    unsigned char *p = realloc(buf, len);
+	    if (p == NULL) {
+		ret = ENOMEM;
+		krb5_warn(context, ret, "%s: record %lu", filename, line);
+		break;
+	    }
+	    buf = p;
+	    size = len;
+	}
+	if (fread(buf, 1, len, f) != len) {
+	    krb5_warnx(context, "%s: truncated binary dump at record %lu",
+		       filename, line);
+	    ret = HDB_ERR_NOENTRY;
+	    break;
+	}
+	value.data = buf;
+	value.length = len;
+	memset(&ent, 0, sizeof(ent));
+	ret = hdb_value2entry(context, &value, &ent.entry);
+	if (ret) {
+	    krb5_warn(context, ret, "%s: record %lu", filename, line);
+	    break;
+	}
+	ret = db->hdb_store(context, db, HDB_F_REPLACE, &ent);
+	hdb_free_entry(context, &ent);
+	if (ret) {
+	    krb5_warn(context, ret, "db_store");
+	    break;
+	}
+    }
+    free(buf);
+    return ret;
+}
+
 /*
  * Parse the time in `s', returning:
  * -1 if error parsing
@@ -365,6 +429,7 @@ doit(const char *filename, int mergep)
     krb5_error_code ret;
     FILE *f;
     char s[8192]; /* XXX should fix this properly */
+    char magic[KADMIN_BINARY_DUMP_MAGIC_LEN];
     char *p;
     int line;
     int flags = O_RDWR;
@@ -392,6 +457,16 @@ doit(const char *filename, int mergep)
 	fclose(f);
 	return 1;
     }
+
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+	memcmp(magic, KADMIN_BINARY_DUMP_MAGIC, sizeof(magic)) == 0) {
+	ret = load_binary(filename, f, db);
+	db->hdb_close(context, db);
+	fclose(f);
+	return ret != 0;
+    }
+    rewind(f);
+
     line = 0;
     ret = 0;
     while(fgets(s, sizeof(s), f) != NULL) {
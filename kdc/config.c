@@ -60,6 +60,8 @@ int enable_http = -1;
 
 /* Log over requests to the KDC */
 const char *request_log;
+size_t request_log_ring_size;	/* capture to a ring of this size */
+unsigned int request_log_sample;	/* capture one in this many */
 
 /* A string describing on what ports to listen */
 const char *port_str;
@@ -259,6 +261,27 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 					     "kdc",
 					     "kdc-request-log",
 					     NULL);
+    if (request_log) {
+	int sample;
+
+	p = krb5_config_get_string(context, NULL, "kdc",
+				   "kdc-request-log-ring-size", NULL);
+	if (p) {
+	    ssize_t sz = parse_bytes(p, NULL);
+	    if (sz <= 0)
+		krb5_errx(context, 1, "invalid kdc-request-log-ring-size: %s",
+			  p);
+	    request_log_ring_size = sz;
+	}
+	sample = krb5_config_get_int_default(context, NULL, 1,
+					     "kdc",
+					     "kdc-request-log-sample",
+					     NULL);
+	if (sample < 0)
+	    krb5_errx(context, 1, "invalid kdc-request-log-sample: %d",
+		      sample);
+	request_log_sample = sample;
+    }
 
     if (krb5_config_get_string(context, NULL, "kdc",
 			       "enforce-transited-policy", NULL))
@@ -421,6 +421,7 @@ do_request(krb5_context context,
 	   void *buf, size_t len, krb5_boolean prependlength,
 	   struct descr *d)
 {
+    static unsigned int sample_count;
     krb5_error_code ret;
     krb5_data reply;
     int datagram_reply = (d->type == SOCK_DGRAM);
@@ -432,8 +433,25 @@ do_request(krb5_context context,
 				   buf, len, &reply, &prependlength,
 				   d->addr_string, d->sa,
 				   datagram_reply);
-    if(request_log)
-	krb5_kdc_save_request(context, request_log, buf, len, &reply, d->sa);
+    if(request_log &&
+       (request_log_sample <= 1 || ++sample_count % request_log_sample == 0)) {
+	if (request_log_ring_size) {
+	    krb5_error_code ret2;
+
+	    ret2 = krb5_kdc_save_request_ring(context, request_log,
+					      request_log_ring_size,
+					      buf, len, &reply, d->sa);
+	    if (ret2) {
+		const char *msg = krb5_get_error_message(context, ret2);
+		kdc_log(context, config, 0,
+			"Not capturing requests: %s", msg);
+		krb5_free_error_message(context, msg);
+		request_log = NULL;
+	    }
+	} else
+	    krb5_kdc_save_request(context, request_log,
+				  buf, len, &reply, d->sa);
+    }
     if(reply.length){
 	send_reply(context, config, prependlength, d, &reply);
 	krb5_data_free(&reply);
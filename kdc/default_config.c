@@ -239,11 +239,22 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 				     "kdc",
 				     "pkinit_win2k_require_binding",
 				     NULL);
+    c->pkinit_check_revocation =
+	krb5_config_get_bool_default(context, NULL,
+				     FALSE,
+				     "kdc",
+				     "pkinit_check_revocation",
+				     NULL);
     c->pkinit_dh_min_bits =
 	krb5_config_get_int_default(context, NULL,
 				    0,
 				    "kdc", "pkinit_dh_min_bits", NULL);
 
+    if (_kdc_reply_cache_init(context, c))
+	krb5_warnx(context, "Failed to set up the reply cache");
+    if (_kdc_pa_cache_init(context, c))
+	krb5_warnx(context, "Failed to set up the preauth cache");
+
     *config = c;
 
     return 0;
@@ -521,6 +521,21 @@ _kdc_fast_unwrap_request(kdc_request_t r)
     }		
     krb5_data_free(&data);
 
+    /*
+     * The outer request is replaced below, which can't be done to
+     * one decoded into an arena, so decode it again the normal way.
+     */
+    if (r->arena) {
+	ret = decode_AS_REQ(r->request.data, r->request.length,
+			    &r->req, NULL);
+	if (ret) {
+	    free_KrbFastReq(&fastreq);
+	    free_PA_FX_FAST_REQUEST(&fxreq);
+	    goto out;
+	}
+	r->arena = NULL;
+    }
+
     free_KDC_REQ_BODY(&r->req.req_body);
     ret = copy_KDC_REQ_BODY(&fastreq.req_body, &r->req.req_body);
     if (ret)
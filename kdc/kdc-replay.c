@@ -33,10 +33,40 @@
 
 #include "kdc_locl.h"
 
+/*
+ * Replay requests captured with kdc-request-log, either in the
+ * append-only format written by krb5_kdc_save_request() or from a
+ * capture ring written by krb5_kdc_save_request_ring().  With one
+ * thread each reply is checked against the captured one; with more
+ * the tool is a load generator and reports throughput and latency.
+ */
+
+struct replay_req {
+    uint64_t seq;
+    struct timeval tv;
+    struct sockaddr_storage sa;
+    char astr[80];
+    krb5_data d;
+    uint32_t clty;
+    uint32_t tag;
+    int pkinit;
+};
+
+static struct replay_req *reqs;
+static size_t nreqs;
+static double *latency;		/* microseconds, per request */
+
 static int version_flag;
 static int help_flag;
+static int threads_flag = 1;
+static char *rate_string;
 
 struct getargs args[] = {
+    { "threads",   0,	arg_integer, &threads_flag,
+      "number of threads replaying requests", "number" },
+    { "rate",      0,	arg_string, &rate_string,
+      "replay speed relative to the capture, 0 for as fast as possible",
+      "factor" },
     { "version",   0,	arg_flag, &version_flag, NULL, NULL },
     { "help",     'h',	arg_flag, &help_flag,    NULL, NULL }
 };
@@ -50,42 +80,185 @@ usage(int ret)
     exit (ret);
 }
 
-int
-main(int argc, char **argv)
+static struct replay_req *
+add_request(krb5_context context)
+{
+    struct replay_req *r;
+
+    r = realloc(reqs, (nreqs + 1) * sizeof(reqs[0]));
+    if (r == NULL)
+	krb5_errx(context, 1, "out of memory");
+    reqs = r;
+    r = &reqs[nreqs];
+    memset(r, 0, sizeof(*r));
+    return r;
+}
+
+static void
+load_log(krb5_context context, void *buf, size_t size)
 {
     krb5_error_code ret;
-    krb5_context context;
-    krb5_kdc_configuration *config;
     krb5_storage *sp;
-    int fd, optidx = 0;
 
-    setprogname(argv[0]);
+    sp = krb5_storage_from_readonly_mem(buf, size);
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_from_readonly_mem");
 
-    if(getarg(args, num_args, argc, argv, &optidx))
-	usage(1);
+    while(1) {
+	struct replay_req *r;
+	krb5_socklen_t salen;
+	krb5_address a;
+	uint32_t t;
 
-    if(help_flag)
-	usage(0);
+	ret = krb5_ret_uint32(sp, &t);
+	if (ret == HEIM_ERR_EOF)
+	    break;
+	else if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(version)");
+	if (t != 1)
+	    krb5_errx(context, 1, "version not 1");
 
-    if(version_flag){
-	print_version(NULL);
-	exit(0);
+	r = add_request(context);
+	r->seq = nreqs;
+
+	ret = krb5_ret_uint32(sp, &t);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(time)");
+	r->tv.tv_sec = t;
+	ret = krb5_ret_address(sp, &a);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_address");
+	ret = krb5_ret_data(sp, &r->d);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_data");
+	ret = krb5_ret_uint32(sp, &r->clty);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(class|type)");
+	ret = krb5_ret_uint32(sp, &r->tag);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(tag)");
+
+	salen = sizeof(r->sa);
+	ret = krb5_addr2sockaddr (context, &a, (struct sockaddr *)&r->sa,
+				  &salen, 88);
+	if (ret == KRB5_PROG_ATYPE_NOSUPP) {
+	    krb5_data_free(&r->d);
+	    krb5_free_address(context, &a);
+	    continue;
+	} else if (ret)
+	    krb5_err(context, 1, ret, "krb5_addr2sockaddr");
+
+	ret = krb5_print_address(&a, r->astr, sizeof(r->astr), NULL);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_print_address");
+	krb5_free_address(context, &a);
+	nreqs++;
     }
 
-    ret = krb5_init_context(&context);
+    krb5_storage_free(sp);
+}
+
+static int
+seq_cmp(const void *a, const void *b)
+{
+    const struct replay_req *ra = a, *rb = b;
+
+    if (ra->seq < rb->seq)
+	return -1;
+    return ra->seq > rb->seq;
+}
+
+static void
+load_ring(krb5_context context, void *buf, size_t size)
+{
+    struct kdc_ring_header *hdr = buf;
+    krb5_error_code ret;
+    uint32_t i;
+
+    if (hdr->segsize < sizeof(struct kdc_ring_record) ||
+	size < KDC_RING_HEADER + (size_t)hdr->nsegs * hdr->segsize)
+	krb5_errx(context, 1, "truncated request capture ring");
+
+    if (hdr->dropped)
+	printf("%llu oversized requests were not captured\n",
+	       (unsigned long long)hdr->dropped);
+
+    for (i = 0; i < hdr->nsegs; i++) {
+	struct kdc_ring_record *rec;
+	struct replay_req *r;
+	krb5_address a;
+
+	rec = (struct kdc_ring_record *)((unsigned char *)buf +
+	    KDC_RING_HEADER + (size_t)i * hdr->segsize);
+	if (rec->length == 0 ||
+	    rec->length > hdr->segsize - sizeof(*rec))
+	    continue;
+
+	r = add_request(context);
+	r->seq = rec->seq;
+	r->tv.tv_sec = rec->sec;
+	r->tv.tv_usec = rec->usec;
+	r->clty = rec->reply_clty;
+	r->tag = rec->reply_tag;
+	r->d.data = rec + 1;
+	r->d.length = rec->length;
+
+	if (rec->family == AF_INET) {
+	    struct sockaddr_in *sin = (struct sockaddr_in *)&r->sa;
+	    sin->sin_family = AF_INET;
+	    sin->sin_port = rec->port;
+	    memcpy(&sin->sin_addr, rec->addr, sizeof(sin->sin_addr));
+#ifdef HAVE_IPV6
+	} else if (rec->family == AF_INET6) {
+	    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&r->sa;
+	    sin6->sin6_family = AF_INET6;
+	    sin6->sin6_port = rec->port;
+	    memcpy(&sin6->sin6_addr, rec->addr, sizeof(sin6->sin6_addr));
+#endif
+	} else
+	    continue;
+
+	ret = krb5_sockaddr2address(context, (struct sockaddr *)&r->sa, &a);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_sockaddr2address");
+	ret = krb5_print_address(&a, r->astr, sizeof(r->astr), NULL);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_print_address");
+	krb5_free_address(context, &a);
+	nreqs++;
+    }
+
+    qsort(reqs, nreqs, sizeof(reqs[0]), seq_cmp);
+}
+
+static void
+setup_kdc(krb5_context *context, krb5_kdc_configuration **config)
+{
+    krb5_error_code ret;
+
+    ret = krb5_init_context(context);
     if (ret)
 	errx (1, "krb5_init_context failed to parse configuration file");
 
-    ret = krb5_kdc_get_config(context, &config);
+    ret = krb5_kdc_get_config(*context, config);
     if (ret)
-	krb5_err(context, 1, ret, "krb5_kdc_default_config");
+	krb5_err(*context, 1, ret, "krb5_kdc_default_config");
 
-    kdc_openlog(context, "kdc-replay", config);
+    kdc_openlog(*context, "kdc-replay", *config);
 
-    ret = krb5_kdc_set_dbinfo(context, config);
+    ret = krb5_kdc_set_dbinfo(*context, *config);
     if (ret)
-	krb5_err(context, 1, ret, "krb5_kdc_set_dbinfo");
+	krb5_err(*context, 1, ret, "krb5_kdc_set_dbinfo");
+}
 
+/*
+ * The PKINIT state (identity, anchors, mappings) is global to the
+ * KDC library, so it is set up once and shared by all threads.
+ */
+
+static void
+setup_pkinit(krb5_context context, krb5_kdc_configuration *config)
+{
 #ifdef PKINIT
     if (config->enable_pkinit) {
 	if (config->pkinit_kdc_identity == NULL)
@@ -102,108 +275,391 @@ main(int argc, char **argv)
 
     }
 #endif /* PKINIT */
+}
 
-    if (argc != 2)
-	errx(1, "argc != 2");
+/*
+ * Process one request and compare the reply with the captured one,
+ * returns non-zero on failure.
+ */
 
-    printf("kdc replay\n");
+static int
+replay_one(krb5_context context, krb5_kdc_configuration *config,
+	   struct replay_req *q)
+{
+    krb5_error_code ret;
+    krb5_data r;
 
-    fd = open(argv[1], O_RDONLY);
-    if (fd < 0)
-	err(1, "open: %s", argv[1]);
+    r.length = 0;
+    r.data = NULL;
 
-    sp = krb5_storage_from_fd(fd);
-    if (sp == NULL)
-	krb5_errx(context, 1, "krb5_storage_from_fd");
+    ret = krb5_kdc_process_request(context, config, q->d.data, q->d.length,
+				   &r, NULL, q->astr,
+				   (struct sockaddr *)&q->sa, 0);
+    if (ret) {
+	krb5_warn(context, ret, "krb5_kdc_process_request");
+	return 1;
+    }
 
-    while(1) {
-	struct sockaddr_storage sa;
-	krb5_socklen_t salen = sizeof(sa);
-	struct timeval tv;
-	krb5_address a;
-	krb5_data d, r;
-	uint32_t t, clty, tag;
-	char astr[80];
+    if (r.length) {
+	Der_class cl;
+	Der_type ty;
+	unsigned int tag2;
+	ret = der_get_tag (r.data, r.length,
+			   &cl, &ty, &tag2, NULL);
+	krb5_data_free(&r);
+	if (MAKE_TAG(cl, ty, 0) != q->clty) {
+	    krb5_warnx(context, "class|type mismatch: %d != %d",
+		       (int)MAKE_TAG(cl, ty, 0), (int)q->clty);
+	    return 1;
+	}
+	if (q->tag != tag2) {
+	    krb5_warnx(context, "tag mismatch");
+	    return 1;
+	}
+    } else {
+	if (q->clty != 0xffffffff) {
+	    krb5_warnx(context, "clty not invalid");
+	    return 1;
+	}
+	if (q->tag != 0xffffffff) {
+	    krb5_warnx(context, "tag not invalid");
+	    return 1;
+	}
+    }
+    return 0;
+}
 
-	ret = krb5_ret_uint32(sp, &t);
-	if (ret == HEIM_ERR_EOF)
+static double
+usec_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000.0 +
+	(now.tv_usec - start->tv_usec);
+}
+
+/*
+ * With a rate, wait until the request is due: its offset into the
+ * capture divided by the rate, counted from the start of the replay.
+ */
+
+static void
+pace(double rate, const struct timeval *start, const struct replay_req *q)
+{
+    double due, now;
+
+    if (rate <= 0)
+	return;
+
+    due = ((q->tv.tv_sec - reqs[0].tv.tv_sec) * 1000000.0 +
+	   (q->tv.tv_usec - reqs[0].tv.tv_usec)) / rate;
+    now = usec_since(start);
+    if (due > now) {
+	struct timespec ts;
+	double d = due - now;
+
+	ts.tv_sec = (time_t)(d / 1000000);
+	ts.tv_nsec = (long)((d - ts.tv_sec * 1000000.0) * 1000);
+	nanosleep(&ts, NULL);
+    }
+}
+
+static double replay_rate;
+static struct timeval replay_start;
+
+/*
+ * Requests replayed from several threads or at a given rate are not
+ * processed at the time they were captured.  Instead the KDC clock is
+ * set once, before the replay starts, to the middle of the capture:
+ * requests within the clock skew of it are processed as they were
+ * captured.
+ */
+
+static void
+capture_time(krb5_context context, struct timeval *tv)
+{
+    time_t span;
+
+    if (nreqs == 0) {
+	gettimeofday(tv, NULL);
+	return;
+    }
+
+    span = reqs[nreqs - 1].tv.tv_sec - reqs[0].tv.tv_sec;
+    if (span > 2 * krb5_get_max_time_skew(context))
+	krb5_warnx(context, "capture spans %ld seconds, more than "
+		   "the clock skew allows", (long)span);
+    *tv = reqs[nreqs / 2].tv;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pkinit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t replay_next;
+static unsigned long replay_errors;
+
+struct replay_thread {
+    pthread_t thread;
+    krb5_context context;
+    krb5_kdc_configuration *config;
+};
+
+static void *
+replay_thread(void *ptr)
+{
+    struct replay_thread *t = ptr;
+    unsigned long errors = 0;
+
+    while (1) {
+	struct timeval begin;
+	struct replay_req *q;
+	size_t i;
+
+	pthread_mutex_lock(&replay_mutex);
+	i = replay_next++;
+	pthread_mutex_unlock(&replay_mutex);
+	if (i >= nreqs)
 	    break;
-	else if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(version)");
-	if (t != 1)
-	    krb5_errx(context, 1, "version not 1");
-	ret = krb5_ret_uint32(sp, &t);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(time)");
-	ret = krb5_ret_address(sp, &a);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_address");
-	ret = krb5_ret_data(sp, &d);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_data");
-	ret = krb5_ret_uint32(sp, &clty);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(class|type)");
-	ret = krb5_ret_uint32(sp, &tag);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(tag)");
+	q = &reqs[i];
 
+	pace(replay_rate, &replay_start, q);
 
-	ret = krb5_addr2sockaddr (context, &a, (struct sockaddr *)&sa,
-				  &salen, 88);
-	if (ret == KRB5_PROG_ATYPE_NOSUPP)
-	    goto out;
-	else if (ret)
-	    krb5_err(context, 1, ret, "krb5_addr2sockaddr");
+	gettimeofday(&begin, NULL);
+	if (q->pkinit)
+	    pthread_mutex_lock(&pkinit_mutex);
+	errors += replay_one(t->context, t->config, q);
+	if (q->pkinit)
+	    pthread_mutex_unlock(&pkinit_mutex);
+	latency[i] = usec_since(&begin);
+    }
+
+    pthread_mutex_lock(&replay_mutex);
+    replay_errors += errors;
+    pthread_mutex_unlock(&replay_mutex);
+    return NULL;
+}
+
+/*
+ * The PKINIT state is shared and not safe to use from several threads
+ * at once, so PKINIT requests are processed one at a time.
+ */
+
+static int
+is_pkinit(const krb5_data *d)
+{
+    AS_REQ req;
+    size_t i;
+    int found = 0;
+
+    if (decode_AS_REQ(d->data, d->length, &req, NULL) != 0)
+	return 0;
+    for (i = 0; req.padata && i < req.padata->len; i++) {
+	if (req.padata->val[i].padata_type == KRB5_PADATA_PK_AS_REQ ||
+	    req.padata->val[i].padata_type == KRB5_PADATA_PK_AS_REQ_WIN)
+	    found = 1;
+    }
+    free_AS_REQ(&req);
+    return found;
+}
+
+/*
+ * The KDC clock is a global that all threads read, so it is set to
+ * the capture time before the threads start.
+ */
 
-	ret = krb5_print_address(&a, astr, sizeof(astr), NULL);
+static unsigned long
+replay_threaded(krb5_context context, krb5_kdc_configuration *config,
+		int nthreads)
+{
+    struct replay_thread *t;
+    struct timeval tv;
+    size_t j;
+    int i, ret;
+
+    t = calloc(nthreads, sizeof(t[0]));
+    if (t == NULL)
+	krb5_errx(context, 1, "out of memory");
+
+    t[0].context = context;
+    t[0].config = config;
+    for (i = 1; i < nthreads; i++)
+	setup_kdc(&t[i].context, &t[i].config);
+
+    for (j = 0; j < nreqs; j++)
+	reqs[j].pkinit = is_pkinit(&reqs[j].d);
+
+    capture_time(context, &tv);
+    krb5_kdc_update_time(&tv);
+    for (i = 0; i < nthreads; i++)
+	krb5_set_real_time(t[i].context, tv.tv_sec, tv.tv_usec);
+
+    gettimeofday(&replay_start, NULL);
+    for (i = 0; i < nthreads; i++) {
+	ret = pthread_create(&t[i].thread, NULL, replay_thread, &t[i]);
 	if (ret)
-	    krb5_err(context, 1, ret, "krb5_print_address");
+	    krb5_err(context, 1, ret, "pthread_create");
+    }
+    for (i = 0; i < nthreads; i++)
+	pthread_join(t[i].thread, NULL);
 
-	printf("processing request from %s, %lu bytes\n",
-	       astr, (unsigned long)d.length);
+    for (i = 1; i < nthreads; i++)
+	krb5_free_context(t[i].context);
+    free(t);
+    return replay_errors;
+}
 
-	r.length = 0;
-	r.data = NULL;
+#endif /* ENABLE_PTHREAD_SUPPORT */
+
+/*
+ * Replay in capture order, with the KDC clock set to the time each
+ * request was captured, or at a given rate with the clock set to the
+ * capture time like the threaded replay does.
+ */
 
-	tv.tv_sec = t;
-	tv.tv_usec = 0;
+static unsigned long
+replay_serial(krb5_context context, krb5_kdc_configuration *config)
+{
+    unsigned long errors = 0;
+    struct timeval tv;
+    size_t i;
 
+    if (rate_string) {
+	capture_time(context, &tv);
 	krb5_kdc_update_time(&tv);
-	krb5_set_real_time(context, tv.tv_sec, 0);
+	krb5_set_real_time(context, tv.tv_sec, tv.tv_usec);
+    }
 
-	ret = krb5_kdc_process_request(context, config, d.data, d.length,
-				       &r, NULL, astr,
-				       (struct sockaddr *)&sa, 0);
-	if (ret)
-	    krb5_err(context, 1, ret, "krb5_kdc_process_request");
-
-	if (r.length) {
-	    Der_class cl;
-	    Der_type ty;
-	    unsigned int tag2;
-	    ret = der_get_tag (r.data, r.length,
-			       &cl, &ty, &tag2, NULL);
-	    if (MAKE_TAG(cl, ty, 0) != clty)
-		krb5_errx(context, 1, "class|type mismatch: %d != %d",
-			  (int)MAKE_TAG(cl, ty, 0), (int)clty);
-	    if (tag != tag2)
-		krb5_errx(context, 1, "tag mismatch");
-
-	    krb5_data_free(&r);
-	} else {
-	    if (clty != 0xffffffff)
-		krb5_errx(context, 1, "clty not invalid");
-	    if (tag != 0xffffffff)
-		krb5_errx(context, 1, "tag not invalid");
+    gettimeofday(&replay_start, NULL);
+    for (i = 0; i < nreqs; i++) {
+	struct replay_req *q = &reqs[i];
+	struct timeval begin;
+
+	printf("processing request from %s, %lu bytes\n",
+	       q->astr, (unsigned long)q->d.length);
+
+	pace(replay_rate, &replay_start, q);
+
+	gettimeofday(&begin, NULL);
+	if (rate_string == NULL) {
+	    krb5_kdc_update_time(&q->tv);
+	    krb5_set_real_time(context, q->tv.tv_sec, q->tv.tv_usec);
 	}
 
-    out:
-	krb5_data_free(&d);
-	krb5_free_address(context, &a);
+	if (replay_one(context, config, q)) {
+	    errors++;
+	    if (rate_string == NULL)
+		break;
+	}
+	latency[i] = usec_since(&begin);
     }
+    return errors;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    if (da < db)
+	return -1;
+    return da > db;
+}
+
+static void
+print_summary(unsigned long errors)
+{
+    double elapsed, sum = 0;
+    size_t i;
+
+    elapsed = usec_since(&replay_start) / 1000000.0;
+    for (i = 0; i < nreqs; i++)
+	sum += latency[i];
+    qsort(latency, nreqs, sizeof(latency[0]), double_cmp);
+
+    printf("%lu requests, %lu errors, %.3f seconds, %.1f requests/s\n",
+	   (unsigned long)nreqs, errors, elapsed,
+	   elapsed > 0 ? nreqs / elapsed : 0.0);
+    if (nreqs)
+	printf("latency usec: avg %.0f p50 %.0f p90 %.0f p99 %.0f max %.0f\n",
+	       sum / nreqs,
+	       latency[nreqs * 50 / 100], latency[nreqs * 90 / 100],
+	       latency[nreqs * 99 / 100], latency[nreqs - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_kdc_configuration *config;
+    unsigned long errors;
+    void *buf;
+    size_t size;
+    int ret, optidx = 0;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, num_args, argc, argv, &optidx))
+	usage(1);
+
+    if(help_flag)
+	usage(0);
+
+    if(version_flag){
+	print_version(NULL);
+	exit(0);
+    }
+
+    if (threads_flag < 1)
+	errx(1, "--threads must be at least 1");
+#ifndef ENABLE_PTHREAD_SUPPORT
+    if (threads_flag > 1)
+	errx(1, "--threads not supported without pthreads");
+#endif
+    if (rate_string) {
+	char *end;
+
+	replay_rate = strtod(rate_string, &end);
+	if (*end != '\0' || replay_rate < 0)
+	    errx(1, "invalid rate: %s", rate_string);
+    }
+
+    setup_kdc(&context, &config);
+    setup_pkinit(context, config);
+
+    if (argc - optidx != 1)
+	usage(1);
+
+    printf("kdc replay\n");
+
+    ret = rk_undumpdata(argv[optidx], &buf, &size);
+    if (ret)
+	krb5_err(context, 1, ret, "%s", argv[optidx]);
+
+    if (size >= KDC_RING_HEADER &&
+	memcmp(buf, KDC_RING_MAGIC, sizeof(((struct kdc_ring_header *)0)->magic)) == 0)
+	load_ring(context, buf, size);
+    else
+	load_log(context, buf, size);
+
+    latency = calloc(nreqs ? nreqs : 1, sizeof(latency[0]));
+    if (latency == NULL)
+	krb5_errx(context, 1, "out of memory");
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (threads_flag > 1)
+	errors = replay_threaded(context, config, threads_flag);
+    else
+#endif
+	errors = replay_serial(context, config);
+
+    if (threads_flag > 1 || rate_string)
+	print_summary(errors);
+
+    if (errors)
+	exit(1);
 
-    krb5_storage_free(sp);
     krb5_free_context(context);
 
     printf("done\n");
@@ -39,6 +39,8 @@
 struct perf {
     unsigned long as_req;
     unsigned long tgs_req;
+    unsigned long kx509_req;
+    unsigned long cached_rep;
     struct timeval start;
     struct timeval stop;
     struct perf *next;
@@ -54,6 +56,7 @@ static krb5_context kdc_context;
 
 static struct sockaddr_storage sa;
 static const char *astr = "0.0.0.0";
+static int retransmit;
 
 static void eval_object(heim_object_t);
 
@@ -104,6 +107,31 @@ plugin_send_to_realm(krb5_context context,
     if (ret)
 	krb5_err(kdc_context, 1, ret, "krb5_kdc_process_request");
 
+    /* send it again, a ticket must come back from the reply cache */
+    if (retransmit) {
+	krb5_data again;
+	Der_class cl;
+	Der_type ty;
+	unsigned int tag;
+
+	krb5_data_zero(&again);
+	ret = krb5_kdc_process_request(kdc_context, kdc_config,
+				       in->data, in->length,
+				       &again, NULL, astr,
+				       (struct sockaddr *)&sa, 0);
+	if (ret)
+	    krb5_err(kdc_context, 1, ret, "krb5_kdc_process_request");
+	if (der_get_tag(out->data, out->length, &cl, &ty, &tag, NULL) == 0 &&
+	    (tag == krb_as_rep || tag == krb_tgs_rep)) {
+	    if (krb5_data_cmp(out, &again) != 0)
+		krb5_errx(kdc_context, 1,
+			  "retransmitted request got a different reply");
+	    if (ptop)
+		ptop->cached_rep++;
+	}
+	krb5_data_free(&again);
+    }
+
     return 0;
 }
 
@@ -134,6 +162,8 @@ perf_stop(struct perf *perf)
     if (ptop) {
 	ptop->as_req += perf->as_req;
 	ptop->tgs_req += perf->tgs_req;
+	ptop->kx509_req += perf->kx509_req;
+	ptop->cached_rep += perf->cached_rep;
     }
 
     timevalsub(&perf->stop, &perf->start);
@@ -154,6 +184,16 @@ perf_stop(struct perf *perf)
 	tgs_ps = (perf->tgs_req * USEC_PER_SEC) / (double)((perf->stop.tv_sec * USEC_PER_SEC) + perf->stop.tv_usec);
 	printf("tgs-req/s %.2lf (total %lu requests)\n", tgs_ps, perf->tgs_req);
     }
+
+    if (perf->kx509_req) {
+	double kx509_ps = 0.0;
+	kx509_ps = (perf->kx509_req * USEC_PER_SEC) / (double)((perf->stop.tv_sec * USEC_PER_SEC) + perf->stop.tv_usec);
+	printf("kx509-req/s %.2lf (total %lu requests)\n", kx509_ps, perf->kx509_req);
+    }
+
+    if (perf->cached_rep)
+	printf("retransmits answered from the reply cache: %lu\n",
+	       perf->cached_rep);
 }
 
 /*
@@ -182,6 +222,24 @@ eval_repeat(heim_dict_t o)
     perf_stop(&perf);
 }
 
+/*
+ *
+ */
+
+static void
+eval_retransmit(heim_dict_t o)
+{
+    heim_object_t or = heim_dict_get_value(o, HSTR("value"));
+
+    heim_assert(or != NULL, "value missing");
+    if (kdc_config->reply_cache == NULL)
+	errx(1, "retransmit needs a reply-cache-size in [kdc]");
+
+    retransmit++;
+    eval_object(or);
+    retransmit--;
+}
+
 /*
  *
  */
@@ -390,6 +448,189 @@ eval_kgetcred(heim_dict_t o)
 }
 
 
+/*
+ *
+ */
+
+#ifdef KX509
+
+static const unsigned char kx509_version[4] = { 0, 0, 2, 0 };
+static heim_octet_string kx509_key;
+
+static void
+kx509_key_init(void)
+{
+    unsigned char *p;
+    BIGNUM *e;
+    RSA *rsa;
+    int len;
+
+    if (kx509_key.length)
+	return;
+
+    rsa = RSA_new();
+    e = BN_new();
+    if (rsa == NULL || e == NULL || BN_set_word(e, 65537) != 1)
+	krb5_errx(kdc_context, 1, "out of memory");
+    if (RSA_generate_key_ex(rsa, 1024, e, NULL) != 1)
+	krb5_errx(kdc_context, 1, "RSA_generate_key_ex");
+    BN_free(e);
+
+    len = i2d_RSAPublicKey(rsa, NULL);
+    if (len <= 0)
+	krb5_errx(kdc_context, 1, "i2d_RSAPublicKey");
+    kx509_key.data = p = malloc(len);
+    if (p == NULL)
+	krb5_errx(kdc_context, 1, "out of memory");
+    kx509_key.length = i2d_RSAPublicKey(rsa, &p);
+    RSA_free(rsa);
+}
+
+static void
+eval_kx509(heim_dict_t o)
+{
+    heim_string_t ccache, server;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    krb5_auth_context ac = NULL;
+    krb5_creds in, *out = NULL;
+    krb5_data data, reply;
+    krb5_error_code ret;
+    Kx509Request req;
+    Kx509Response rep;
+    Certificate cert;
+    krb5_ccache cc;
+    HMAC_CTX ctx;
+    size_t size;
+
+    if (ptop)
+	ptop->kx509_req++;
+
+    ccache = heim_dict_get_value(o, HSTR("ccache"));
+    if (ccache == NULL)
+	krb5_errx(kdc_context, 1, "no ccache");
+    server = heim_dict_get_value(o, HSTR("server"));
+
+    kx509_key_init();
+
+    ret = krb5_cc_resolve(kdc_context, heim_string_get_utf8(ccache), &cc);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "krb5_cc_resolve");
+
+    memset(&in, 0, sizeof(in));
+    ret = krb5_cc_get_principal(kdc_context, cc, &in.client);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "krb5_cc_get_principal");
+
+    if (server) {
+	ret = krb5_parse_name(kdc_context, heim_string_get_utf8(server),
+			      &in.server);
+	if (ret)
+	    krb5_err(kdc_context, 1, ret, "krb5_parse_name");
+    } else {
+	/* the name the KDC expects, see kx509.c */
+	ret = krb5_sname_to_principal(kdc_context, NULL, "kca_service",
+				      KRB5_NT_UNKNOWN, &in.server);
+	if (ret)
+	    krb5_err(kdc_context, 1, ret, "krb5_sname_to_principal");
+	ret = krb5_principal_set_realm(kdc_context, in.server,
+				       krb5_principal_get_realm(kdc_context,
+								in.client));
+	if (ret)
+	    krb5_err(kdc_context, 1, ret, "krb5_principal_set_realm");
+    }
+
+    ret = krb5_get_credentials(kdc_context, 0, cc, &in, &out);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "krb5_get_credentials");
+
+    memset(&req, 0, sizeof(req));
+    ret = krb5_mk_req_extended(kdc_context, &ac, 0, NULL, out,
+			       &req.authenticator);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "krb5_mk_req_extended");
+
+    HMAC_CTX_init(&ctx);
+    HMAC_Init_ex(&ctx, out->session.keyvalue.data,
+		 out->session.keyvalue.length, EVP_sha1(), NULL);
+    HMAC_Update(&ctx, kx509_version, sizeof(kx509_version));
+    HMAC_Update(&ctx, kx509_key.data, kx509_key.length);
+    HMAC_Final(&ctx, digest, 0);
+
+    req.pk_key = kx509_key;
+    req.pk_hash.data = digest;
+    req.pk_hash.length = sizeof(digest);
+
+    ASN1_MALLOC_ENCODE(Kx509Request, data.data, data.length, &req,
+		       &size, ret);
+    krb5_data_free(&req.authenticator);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "encode_Kx509Request");
+    ret = krb5_data_realloc(&data, data.length + sizeof(kx509_version));
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "krb5_data_realloc");
+    memmove((unsigned char *)data.data + sizeof(kx509_version),
+	    data.data, size);
+    memcpy(data.data, kx509_version, sizeof(kx509_version));
+
+    krb5_kdc_update_time(NULL);
+
+    ret = krb5_kdc_process_request(kdc_context, kdc_config,
+				   data.data, data.length,
+				   &reply, NULL, astr,
+				   (struct sockaddr *)&sa, 0);
+    krb5_data_free(&data);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "krb5_kdc_process_request");
+
+    if (reply.length <= sizeof(kx509_version) ||
+	memcmp(reply.data, kx509_version, sizeof(kx509_version)) != 0)
+	krb5_errx(kdc_context, 1, "kx509 request failed");
+
+    ret = decode_Kx509Response((unsigned char *)reply.data +
+			       sizeof(kx509_version),
+			       reply.length - sizeof(kx509_version),
+			       &rep, &size);
+    krb5_data_free(&reply);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "decode_Kx509Response");
+
+    if (rep.error_code)
+	krb5_errx(kdc_context, 1, "kx509 error %d: %s", (int)*rep.error_code,
+		  rep.e_text ? *rep.e_text : "");
+    if (rep.certificate == NULL || rep.hash == NULL)
+	krb5_errx(kdc_context, 1, "kx509 reply without certificate");
+
+    HMAC_Init_ex(&ctx, out->session.keyvalue.data,
+		 out->session.keyvalue.length, EVP_sha1(), NULL);
+    HMAC_Update(&ctx, kx509_version, sizeof(kx509_version));
+    HMAC_Update(&ctx, rep.certificate->data, rep.certificate->length);
+    HMAC_Final(&ctx, digest, 0);
+    HMAC_CTX_cleanup(&ctx);
+
+    if (rep.hash->length != sizeof(digest) ||
+	memcmp(rep.hash->data, digest, sizeof(digest)) != 0)
+	krb5_errx(kdc_context, 1, "kx509 reply hash wrong");
+
+    ret = decode_Certificate(rep.certificate->data, rep.certificate->length,
+			     &cert, &size);
+    if (ret)
+	krb5_err(kdc_context, 1, ret, "decode_Certificate");
+    if (cert.tbsCertificate.subjectPublicKeyInfo.subjectPublicKey.length !=
+	kx509_key.length * 8 ||
+	memcmp(cert.tbsCertificate.subjectPublicKeyInfo.subjectPublicKey.data,
+	       kx509_key.data, kx509_key.length) != 0)
+	krb5_errx(kdc_context, 1, "kx509 certificate for the wrong key");
+
+    free_Certificate(&cert);
+    free_Kx509Response(&rep);
+    krb5_auth_con_free(kdc_context, ac);
+    krb5_free_creds(kdc_context, out);
+    krb5_free_cred_contents(kdc_context, &in);
+    krb5_cc_close(kdc_context, cc);
+}
+
+#endif /* KX509 */
+
 /*
  *
  */
@@ -438,12 +679,18 @@ eval_object(heim_object_t o)
 
 	if (strcmp(op, "repeat") == 0) {
 	    eval_repeat(o);
+	} else if (strcmp(op, "retransmit") == 0) {
+	    eval_retransmit(o);
 	} else if (strcmp(op, "kinit") == 0) {
 	    eval_kinit(o);
 	} else if (strcmp(op, "kgetcred") == 0) {
 	    eval_kgetcred(o);
 	} else if (strcmp(op, "kdestroy") == 0) {
 	    eval_kdestroy(o);
+#ifdef KX509
+	} else if (strcmp(op, "kx509") == 0) {
+	    eval_kx509(o);
+#endif
 	} else {
 	    errx(1, "unsupported ops %s", op);
 	}
@@ -482,6 +729,9 @@ main(int argc, char **argv)
     krb5_plugin_register(kdc_context, PLUGIN_TYPE_DATA,
 			 KRB5_PLUGIN_SEND_TO_KDC, &send_to_kdc);
 
+    /* requests come from astr, the reply cache needs a real address */
+    socket_set_any((struct sockaddr *)&sa, AF_INET);
+
     {
 	void *buf;
 	size_t size;
@@ -80,6 +80,7 @@ typedef struct krb5_kdc_configuration {
     int pkinit_dh_min_bits;
     int pkinit_require_binding;
     int pkinit_allow_proxy_certs;
+    int pkinit_check_revocation;
 
     krb5_log_facility *logf;
 
@@ -91,6 +92,10 @@ typedef struct krb5_kdc_configuration {
     int enable_kx509;
     const char *kx509_template;
     const char *kx509_ca;
+    struct kdc_kx509_ca *kx509_cas; /* loaded CAs, see kx509.c */
+
+    struct kdc_reply_cache *reply_cache; /* see process.c */
+    struct kdc_pa_cache *pa_cache; /* see kerberos5.c */
 
 } krb5_kdc_configuration;
 
@@ -106,6 +111,7 @@ struct krb5_kdc_service {
 			       struct sockaddr *addr,
 			       int datagram_reply,
 			       int *claim);
+    unsigned int tag;	/* outer APPLICATION tag, 0 if untagged */
 };
 
 #include <kdc-protos.h>
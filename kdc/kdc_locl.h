@@ -58,6 +58,7 @@ struct kdc_request_desc {
     krb5_data request;
     KDC_REQ req;
     METHOD_DATA *padata;
+    struct asn1_arena *arena;	/* req lives here, if set */
 
     /* out */
 
@@ -94,6 +95,8 @@ extern sig_atomic_t exit_flag;
 extern size_t max_request_udp;
 extern size_t max_request_tcp;
 extern const char *request_log;
+extern size_t request_log_ring_size;
+extern unsigned int request_log_sample;
 extern const char *port_str;
 extern krb5_addresses explicit_addresses;
 
@@ -110,6 +113,36 @@ extern const struct units _kdc_digestunits[];
 
 #define KDC_LOG_FILE		"kdc.log"
 
+/*
+ * Request capture ring, see krb5_kdc_save_request_ring().  Apart
+ * from the address, all fields are in host byte order.
+ */
+
+#define KDC_RING_MAGIC		"KDCRING1"
+#define KDC_RING_HEADER		4096
+#define KDC_RING_SEGMENT	8192
+
+struct kdc_ring_header {
+    char magic[8];
+    uint32_t segsize;
+    uint32_t nsegs;
+    uint64_t next;		/* sequence number of the next record */
+    uint64_t dropped;		/* requests too large for a segment */
+};
+
+struct kdc_ring_record {
+    uint32_t length;		/* of the request, 0 while being written */
+    uint32_t reply_clty;
+    uint32_t reply_tag;
+    uint32_t usec;
+    uint64_t seq;
+    uint64_t sec;
+    uint16_t family;
+    uint16_t port;		/* network byte order, as in the sockaddr */
+    unsigned char addr[16];
+    /* request follows */
+};
+
 extern struct timeval _kdc_now;
 #define kdc_time (_kdc_now.tv_sec)
 
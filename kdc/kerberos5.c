@@ -543,6 +543,336 @@ pa_enc_chal_validate(kdc_request_t r, const PA_DATA *pa)
     return ret;
 }
 
+/*
+ * Preauth cache.  Password logons ask for the same ETYPE-INFO2 and
+ * decrypt a PA-ENC-TIMESTAMP with the same client key over and over,
+ * so for up to preauth-cache-size clients keep, per client key, the
+ * encoded ETYPE-INFO2 and a crypto context that has already derived
+ * the PA-ENC-TIMESTAMP keys.
+ *
+ * An entry is only used for the kvno it was made for, and only while
+ * each key and salt in it still matches the client's, so a key or
+ * salt change (with or without a new kvno) makes it stale and it is
+ * made again.
+ * A crypto context is not thread safe, so it is taken out of the
+ * entry while it is used and put back afterwards; a thread that finds
+ * it taken makes its own.
+ */
+
+struct kdc_pa_cache_key {
+    krb5_keyblock key;		/* to notice key changes */
+    Salt *salt;			/* the ETYPE-INFO2 depends on it too */
+    krb5_crypto crypto;		/* NULL when in use or not made yet */
+    krb5_data etype_info2;	/* empty until first needed */
+};
+
+struct kdc_pa_cache_entry {
+    struct kdc_pa_cache_entry *next;	/* in the hash bucket */
+    struct kdc_pa_cache_entry *older;	/* in use order */
+    struct kdc_pa_cache_entry *newer;
+    uint32_t hash;
+    char *name;
+    krb5_kvno kvno;
+    size_t nkeys;
+    struct kdc_pa_cache_key *keys;
+};
+
+struct kdc_pa_cache {
+    HEIMDAL_MUTEX mutex;
+    size_t max_entries;
+    size_t nentries;
+    size_t nbuckets;
+    struct kdc_pa_cache_entry **buckets;
+    struct kdc_pa_cache_entry *oldest;
+    struct kdc_pa_cache_entry *newest;
+};
+
+krb5_error_code
+_kdc_pa_cache_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_pa_cache *pc;
+    int n;
+
+    n = krb5_config_get_int_default(context, NULL, 0,
+				    "kdc", "preauth-cache-size", NULL);
+    if (n <= 0)
+	return 0;
+
+    pc = calloc(1, sizeof(*pc));
+    if (pc == NULL)
+	return krb5_enomem(context);
+    pc->max_entries = n;
+
+    pc->nbuckets = 16;
+    while (pc->nbuckets < pc->max_entries && pc->nbuckets < 65536)
+	pc->nbuckets *= 2;
+    pc->buckets = calloc(pc->nbuckets, sizeof(pc->buckets[0]));
+    if (pc->buckets == NULL) {
+	free(pc);
+	return krb5_enomem(context);
+    }
+    HEIMDAL_MUTEX_init(&pc->mutex);
+
+    config->pa_cache = pc;
+    return 0;
+}
+
+static uint32_t
+pa_cache_hash(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+
+static int
+pa_cache_salt_matches(const Salt *a, const Salt *b)
+{
+    if (a == NULL || b == NULL)
+	return a == b;
+    if (a->type != b->type ||
+	der_heim_octet_string_cmp(&a->salt, &b->salt) != 0)
+	return 0;
+    if (a->opaque == NULL || b->opaque == NULL)
+	return a->opaque == b->opaque;
+    return der_heim_octet_string_cmp(a->opaque, b->opaque) == 0;
+}
+
+static int
+pa_cache_key_matches(const struct kdc_pa_cache_key *ck, const Key *key)
+{
+    return ck->key.keytype == key->key.keytype &&
+	ck->key.keyvalue.length == key->key.keyvalue.length &&
+	ct_memcmp(ck->key.keyvalue.data, key->key.keyvalue.data,
+		  key->key.keyvalue.length) == 0 &&
+	pa_cache_salt_matches(ck->salt, key->salt);
+}
+
+/* called with the mutex held, or on an entry no one else can see */
+
+static void
+pa_cache_free_entry(krb5_context context, struct kdc_pa_cache_entry *e)
+{
+    size_t i;
+
+    for (i = 0; i < e->nkeys; i++) {
+	krb5_free_keyblock_contents(context, &e->keys[i].key);
+	if (e->keys[i].salt) {
+	    free_Salt(e->keys[i].salt);
+	    free(e->keys[i].salt);
+	}
+	if (e->keys[i].crypto)
+	    krb5_crypto_destroy(context, e->keys[i].crypto);
+	krb5_data_free(&e->keys[i].etype_info2);
+    }
+    free(e->keys);
+    free(e->name);
+    free(e);
+}
+
+static void
+pa_cache_unlink(struct kdc_pa_cache *pc, struct kdc_pa_cache_entry *e)
+{
+    struct kdc_pa_cache_entry **pe;
+
+    for (pe = &pc->buckets[e->hash % pc->nbuckets]; *pe != e; pe = &(*pe)->next)
+	;
+    *pe = e->next;
+    if (e->older)
+	e->older->newer = e->newer;
+    else
+	pc->oldest = e->newer;
+    if (e->newer)
+	e->newer->older = e->older;
+    else
+	pc->newest = e->older;
+    pc->nentries--;
+}
+
+static void
+pa_cache_link(struct kdc_pa_cache *pc, struct kdc_pa_cache_entry *e)
+{
+    struct kdc_pa_cache_entry **b = &pc->buckets[e->hash % pc->nbuckets];
+
+    e->next = *b;
+    *b = e;
+    e->newer = NULL;
+    e->older = pc->newest;
+    if (pc->newest)
+	pc->newest->newer = e;
+    else
+	pc->oldest = e;
+    pc->newest = e;
+    pc->nentries++;
+}
+
+static struct kdc_pa_cache_entry *
+pa_cache_new_entry(krb5_context context, const char *name, uint32_t hash,
+		   const hdb_entry *client)
+{
+    struct kdc_pa_cache_entry *e;
+    size_t i;
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+	return NULL;
+    e->hash = hash;
+    e->kvno = client->kvno;
+    e->name = strdup(name);
+    e->keys = calloc(client->keys.len ? client->keys.len : 1,
+		     sizeof(e->keys[0]));
+    if (e->name == NULL || e->keys == NULL) {
+	pa_cache_free_entry(context, e);
+	return NULL;
+    }
+    for (i = 0; i < client->keys.len; i++) {
+	const Salt *salt = client->keys.val[i].salt;
+
+	if (krb5_copy_keyblock_contents(context, &client->keys.val[i].key,
+					&e->keys[i].key)) {
+	    pa_cache_free_entry(context, e);
+	    return NULL;
+	}
+	e->nkeys++;
+	if (salt) {
+	    e->keys[i].salt = calloc(1, sizeof(*salt));
+	    if (e->keys[i].salt == NULL ||
+		copy_Salt(salt, e->keys[i].salt)) {
+		pa_cache_free_entry(context, e);
+		return NULL;
+	    }
+	}
+    }
+    return e;
+}
+
+/*
+ * Find the client's cache entry and the cached state of `key', one of
+ * the client's keys, replacing a stale entry.  Called with the mutex
+ * held, returns NULL if there is none and none could be made.
+ */
+
+static struct kdc_pa_cache_key *
+pa_cache_lookup(kdc_request_t r, const Key *key)
+{
+    struct kdc_pa_cache *pc = r->config->pa_cache;
+    const hdb_entry *client = &r->client->entry;
+    struct kdc_pa_cache_entry *e;
+    size_t i = key - client->keys.val;
+    uint32_t hash;
+
+    if (r->client_name == NULL || i >= client->keys.len)
+	return NULL;
+
+    hash = pa_cache_hash(r->client_name);
+    for (e = pc->buckets[hash % pc->nbuckets]; e; e = e->next)
+	if (e->hash == hash && strcmp(e->name, r->client_name) == 0)
+	    break;
+
+    if (e) {
+	pa_cache_unlink(pc, e);
+	if (e->kvno != client->kvno || e->nkeys != client->keys.len ||
+	    !pa_cache_key_matches(&e->keys[i], key)) {
+	    pa_cache_free_entry(r->context, e);
+	    e = NULL;
+	}
+    }
+    if (e == NULL) {
+	e = pa_cache_new_entry(r->context, r->client_name, hash, client);
+	if (e == NULL)
+	    return NULL;
+	while (pc->nentries >= pc->max_entries) {
+	    struct kdc_pa_cache_entry *o = pc->oldest;
+
+	    pa_cache_unlink(pc, o);
+	    pa_cache_free_entry(r->context, o);
+	}
+    }
+    pa_cache_link(pc, e);
+    return &e->keys[i];
+}
+
+/* a crypto context for `key', to be given back with pa_cache_put_crypto() */
+
+static krb5_error_code
+pa_cache_get_crypto(kdc_request_t r, const Key *key, krb5_crypto *crypto)
+{
+    struct kdc_pa_cache *pc = r->config->pa_cache;
+    struct kdc_pa_cache_key *ck;
+
+    *crypto = NULL;
+    if (pc) {
+	HEIMDAL_MUTEX_lock(&pc->mutex);
+	ck = pa_cache_lookup(r, key);
+	if (ck) {
+	    *crypto = ck->crypto;
+	    ck->crypto = NULL;
+	}
+	HEIMDAL_MUTEX_unlock(&pc->mutex);
+	if (*crypto)
+	    return 0;
+    }
+    return krb5_crypto_init(r->context, &key->key, 0, crypto);
+}
+
+static void
+pa_cache_put_crypto(kdc_request_t r, const Key *key, krb5_crypto crypto)
+{
+    struct kdc_pa_cache *pc = r->config->pa_cache;
+    struct kdc_pa_cache_key *ck;
+
+    if (pc) {
+	HEIMDAL_MUTEX_lock(&pc->mutex);
+	ck = pa_cache_lookup(r, key);
+	if (ck && ck->crypto == NULL) {
+	    ck->crypto = crypto;
+	    crypto = NULL;
+	}
+	HEIMDAL_MUTEX_unlock(&pc->mutex);
+    }
+    if (crypto)
+	krb5_crypto_destroy(r->context, crypto);
+}
+
+/* copy of the cached ETYPE-INFO2 for `key', non-zero if there is none */
+
+static int
+pa_cache_get_etype_info2(kdc_request_t r, const Key *key, krb5_data *data)
+{
+    struct kdc_pa_cache *pc = r->config->pa_cache;
+    struct kdc_pa_cache_key *ck;
+    int ret = ENOENT;
+
+    krb5_data_zero(data);
+    if (pc == NULL)
+	return ret;
+    HEIMDAL_MUTEX_lock(&pc->mutex);
+    ck = pa_cache_lookup(r, key);
+    if (ck && ck->etype_info2.length)
+	ret = krb5_data_copy(data, ck->etype_info2.data,
+			     ck->etype_info2.length);
+    HEIMDAL_MUTEX_unlock(&pc->mutex);
+    return ret;
+}
+
+static void
+pa_cache_put_etype_info2(kdc_request_t r, const Key *key,
+			 const void *buf, size_t len)
+{
+    struct kdc_pa_cache *pc = r->config->pa_cache;
+    struct kdc_pa_cache_key *ck;
+
+    if (pc == NULL)
+	return;
+    HEIMDAL_MUTEX_lock(&pc->mutex);
+    ck = pa_cache_lookup(r, key);
+    if (ck && ck->etype_info2.length == 0)
+	(void) krb5_data_copy(&ck->etype_info2, buf, len);
+    HEIMDAL_MUTEX_unlock(&pc->mutex);
+}
+
 static krb5_error_code
 pa_enc_ts_validate(kdc_request_t r, const PA_DATA *pa)
 {
@@ -594,7 +924,7 @@ pa_enc_ts_validate(kdc_request_t r, const PA_DATA *pa)
     }
 
  try_next_key:
-    ret = krb5_crypto_init(r->context, &pa_key->key, 0, &crypto);
+    ret = pa_cache_get_crypto(r, pa_key, &crypto);
     if (ret) {
 	const char *msg = krb5_get_error_message(r->context, ret);
 	_kdc_r_log(r, 0, "krb5_crypto_init failed: %s", msg);
@@ -608,7 +938,7 @@ pa_enc_ts_validate(kdc_request_t r, const PA_DATA *pa)
 				      KRB5_KU_PA_ENC_TIMESTAMP,
 				      &enc_data,
 				      &ts_data);
-    krb5_crypto_destroy(r->context, crypto);
+    pa_cache_put_crypto(r, pa_key, crypto);
     /*
      * Since the user might have several keys with the same
      * enctype but with diffrent salting, we need to try all
@@ -1147,15 +1477,20 @@ make_etype_info2_entry(ETYPE_INFO2_ENTRY *ent, Key *key)
  */
 
 static krb5_error_code
-get_pa_etype_info2(krb5_context context,
-		   krb5_kdc_configuration *config,
-		   METHOD_DATA *md, Key *ckey)
+get_pa_etype_info2(kdc_request_t r, METHOD_DATA *md, Key *ckey)
 {
     krb5_error_code ret = 0;
     ETYPE_INFO2 pa;
+    krb5_data data;
     unsigned char *buf;
     size_t len;
 
+    if (pa_cache_get_etype_info2(r, ckey, &data) == 0) {
+	buf = data.data;
+	len = data.length;
+	goto add;
+    }
+
     pa.len = 1;
     pa.val = calloc(1, sizeof(pa.val[0]));
     if(pa.val == NULL)
@@ -1171,6 +1506,8 @@ get_pa_etype_info2(krb5_context context,
     free_ETYPE_INFO2(&pa);
     if(ret)
 	return ret;
+    pa_cache_put_etype_info2(r, ckey, buf, len);
+ add:
     ret = realloc_method_data(md);
     if(ret) {
 	free(buf);
@@ -1800,8 +2137,7 @@ _kdc_as_rep(kdc_request_t r,
 		if (ret)
 		    goto out;
 	    }
-	    ret = get_pa_etype_info2(context, config,
-				     &error_method, ckey);
+	    ret = get_pa_etype_info2(r, &error_method, ckey);
 	    if (ret)
 		goto out;
 	}
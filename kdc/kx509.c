@@ -131,6 +131,136 @@ calculate_reply_hash(krb5_context context,
     return 0;
 }
 
+/*
+ * The CA certificate with its private key and the template certificate
+ * are loaded the first time a kx509_ca/kx509_template pair is used and
+ * are kept for the life of the KDC, so that issuing a certificate only
+ * costs the signature.  Changing the files needs a restart of the KDC.
+ */
+
+struct kdc_kx509_ca {
+    struct kdc_kx509_ca *next;
+    char *ca;
+    char *template;
+    hx509_cert signer;
+    hx509_cert template_cert;
+};
+
+static krb5_error_code
+load_ca(krb5_context context,
+	krb5_kdc_configuration *config,
+	struct kdc_kx509_ca *ca)
+{
+    hx509_certs certs;
+    hx509_query *q;
+    int ret;
+
+    ret = hx509_certs_init(context->hx509ctx, ca->ca, 0, NULL, &certs);
+    if (ret) {
+	kdc_log(context, config, 0, "Failed to load CA %s", ca->ca);
+	return ret;
+    }
+    ret = hx509_query_alloc(context->hx509ctx, &q);
+    if (ret) {
+	hx509_certs_free(&certs);
+	return ret;
+    }
+
+    hx509_query_match_option(q, HX509_QUERY_OPTION_PRIVATE_KEY);
+    hx509_query_match_option(q, HX509_QUERY_OPTION_KU_KEYCERTSIGN);
+
+    ret = hx509_certs_find(context->hx509ctx, certs, q, &ca->signer);
+    hx509_query_free(context->hx509ctx, q);
+    hx509_certs_free(&certs);
+    if (ret) {
+	kdc_log(context, config, 0, "Failed to find a CA in %s", ca->ca);
+	return ret;
+    }
+
+    ret = hx509_certs_init(context->hx509ctx, ca->template, 0, NULL, &certs);
+    if (ret) {
+	kdc_log(context, config, 0, "Failed to load template %s",
+		ca->template);
+	return ret;
+    }
+    ret = hx509_get_one_cert(context->hx509ctx, certs, &ca->template_cert);
+    hx509_certs_free(&certs);
+    if (ret) {
+	kdc_log(context, config, 0, "Failed to find template in %s",
+		ca->template);
+	return ret;
+    }
+    return 0;
+}
+
+static void
+free_ca(struct kdc_kx509_ca *ca)
+{
+    if (ca->signer)
+	hx509_cert_free(ca->signer);
+    if (ca->template_cert)
+	hx509_cert_free(ca->template_cert);
+    free(ca->ca);
+    free(ca->template);
+    free(ca);
+}
+
+/*
+ * Find the CA for clients of `realm´, the kx509_ca and kx509_template
+ * of the realm if set, otherwise the global ones.
+ */
+
+static krb5_error_code
+get_ca(krb5_context context,
+       krb5_kdc_configuration *config,
+       const char *realm,
+       struct kdc_kx509_ca **ret_ca)
+{
+    struct kdc_kx509_ca *ca;
+    const char *kx509_ca, *kx509_template;
+    krb5_error_code ret;
+
+    *ret_ca = NULL;
+
+    kx509_ca = krb5_config_get_string(context, NULL, "kdc", realm,
+				      "kx509_ca", NULL);
+    if (kx509_ca == NULL)
+	kx509_ca = config->kx509_ca;
+    kx509_template = krb5_config_get_string(context, NULL, "kdc", realm,
+					    "kx509_template", NULL);
+    if (kx509_template == NULL)
+	kx509_template = config->kx509_template;
+
+    for (ca = config->kx509_cas; ca != NULL; ca = ca->next) {
+	if (strcmp(ca->ca, kx509_ca) == 0 &&
+	    strcmp(ca->template, kx509_template) == 0) {
+	    *ret_ca = ca;
+	    return 0;
+	}
+    }
+
+    ca = calloc(1, sizeof(*ca));
+    if (ca == NULL)
+	return krb5_enomem(context);
+    ca->ca = strdup(kx509_ca);
+    ca->template = strdup(kx509_template);
+    if (ca->ca == NULL || ca->template == NULL) {
+	free_ca(ca);
+	return krb5_enomem(context);
+    }
+
+    ret = load_ca(context, config, ca);
+    if (ret) {
+	free_ca(ca);
+	return ret;
+    }
+
+    ca->next = config->kx509_cas;
+    config->kx509_cas = ca;
+    *ret_ca = ca;
+    return 0;
+}
+
 /*
  * Build a certifate for `principal´ that will expire at `endtime´.
  */
@@ -144,11 +274,10 @@ build_certificate(krb5_context context,
 		  krb5_data *certificate)
 {
     char *name = NULL;
-    const char *kx509_ca;
     hx509_ca_tbs tbs = NULL;
     hx509_env env = NULL;
     hx509_cert cert = NULL;
-    hx509_cert signer = NULL;
+    struct kdc_kx509_ca *ca;
     krb5_boolean def_bool;
     int ret;
 
@@ -183,43 +312,10 @@ build_certificate(krb5_context context,
     if (ret)
 	goto out;
 
-    /* Pick an issuer based on the crealm if we can */
-    kx509_ca = krb5_config_get_string(context, NULL, "kdc",
-                                      krb5_principal_get_realm(context,
-                                                               principal),
-                                      "kx509_ca", NULL);
-    if (kx509_ca == NULL)
-        kx509_ca = config->kx509_ca;
-
-    {
-	hx509_certs certs;
-	hx509_query *q;
-
-	ret = hx509_certs_init(context->hx509ctx, config->kx509_ca, 0,
-			       NULL, &certs);
-	if (ret) {
-	    kdc_log(context, config, 0, "Failed to load CA %s",
-		    config->kx509_ca);
-	    goto out;
-	}
-	ret = hx509_query_alloc(context->hx509ctx, &q);
-	if (ret) {
-	    hx509_certs_free(&certs);
-	    goto out;
-	}
-
-	hx509_query_match_option(q, HX509_QUERY_OPTION_PRIVATE_KEY);
-	hx509_query_match_option(q, HX509_QUERY_OPTION_KU_KEYCERTSIGN);
-
-	ret = hx509_certs_find(context->hx509ctx, certs, q, &signer);
-	hx509_query_free(context->hx509ctx, q);
-	hx509_certs_free(&certs);
-	if (ret) {
-	    kdc_log(context, config, 0, "Failed to find a CA in %s",
-		    config->kx509_ca);
-	    goto out;
-	}
-    }
+    ret = get_ca(context, config,
+		 krb5_principal_get_realm(context, principal), &ca);
+    if (ret)
+	goto out;
 
     ret = hx509_ca_tbs_init(context->hx509ctx, &tbs);
     if (ret)
@@ -247,33 +343,13 @@ build_certificate(krb5_context context,
 	    goto out;
     }
 
-    {
-	hx509_certs certs;
-	hx509_cert template;
-
-	ret = hx509_certs_init(context->hx509ctx, config->kx509_template, 0,
-			       NULL, &certs);
-	if (ret) {
-	    kdc_log(context, config, 0, "Failed to load template %s",
-		    config->kx509_template);
-	    goto out;
-	}
-	ret = hx509_get_one_cert(context->hx509ctx, certs, &template);
-	hx509_certs_free(&certs);
-	if (ret) {
-	    kdc_log(context, config, 0, "Failed to find template in %s",
-		    config->kx509_template);
-	    goto out;
-	}
-	ret = hx509_ca_tbs_set_template(context->hx509ctx, tbs,
-					HX509_CA_TEMPLATE_SUBJECT|
-					HX509_CA_TEMPLATE_KU|
-					HX509_CA_TEMPLATE_EKU,
-					template);
-	hx509_cert_free(template);
-	if (ret)
-	    goto out;
-    }
+    ret = hx509_ca_tbs_set_template(context->hx509ctx, tbs,
+				    HX509_CA_TEMPLATE_SUBJECT|
+				    HX509_CA_TEMPLATE_KU|
+				    HX509_CA_TEMPLATE_EKU,
+				    ca->template_cert);
+    if (ret)
+	goto out;
 
     def_bool = krb5_config_get_bool_default(context, NULL, TRUE, "kdc",
                                             "kx509_include_pkinit_san",
@@ -293,8 +369,7 @@ build_certificate(krb5_context context,
     hx509_ca_tbs_subject_expand(context->hx509ctx, tbs, env);
     hx509_env_free(&env);
 
-    ret = hx509_ca_sign(context->hx509ctx, tbs, signer, &cert);
-    hx509_cert_free(signer);
+    ret = hx509_ca_sign(context->hx509ctx, tbs, ca->signer, &cert);
     if (ret)
 	goto out;
 
@@ -316,8 +391,6 @@ out:
 	hx509_env_free(&env);
     if (tbs)
 	hx509_ca_tbs_free(&tbs);
-    if (signer)
-	hx509_cert_free(signer);
     krb5_set_error_message(context, ret, "cert creation failed");
     return ret;
 }
@@ -405,15 +478,22 @@ _kdc_do_kx509(krb5_context context,
 	if (ret)
 	    goto out;
 
-	ret = krb5_principal_compare(context, sprincipal, principal);
-	krb5_free_principal(context, principal);
+	/*
+	 * sprincipal has the referral realm, the ticket was decrypted
+	 * with one of our keys so its realm is ours.
+	 */
+	ret = krb5_principal_compare_any_realm(context, sprincipal,
+					       principal);
 	if (ret != TRUE) {
 	    char *expected, *used;
 
 	    ret = krb5_unparse_name(context, sprincipal, &expected);
-	    if (ret)
+	    if (ret) {
+		krb5_free_principal(context, principal);
 		goto out;
+	    }
 	    ret = krb5_unparse_name(context, principal, &used);
+	    krb5_free_principal(context, principal);
 	    if (ret) {
 		krb5_xfree(expected);
 		goto out;
@@ -428,6 +508,7 @@ _kdc_do_kx509(krb5_context context,
 	    krb5_xfree(used);
 	    goto out;
 	}
+	krb5_free_principal(context, principal);
     }
 
     ret = krb5_auth_con_getkey(context, ac, &key);
@@ -116,6 +116,57 @@ out:
     return ret;
 }
 
+/*
+ * Pin a read snapshot in every backend that supports it so that all
+ * lookups done for one request (client, server, krbtgt, ...) see the
+ * same state of the database.  Failure is not fatal, we then just
+ * read the latest state on every fetch.  Returns the set of databases
+ * to pass to _kdc_db_snapshot_end().
+ */
+
+uint64_t
+_kdc_db_snapshot_begin(krb5_context context,
+		       krb5_kdc_configuration *config)
+{
+    krb5_error_code ret;
+    uint64_t pinned = 0;
+    int i;
+
+    for (i = 0; i < config->num_db && i < 64; i++) {
+	HDB *db = config->db[i];
+
+	if ((db->hdb_capability_flags & HDB_CAP_F_SNAPSHOT) == 0 ||
+	    db->hdb_snapshot_begin == NULL)
+	    continue;
+	ret = db->hdb_open(context, db, O_RDONLY, 0);
+	if (ret == 0) {
+	    ret = db->hdb_snapshot_begin(context, db);
+	    db->hdb_close(context, db);
+	}
+	if (ret) {
+	    const char *msg = krb5_get_error_message(context, ret);
+	    kdc_log(context, config, 5, "Failed to start db snapshot: %s", msg);
+	    krb5_free_error_message(context, msg);
+	    continue;
+	}
+	pinned |= (uint64_t)1 << i;
+    }
+    return pinned;
+}
+
+void
+_kdc_db_snapshot_end(krb5_context context,
+		     krb5_kdc_configuration *config,
+		     uint64_t pinned)
+{
+    int i;
+
+    for (i = 0; i < config->num_db && i < 64; i++) {
+	if (pinned & ((uint64_t)1 << i))
+	    config->db[i]->hdb_snapshot_end(context, config->db[i]);
+    }
+}
+
 void
 _kdc_free_ent(krb5_context context, hdb_entry_ex *ent)
 {
@@ -200,12 +200,433 @@ _kdc_pk_free_client_param(krb5_context context, pk_client_params *cp)
     free(cp);
 }
 
+/*
+ * Pool of ephemeral Diffie-Hellman and ECDH keys.
+ *
+ * Generating the KDC's half of the key exchange is the expensive part
+ * of a PKINIT DH request, so when [kdc] pkinit_dh_pool_size is set a
+ * number of keys per group are generated ahead of time by background
+ * threads.  Each key is handed out once and then belongs to the
+ * request.  DH groups are added the first time a client uses them,
+ * which can only be a group from the moduli file, ECDH curves when the
+ * pool is set up.  When a group is empty the request generates its
+ * own key, as it would without the pool.
+ *
+ * The threads are started by the first request that wants a key, so
+ * they run in the process that serves requests and not in the one
+ * that read the configuration before detaching.  A fork waits for the
+ * pool to be unlocked, and the child starts threads of its own.
+ */
+
+struct pk_pool_group {
+    struct pk_pool_group *next;
+    char *name;
+    DH *params;
+#ifdef HAVE_OPENSSL
+    int nid;
+#endif
+    void **keys;
+    size_t len;
+};
+
+static struct {
+    size_t size;
+    int threads;
+    int started;
+    unsigned long hits;
+    unsigned long misses;
+    struct pk_pool_group *groups;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pthread_mutex_t mutex;
+    pthread_cond_t refill;
+#endif
+} pk_pool = {
+    0, 0, 0, 0, 0, NULL
+#ifdef ENABLE_PTHREAD_SUPPORT
+    , PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+#endif
+};
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+#define POOL_LOCK() pthread_mutex_lock(&pk_pool.mutex)
+#define POOL_UNLOCK() pthread_mutex_unlock(&pk_pool.mutex)
+#define POOL_SIGNAL() pthread_cond_signal(&pk_pool.refill)
+#else
+#define POOL_LOCK() do { } while (0)
+#define POOL_UNLOCK() do { } while (0)
+#define POOL_SIGNAL() do { } while (0)
+#endif
+
+static void
+pool_key_free(struct pk_pool_group *g, void *key)
+{
+#ifdef HAVE_OPENSSL
+    if (g->nid) {
+	EC_KEY_free(key);
+	return;
+    }
+#endif
+    DH_free(key);
+}
+
+static void *
+pool_key_generate(struct pk_pool_group *g)
+{
+    DH *dh;
+
+#ifdef HAVE_OPENSSL
+    if (g->nid) {
+	EC_KEY *ec = EC_KEY_new_by_curve_name(g->nid);
+
+	if (ec != NULL && EC_KEY_generate_key(ec) != 1) {
+	    EC_KEY_free(ec);
+	    ec = NULL;
+	}
+	return ec;
+    }
+#endif
+    dh = DH_new();
+    if (dh == NULL)
+	return NULL;
+    dh->p = BN_dup(g->params->p);
+    dh->g = BN_dup(g->params->g);
+    if (g->params->q)
+	dh->q = BN_dup(g->params->q);
+    if (dh->p == NULL || dh->g == NULL ||
+	(g->params->q && dh->q == NULL) ||
+	!DH_generate_key(dh)) {
+	DH_free(dh);
+	return NULL;
+    }
+    return dh;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static void *
+pool_thread(void *arg)
+{
+    struct pk_pool_group *g;
+    void *key;
+
+    POOL_LOCK();
+    for (;;) {
+	for (g = pk_pool.groups; g != NULL; g = g->next)
+	    if (g->len < pk_pool.size)
+		break;
+	if (g == NULL) {
+	    pthread_cond_wait(&pk_pool.refill, &pk_pool.mutex);
+	    continue;
+	}
+	POOL_UNLOCK();
+	key = pool_key_generate(g);
+	if (key == NULL) {
+	    sleep(1);
+	    POOL_LOCK();
+	    continue;
+	}
+	POOL_LOCK();
+	if (g->len < pk_pool.size)
+	    g->keys[g->len++] = key;
+	else
+	    pool_key_free(g, key);
+    }
+    POOL_UNLOCK();
+    return NULL;
+}
+
+/* must be called with the pool locked */
+static void
+pool_start(krb5_context context)
+{
+    int i;
+
+    pk_pool.started = 1;
+    for (i = 0; i < pk_pool.threads; i++) {
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+	    krb5_warnx(context, "PKINIT: failed to start key pool thread");
+	    break;
+	}
+	pthread_detach(thread);
+    }
+}
+
+static void
+pool_atfork_prepare(void)
+{
+    POOL_LOCK();
+}
+
+static void
+pool_atfork_parent(void)
+{
+    POOL_UNLOCK();
+}
+
+/* the threads are gone, the child starts its own when it needs them */
+static void
+pool_atfork_child(void)
+{
+    pk_pool.started = 0;
+    pthread_cond_init(&pk_pool.refill, NULL);
+    POOL_UNLOCK();
+}
+#endif
+
+/* must be called with the pool locked */
+static struct pk_pool_group *
+pool_add_group(const char *name, DH *params, int nid)
+{
+    struct pk_pool_group *g;
+
+    g = calloc(1, sizeof(*g));
+    if (g == NULL)
+	return NULL;
+    g->keys = calloc(pk_pool.size, sizeof(g->keys[0]));
+    g->name = strdup(name);
+    if (g->keys == NULL || g->name == NULL)
+	goto fail;
+#ifdef HAVE_OPENSSL
+    g->nid = nid;
+    if (nid == 0)
+#endif
+    {
+	g->params = DH_new();
+	if (g->params == NULL)
+	    goto fail;
+	g->params->p = BN_dup(params->p);
+	g->params->g = BN_dup(params->g);
+	if (params->q)
+	    g->params->q = BN_dup(params->q);
+	if (g->params->p == NULL || g->params->g == NULL ||
+	    (params->q && g->params->q == NULL))
+	    goto fail;
+    }
+    g->next = pk_pool.groups;
+    pk_pool.groups = g;
+    POOL_SIGNAL();
+    return g;
+
+ fail:
+    if (g->params)
+	DH_free(g->params);
+    free(g->name);
+    free(g->keys);
+    free(g);
+    return NULL;
+}
+
+/*
+ * Take a key for the named group out of the pool.  params describes
+ * the group in case this is the first time it is asked for.  Returns
+ * NULL when the pool is disabled or has run dry.
+ */
+
+static void *
+pool_get(krb5_context context, krb5_kdc_configuration *config,
+	 const char *name, DH *params, int nid)
+{
+    unsigned long hits, misses;
+    struct pk_pool_group *g;
+    void *key = NULL;
+
+    if (pk_pool.size == 0 || name == NULL)
+	return NULL;
+
+    POOL_LOCK();
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (!pk_pool.started)
+	pool_start(context);
+#endif
+    for (g = pk_pool.groups; g != NULL; g = g->next)
+	if (strcmp(g->name, name) == 0)
+	    break;
+    if (g == NULL)
+	g = pool_add_group(name, params, nid);
+    if (g != NULL && g->len > 0) {
+	key = g->keys[--g->len];
+	pk_pool.hits++;
+    } else
+	pk_pool.misses++;
+    hits = pk_pool.hits;
+    misses = pk_pool.misses;
+    POOL_SIGNAL();
+    POOL_UNLOCK();
+
+    kdc_log(context, config, 5,
+	    "PKINIT: key pool %s for %s (%lu hits, %lu misses)",
+	    key ? "hit" : "miss", name, hits, misses);
+
+    return key;
+}
+
+static void
+pool_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    int size, threads;
+
+    size = krb5_config_get_int_default(context, NULL, 0,
+				       "kdc", "pkinit_dh_pool_size", NULL);
+    threads = krb5_config_get_int_default(context, NULL, 1,
+					  "kdc", "pkinit_dh_pool_threads", NULL);
+    if (size <= 0)
+	return;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (threads < 1)
+	threads = 1;
+
+    if (pthread_atfork(pool_atfork_prepare, pool_atfork_parent,
+		       pool_atfork_child) != 0) {
+	krb5_warnx(context, "PKINIT: failed to set up the key pool");
+	return;
+    }
+    pk_pool.size = size;
+    pk_pool.threads = threads;
+#ifdef HAVE_OPENSSL
+    POOL_LOCK();
+    pool_add_group("P-256", NULL, NID_X9_62_prime256v1);
+    POOL_UNLOCK();
+#endif
+    kdc_log(context, config, 0,
+	    "PKINIT: key pool of %d keys per group", size);
+#else
+    (void)threads;
+    krb5_warnx(context, "PKINIT: pkinit_dh_pool_size set, but the "
+	       "key pool needs thread support");
+#endif
+}
+
+/*
+ * Revocation data (pkinit_revoke) can be reloaded by a thread of its
+ * own, so the request path only ever looks at data that is already
+ * parsed.  The thread polls the files every interval, and more often
+ * when the data is getting close to its nextUpdate time.
+ *
+ * Like the key pool threads it is started by the first request that
+ * checks revocation, and hx509 stops reloading from the request only
+ * once it runs.  A forked child goes back to reloading from the
+ * request until it has started a thread of its own.
+ */
+
+static int revoke_interval;
+static int revoke_started;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static pthread_mutex_t revoke_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static void *
+revoke_thread(void *arg)
+{
+    hx509_revoke_ctx revokectx = arg;
+    hx509_context hxctx;
+    time_t next, now;
+    int wait = revoke_interval;
+
+    if (hx509_context_init(&hxctx))
+	return NULL;
+
+    for (;;) {
+	sleep(wait);
+	next = 0;
+	hx509_revoke_refresh(hxctx, revokectx, &next);
+	hx509_clear_error_string(hxctx);
+
+	wait = revoke_interval;
+	now = time(NULL);
+	if (next != 0 && next - now < 2 * revoke_interval) {
+	    wait = revoke_interval / 4;
+	    if (wait < 1)
+		wait = 1;
+	}
+    }
+    hx509_context_free(&hxctx);
+    return NULL;
+}
+
+static void
+revoke_atfork_prepare(void)
+{
+    pthread_mutex_lock(&revoke_mutex);
+}
+
+static void
+revoke_atfork_parent(void)
+{
+    pthread_mutex_unlock(&revoke_mutex);
+}
+
+static void
+revoke_atfork_child(void)
+{
+    if (revoke_started)
+	hx509_revoke_set_reload(kdc_identity->revokectx, 1);
+    revoke_started = 0;
+    pthread_mutex_unlock(&revoke_mutex);
+}
+#endif
+
+static void
+revoke_start(krb5_context context, krb5_kdc_configuration *config)
+{
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pthread_t thread;
+
+    if (revoke_interval <= 0)
+	return;
+
+    pthread_mutex_lock(&revoke_mutex);
+    if (!revoke_started) {
+	revoke_started = 1;
+	if (pthread_create(&thread, NULL, revoke_thread,
+			   kdc_identity->revokectx) != 0) {
+	    krb5_warnx(context, "PKINIT: failed to start revoke refresh thread");
+	} else {
+	    pthread_detach(thread);
+	    hx509_revoke_set_reload(kdc_identity->revokectx, 0);
+	    kdc_log(context, config, 0,
+		    "PKINIT: refreshing revocation data every %d seconds",
+		    revoke_interval);
+	}
+    }
+    pthread_mutex_unlock(&revoke_mutex);
+#endif
+}
+
+static void
+revoke_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    if (kdc_identity->revokectx == NULL || !config->pkinit_check_revocation)
+	return;
+
+    revoke_interval =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "pkinit_revoke_refresh_interval", NULL);
+    if (revoke_interval <= 0)
+	return;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (pthread_atfork(revoke_atfork_prepare, revoke_atfork_parent,
+		       revoke_atfork_child) != 0) {
+	krb5_warnx(context, "PKINIT: failed to set up revoke refresh thread");
+	revoke_interval = 0;
+    }
+#else
+    revoke_interval = 0;
+    krb5_warnx(context, "PKINIT: pkinit_revoke_refresh_interval set, but "
+	       "refreshing in the background needs thread support");
+#endif
+}
+
 static krb5_error_code
 generate_dh_keyblock(krb5_context context,
+		     krb5_kdc_configuration *config,
 		     pk_client_params *client_params,
                      krb5_enctype enctype)
 {
     unsigned char *dh_gen_key = NULL;
+    void *pooled;
     krb5_keyblock key;
     krb5_error_code ret;
     size_t dh_gen_keylen, size;
@@ -220,7 +641,12 @@ generate_dh_keyblock(krb5_context context,
 	    goto out;
 	}
 
-	if (!DH_generate_key(client_params->u.dh.key)) {
+	pooled = pool_get(context, config, client_params->dh_group_name,
+			  client_params->u.dh.key, 0);
+	if (pooled) {
+	    DH_free(client_params->u.dh.key);
+	    client_params->u.dh.key = pooled;
+	} else if (!DH_generate_key(client_params->u.dh.key)) {
 	    ret = KRB5KRB_ERR_GENERIC;
 	    krb5_set_error_message(context, ret,
 				   "Can't generate Diffie-Hellman keys");
@@ -259,17 +685,22 @@ generate_dh_keyblock(krb5_context context,
 	    goto out;
 	}
 
-	client_params->u.ecdh.key = EC_KEY_new();
+	if (EC_GROUP_get_curve_name(EC_KEY_get0_group(client_params->u.ecdh.public_key)) == NID_X9_62_prime256v1)
+	    client_params->u.ecdh.key = pool_get(context, config, "P-256",
+						 NULL, NID_X9_62_prime256v1);
 	if (client_params->u.ecdh.key == NULL) {
-	    ret = ENOMEM;
-	    goto out;
-	}
-	EC_KEY_set_group(client_params->u.ecdh.key,
-			 EC_KEY_get0_group(client_params->u.ecdh.public_key));
+	    client_params->u.ecdh.key = EC_KEY_new();
+	    if (client_params->u.ecdh.key == NULL) {
+		ret = ENOMEM;
+		goto out;
+	    }
+	    EC_KEY_set_group(client_params->u.ecdh.key,
+			     EC_KEY_get0_group(client_params->u.ecdh.public_key));
 
-	if (EC_KEY_generate_key(client_params->u.ecdh.key) != 1) {
-	    ret = ENOMEM;
-	    goto out;
+	    if (EC_KEY_generate_key(client_params->u.ecdh.key) != 1) {
+		ret = ENOMEM;
+		goto out;
+	    }
 	}
 
 	size = (EC_GROUP_get_degree(EC_KEY_get0_group(client_params->u.ecdh.key)) + 7) / 8;
@@ -564,6 +995,10 @@ _kdc_pk_rd_padata(krb5_context context,
     hx509_verify_set_time(cp->verify_ctx, kdc_time);
     hx509_verify_attach_anchors(cp->verify_ctx, trust_anchors);
     hx509_certs_free(&trust_anchors);
+    if (kdc_identity->revokectx && config->pkinit_check_revocation) {
+	revoke_start(context, config);
+	hx509_verify_attach_revoke(cp->verify_ctx, kdc_identity->revokectx);
+    }
 
     if (config->pkinit_allow_proxy_certs)
 	hx509_verify_set_proxy_certificate(cp->verify_ctx, 1);
@@ -718,10 +1153,14 @@ _kdc_pk_rd_padata(krb5_context context,
     {
 	hx509_certs signer_certs;
 	int flags = HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH; /* BTMM */
+	unsigned long hits, misses, prev_hits;
 
 	if (req->req_body.kdc_options.request_anonymous)
 	    flags |= HX509_CMS_VS_ALLOW_ZERO_SIGNER;
 
+	hx509_context_get_path_cache_stats(context->hx509ctx,
+					   &prev_hits, &misses);
+
 	ret = hx509_cms_verify_signed(context->hx509ctx,
 				      cp->verify_ctx,
 				      flags,
@@ -740,6 +1179,12 @@ _kdc_pk_rd_padata(krb5_context context,
 	    goto out;
 	}
 
+	hx509_context_get_path_cache_stats(context->hx509ctx, &hits, &misses);
+	if (hits + misses)
+	    kdc_log(context, config, 5,
+		    "PKINIT: chain cache %s (%lu hits, %lu misses)",
+		    hits != prev_hits ? "hit" : "miss", hits, misses);
+
 	if (signer_certs) {
 	    ret = hx509_get_one_cert(context->hx509ctx, signer_certs,
 				     &cp->cert);
@@ -1340,7 +1785,7 @@ _kdc_pk_mk_pa_reply(krb5_context context,
 
 	    rep.element = choice_PA_PK_AS_REP_dhInfo;
 
-	    ret = generate_dh_keyblock(context, cp, enctype);
+	    ret = generate_dh_keyblock(context, config, cp, enctype);
 	    if (ret)
 		return ret;
 
@@ -1967,6 +2412,8 @@ krb5_kdc_pk_initialize(krb5_context context,
     if (ret)
 	krb5_err(context, 1, ret, "PKINIT: failed to load modidi file");
 
+    pool_init(context, config);
+
     principal_mappings.len = 0;
     principal_mappings.val = NULL;
 
@@ -1985,6 +2432,36 @@ krb5_kdc_pk_initialize(krb5_context context,
 	return ret;
     }
 
+    revoke_init(context, config);
+
+    {
+	int size;
+
+	size = krb5_config_get_int_default(context, NULL, 0, "kdc",
+					   "pkinit_chain_cache_size", NULL);
+	if (size > 0) {
+	    ret = hx509_context_set_path_cache(context->hx509ctx, size);
+	    if (ret)
+		krb5_warnx(context, "PKINIT: failed to set up chain cache");
+	    else
+		kdc_log(context, config, 0,
+			"PKINIT: caching up to %d verified chains", size);
+	}
+    }
+
+    {
+	int threads;
+
+	threads = krb5_config_get_int_default(context, NULL, 0, "kdc",
+					      "pkinit_verify_threads", NULL);
+	if (threads > 1) {
+	    ret = hx509_context_set_verify_threads(context->hx509ctx, threads);
+	    if (ret)
+		krb5_warnx(context, "PKINIT: failed to start %d signature "
+			   "verification threads", threads);
+	}
+    }
+
     {
 	hx509_query *q;
 	hx509_cert cert;
@@ -33,6 +33,7 @@
  */
 
 #include "kdc_locl.h"
+#include <parse_bytes.h>
 
 /*
  *
@@ -47,6 +48,59 @@ krb5_kdc_update_time(struct timeval *tv)
 	_kdc_now = *tv;
 }
 
+/*
+ * AS and TGS requests are decoded into an arena, so the request is
+ * a couple of allocations instead of one per element, and its
+ * octet strings point into the request buffer.  Each thread keeps
+ * its arena and resets it once the reply has been built, so a
+ * request normally costs no malloc() for the arena at all.
+ */
+
+static HEIMDAL_thread_key arena_key;
+static int arena_key_ok;
+
+static void
+arena_key_destroy(void *ptr)
+{
+    asn1_arena_destroy(ptr);
+}
+
+static void
+arena_key_init(void *ptr)
+{
+    int ret;
+
+    HEIMDAL_key_create(&arena_key, arena_key_destroy, ret);
+    arena_key_ok = (ret == 0);
+}
+
+static krb5_error_code
+request_arena_get(struct asn1_arena **arena)
+{
+    static heim_base_once_t once = HEIM_BASE_ONCE_INIT;
+    krb5_error_code ret;
+    int ret2;
+
+    heim_base_once_f(&once, NULL, arena_key_init);
+    if (arena_key_ok && (*arena = HEIMDAL_getspecific(arena_key)) != NULL)
+	return 0;
+    ret = asn1_arena_create(0, ASN1_ARENA_ZEROCOPY, arena);
+    if (ret || !arena_key_ok)
+	return ret;
+    HEIMDAL_setspecific(arena_key, *arena, ret2);
+    (void) ret2;
+    return 0;
+}
+
+static void
+request_arena_put(struct asn1_arena *arena)
+{
+    if (arena_key_ok && HEIMDAL_getspecific(arena_key) == arena)
+	asn1_arena_reset(arena);
+    else
+	asn1_arena_destroy(arena);
+}
+
 static krb5_error_code
 kdc_as_req(krb5_context context,
 	   krb5_kdc_configuration *config,
@@ -58,15 +112,24 @@ kdc_as_req(krb5_context context,
 	   int *claim)
 {
     struct kdc_request_desc r;
+    struct asn1_arena *arena;
     krb5_error_code ret;
     size_t len;
 
     memset(&r, 0, sizeof(r));
 
-    ret = decode_AS_REQ(req_buffer->data, req_buffer->length, &r.req, &len);
+    ret = request_arena_get(&arena);
     if (ret)
 	return ret;
 
+    ret = decode_AS_REQ_arena(req_buffer->data, req_buffer->length,
+			      &r.req, &len, arena);
+    if (ret) {
+	request_arena_put(arena);
+	return ret;
+    }
+
+    r.arena = arena;
     r.context = context;
     r.config = config;
     r.request.data = req_buffer->data;
@@ -75,7 +138,10 @@ kdc_as_req(krb5_context context,
     *claim = 1;
 
     ret = _kdc_as_rep(&r, reply, from, addr, datagram_reply);
-    free_AS_REQ(&r.req);
+    /* FAST may have replaced the request with a malloc()ed one */
+    if (r.arena == NULL)
+	free_AS_REQ(&r.req);
+    request_arena_put(arena);
     return ret;
 }
 
@@ -90,19 +156,27 @@ kdc_tgs_req(krb5_context context,
 	    int datagram_reply,
 	    int *claim)
 {
+    struct asn1_arena *arena;
     krb5_error_code ret;
     KDC_REQ req;
     size_t len;
 
-    ret = decode_TGS_REQ(req_buffer->data, req_buffer->length, &req, &len);
+    ret = request_arena_get(&arena);
     if (ret)
 	return ret;
 
+    ret = decode_TGS_REQ_arena(req_buffer->data, req_buffer->length,
+			       &req, &len, arena);
+    if (ret) {
+	request_arena_put(arena);
+	return ret;
+    }
+
     *claim = 1;
 
     ret = _kdc_tgs_rep(context, config, &req, reply,
 		       from, addr, datagram_reply);
-    free_TGS_REQ(&req);
+    request_arena_put(arena);
     return ret;
 }
 
@@ -168,17 +242,354 @@ kdc_kx509(krb5_context context,
 
 
 static struct krb5_kdc_service services[] =  {
-    { KS_KRB5,		kdc_as_req },
-    { KS_KRB5,		kdc_tgs_req },
+    { KS_KRB5,		kdc_as_req,	krb_as_req },
+    { KS_KRB5,		kdc_tgs_req,	krb_tgs_req },
 #ifdef DIGEST
-    { 0,		kdc_digest },
+    { 0,		kdc_digest,	128 },	/* DigestREQ */
 #endif
 #ifdef KX509
-    { 0,		kdc_kx509 },
+    { 0,		kdc_kx509,	0 },
 #endif
-    { 0, NULL }
+    { 0, NULL, 0 }
+};
+
+/*
+ * Peek at the outer tag of the request so that it is only handed to
+ * the service that can decode it, instead of every service trying
+ * (and failing) a full decode in turn.  Returns 0 when the request
+ * doesn't start with a constructed APPLICATION tag.
+ */
+
+static unsigned int
+request_tag(const krb5_data *req_buffer)
+{
+    Der_class cl;
+    Der_type ty;
+    unsigned int tag;
+
+    if (der_get_tag(req_buffer->data, req_buffer->length,
+		    &cl, &ty, &tag, NULL) != 0)
+	return 0;
+    if (cl != ASN1_C_APPL || ty != CONS)
+	return 0;
+    return tag;
+}
+
+/*
+ * Reply cache.  Clients retransmit over UDP after a second or two, and
+ * a busy KDC is when that happens most.  Instead of processing the
+ * retransmit again (and handing out a different ticket), a request
+ * that is byte for byte the same as one answered within the last
+ * reply-cache-lifetime seconds, from the same address and port, gets
+ * the reply that was sent the first time.  Requests without a known
+ * source address are never cached.  Only AS-REP and TGS-REP
+ * replies are kept; errors are cheap to redo and may be transient.
+ *
+ * Entries are kept in insertion order, which with a fixed lifetime is
+ * also expiry order, so the oldest entry is dropped when it expires or
+ * when the cache is over reply-cache-size bytes.
+ */
+
+struct kdc_reply_cache_entry {
+    struct kdc_reply_cache_entry *next;		/* in the hash bucket */
+    struct kdc_reply_cache_entry *newer;	/* in insertion order */
+    uint32_t hash;
+    time_t expires;
+    int datagram_reply;
+    size_t addr_len;
+    size_t req_len;
+    size_t rep_len;
+    /* address, request and reply follow */
 };
 
+struct kdc_reply_cache {
+    HEIMDAL_MUTEX mutex;
+    time_t lifetime;
+    size_t max_size;
+    size_t size;
+    size_t nbuckets;
+    struct kdc_reply_cache_entry **buckets;
+    struct kdc_reply_cache_entry *oldest;
+    struct kdc_reply_cache_entry *newest;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evicted;
+    unsigned long too_large;
+};
+
+#define RC_ENTRY_ADDR(e) ((unsigned char *)((e) + 1))
+#define RC_ENTRY_REQ(e) (RC_ENTRY_ADDR(e) + (e)->addr_len)
+#define RC_ENTRY_REP(e) (RC_ENTRY_REQ(e) + (e)->req_len)
+#define RC_ENTRY_SIZE(e) \
+    (sizeof(*(e)) + (e)->addr_len + (e)->req_len + (e)->rep_len)
+
+krb5_error_code
+_kdc_reply_cache_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_reply_cache *rc;
+    const char *p;
+    ssize_t size;
+
+    p = krb5_config_get_string(context, NULL, "kdc", "reply-cache-size", NULL);
+    if (p == NULL)
+	return 0;
+    size = parse_bytes(p, NULL);
+    if (size < 0)
+	krb5_warnx(context, "Bad reply-cache-size: %s", p);
+    if (size <= 0)
+	return 0;
+
+    rc = calloc(1, sizeof(*rc));
+    if (rc == NULL)
+	return krb5_enomem(context);
+    rc->max_size = size;
+    rc->lifetime = krb5_config_get_time_default(context, NULL, 30, "kdc",
+						"reply-cache-lifetime", NULL);
+
+    /* about one bucket per two kilobytes of requests and replies */
+    rc->nbuckets = 16;
+    while (rc->nbuckets < rc->max_size / 2048 && rc->nbuckets < 65536)
+	rc->nbuckets *= 2;
+    rc->buckets = calloc(rc->nbuckets, sizeof(rc->buckets[0]));
+    if (rc->buckets == NULL) {
+	free(rc);
+	return krb5_enomem(context);
+    }
+    HEIMDAL_MUTEX_init(&rc->mutex);
+
+    config->reply_cache = rc;
+    return 0;
+}
+
+/*
+ * The source of the request, as bytes to compare, or 0 when it is not
+ * known: such requests are not cached, as they would all share a key.
+ */
+
+static size_t
+reply_cache_addr(struct sockaddr *addr, unsigned char *buf, size_t len)
+{
+    size_t alen;
+    int port;
+
+    if (addr == NULL)
+	return 0;
+    alen = socket_addr_size(addr);
+    if (alen == 0 || alen + sizeof(port) > len)
+	return 0;
+    port = socket_get_port(addr);
+    memcpy(buf, &port, sizeof(port));
+    memcpy(buf + sizeof(port), socket_get_address(addr), alen);
+    return alen + sizeof(port);
+}
+
+static uint32_t
+reply_cache_hash(const unsigned char *addr, size_t addr_len,
+		 const krb5_data *req, int datagram_reply)
+{
+    const unsigned char *p = req->data;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < addr_len; i++)
+	h = (h ^ addr[i]) * 16777619U;
+    for (i = 0; i < req->length; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return (h ^ (datagram_reply != 0)) * 16777619U;
+}
+
+/* unlink and free the oldest entry, called with the mutex held */
+
+static void
+reply_cache_drop_oldest(struct kdc_reply_cache *rc)
+{
+    struct kdc_reply_cache_entry *e = rc->oldest, **pe;
+
+    for (pe = &rc->buckets[e->hash % rc->nbuckets]; *pe != e; pe = &(*pe)->next)
+	;
+    *pe = e->next;
+    rc->oldest = e->newer;
+    if (rc->oldest == NULL)
+	rc->newest = NULL;
+    rc->size -= RC_ENTRY_SIZE(e);
+    free(e);
+}
+
+static int
+reply_cache_lookup(krb5_context context,
+		   krb5_kdc_configuration *config,
+		   struct kdc_reply_cache *rc,
+		   const unsigned char *addr, size_t addr_len,
+		   const krb5_data *req,
+		   int datagram_reply,
+		   uint32_t hash,
+		   const char *from,
+		   krb5_data *reply)
+{
+    struct kdc_reply_cache_entry *e;
+    unsigned long hits, misses;
+    int found = 0;
+
+    HEIMDAL_MUTEX_lock(&rc->mutex);
+    while (rc->oldest && rc->oldest->expires <= kdc_time)
+	reply_cache_drop_oldest(rc);
+
+    for (e = rc->buckets[hash % rc->nbuckets]; e != NULL; e = e->next) {
+	if (e->hash == hash &&
+	    e->datagram_reply == datagram_reply &&
+	    e->addr_len == addr_len &&
+	    e->req_len == req->length &&
+	    memcmp(RC_ENTRY_ADDR(e), addr, addr_len) == 0 &&
+	    memcmp(RC_ENTRY_REQ(e), req->data, req->length) == 0)
+	    break;
+    }
+    if (e != NULL && krb5_data_copy(reply, RC_ENTRY_REP(e), e->rep_len) == 0) {
+	found = 1;
+	rc->hits++;
+    } else
+	rc->misses++;
+    hits = rc->hits;
+    misses = rc->misses;
+    HEIMDAL_MUTEX_unlock(&rc->mutex);
+
+    if (found)
+	kdc_log(context, config, 4,
+		"Retransmitted request from %s, sending the cached reply "
+		"(%lu hits, %lu misses)", from, hits, misses);
+    return found;
+}
+
+static void
+reply_cache_store(krb5_context context,
+		  krb5_kdc_configuration *config,
+		  struct kdc_reply_cache *rc,
+		  const unsigned char *addr, size_t addr_len,
+		  const krb5_data *req,
+		  int datagram_reply,
+		  uint32_t hash,
+		  const krb5_data *reply)
+{
+    struct kdc_reply_cache_entry *e;
+    unsigned long evicted = 0, too_large;
+    size_t size;
+
+    size = sizeof(*e) + addr_len + req->length + reply->length;
+    if (size > rc->max_size) {
+	HEIMDAL_MUTEX_lock(&rc->mutex);
+	too_large = ++rc->too_large;
+	HEIMDAL_MUTEX_unlock(&rc->mutex);
+	kdc_log(context, config, 5,
+		"Reply of %lu bytes too large for the reply cache (%lu so far)",
+		(unsigned long)reply->length, too_large);
+	return;
+    }
+
+    e = malloc(size);
+    if (e == NULL)
+	return;
+    e->hash = hash;
+    e->expires = kdc_time + rc->lifetime;
+    e->datagram_reply = datagram_reply;
+    e->addr_len = addr_len;
+    e->req_len = req->length;
+    e->rep_len = reply->length;
+    e->newer = NULL;
+    memcpy(RC_ENTRY_ADDR(e), addr, addr_len);
+    memcpy(RC_ENTRY_REQ(e), req->data, req->length);
+    memcpy(RC_ENTRY_REP(e), reply->data, reply->length);
+
+    HEIMDAL_MUTEX_lock(&rc->mutex);
+    while (rc->oldest &&
+	   (rc->oldest->expires <= kdc_time || rc->size + size > rc->max_size)) {
+	if (rc->oldest->expires > kdc_time)
+	    evicted++;
+	reply_cache_drop_oldest(rc);
+    }
+    e->next = rc->buckets[hash % rc->nbuckets];
+    rc->buckets[hash % rc->nbuckets] = e;
+    if (rc->newest)
+	rc->newest->newer = e;
+    else
+	rc->oldest = e;
+    rc->newest = e;
+    rc->size += size;
+    rc->evicted += evicted;
+    evicted = rc->evicted;
+    HEIMDAL_MUTEX_unlock(&rc->mutex);
+
+    if (evicted && evicted % 1000 == 0)
+	kdc_log(context, config, 3,
+		"Reply cache of %lu bytes is full, %lu replies dropped "
+		"before their lifetime was up",
+		(unsigned long)rc->max_size, evicted);
+}
+
+static int
+process_request(krb5_context context,
+		krb5_kdc_configuration *config,
+		krb5_data *req_buffer,
+		krb5_data *reply,
+		krb5_boolean *prependlength,
+		const char *from,
+		struct sockaddr *addr,
+		int datagram_reply,
+		unsigned int flags)
+{
+    struct kdc_reply_cache *rc = NULL;
+    unsigned char rc_addr[sizeof(int) + 16];
+    size_t rc_addr_len = 0;
+    uint32_t rc_hash = 0;
+    krb5_error_code ret;
+    unsigned int i, tag;
+    int claim = 0;
+    uint64_t pinned;
+
+    tag = request_tag(req_buffer);
+
+    if (config->reply_cache && (tag == krb_as_req || tag == krb_tgs_req))
+	rc_addr_len = reply_cache_addr(addr, rc_addr, sizeof(rc_addr));
+    if (rc_addr_len) {
+	rc = config->reply_cache;
+	rc_hash = reply_cache_hash(rc_addr, rc_addr_len, req_buffer,
+				   datagram_reply);
+	if (reply_cache_lookup(context, config, rc, rc_addr, rc_addr_len,
+			       req_buffer, datagram_reply, rc_hash,
+			       from, reply))
+	    return 0;
+    }
+
+    pinned = _kdc_db_snapshot_begin(context, config);
+
+    for (i = 0; services[i].process != NULL; i++) {
+	if ((services[i].flags & flags) != flags)
+	    continue;
+	if (services[i].tag != 0 && services[i].tag != tag)
+	    continue;
+	ret = (*services[i].process)(context, config, req_buffer,
+				     reply, from, addr, datagram_reply,
+				     &claim);
+	if (claim) {
+	    if (prependlength && (services[i].flags & KS_NO_LENGTH))
+		*prependlength = 0;
+
+	    _kdc_db_snapshot_end(context, config, pinned);
+
+	    if (rc && ret == 0) {
+		unsigned int rtag = request_tag(reply);
+
+		if (rtag == krb_as_rep || rtag == krb_tgs_rep)
+		    reply_cache_store(context, config, rc, rc_addr,
+				      rc_addr_len, req_buffer,
+				      datagram_reply, rc_hash, reply);
+	    }
+	    return ret;
+	}
+    }
+
+    _kdc_db_snapshot_end(context, config, pinned);
+    return -1;
+}
+
 /*
  * handle the request in `buf, len', from `addr' (or `from' as a string),
  * sending a reply in `reply'.
@@ -195,31 +606,20 @@ krb5_kdc_process_request(krb5_context context,
 			 struct sockaddr *addr,
 			 int datagram_reply)
 {
-    krb5_error_code ret;
-    unsigned int i;
-    krb5_data req_buffer;
-    int claim = 0;
     heim_auto_release_t pool = heim_auto_release_create();
+    krb5_data req_buffer;
+    int ret;
 
     req_buffer.data = buf;
     req_buffer.length = len;
 
-    for (i = 0; services[i].process != NULL; i++) {
-	ret = (*services[i].process)(context, config, &req_buffer,
-				     reply, from, addr, datagram_reply,
-				     &claim);
-	if (claim) {
-	    if (services[i].flags & KS_NO_LENGTH)
-		*prependlength = 0;
-
-	    heim_auto_release_drain(pool);
-	    return ret;
-	}
-    }
+    ret = process_request(context, config, &req_buffer, reply,
+			  prependlength, from, addr, datagram_reply, 0);
 
-    heim_auto_release_drain(pool);
+    /* drains the pool and pops it off this thread's pool stack */
+    heim_release(pool);
 
-    return -1;
+    return ret;
 }
 
 /*
@@ -239,25 +639,13 @@ krb5_kdc_process_krb5_request(krb5_context context,
 			      struct sockaddr *addr,
 			      int datagram_reply)
 {
-    krb5_error_code ret;
-    unsigned int i;
     krb5_data req_buffer;
-    int claim = 0;
 
     req_buffer.data = buf;
     req_buffer.length = len;
 
-    for (i = 0; services[i].process != NULL; i++) {
-	if ((services[i].flags & KS_KRB5) == 0)
-	    continue;
-	ret = (*services[i].process)(context, config, &req_buffer,
-				     reply, from, addr, datagram_reply,
-				     &claim);
-	if (claim)
-	    return ret;
-    }
-
-    return -1;
+    return process_request(context, config, &req_buffer, reply, NULL,
+			   from, addr, datagram_reply, KS_KRB5);
 }
 
 /*
@@ -327,3 +715,188 @@ out:
 
     return 0;
 }
+
+#if defined(HAVE_MMAP) && defined(HAVE___SYNC_ADD_AND_FETCH)
+
+/*
+ * The capture ring is a file mapped shared into the KDC: a header
+ * page followed by fixed size segments, each holding one request.
+ * Writers claim the next sequence number with an atomic add and
+ * overwrite the oldest segment, so capturing costs a memcpy and no
+ * system calls, and several KDCs may capture into the same ring.
+ */
+
+static struct {
+    char *fn;
+    struct kdc_ring_header *hdr;
+    size_t size;
+} ring;
+
+static krb5_error_code
+ring_open(krb5_context context, const char *fn, size_t size)
+{
+    struct kdc_ring_header *hdr;
+    struct stat sb;
+    uint32_t nsegs;
+    int fd, ret;
+
+    if (size < KDC_RING_HEADER + KDC_RING_SEGMENT) {
+	krb5_set_error_message(context, EINVAL,
+			       "Request capture ring too small: %lu",
+			       (unsigned long)size);
+	return EINVAL;
+    }
+    nsegs = (size - KDC_RING_HEADER) / KDC_RING_SEGMENT;
+    size = KDC_RING_HEADER + (size_t)nsegs * KDC_RING_SEGMENT;
+
+    fd = open(fn, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+	ret = errno;
+	krb5_set_error_message(context, ret, "Failed to open: %s", fn);
+	return ret;
+    }
+    rk_cloexec(fd);
+    if (fstat(fd, &sb) < 0 ||
+	(sb.st_size == 0 && ftruncate(fd, size) < 0)) {
+	ret = errno;
+	close(fd);
+	krb5_set_error_message(context, ret, "Failed to size: %s", fn);
+	return ret;
+    }
+    if (sb.st_size != 0 && (size_t)sb.st_size != size) {
+	close(fd);
+	krb5_set_error_message(context, EINVAL,
+			       "Request capture ring %s has a different "
+			       "size", fn);
+	return EINVAL;
+    }
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+	ret = errno;
+	krb5_set_error_message(context, ret, "Failed to map: %s", fn);
+	return ret;
+    }
+
+    /*
+     * Keep appending to an existing ring of the same geometry, but
+     * never overwrite a file that is something else.
+     */
+    if (sb.st_size == 0) {
+	hdr->segsize = KDC_RING_SEGMENT;
+	hdr->nsegs = nsegs;
+	memcpy(hdr->magic, KDC_RING_MAGIC, sizeof(hdr->magic));
+    } else if (memcmp(hdr->magic, KDC_RING_MAGIC, sizeof(hdr->magic)) != 0 ||
+	       hdr->segsize != KDC_RING_SEGMENT || hdr->nsegs != nsegs) {
+	munmap(hdr, size);
+	krb5_set_error_message(context, EINVAL,
+			       "%s is not a request capture ring of this "
+			       "geometry", fn);
+	return EINVAL;
+    }
+
+    ring.fn = strdup(fn);
+    if (ring.fn == NULL) {
+	munmap(hdr, size);
+	return krb5_enomem(context);
+    }
+    ring.hdr = hdr;
+    ring.size = size;
+    return 0;
+}
+
+/*
+ * Like krb5_kdc_save_request(), but record the request in a memory
+ * mapped ring of `size' bytes that kdc-replay can read.
+ */
+
+int
+krb5_kdc_save_request_ring(krb5_context context,
+			   const char *fn,
+			   size_t size,
+			   const unsigned char *buf,
+			   size_t len,
+			   const krb5_data *reply,
+			   const struct sockaddr *sa)
+{
+    struct kdc_ring_record *rec;
+    Der_class cl;
+    Der_type ty;
+    unsigned int tag;
+    uint64_t seq;
+    int ret;
+
+    if (ring.hdr == NULL || strcmp(ring.fn, fn) != 0) {
+	if (ring.hdr) {
+	    munmap(ring.hdr, ring.size);
+	    free(ring.fn);
+	    ring.hdr = NULL;
+	}
+	ret = ring_open(context, fn, size);
+	if (ret)
+	    return ret;
+    }
+
+    if (len > KDC_RING_SEGMENT - sizeof(*rec)) {
+	__sync_add_and_fetch(&ring.hdr->dropped, 1);
+	return 0;
+    }
+
+    seq = __sync_fetch_and_add(&ring.hdr->next, 1);
+    rec = (struct kdc_ring_record *)((unsigned char *)ring.hdr +
+	KDC_RING_HEADER + (seq % ring.hdr->nsegs) * KDC_RING_SEGMENT);
+
+    rec->length = 0;
+    __sync_synchronize();
+
+    rec->seq = seq;
+    rec->sec = _kdc_now.tv_sec;
+    rec->usec = _kdc_now.tv_usec;
+    rec->family = 0;
+    rec->port = 0;
+    memset(rec->addr, 0, sizeof(rec->addr));
+    if (sa->sa_family == AF_INET) {
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	rec->family = AF_INET;
+	rec->port = sin->sin_port;
+	memcpy(rec->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+#ifdef HAVE_IPV6
+    } else if (sa->sa_family == AF_INET6) {
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+	rec->family = AF_INET6;
+	rec->port = sin6->sin6_port;
+	memcpy(rec->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+#endif
+    }
+
+    if (der_get_tag(reply->data, reply->length, &cl, &ty, &tag, NULL) == 0) {
+	rec->reply_clty = MAKE_TAG(cl, ty, 0);
+	rec->reply_tag = tag;
+    } else {
+	rec->reply_clty = 0xffffffff;
+	rec->reply_tag = 0xffffffff;
+    }
+    memcpy(rec + 1, buf, len);
+
+    __sync_synchronize();
+    rec->length = len;
+
+    return 0;
+}
+
+#else
+
+int
+krb5_kdc_save_request_ring(krb5_context context,
+			   const char *fn,
+			   size_t size,
+			   const unsigned char *buf,
+			   size_t len,
+			   const krb5_data *reply,
+			   const struct sockaddr *sa)
+{
+    /* no mmap or atomics, use the append-only format */
+    return krb5_kdc_save_request(context, fn, buf, len, reply, sa);
+}
+
+#endif
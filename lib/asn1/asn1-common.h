@@ -82,3 +82,18 @@ typedef struct heim_base_data heim_any_set;
 #endif
 
 #endif
+
+/*
+ * Generated headers repeat the definitions above but not these, so
+ * they live outside __asn1_common_definitions__.
+ */
+
+#ifndef __asn1_arena_definitions__
+#define __asn1_arena_definitions__
+
+/* see asn1_arena_create() */
+struct asn1_arena;
+
+#define ASN1_ARENA_ZEROCOPY	1
+
+#endif
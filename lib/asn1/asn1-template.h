@@ -172,6 +172,16 @@ _asn1_decode_top (
 	void * /*data*/,
 	size_t * /*size*/);
 
+int
+_asn1_decode_top_arena (
+	const struct asn1_template * /*t*/,
+	unsigned /*flags*/,
+	const unsigned char * /*p*/,
+	size_t /*len*/,
+	void * /*data*/,
+	size_t * /*size*/,
+	struct asn1_arena * /*arena*/);
+
 int
 _asn1_encode (
 	const struct asn1_template * /*t*/,
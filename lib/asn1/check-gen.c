@@ -217,6 +217,191 @@ test_authenticator (void)
     return ret;
 }
 
+static char *krbtgt_princ[] = { "krbtgt", "SU.SE" };
+static char *host_princ[] = { "host", "foo.su.se" };
+
+/*
+ * Encode an AS-REQ or a TGS-REQ that uses every part of the request
+ * the KDC decodes into an arena.
+ */
+
+static void
+encode_kdc_req(int tgs, unsigned char **p, size_t *len)
+{
+    KDC_REQ req;
+    PA_DATA pa;
+    PrincipalName cname = { KRB5_NT_PRINCIPAL, { 2, lharoot_princ } };
+    PrincipalName sname = { KRB5_NT_SRV_INST, { 2, krbtgt_princ } };
+    PrincipalName hname = { KRB5_NT_SRV_HST, { 2, host_princ } };
+    ENCTYPE etypes[] = { KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+			 KRB5_ENCTYPE_AES128_CTS_HMAC_SHA1_96 };
+    HostAddress addr = { 2, { 4, "\x0a\x00\x00\x01" } };
+    HostAddresses addrs = { 1, &addr };
+    KerberosTime till = 1700000000;
+    Ticket ticket;
+    int kvno = 2;
+    size_t size;
+    int ret;
+
+    memset(&req, 0, sizeof(req));
+    req.pvno = 5;
+    req.msg_type = tgs ? krb_tgs_req : krb_as_req;
+    pa.padata_type = tgs ? KRB5_PADATA_TGS_REQ : KRB5_PADATA_ENC_TIMESTAMP;
+    pa.padata_value.length = 5;
+    pa.padata_value.data = "\x01\x02\x03\x04\x05";
+    req.padata = calloc(1, sizeof(*req.padata));
+    if (req.padata == NULL)
+	errx(1, "malloc");
+    req.padata->len = 1;
+    req.padata->val = &pa;
+    req.req_body.kdc_options.forwardable = 1;
+    req.req_body.kdc_options.canonicalize = 1;
+    req.req_body.realm = "SU.SE";
+    req.req_body.sname = tgs ? &hname : &sname;
+    req.req_body.till = &till;
+    req.req_body.nonce = 4711;
+    req.req_body.etype.len = 2;
+    req.req_body.etype.val = etypes;
+    req.req_body.addresses = &addrs;
+    if (tgs) {
+	ticket.tkt_vno = 5;
+	ticket.realm = "SU.SE";
+	ticket.sname = sname;
+	ticket.enc_part.etype = KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96;
+	ticket.enc_part.kvno = &kvno;
+	ticket.enc_part.cipher.length = 8;
+	ticket.enc_part.cipher.data = "ciphertx";
+	req.req_body.additional_tickets =
+	    calloc(1, sizeof(*req.req_body.additional_tickets));
+	if (req.req_body.additional_tickets == NULL)
+	    errx(1, "malloc");
+	req.req_body.additional_tickets->len = 1;
+	req.req_body.additional_tickets->val = &ticket;
+	req.req_body.enc_authorization_data = &ticket.enc_part;
+    } else {
+	req.req_body.cname = &cname;
+    }
+
+    if (tgs)
+	ASN1_MALLOC_ENCODE(TGS_REQ, *p, *len, &req, &size, ret);
+    else
+	ASN1_MALLOC_ENCODE(AS_REQ, *p, *len, &req, &size, ret);
+    if (ret || size != *len)
+	errx(1, "encode %s", tgs ? "TGS-REQ" : "AS-REQ");
+
+    free(req.padata);
+    free(req.req_body.additional_tickets);
+}
+
+static int
+decode_kdc_req_arena(int tgs, const unsigned char *p, size_t len,
+		     KDC_REQ *req, size_t *size, struct asn1_arena *arena)
+{
+    if (tgs)
+	return decode_TGS_REQ_arena(p, len, req, size, arena);
+    return decode_AS_REQ_arena(p, len, req, size, arena);
+}
+
+/*
+ * Decode AS-REQ and TGS-REQ into an arena, as the KDC does, and check
+ * that the result encodes back to the input.  Then feed the arena
+ * truncated and corrupted requests; whatever a failed decode left in
+ * the arena must be released by the next reset.
+ */
+
+static int
+test_arena (void)
+{
+    unsigned flags[] = { 0, ASN1_ARENA_ZEROCOPY };
+    struct asn1_arena *arena;
+    unsigned char *p, *q, *buf;
+    const char *name;
+    size_t len, qlen, size, j;
+    KDC_REQ req;
+    int i, tgs, e, ret = 0;
+
+    for (tgs = 0; tgs < 2; tgs++) {
+	name = tgs ? "TGS-REQ" : "AS-REQ";
+	encode_kdc_req(tgs, &p, &len);
+	buf = malloc(len);
+	if (buf == NULL)
+	    errx(1, "malloc");
+
+	for (i = 0; i < sizeof(flags)/sizeof(flags[0]); i++) {
+	    if (asn1_arena_create(0, flags[i], &arena))
+		errx(1, "asn1_arena_create");
+
+	    if (decode_kdc_req_arena(tgs, p, len, &req, &size, arena) ||
+		size != len) {
+		printf("arena decode of %s failed (flags %u)\n",
+		       name, flags[i]);
+		ret++;
+		asn1_arena_destroy(arena);
+		continue;
+	    }
+	    if (req.req_body.nonce != 4711 ||
+		req.padata == NULL || req.padata->len != 1 ||
+		req.padata->val[0].padata_value.length != 5 ||
+		memcmp(req.padata->val[0].padata_value.data,
+		       "\x01\x02\x03\x04\x05", 5) != 0 ||
+		req.req_body.sname == NULL ||
+		strcmp(req.req_body.sname->name_string.val[0],
+		       tgs ? "host" : "krbtgt") != 0 ||
+		(tgs && (req.req_body.additional_tickets == NULL ||
+			 req.req_body.additional_tickets->len != 1)) ||
+		(!tgs && req.req_body.cname == NULL)) {
+		printf("arena decoded %s has wrong contents (flags %u)\n",
+		       name, flags[i]);
+		ret++;
+	    }
+	    if (tgs)
+		ASN1_MALLOC_ENCODE(TGS_REQ, q, qlen, &req, &size, e);
+	    else
+		ASN1_MALLOC_ENCODE(AS_REQ, q, qlen, &req, &size, e);
+	    if (e || qlen != len || memcmp(p, q, len) != 0) {
+		printf("arena decoded %s encodes differently (flags %u)\n",
+		       name, flags[i]);
+		ret++;
+	    }
+	    if (e == 0)
+		free(q);
+	    asn1_arena_reset(arena);
+
+	    /* every truncation has to fail, without a reset in between */
+	    for (j = 0; j < len; j++) {
+		if (decode_kdc_req_arena(tgs, p, j, &req, &size, arena) == 0) {
+		    printf("arena decode of %s truncated to %lu bytes "
+			   "succeeded (flags %u)\n",
+			   name, (unsigned long)j, flags[i]);
+		    ret++;
+		}
+	    }
+	    asn1_arena_reset(arena);
+
+	    /* corrupted bytes may or may not decode, they must not leak */
+	    for (j = 0; j < len; j++) {
+		memcpy(buf, p, len);
+		buf[j] ^= 0xff;
+		decode_kdc_req_arena(tgs, buf, len, &req, &size, arena);
+	    }
+	    asn1_arena_reset(arena);
+
+	    /* and the arena is still good after all those errors */
+	    if (decode_kdc_req_arena(tgs, p, len, &req, &size, arena) ||
+		size != len || req.req_body.nonce != 4711) {
+		printf("arena decode of %s failed after errors (flags %u)\n",
+		       name, flags[i]);
+		ret++;
+	    }
+	    asn1_arena_destroy(arena);
+	}
+	free(buf);
+	free(p);
+    }
+
+    return ret;
+}
+
 static int
 cmp_KRB_ERROR (void *a, void *b)
 {
@@ -1701,6 +1886,7 @@ main(int argc, char **argv)
 
     ret += test_principal ();
     ret += test_authenticator();
+    ret += test_arena();
     ret += test_krb_error();
     ret += test_Name();
     ret += test_bit_string();
@@ -43,7 +43,7 @@
 #include <asn1-common.h>
 #include <asn1_err.h>
 #include <der.h>
-#include <test_asn1.h>
+#include <test_template_asn1.h>
 
 #include "check-common.h"
 
@@ -407,6 +407,136 @@ test_seqof4(void)
     return ret;
 }
 
+typedef int (ASN1CALL *arena_decode)(const unsigned char *, size_t, void *,
+				     size_t *, struct asn1_arena *);
+
+static int
+arena_roundtrip(struct asn1_arena *arena, const char *name,
+		const char *bytes, size_t len, void *data,
+		arena_decode decode, generic_length length,
+		generic_encode encode)
+{
+    unsigned char *buf;
+    size_t sz, blen;
+    int ret;
+
+    ret = (*decode)((const unsigned char *)bytes, len, data, &sz, arena);
+    if (ret) {
+	printf("arena decode of %s failed %d\n", name, ret);
+	return 1;
+    }
+    if (sz != len) {
+	printf("arena decode of %s consumed %lu of %lu\n", name,
+	       (unsigned long)sz, (unsigned long)len);
+	return 1;
+    }
+    blen = (*length)(data);
+    if (blen != len) {
+	printf("arena decoded %s has length %lu, expected %lu\n", name,
+	       (unsigned long)blen, (unsigned long)len);
+	return 1;
+    }
+    buf = emalloc(blen);
+    ret = (*encode)(buf + blen - 1, blen, data, &sz);
+    if (ret || sz != len || memcmp(buf, bytes, len) != 0) {
+	printf("arena decoded %s does not encode back to the input\n", name);
+	free(buf);
+	return 1;
+    }
+    free(buf);
+    return 0;
+}
+
+static int
+test_arena(void)
+{
+    static const char seqof2[] =
+	"\x30\x0c\x30\x0a\x1b\x03\x66\x6f\x6f\x1b\x03\x62\x61\x72";
+    static const char seqofseq2[] =
+	"\x30\x13\x30\x07\xa0\x05\x1b\x03\x65\x74\x74\x30\x08\xa0"
+	"\x06\x1b\x04\x74\x76\x61\x61";
+    static const char seqof4[] =
+	"\x30\x76"
+	"\xa0\x18\x30\x16"
+	"\x30\x14"
+	"\x04\x00" "\x04\x02\x01\x02" "\x02\x01\x01"
+	"\x02\x09\x00\xff\xff\xff\xff\xff\xff\xff\xff"
+	"\xa1\x27"
+	"\x30\x25"
+	"\x02\x01\x01" "\x02\x09\x00\xff\xff\xff\xff\xff\xff\xff\xff"
+	"\x02\x09\x00\x80\x00\x00\x00\x00\x00\x00\x00"
+	"\x04\x00" "\x04\x02\x01\x02" "\x04\x04\x00\x01\x02\x03"
+	"\xa2\x31"
+	"\x30\x2f"
+	"\x04\x00" "\x02\x01\x01" "\x04\x02\x01\x02"
+	"\x02\x09\x00\xff\xff\xff\xff\xff\xff\xff\xff"
+	"\x04\x04\x00\x01\x02\x03"
+	"\x02\x09\x00\x80\x00\x00\x00\x00\x00\x00\x00"
+	"\x04\x01\x00" "\x02\x05\x01\x00\x00\x00\x00";
+    static const char oid[] = "\x06\x03\x2a\x03\x04";
+    struct asn1_arena *arena;
+    TESTMechType mech;
+    TESTSeqOf2 s2;
+    TESTSeqOfSeq2 ss2;
+    TESTSeqOf4 s4;
+    size_t sz;
+    int i, ret = 0;
+
+    /* small chunks to exercise chunk chaining */
+    if (asn1_arena_create(64, 0, &arena))
+	errx(1, "asn1_arena_create");
+
+    for (i = 0; i < 3; i++) {
+	ret += arena_roundtrip(arena, "seqof2", seqof2, sizeof(seqof2) - 1,
+			       &s2, (arena_decode)decode_TESTSeqOf2_arena,
+			       (generic_length)length_TESTSeqOf2,
+			       (generic_encode)encode_TESTSeqOf2);
+	ret += arena_roundtrip(arena, "seqofseq2", seqofseq2,
+			       sizeof(seqofseq2) - 1, &ss2,
+			       (arena_decode)decode_TESTSeqOfSeq2_arena,
+			       (generic_length)length_TESTSeqOfSeq2,
+			       (generic_encode)encode_TESTSeqOfSeq2);
+	ret += arena_roundtrip(arena, "seqof4", seqof4, sizeof(seqof4) - 1,
+			       &s4, (arena_decode)decode_TESTSeqOf4_arena,
+			       (generic_length)length_TESTSeqOf4,
+			       (generic_encode)encode_TESTSeqOf4);
+	/* OIDs are not decoded natively, they are released on reset */
+	ret += arena_roundtrip(arena, "oid", oid, sizeof(oid) - 1, &mech,
+			       (arena_decode)decode_TESTMechType_arena,
+			       (generic_length)length_TESTMechType,
+			       (generic_encode)encode_TESTMechType);
+	if (strcmp(s2.strings.val[1], "bar") != 0) {
+	    printf("arena decode of seqof2 gave wrong string\n");
+	    ret++;
+	}
+	asn1_arena_reset(arena);
+    }
+
+    /* a truncated encoding must fail and leave the output zeroed */
+    if (decode_TESTSeqOf4_arena((const unsigned char *)seqof4,
+				sizeof(seqof4) - 5, &s4, &sz, arena) == 0 ||
+	s4.b1 != NULL || s4.b2 != NULL || s4.b3 != NULL) {
+	printf("arena decode of truncated seqof4 did not fail cleanly\n");
+	ret++;
+    }
+    asn1_arena_destroy(arena);
+
+    if (asn1_arena_create(0, ASN1_ARENA_ZEROCOPY, &arena))
+	errx(1, "asn1_arena_create");
+    ret += arena_roundtrip(arena, "seqof4 zerocopy", seqof4,
+			   sizeof(seqof4) - 1, &s4,
+			   (arena_decode)decode_TESTSeqOf4_arena,
+			   (generic_length)length_TESTSeqOf4,
+			   (generic_encode)encode_TESTSeqOf4);
+    if (ret == 0 && s4.b1->val[0].s2.data != (void *)&seqof4[12]) {
+	printf("zero copy arena decode copied an OCTET STRING\n");
+	ret++;
+    }
+    asn1_arena_destroy(arena);
+
+    return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -418,6 +548,7 @@ main(int argc, char **argv)
     ret += test_seqof2();
     ret += test_seqof3();
     ret += test_seqof4();
+    ret += test_arena();
 
     return ret;
 }
@@ -37,6 +37,7 @@
 #define __DER_H__
 
 #include <stdint.h>
+#include <asn1-common.h>
 
 typedef enum {
     ASN1_C_UNIV = 0,
@@ -97,6 +98,7 @@ typedef struct heim_ber_time_t {
 } heim_ber_time_t;
 
 struct asn1_template;
+struct asn1_arena;
 
 #include <der-protos.h>
 
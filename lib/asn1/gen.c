@@ -245,6 +245,7 @@ init_generate (const char *filename, const char *base)
 	  "#endif\n",
 	  headerfile);
     fprintf (headerfile, "struct units;\n\n");
+    fprintf (headerfile, "struct asn1_arena;\n\n");
     fprintf (headerfile, "#endif\n\n");
     if (asprintf(&fn, "%s_files", base) < 0 || fn == NULL)
 	errx(1, "malloc");
@@ -1012,7 +1013,7 @@ generate_type (const Symbol *s)
 
     generate_type_header (s);
 
-    if (template_flag)
+    if (template_flag || arena_type(s->name))
 	generate_template(s);
 
     if (template_flag == 0 || is_template_compat(s) == 0) {
@@ -1040,6 +1041,12 @@ generate_type (const Symbol *s)
 	     "decode_%s(const unsigned char *, size_t, %s *, size_t *);\n",
 	     exp,
 	     s->gen_name, s->gen_name);
+    if ((template_flag || arena_type(s->name)) && s->type != NULL)
+	fprintf (h,
+		 "%sint    ASN1CALL "
+		 "decode_%s_arena(const unsigned char *, size_t, %s *, size_t *, struct asn1_arena *);\n",
+		 exp,
+		 s->gen_name, s->gen_name);
     fprintf (h,
 	     "%sint    ASN1CALL "
 	     "encode_%s(unsigned char *, size_t, const %s *, size_t *);\n",
@@ -82,6 +82,7 @@ int is_primitive_type(int);
 
 int preserve_type(const char *);
 int seq_type(const char *);
+int arena_type(const char *);
 
 void generate_header_of_codefile(const char *);
 void close_codefile(void);
@@ -95,6 +96,7 @@ extern FILE *privheaderfile, *headerfile, *codefile, *logfile, *templatefile;
 extern const char *fuzzer_string;
 extern int support_ber;
 extern int template_flag;
+extern int arena_flag;
 extern int rfc1510_bitstring;
 extern int one_code_file;
 extern int parse_units_flag;
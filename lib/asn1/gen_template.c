@@ -436,14 +436,49 @@ add_line_pointer(struct templatehead *t,
     q->ptr = strdup(ptr);
 }
 
+static void gen_extern_stubs(FILE *, const char *);
+
+/*
+ * With --arena only the listed types get templates, the types of
+ * this module they use that are not listed go through their
+ * generated code like imported types do.
+ */
+
 static int
 use_extern(const Symbol *s)
 {
     if (s->type == NULL)
 	return 1;
+    if (template_flag == 0 && !arena_type(s->name))
+	return 1;
     return 0;
 }
 
+struct stublist {
+    const Symbol *s;
+    struct stublist *next;
+};
+
+static struct stublist *local_stubs;
+
+static void
+gen_local_extern_stubs(const Symbol *s)
+{
+    struct stublist *sl;
+
+    /* imported types got theirs in gen_template_import() */
+    if (s->type == NULL)
+	return;
+    for (sl = local_stubs; sl != NULL; sl = sl->next)
+	if (sl->s == s)
+	    return;
+    sl = emalloc(sizeof(*sl));
+    sl->s = s;
+    sl->next = local_stubs;
+    local_stubs = sl;
+    gen_extern_stubs(get_code_file(), s->gen_name);
+}
+
 static int
 is_struct(const Type *t, int isstruct)
 {
@@ -489,6 +524,7 @@ template_members(struct templatehead *temp, const char *basetype, const char *na
     switch (t->type) {
     case TType:
 	if (use_extern(t->symbol)) {
+	    gen_local_extern_stubs(t->symbol);
 	    add_line(temp, "{ A1_OP_TYPE_EXTERN %s%s, %s, &asn1_extern_%s}",
 		     optional ? "|A1_FLAG_OPTIONAL" : "",
 		     implicit ? "|A1_FLAG_IMPLICIT" : "",
@@ -851,7 +887,7 @@ gen_template_import(const Symbol *s)
 {
     FILE *f = get_code_file();
 
-    if (template_flag == 0)
+    if (template_flag == 0 && arena_flag == 0)
 	return;
 
     gen_extern_stubs(f, s->gen_name);
@@ -927,6 +963,23 @@ generate_template(const Symbol *s)
 
     generate_template_type(s->gen_name, &dupname, s->name, s->gen_name, NULL, s->type, 0, 0, 1);
 
+    fprintf(f,
+	    "\n"
+	    "int\n"
+	    "decode_%s_arena(const unsigned char *p, size_t len, %s *data, size_t *size, struct asn1_arena *arena)\n"
+	    "{\n"
+	    "    return _asn1_decode_top_arena(asn1_%s, 0|%s, p, len, data, size, arena);\n"
+	    "}\n"
+	    "\n",
+	    s->gen_name,
+	    s->gen_name,
+	    dupname,
+	    support_ber ? "A1_PF_ALLOW_BER" : "0");
+
+    /* with --arena alone the rest is generated code, not templates */
+    if (template_flag == 0)
+	return;
+
     fprintf(f,
 	    "\n"
 	    "int\n"
@@ -39,6 +39,7 @@ extern FILE *yyin;
 
 static getarg_strings preserve;
 static getarg_strings seq;
+static getarg_strings arena;
 
 int
 preserve_type(const char *p)
@@ -60,10 +61,21 @@ seq_type(const char *p)
     return 0;
 }
 
+int
+arena_type(const char *p)
+{
+    int i;
+    for (i = 0; i < arena.num_strings; i++)
+	if (strcmp(arena.strings[i], p) == 0)
+	    return 1;
+    return 0;
+}
+
 const char *fuzzer_string = "";
 int fuzzer_flag;
 int support_ber;
 int template_flag;
+int arena_flag;
 int rfc1510_bitstring;
 int one_code_file;
 char *option_file;
@@ -74,6 +86,7 @@ int help_flag;
 struct getargs args[] = {
     { "fuzzer", 0, arg_flag, &fuzzer_flag, NULL, NULL },
     { "template", 0, arg_flag, &template_flag, NULL, NULL },
+    { "arena", 0, arg_strings, &arena, NULL, NULL },
     { "encode-rfc1510-bit-string", 0, arg_flag, &rfc1510_bitstring, NULL, NULL },
     { "decode-dce-ber", 0, arg_flag, &support_ber, NULL, NULL },
     { "support-ber", 0, arg_flag, &support_ber, NULL, NULL },
@@ -185,6 +198,8 @@ main(int argc, char **argv)
 	}
     }
 
+    arena_flag = arena.num_strings > 0;
+
     if (fuzzer_flag) {
 	if (!template_flag) {
 	    printf("can't do fuzzer w/o --template");
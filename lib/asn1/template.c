@@ -138,9 +138,309 @@ _asn1_bmember_put_bit(unsigned char *p, const void *data, unsigned int bit,
     }
 }
 
+/*
+ * Decode arenas.
+ *
+ * An arena lets a caller decode a template compiled type without a
+ * malloc() per element: the structures, SEQUENCE OF arrays and
+ * (most) strings are carved out of large chunks with a bump pointer
+ * and the whole lot is released with a single asn1_arena_reset() or
+ * asn1_arena_destroy().  free_<type>() must not be called on data
+ * decoded into an arena.
+ *
+ * Primitive types that the arena does not know how to decode
+ * natively are decoded with the normal der_get_*() functions; a copy
+ * of the decoded value is recorded in the arena together with its
+ * release function, so that it is freed on reset even if the caller
+ * already let go of the top level structure.
+ *
+ * With ASN1_ARENA_ZEROCOPY, OCTET STRINGs and preserved encodings
+ * point straight into the input buffer, which then has to outlive
+ * the decoded data.
+ */
+
+#define ARENA_ALIGN(x)		(((x) + 15) & ~((size_t)15))
+#define ARENA_CHUNK_HDR		ARENA_ALIGN(sizeof(struct asn1_arena_chunk))
+#define ARENA_CHUNK_DEFAULT	8192
+
+struct asn1_arena_chunk {
+    struct asn1_arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+
+struct asn1_arena_release {
+    struct asn1_arena_release *next;
+    asn1_type_release release;
+};
+
+#define ARENA_RELEASE_HDR	ARENA_ALIGN(sizeof(struct asn1_arena_release))
+
+struct asn1_arena {
+    struct asn1_arena_chunk *chunks;
+    struct asn1_arena_release *releases;
+    size_t chunk_size;
+    unsigned flags;
+    void *last;
+};
+
+/*
+ * Create a decode arena, chunk_size is the allocation granularity (0
+ * picks a default) and flags is 0 or ASN1_ARENA_ZEROCOPY.
+ */
+
+int
+asn1_arena_create(size_t chunk_size, unsigned flags, struct asn1_arena **arena)
+{
+    struct asn1_arena *a;
+
+    *arena = NULL;
+
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+	return ENOMEM;
+    a->chunk_size = chunk_size ? ARENA_ALIGN(chunk_size) : ARENA_CHUNK_DEFAULT;
+    a->flags = flags;
+    *arena = a;
+    return 0;
+}
+
+void
+asn1_arena_reset(struct asn1_arena *a)
+{
+    struct asn1_arena_chunk *c, *next;
+    struct asn1_arena_release *r;
+
+    if (a == NULL)
+	return;
+
+    for (r = a->releases; r != NULL; r = r->next)
+	(r->release)((unsigned char *)r + ARENA_RELEASE_HDR);
+    a->releases = NULL;
+    a->last = NULL;
+
+    /* keep the current chunk around for the next decode */
+    if ((c = a->chunks) == NULL)
+	return;
+    for (next = c->next; next != NULL; next = c->next) {
+	c->next = next->next;
+	free(next);
+    }
+    c->used = 0;
+}
+
+void
+asn1_arena_destroy(struct asn1_arena *a)
+{
+    if (a == NULL)
+	return;
+    asn1_arena_reset(a);
+    free(a->chunks);
+    free(a);
+}
+
+static void *
+arena_alloc(struct asn1_arena *a, size_t size)
+{
+    struct asn1_arena_chunk *c = a->chunks;
+    void *ptr;
+
+    if (size > ARENA_ALIGN(size))
+	return NULL;
+    size = ARENA_ALIGN(size);
+
+    if (c == NULL || c->size - c->used < size) {
+	size_t csize = size > a->chunk_size ? size : a->chunk_size;
+
+	if (csize + ARENA_CHUNK_HDR < csize)
+	    return NULL;
+	c = malloc(ARENA_CHUNK_HDR + csize);
+	if (c == NULL)
+	    return NULL;
+	c->size = csize;
+	c->used = 0;
+	if (a->chunks != NULL && size > a->chunk_size / 4) {
+	    /*
+	     * Big allocation, give it a chunk of its own and keep
+	     * filling the current one.
+	     */
+	    c->next = a->chunks->next;
+	    a->chunks->next = c;
+	    c->used = size;
+	    ptr = (unsigned char *)c + ARENA_CHUNK_HDR;
+	    memset(ptr, 0, size);
+	    return ptr;
+	}
+	c->next = a->chunks;
+	a->chunks = c;
+    }
+    ptr = (unsigned char *)c + ARENA_CHUNK_HDR + c->used;
+    c->used += size;
+    memset(ptr, 0, size);
+    a->last = ptr;
+    return ptr;
+}
+
+/*
+ * Grow the last allocation in place when possible, used for
+ * SEQUENCE OF arrays.
+ */
+
+static void *
+arena_realloc(struct asn1_arena *a, void *old, size_t oldsize, size_t newsize)
+{
+    struct asn1_arena_chunk *c = a->chunks;
+    void *ptr;
+
+    if (old != NULL && old == a->last && newsize <= ARENA_ALIGN(newsize)) {
+	size_t off = (unsigned char *)old - ((unsigned char *)c + ARENA_CHUNK_HDR);
+
+	if (c->size - off >= ARENA_ALIGN(newsize)) {
+	    c->used = off + ARENA_ALIGN(newsize);
+	    return old;
+	}
+    }
+    ptr = arena_alloc(a, newsize);
+    if (ptr != NULL && oldsize)
+	memcpy(ptr, old, oldsize);
+    return ptr;
+}
+
+static int
+arena_add_release(struct asn1_arena *a, asn1_type_release release,
+		  const void *data, size_t size)
+{
+    struct asn1_arena_release *r;
+
+    r = arena_alloc(a, ARENA_RELEASE_HDR + size);
+    if (r == NULL)
+	return ENOMEM;
+    r->release = release;
+    memcpy((unsigned char *)r + ARENA_RELEASE_HDR, data, size);
+    r->next = a->releases;
+    a->releases = r;
+    return 0;
+}
+
+static int
+arena_octet_string(struct asn1_arena *a, const unsigned char *p, size_t len,
+		   heim_octet_string *data)
+{
+    data->length = len;
+    if (a->flags & ASN1_ARENA_ZEROCOPY) {
+	data->data = rk_UNCONST(p);
+	return 0;
+    }
+    data->data = arena_alloc(a, len);
+    if (data->data == NULL)
+	return ENOMEM;
+    memcpy(data->data, p, len);
+    return 0;
+}
+
+static int
+arena_general_string(struct asn1_arena *a, const unsigned char *p, size_t len,
+		     heim_general_string *str)
+{
+    const unsigned char *p1;
+
+    *str = NULL;
+
+    /* same rules as der_get_general_string() */
+    p1 = memchr(p, 0, len);
+    if (p1 != NULL) {
+	while ((size_t)(p1 - p) < len && *p1 == '\0')
+	    p1++;
+	if ((size_t)(p1 - p) != len)
+	    return ASN1_BAD_CHARACTER;
+    }
+    if (len > len + 1)
+	return ASN1_BAD_LENGTH;
+
+    *str = arena_alloc(a, len + 1);
+    if (*str == NULL)
+	return ENOMEM;
+    memcpy(*str, p, len);
+    return 0;
+}
+
+static int
+arena_decode_prim(struct asn1_arena *a, unsigned int type,
+		  const unsigned char *p, size_t len, void *el, size_t *size)
+{
+    int ret;
+
+    switch (type) {
+    case A1T_OCTET_STRING:
+	*size = len;
+	return arena_octet_string(a, p, len, el);
+    case A1T_GENERAL_STRING:
+    case A1T_UTF8_STRING:
+    case A1T_TELETEX_STRING:
+	*size = len;
+	return arena_general_string(a, p, len, el);
+    default:
+	break;
+    }
+
+    ret = (asn1_template_prim[type].decode)(p, len, el, size);
+
+    switch (type) {
+    case A1T_IMEMBER:
+    case A1T_INTEGER:
+    case A1T_INTEGER64:
+    case A1T_UNSIGNED:
+    case A1T_UNSIGNED64:
+    case A1T_GENERALIZED_TIME:
+    case A1T_UTC_TIME:
+    case A1T_BOOLEAN:
+	/* nothing allocated */
+	break;
+    default: {
+	int ret2 = arena_add_release(a, asn1_template_prim[type].release,
+				     el, asn1_template_prim[type].size);
+	if (ret2) {
+	    (asn1_template_prim[type].release)(el);
+	    if (ret == 0)
+		ret = ret2;
+	}
+	break;
+    }
+    }
+    return ret;
+}
+
+static void *
+decode_calloc(struct asn1_arena *a, size_t size)
+{
+    if (a)
+	return arena_alloc(a, size);
+    return calloc(1, size);
+}
+
+static void
+decode_free(struct asn1_arena *a, void *ptr)
+{
+    if (a == NULL)
+	free(ptr);
+}
+
+static int
+decode_template(const struct asn1_template *, unsigned,
+		const unsigned char *, size_t, void *, size_t *,
+		struct asn1_arena *);
+
 int
 _asn1_decode(const struct asn1_template *t, unsigned flags,
 	     const unsigned char *p, size_t len, void *data, size_t *size)
+{
+    return decode_template(t, flags, p, len, data, size, NULL);
+}
+
+static int
+decode_template(const struct asn1_template *t, unsigned flags,
+		const unsigned char *p, size_t len, void *data, size_t *size,
+		struct asn1_arena *arena)
 {
     size_t elements = A1_HEADER_LEN(t);
     size_t oldlen = len;
@@ -170,20 +470,26 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    }
 
 	    if (t->tt & A1_FLAG_OPTIONAL) {
-		*pel = calloc(1, elsize);
+		*pel = decode_calloc(arena, elsize);
 		if (*pel == NULL)
 		    return ENOMEM;
 		el = *pel;
 	    }
 	    if ((t->tt & A1_OP_MASK) == A1_OP_TYPE) {
-		ret = _asn1_decode(t->ptr, flags, p, len, el, &newsize);
+		ret = decode_template(t->ptr, flags, p, len, el, &newsize,
+				      arena);
 	    } else {
 		const struct asn1_type_func *f = t->ptr;
 		ret = (f->decode)(p, len, el, &newsize);
+		if (ret == 0 && arena) {
+		    ret = arena_add_release(arena, f->release, el, f->size);
+		    if (ret)
+			(f->release)(el);
+		}
 	    }
 	    if (ret) {
 		if (t->tt & A1_FLAG_OPTIONAL) {
-		    free(*pel);
+		    decode_free(arena, *pel);
 		    *pel = NULL;
 		    break;
 		}
@@ -244,13 +550,14 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		void **el = (void **)data;
 		size_t ellen = _asn1_sizeofType(t->ptr);
 
-		*el = calloc(1, ellen);
+		*el = decode_calloc(arena, ellen);
 		if (*el == NULL)
 		    return ENOMEM;
 		data = *el;
 	    }
 
-	    ret = _asn1_decode(t->ptr, subflags, p, datalen, data, &newsize);
+	    ret = decode_template(t->ptr, subflags, p, datalen, data, &newsize,
+				  arena);
 	    if (ret)
 		return ret;
 
@@ -302,7 +609,10 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		return ASN1_PARSE_ERROR;
 	    }
 
-	    ret = (asn1_template_prim[type].decode)(p, len, el, &newsize);
+	    if (arena)
+		ret = arena_decode_prim(arena, type, p, len, el, &newsize);
+	    else
+		ret = (asn1_template_prim[type].decode)(p, len, el, &newsize);
 	    if (ret)
 		return ret;
 	    p += newsize; len -= newsize;
@@ -314,7 +624,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    struct template_of *el = DPO(data, t->offset);
 	    size_t newsize;
 	    size_t ellen = _asn1_sizeofType(t->ptr);
-	    size_t vallength = 0;
+	    size_t vallength = 0, valcap = 0;
 
 	    while (len > 0) {
 		void *tmp;
@@ -322,15 +632,31 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		if (vallength > newlen)
 		    return ASN1_OVERFLOW;
 
-		tmp = realloc(el->val, newlen);
-		if (tmp == NULL)
-		    return ENOMEM;
-
-		memset(DPO(tmp, vallength), 0, ellen);
+		if (arena == NULL) {
+		    tmp = realloc(el->val, newlen);
+		    if (tmp == NULL)
+			return ENOMEM;
+		    memset(DPO(tmp, vallength), 0, ellen);
+		} else if (newlen > valcap) {
+		    /*
+		     * The element decode allocates from the arena too,
+		     * so growing in place rarely works; double instead.
+		     */
+		    size_t cap = valcap ? valcap * 2 : ellen * 4;
+		    if (cap < newlen)
+			cap = newlen;
+		    tmp = arena_realloc(arena, el->val, vallength, cap);
+		    if (tmp == NULL)
+			return ENOMEM;
+		    memset(DPO(tmp, vallength), 0, cap - vallength);
+		    valcap = cap;
+		} else
+		    tmp = el->val;
 		el->val = tmp;
 
-		ret = _asn1_decode(t->ptr, flags & (~A1_PF_INDEFINTE), p, len,
-				   DPO(el->val, vallength), &newsize);
+		ret = decode_template(t->ptr, flags & (~A1_PF_INDEFINTE),
+				      p, len, DPO(el->val, vallength), &newsize,
+				      arena);
 		if (ret)
 		    return ret;
 		vallength = newlen;
@@ -380,8 +706,9 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	   
 	    for (i = 1; i < A1_HEADER_LEN(choice) + 1; i++) {
 		/* should match first tag instead, store it in choice.tt */
-		ret = _asn1_decode(choice[i].ptr, 0, p, len,
-				   DPO(data, choice[i].offset), &datalen);
+		ret = decode_template(choice[i].ptr, 0, p, len,
+				      DPO(data, choice[i].offset), &datalen,
+				      arena);
 		if (ret == 0) {
 		    *element = i;
 		    p += datalen; len -= datalen;
@@ -395,8 +722,13 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		    return ASN1_BAD_ID;
 
 		*element = 0;
-		ret = der_get_octet_string(p, len,
-					   DPO(data, choice->tt), &datalen);
+		if (arena) {
+		    datalen = len;
+		    ret = arena_octet_string(arena, p, len,
+					     DPO(data, choice->tt));
+		} else
+		    ret = der_get_octet_string(p, len,
+					       DPO(data, choice->tt), &datalen);
 		if (ret)
 		    return ret;
 		p += datalen; len -= datalen;
@@ -427,6 +759,9 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
     if (startp) {
 	heim_octet_string *save = data;
 
+	if (arena)
+	    return arena_octet_string(arena, startp, oldlen, save);
+
 	save->data = malloc(oldlen);
 	if (save->data == NULL)
 	    return ENOMEM;
@@ -1108,6 +1443,30 @@ _asn1_decode_top(const struct asn1_template *t, unsigned flags, const unsigned c
     return ret;
 }
 
+/*
+ * Like _asn1_decode_top(), but allocate from the arena (if given).
+ * On failure the output is zeroed, the partial decode stays in the
+ * arena until it is reset.
+ */
+
+int
+_asn1_decode_top_arena(const struct asn1_template *t, unsigned flags,
+		       const unsigned char *p, size_t len, void *data,
+		       size_t *size, struct asn1_arena *arena)
+{
+    int ret;
+
+    if (arena == NULL)
+	return _asn1_decode_top(t, flags, p, len, data, size);
+
+    memset(data, 0, t->offset);
+    ret = decode_template(t, flags, p, len, data, size, arena);
+    if (ret)
+	memset(data, 0, t->offset);
+
+    return ret;
+}
+
 int
 _asn1_copy_top(const struct asn1_template *t, const void *from, void *to)
 {
@@ -36,14 +36,18 @@
 #include "baselocl.h"
 
 /*
- *
+ * Small arrays keep their elements in the object itself and only
+ * move to a malloc()ed buffer when they outgrow it.
  */
 
+#define ARRAY_INLINE_LEN 4
+
 struct heim_array_data {
     size_t len;
     heim_object_t *val;
     size_t allocated_len;
     heim_object_t *allocated;
+    heim_object_t inline_val[ARRAY_INLINE_LEN];
 };
 
 static void
@@ -53,7 +57,27 @@ array_dealloc(heim_object_t ptr)
     size_t n;
     for (n = 0; n < array->len; n++)
 	heim_release(array->val[n]);
-    free(array->allocated);
+    if (array->allocated != array->inline_val)
+	free(array->allocated);
+}
+
+/*
+ * realloc() the element buffer to new_len slots, leaving the
+ * contents (and thus array->val's offset) as is.
+ */
+static heim_object_t *
+array_realloc(heim_array_t array, size_t new_len)
+{
+    heim_object_t *ptr;
+
+    if (array->allocated != array->inline_val)
+	return realloc(array->allocated, new_len * sizeof(array->val[0]));
+
+    ptr = malloc(new_len * sizeof(array->val[0]));
+    if (ptr != NULL)
+	memcpy(ptr, array->allocated,
+	       array->allocated_len * sizeof(array->val[0]));
+    return ptr;
 }
 
 struct heim_type_data array_object = {
@@ -82,9 +106,9 @@ heim_array_create(void)
     if (array == NULL)
 	return NULL;
 
-    array->allocated = NULL;
-    array->allocated_len = 0;
-    array->val = NULL;
+    array->allocated = array->inline_val;
+    array->allocated_len = ARRAY_INLINE_LEN;
+    array->val = array->allocated;
     array->len = 0;
 
     return array;
@@ -141,7 +165,7 @@ heim_array_append_value(heim_array_t array, heim_object_t object)
 
     /* Pre-allocate extra .5 times number of used slots */
     new_len = leading + array->len + 1 + (array->len >> 1);
-    ptr = realloc(array->allocated, new_len * sizeof(array->val[0]));
+    ptr = array_realloc(array, new_len);
     if (ptr == NULL)
 	return ENOMEM;
     array->allocated = ptr;
@@ -178,9 +202,9 @@ heim_array_prepend_value(heim_array_t array, heim_object_t object)
 	 * array->len - 1 from this array a lot; don't want to grow
 	 * forever!
 	 */
-	(void) memmove(&array->allocated[array->len], &array->val[0],
-		       array->len * sizeof(array->val[0]));
-	array->val = &array->allocated[array->len];
+	(void) memmove(&array->allocated[array->allocated_len - array->len],
+		       &array->val[0], array->len * sizeof(array->val[0]));
+	array->val = &array->allocated[array->allocated_len - array->len];
 
 	/* We have pre-allocated space; use it */
 	array->val--;
@@ -190,7 +214,7 @@ heim_array_prepend_value(heim_array_t array, heim_object_t object)
     }
     /* Pre-allocate extra .5 times number of used slots */
     new_len = array->len + 1 + trailing + (array->len >> 1);
-    ptr = realloc(array->allocated, new_len * sizeof(array->val[0]));
+    ptr = array_realloc(array, new_len);
     if (ptr == NULL)
 	return ENOMEM;
     (void) memmove(&ptr[1], &ptr[0], array->len * sizeof (array->val[0]));
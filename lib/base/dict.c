@@ -35,30 +35,64 @@
 
 #include "baselocl.h"
 
+/*
+ * Open addressing with linear probing over a power of two sized
+ * table.  Entries live inline in the table and cache the key's hash,
+ * so lookups touch one contiguous array and only call heim_cmp() on
+ * likely matches.  Deleted slots become tombstones that are reused by
+ * later inserts and dropped when the table is rebuilt; the table
+ * doubles once it is three quarters full (live entries + tombstones).
+ */
+
 struct hashentry {
-    struct hashentry **prev;
-    struct hashentry *next;
     heim_object_t key;
     heim_object_t value;
+    unsigned long hash;
 };
 
 struct heim_dict_data {
-    size_t size;
-    struct hashentry **tab;
+    size_t size;		/* number of slots, power of two */
+    size_t count;		/* live entries */
+    size_t used;		/* live entries + tombstones */
+    struct hashentry *tab;
 };
 
+static const char tombstone_key;
+#define TOMBSTONE ((heim_object_t)&tombstone_key)
+
+#define DICT_MIN_SIZE 8
+
+static int
+is_live(const struct hashentry *h)
+{
+    return h->key != NULL && h->key != TOMBSTONE;
+}
+
+/*
+ * Objects without a hash function hash to their (aligned) address, so
+ * spread the low bits before masking.
+ */
+static unsigned long
+dict_hash(heim_object_t key)
+{
+    unsigned long v = heim_get_hash(key);
+
+    v ^= v >> 16;
+    v *= 0x45d9f3bUL;
+    v ^= v >> 16;
+    return v;
+}
+
 static void
 dict_dealloc(void *ptr)
 {
     heim_dict_t dict = ptr;
-    struct hashentry **h, *g, *i;
+    struct hashentry *h;
 
     for (h = dict->tab; h < &dict->tab[dict->size]; ++h) {
-	for (g = h[0]; g; g = i) {
-	    i = g->next;
-	    heim_release(g->key);
-	    heim_release(g->value);
-	    free(g);
+	if (is_live(h)) {
+	    heim_release(h->key);
+	    heim_release(h->value);
 	}
     }
     free(dict->tab);
@@ -76,31 +110,42 @@ struct heim_type_data dict_object = {
 };
 
 static size_t
-isprime(size_t p)
+table_size(size_t hint)
 {
-    size_t q, i;
+    size_t size = DICT_MIN_SIZE;
 
-    for(i = 2 ; i < p; i++) {
-	q = p / i;
-
-	if (i * q == p)
+    /* room for `hint' entries below the 3/4 load factor */
+    while (size - (size >> 2) <= hint) {
+	if (size > ((size_t)-1 >> 1) / sizeof(struct hashentry))
 	    return 0;
-	if (i * i > p)
-	    return 1;
+	size <<= 1;
     }
-    return 1;
+    return size;
 }
 
-static size_t
-findprime(size_t p)
+static int
+dict_resize(heim_dict_t dict, size_t size)
 {
-    if (p % 2 == 0)
-	p++;
+    struct hashentry *tab, *h, *n;
 
-    while (isprime(p) == 0)
-	p += 2;
+    tab = calloc(size, sizeof(tab[0]));
+    if (tab == NULL)
+	return ENOMEM;
 
-    return p;
+    for (h = dict->tab; h < &dict->tab[dict->size]; ++h) {
+	if (!is_live(h))
+	    continue;
+	for (n = &tab[h->hash & (size - 1)]; n->key != NULL; ) {
+	    if (++n == &tab[size])
+		n = tab;
+	}
+	*n = *h;
+    }
+    free(dict->tab);
+    dict->tab = tab;
+    dict->size = size;
+    dict->used = dict->count;
+    return 0;
 }
 
 /**
@@ -115,8 +160,11 @@ heim_dict_create(size_t size)
     heim_dict_t dict;
 
     dict = _heim_alloc_object(&dict_object, sizeof(*dict));
+    if (dict == NULL)
+	return NULL;
 
-    dict->size = findprime(size);
+    dict->count = dict->used = 0;
+    dict->size = table_size(size);
     if (dict->size == 0) {
 	heim_release(dict);
 	return NULL;
@@ -144,18 +192,35 @@ heim_dict_get_type_id(void)
     return HEIM_TID_DICT;
 }
 
-/* Intern search function */
+/*
+ * Intern search function, returns the entry for key or NULL.  If
+ * `slot' is given it is set to where key should be inserted when it's
+ * not found: the first tombstone on the probe path, or the empty slot
+ * that ended it.
+ */
 
 static struct hashentry *
-_search(heim_dict_t dict, heim_object_t ptr)
+_search(heim_dict_t dict, heim_object_t ptr, unsigned long v,
+	struct hashentry **slot)
 {
-    unsigned long v = heim_get_hash(ptr);
-    struct hashentry *p;
-
-    for (p = dict->tab[v % dict->size]; p != NULL; p = p->next)
-	if (heim_cmp(ptr, p->key) == 0)
+    size_t mask = dict->size - 1;
+    size_t i = v & mask;
+    struct hashentry *p, *free_slot = NULL;
+
+    for (;;) {
+	p = &dict->tab[i];
+	if (p->key == NULL)
+	    break;
+	if (p->key == TOMBSTONE) {
+	    if (free_slot == NULL)
+		free_slot = p;
+	} else if (p->hash == v && heim_cmp(ptr, p->key) == 0) {
 	    return p;
-
+	}
+	i = (i + 1) & mask;
+    }
+    if (slot)
+	*slot = free_slot ? free_slot : p;
     return NULL;
 }
 
@@ -172,7 +237,7 @@ heim_object_t
 heim_dict_get_value(heim_dict_t dict, heim_object_t key)
 {
     struct hashentry *p;
-    p = _search(dict, key);
+    p = _search(dict, key, dict_hash(key), NULL);
     if (p == NULL)
 	return NULL;
 
@@ -192,7 +257,7 @@ heim_object_t
 heim_dict_copy_value(heim_dict_t dict, heim_object_t key)
 {
     struct hashentry *p;
-    p = _search(dict, key);
+    p = _search(dict, key, dict_hash(key), NULL);
     if (p == NULL)
 	return NULL;
 
@@ -212,32 +277,36 @@ heim_dict_copy_value(heim_dict_t dict, heim_object_t key)
 int
 heim_dict_set_value(heim_dict_t dict, heim_object_t key, heim_object_t value)
 {
-    struct hashentry **tabptr, *h;
+    unsigned long v = dict_hash(key);
+    struct hashentry *h, *slot;
 
-    h = _search(dict, key);
+    h = _search(dict, key, v, &slot);
     if (h) {
-	heim_release(h->value);
-	h->value = heim_retain(value);
-    } else {
-	unsigned long v;
-
-	h = malloc(sizeof(*h));
-	if (h == NULL)
-	    return ENOMEM;
+	heim_object_t old = h->value;
 
-	h->key = heim_retain(key);
 	h->value = heim_retain(value);
+	heim_release(old);
+	return 0;
+    }
 
-	v = heim_get_hash(key);
+    if (slot->key == NULL && dict->used + 1 > dict->size - (dict->size >> 2)) {
+	size_t size = dict->size;
 
-	tabptr = &dict->tab[v % dict->size];
-	h->next = *tabptr;
-	*tabptr = h;
-	h->prev = tabptr;
-	if (h->next)
-	    h->next->prev = &h->next;
+	/* only grow if it's live entries, not tombstones, filling us up */
+	if (dict->count + 1 > (size >> 1))
+	    size <<= 1;
+	if (size < dict->size || dict_resize(dict, size))
+	    return ENOMEM;
+	(void) _search(dict, key, v, &slot);
     }
 
+    if (slot->key == NULL)
+	dict->used++;
+    dict->count++;
+    slot->key = heim_retain(key);
+    slot->value = heim_retain(value);
+    slot->hash = v;
+
     return 0;
 }
 
@@ -251,18 +320,20 @@ heim_dict_set_value(heim_dict_t dict, heim_object_t key, heim_object_t value)
 void
 heim_dict_delete_key(heim_dict_t dict, heim_object_t key)
 {
-    struct hashentry *h = _search(dict, key);
+    struct hashentry *h = _search(dict, key, dict_hash(key), NULL);
+    heim_object_t k, v;
 
     if (h == NULL)
 	return;
 
-    heim_release(h->key);
-    heim_release(h->value);
-
-    if ((*(h->prev) = h->next) != NULL)
-	h->next->prev = h->prev;
+    k = h->key;
+    v = h->value;
+    h->key = TOMBSTONE;
+    h->value = NULL;
+    dict->count--;
 
-    free(h);
+    heim_release(k);
+    heim_release(v);
 }
 
 /**
@@ -276,11 +347,11 @@ heim_dict_delete_key(heim_dict_t dict, heim_object_t key)
 void
 heim_dict_iterate_f(heim_dict_t dict, void *arg, heim_dict_iterator_f_t func)
 {
-    struct hashentry **h, *g;
+    struct hashentry *h;
 
     for (h = dict->tab; h < &dict->tab[dict->size]; ++h)
-	for (g = *h; g; g = g->next)
-	    func(g->key, g->value, arg);
+	if (is_live(h))
+	    func(h->key, h->value, arg);
 }
 
 #ifdef __BLOCKS__
@@ -294,10 +365,10 @@ heim_dict_iterate_f(heim_dict_t dict, void *arg, heim_dict_iterator_f_t func)
 void
 heim_dict_iterate(heim_dict_t dict, void (^func)(heim_object_t, heim_object_t))
 {
-    struct hashentry **h, *g;
+    struct hashentry *h;
 
     for (h = dict->tab; h < &dict->tab[dict->size]; ++h)
-	for (g = *h; g; g = g->next)
-	    func(g->key, g->value);
+	if (is_live(h))
+	    func(h->key, h->value);
 }
 #endif
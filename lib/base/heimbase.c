@@ -43,6 +43,7 @@ struct heim_base {
     heim_base_atomic_type ref_cnt;
     HEIM_TAILQ_ENTRY(heim_base) autorel;
     heim_auto_release_t autorelpool;
+    unsigned int slab;
     uintptr_t isaextra[3];
 };
 
@@ -52,6 +53,7 @@ struct heim_base_mem {
     heim_base_atomic_type ref_cnt;
     HEIM_TAILQ_ENTRY(heim_base) autorel;
     heim_auto_release_t autorelpool;
+    unsigned int slab;
     const char *name;
     void (*dealloc)(void *);
     uintptr_t isaextra[1];
@@ -64,6 +66,96 @@ struct heim_base_mem {
 HEIMDAL_MUTEX _heim_base_mutex = HEIMDAL_MUTEX_INITIALIZER;
 #endif
 
+/*
+ * Small objects (numbers, short strings, dicts, arrays, errors) come
+ * from per size class free lists, refilled a slab at a time, instead
+ * of a malloc()/free() each.  Slabs are never handed back to malloc.
+ * heim_base.slab holds the size class + 1, or 0 for calloc()ed
+ * objects.
+ */
+
+#define HEIM_SLAB_QUANTUM	32
+#define HEIM_SLAB_CLASSES	8	/* up to 256 bytes including header */
+#define HEIM_SLAB_OBJECTS	64	/* objects carved per refill */
+
+struct heim_slab_free {
+    struct heim_slab_free *next;
+};
+
+static struct heim_slab_class {
+    HEIMDAL_MUTEX mutex;
+    struct heim_slab_free *free;
+} slabs[HEIM_SLAB_CLASSES] = {
+#define SLAB_INIT { HEIMDAL_MUTEX_INITIALIZER, NULL }
+    SLAB_INIT, SLAB_INIT, SLAB_INIT, SLAB_INIT,
+    SLAB_INIT, SLAB_INIT, SLAB_INIT, SLAB_INIT
+#undef SLAB_INIT
+};
+
+/* Allocate a zeroed object of `size' bytes including its header */
+static void *
+base_alloc(size_t size)
+{
+    struct heim_slab_class *sc;
+    struct heim_slab_free *f, *n;
+    struct heim_base *p;
+    size_t c, csize, i;
+    char *slab;
+
+    if (size > HEIM_SLAB_QUANTUM * HEIM_SLAB_CLASSES)
+	return calloc(1, size);
+
+    c = (size - 1) / HEIM_SLAB_QUANTUM;
+    csize = (c + 1) * HEIM_SLAB_QUANTUM;
+    sc = &slabs[c];
+
+    HEIMDAL_MUTEX_lock(&sc->mutex);
+    f = sc->free;
+    if (f)
+	sc->free = f->next;
+    HEIMDAL_MUTEX_unlock(&sc->mutex);
+
+    if (f == NULL) {
+	slab = malloc(csize * HEIM_SLAB_OBJECTS);
+	if (slab == NULL)
+	    return calloc(1, size);
+	/* keep the first object, chain up the rest and hand them over */
+	f = (struct heim_slab_free *)slab;
+	for (i = 1; i < HEIM_SLAB_OBJECTS - 1; i++) {
+	    n = (struct heim_slab_free *)(slab + i * csize);
+	    n->next = (struct heim_slab_free *)(slab + (i + 1) * csize);
+	}
+	n = (struct heim_slab_free *)(slab + i * csize);
+	HEIMDAL_MUTEX_lock(&sc->mutex);
+	n->next = sc->free;
+	sc->free = (struct heim_slab_free *)(slab + csize);
+	HEIMDAL_MUTEX_unlock(&sc->mutex);
+    }
+
+    memset(f, 0, csize);
+    p = (struct heim_base *)f;
+    p->slab = c + 1;
+    return p;
+}
+
+static void
+base_free(struct heim_base *p)
+{
+    struct heim_slab_class *sc;
+    struct heim_slab_free *f;
+
+    if (p->slab == 0) {
+	free(p);
+	return;
+    }
+    sc = &slabs[p->slab - 1];
+    f = (struct heim_slab_free *)p;
+    HEIMDAL_MUTEX_lock(&sc->mutex);
+    f->next = sc->free;
+    sc->free = f;
+    HEIMDAL_MUTEX_unlock(&sc->mutex);
+}
+
 /*
  * Auto release structure
  */
@@ -133,7 +225,7 @@ heim_release(void *ptr)
 	}
 	if (p->isa->dealloc)
 	    p->isa->dealloc(ptr);
-	free(p);
+	base_free(p);
     } else
 	heim_abort("over release");
 }
@@ -289,7 +381,7 @@ heim_alloc(size_t size, const char *name, heim_type_dealloc dealloc)
 {
     /* XXX use posix_memalign */
 
-    struct heim_base_mem *p = calloc(1, size + sizeof(*p));
+    struct heim_base_mem *p = base_alloc(size + sizeof(*p));
     if (p == NULL)
 	return NULL;
     p->isa = &memory_object;
@@ -330,7 +422,7 @@ heim_object_t
 _heim_alloc_object(heim_type_t type, size_t size)
 {
     /* XXX should use posix_memalign */
-    struct heim_base *p = calloc(1, size + sizeof(*p));
+    struct heim_base *p = base_alloc(size + sizeof(*p));
     if (p == NULL)
 	return NULL;
     p->isa = type;
@@ -501,8 +593,9 @@ autorel_dealloc(void *ptr)
     if (tls->current != ptr)
 	heim_abort("autorelease not releaseing top pool");
 
-    if (tls->current != tls->head)
-	tls->current = ar->parent;
+    tls->current = ar->parent;
+    if (tls->head == ar)
+	tls->head = NULL;
     HEIMDAL_MUTEX_unlock(&tls->tls_mutex);
 }
 
@@ -76,11 +76,15 @@ string_cmp(void *a, void *b)
 static unsigned long
 string_hash(void *ptr)
 {
-    const char *s = ptr;
+    const unsigned char *s = (const unsigned char *)heim_string_get_utf8(ptr);
     unsigned long n;
 
-    for (n = 0; *s; ++s)
-	n += *s;
+    /*
+     * FNV-1a over the string's (possibly referenced) contents; a plain
+     * sum collides for every permutation of a name.
+     */
+    for (n = 2166136261UL; *s; ++s)
+	n = (n ^ *s) * 16777619UL;
     return n;
 }
 
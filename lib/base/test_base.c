@@ -139,6 +139,12 @@ test_auto_release(void)
     heim_release(ar2);
     heim_release(ar1);
 
+    /* releasing the outermost pool must leave the thread usable */
+    ar1 = heim_auto_release_create();
+    n1 = heim_number_create(1);
+    heim_auto_release(n1);
+    heim_release(ar1);
+
     return 0;
 }
 
@@ -888,6 +894,113 @@ test_array()
     return 0;
 }
 
+/*
+ * Microbenchmark for the containers and the small object allocator;
+ * also checks that the dict stays consistent through growth and
+ * tombstone reuse.
+ */
+
+static double
+elapsed(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) +
+	(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+#define BENCH_N 100000
+
+static int
+test_bench(void)
+{
+    struct timeval start;
+    heim_string_t *keys;
+    heim_dict_t dict;
+    heim_array_t a;
+    size_t i, j;
+    int ret = 0;
+
+    keys = calloc(BENCH_N, sizeof(keys[0]));
+    if (keys == NULL)
+	return 1;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < BENCH_N; i++)
+	keys[i] = heim_string_create_with_format("principal-%lu",
+						 (unsigned long)i);
+    printf("bench: %d string creates: %.3fs\n", BENCH_N, elapsed(&start));
+
+    /* start small to exercise growth */
+    dict = heim_dict_create(1);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < BENCH_N; i++) {
+	heim_number_t n = heim_number_create(i);
+	if (heim_dict_set_value(dict, keys[i], n))
+	    ret = 1;
+	heim_release(n);
+    }
+    printf("bench: %d dict inserts: %.3fs\n", BENCH_N, elapsed(&start));
+
+    gettimeofday(&start, NULL);
+    for (j = 0; j < 10; j++) {
+	for (i = 0; i < BENCH_N; i++) {
+	    heim_number_t n = heim_dict_get_value(dict, keys[i]);
+	    if (n == NULL || heim_number_get_int(n) != (int)i)
+		ret = 1;
+	}
+    }
+    printf("bench: %d dict lookups: %.3fs\n", 10 * BENCH_N, elapsed(&start));
+
+    gettimeofday(&start, NULL);
+    for (j = 0; j < 4; j++) {
+	for (i = j; i < BENCH_N; i += 4)
+	    heim_dict_delete_key(dict, keys[i]);
+	for (i = j; i < BENCH_N; i += 4) {
+	    if (heim_dict_get_value(dict, keys[i]) != NULL)
+		ret = 1;
+	    heim_dict_set_value(dict, keys[i], keys[i]);
+	}
+    }
+    printf("bench: %d dict delete/reinserts: %.3fs\n", 2 * BENCH_N,
+	   elapsed(&start));
+    for (i = 0; i < BENCH_N; i++)
+	if (heim_dict_get_value(dict, keys[i]) != keys[i])
+	    ret = 1;
+    heim_release(dict);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < BENCH_N; i++) {
+	a = heim_array_create();
+	heim_array_append_value(a, keys[i]);
+	heim_array_append_value(a, keys[(i + 1) % BENCH_N]);
+	heim_array_insert_value(a, 0, keys[(i + 2) % BENCH_N]);
+	if (heim_array_get_value(a, 1) != keys[i])
+	    ret = 1;
+	heim_release(a);
+    }
+    printf("bench: %d small arrays: %.3fs\n", BENCH_N, elapsed(&start));
+
+    a = heim_array_create();
+    gettimeofday(&start, NULL);
+    for (i = 0; i < BENCH_N; i++)
+	heim_array_append_value(a, keys[i]);
+    printf("bench: %d array appends: %.3fs\n", BENCH_N, elapsed(&start));
+    for (i = 0; i < BENCH_N; i++)
+	if (heim_array_get_value(a, i) != keys[i])
+	    ret = 1;
+    heim_release(a);
+
+    for (i = 0; i < BENCH_N; i++)
+	heim_release(keys[i]);
+    free(keys);
+
+    if (ret)
+	printf("bench: container consistency check failed\n");
+    return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -903,6 +1016,7 @@ main(int argc, char **argv)
     res |= test_db(NULL, NULL);
     res |= test_db("json", argc > 1 ? argv[1] : "test_db.json");
     res |= test_array();
+    res |= test_bench();
 
     return res ? 1 : 0;
 }
@@ -81,6 +81,21 @@ mpz2BN(mp_int *s)
 
 #define DH_NUM_TRIES 10
 
+/*
+ * The private key is the exponent in both DH operations, use the
+ * fixed window Montgomery exponentiation whenever the modulus allows.
+ */
+
+static int
+dh_exptmod(mp_int *g, mp_int *priv_key, mp_int *p, mp_int *res)
+{
+    mp_digit rho;
+
+    if (mp_isodd(p) && mp_montgomery_setup(p, &rho) == MP_OKAY)
+	return mp_exptmod_ct(g, priv_key, p, rho, NULL, res);
+    return mp_exptmod(g, priv_key, p, res);
+}
+
 static int
 ltm_dh_generate_key(DH *dh)
 {
@@ -119,7 +134,7 @@ ltm_dh_generate_key(DH *dh)
 	BN2mpz(&g, dh->g);
 	BN2mpz(&p, dh->p);
 
-	res = mp_exptmod(&g, &priv_key, &p, &pub);
+	res = dh_exptmod(&g, &priv_key, &p, &pub);
 
 	mp_clear_multi(&priv_key, &g, &p, NULL);
 	if (res != 0)
@@ -175,7 +190,7 @@ ltm_dh_compute_key(unsigned char *shared, const BIGNUM * pub, DH *dh)
 
     BN2mpz(&priv_key, dh->priv_key);
 
-    ret = mp_exptmod(&peer_pub, &priv_key, &p, &s);
+    ret = dh_exptmod(&peer_pub, &priv_key, &p, &s);
 
     if (ret != 0) {
 	ret = -1;
@@ -0,0 +1,312 @@
+#include <tommath.h>
+#ifdef BN_MP_EXPTMOD_CT_C
+/* LibTomMath, multiple-precision integer library -- Tom St Denis
+ *
+ * LibTomMath is a library that provides multiple-precision
+ * integer arithmetic as well as number theoretic functionality.
+ *
+ * The library was designed directly after the MPI library by
+ * Michael Fromberger but has been written from scratch with
+ * additional optimizations in place.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtom.org
+ */
+
+/* computes Y == G**X mod P for secret X and odd P
+ *
+ * Uses a left-to-right fixed window over Montgomery representatives.
+ * The sequence of squarings and multiplications only depends on the
+ * size of P and X (in digits), never on the bits of X, and the table
+ * entry for each window is read by scanning the whole table with a
+ * mask so the memory access pattern does not depend on X either.
+ *
+ * The Montgomery products work on fixed size digit arrays and are
+ * computed column by column (comba) with the reduction interleaved
+ * in the same columns [product scanning, Koc et al.].  The final
+ * subtraction is done with a mask rather than a branch.
+ *
+ * "mp" is the value from mp_montgomery_setup(P) and "RR" is
+ * R**2 mod P (R = B**P->used).  Both only depend on P so callers that
+ * use the same modulus repeatedly (RSA CRT) can compute them once.  If
+ * RR is NULL it is computed here.
+ */
+
+/* all ones if x is non-zero, zero otherwise */
+#define CT_NONZERO(x) ((mp_digit)0 - (((x) | ((mp_digit)0 - (x))) >> (sizeof(mp_digit) * CHAR_BIT - 1)))
+
+/* r = u - m if (carry:u) >= m else u, u may alias r */
+static void
+ct_mont_final(const mp_digit *u, mp_digit carry, const mp_digit *m,
+              int n, mp_digit *s, mp_digit *r)
+{
+  mp_digit borrow = 0, mask;
+  int      j;
+
+  for (j = 0; j < n; j++) {
+    s[j]   = u[j] - m[j] - borrow;
+    borrow = s[j] >> (sizeof(mp_digit) * CHAR_BIT - 1);
+    s[j]  &= MP_MASK;
+  }
+  /* keep the difference unless it borrowed out of a zero carry */
+  mask = CT_NONZERO(carry) | ~CT_NONZERO(borrow);
+  for (j = 0; j < n; j++) {
+    r[j] = (s[j] & mask) | (u[j] & ~mask);
+  }
+}
+
+/* r = a*b/R mod m on n digits, a, b < m, r may alias a or b,
+ * q and s are n digit scratch arrays
+ */
+static void
+ct_mont_mul(const mp_digit *a, const mp_digit *b, const mp_digit *m,
+            mp_digit rho, int n, mp_digit *q, mp_digit *s, mp_digit *r)
+{
+  mp_word  t = 0, u;
+  int      i, j;
+
+  /* two accumulators so the products do not serialize on one carry chain */
+  for (i = 0; i < n; i++) {
+    u = 0;
+    for (j = 0; j < i; j++) {
+      t += ((mp_word)a[j]) * ((mp_word)b[i - j]);
+      u += ((mp_word)q[j]) * ((mp_word)m[i - j]);
+    }
+    t += u + ((mp_word)a[i]) * ((mp_word)b[0]);
+    q[i] = (((mp_digit)t) * rho) & MP_MASK;
+    t += ((mp_word)q[i]) * ((mp_word)m[0]);
+    t >>= ((mp_word)DIGIT_BIT);
+  }
+
+  /* q[i - n] is not read again once column i is reached */
+  for (i = n; i < 2 * n; i++) {
+    u = 0;
+    for (j = i - n + 1; j < n; j++) {
+      t += ((mp_word)a[j]) * ((mp_word)b[i - j]);
+      u += ((mp_word)q[j]) * ((mp_word)m[i - j]);
+    }
+    t += u;
+    q[i - n] = ((mp_digit)t) & MP_MASK;
+    t >>= ((mp_word)DIGIT_BIT);
+  }
+
+  ct_mont_final(q, (mp_digit)t, m, n, s, r);
+}
+
+/* r = a*a/R mod m, as above but each cross product is computed once */
+static void
+ct_mont_sqr(const mp_digit *a, const mp_digit *m, mp_digit rho, int n,
+            mp_digit *q, mp_digit *s, mp_digit *r)
+{
+  mp_word  t = 0, c;
+  int      i, j;
+
+  for (i = 0; i < n; i++) {
+    c = 0;
+    for (j = 0; j < i - j; j++) {
+      c += ((mp_word)a[j]) * ((mp_word)a[i - j]);
+    }
+    t += c + c;
+    if ((i & 1) == 0) {
+      t += ((mp_word)a[i / 2]) * ((mp_word)a[i / 2]);
+    }
+    for (j = 0; j < i; j++) {
+      t += ((mp_word)q[j]) * ((mp_word)m[i - j]);
+    }
+    q[i] = (((mp_digit)t) * rho) & MP_MASK;
+    t += ((mp_word)q[i]) * ((mp_word)m[0]);
+    t >>= ((mp_word)DIGIT_BIT);
+  }
+
+  for (i = n; i < 2 * n; i++) {
+    c = 0;
+    for (j = i - n + 1; j < i - j; j++) {
+      c += ((mp_word)a[j]) * ((mp_word)a[i - j]);
+    }
+    t += c + c;
+    if ((i & 1) == 0) {
+      t += ((mp_word)a[i / 2]) * ((mp_word)a[i / 2]);
+    }
+    for (j = i - n + 1; j < n; j++) {
+      t += ((mp_word)q[j]) * ((mp_word)m[i - j]);
+    }
+    q[i - n] = ((mp_digit)t) & MP_MASK;
+    t >>= ((mp_word)DIGIT_BIT);
+  }
+
+  ct_mont_final(q, (mp_digit)t, m, n, s, r);
+}
+
+/* r = tab[idx], touching every entry */
+static void
+ct_select(const mp_digit *tab, int entries, int n, int idx, mp_digit *r)
+{
+  mp_digit mask;
+  int      i, j;
+
+  for (j = 0; j < n; j++) {
+    r[j] = 0;
+  }
+  for (i = 0; i < entries; i++) {
+    mask = ~CT_NONZERO((mp_digit)(i ^ idx));
+    for (j = 0; j < n; j++) {
+      r[j] |= tab[i * n + j] & mask;
+    }
+  }
+}
+
+/* copy "a" (0 <= a < P) to n digits, zero padded */
+static void
+ct_load(mp_int *a, int n, mp_digit *r)
+{
+  int j;
+
+  for (j = 0; j < n; j++) {
+    r[j] = (j < a->used) ? a->dp[j] : 0;
+  }
+}
+
+/* bits [pos, pos + winsize) of X */
+static int
+ct_window(mp_int *X, int pos, int winsize)
+{
+  mp_digit w = 0;
+  int      d, s;
+
+  d = pos / DIGIT_BIT;
+  s = pos % DIGIT_BIT;
+  if (d < X->used) {
+    w = X->dp[d] >> s;
+  }
+  if (s + winsize > DIGIT_BIT && d + 1 < X->used) {
+    w |= X->dp[d + 1] << (DIGIT_BIT - s);
+  }
+  return (int)(w & (((mp_digit)1 << winsize) - 1));
+}
+
+int mp_exptmod_ct (mp_int * G, mp_int * X, mp_int * P, mp_digit mp,
+                   mp_int * RR, mp_int * Y)
+{
+  mp_int   base, rr;
+  mp_digit *buf, *tab, *m, *one, *acc, *tmp, *q, *s;
+  int      err, n, x, bits, pos, winsize, entries, size;
+
+  if (P->sign == MP_NEG || mp_iseven (P) || X->sign == MP_NEG) {
+    return MP_VAL;
+  }
+
+  n = P->used;
+
+  /* a column sums up to 2n double digit products */
+  if ((2 * n + 1) >= (1 << ((CHAR_BIT * sizeof (mp_word)) - (2 * DIGIT_BIT)))) {
+    return mp_exptmod (G, X, P, Y);
+  }
+
+  /* the schedule depends on the digit counts only */
+  bits = MAX (P->used, X->used) * DIGIT_BIT;
+  if (bits <= 256) {
+    winsize = 4;
+  } else if (bits <= 1536) {
+    winsize = 5;
+  } else {
+    winsize = 6;
+  }
+  entries = 1 << winsize;
+
+  /* table, modulus, one, accumulator, temporary and two scratch rows */
+  size = n * (entries + 6);
+  buf = XMALLOC (sizeof (mp_digit) * size);
+  if (buf == NULL) {
+    return MP_MEM;
+  }
+  tab = buf;
+  m   = tab + n * entries;
+  one = m + n;
+  acc = one + n;
+  tmp = acc + n;
+  q   = tmp + n;
+  s   = q + n;
+
+  if ((err = mp_init_multi (&base, &rr, NULL)) != MP_OKAY) {
+    XFREE (buf);
+    return err;
+  }
+
+  if (RR == NULL) {
+    if ((err = mp_montgomery_calc_normalization (&rr, P)) != MP_OKAY) {
+      goto LBL_ERR;
+    }
+    if ((err = mp_sqrmod (&rr, P, &rr)) != MP_OKAY) {
+      goto LBL_ERR;
+    }
+    RR = &rr;
+  }
+
+  /* base = G mod P */
+  if (G->sign == MP_NEG || mp_cmp_mag (G, P) != MP_LT) {
+    if ((err = mp_mod (G, P, &base)) != MP_OKAY) {
+      goto LBL_ERR;
+    }
+  } else if ((err = mp_copy (G, &base)) != MP_OKAY) {
+    goto LBL_ERR;
+  }
+
+  ct_load (P, n, m);
+  for (x = 0; x < n; x++) {
+    one[x] = 0;
+  }
+  one[0] = 1;
+
+  /* tab[0] = R mod P (one), tab[1] = G*R mod P, tab[x] = G**x * R mod P */
+  ct_load (RR, n, tmp);
+  ct_mont_mul (tmp, one, m, mp, n, q, s, tab);
+  ct_load (&base, n, acc);
+  ct_mont_mul (acc, tmp, m, mp, n, q, s, tab + n);
+  for (x = 2; x < entries; x++) {
+    ct_mont_mul (tab + (x - 1) * n, tab + n, m, mp, n, q, s, tab + x * n);
+  }
+
+  /* the top window initializes the result */
+  pos = ((bits + winsize - 1) / winsize - 1) * winsize;
+  ct_select (tab, entries, n, ct_window (X, pos, winsize), acc);
+
+  for (pos -= winsize; pos >= 0; pos -= winsize) {
+    for (x = 0; x < winsize; x++) {
+      ct_mont_sqr (acc, m, mp, n, q, s, acc);
+    }
+    /* always multiply, a zero window selects the Montgomery one */
+    ct_select (tab, entries, n, ct_window (X, pos, winsize), tmp);
+    ct_mont_mul (acc, tmp, m, mp, n, q, s, acc);
+  }
+
+  /* leave the Montgomery domain */
+  ct_mont_mul (acc, one, m, mp, n, q, s, acc);
+
+  if ((err = mp_grow (&base, n)) != MP_OKAY) {
+    goto LBL_ERR;
+  }
+  for (x = 0; x < n; x++) {
+    base.dp[x] = acc[x];
+  }
+  for (; x < base.alloc; x++) {
+    base.dp[x] = 0;
+  }
+  base.used = n;
+  base.sign = MP_ZPOS;
+  mp_clamp (&base);
+
+  mp_exch (&base, Y);
+  err = MP_OKAY;
+
+LBL_ERR:
+  /* the table holds powers of the secret base */
+  for (x = 0; x < size; x++) {
+    ((volatile mp_digit *)buf)[x] = 0;
+  }
+  XFREE (buf);
+  mp_clear_multi (&base, &rr, NULL);
+  return err;
+}
+#endif
@@ -447,6 +447,11 @@ int mp_reduce_2k_l(mp_int *a, mp_int *n, mp_int *d);
 /* d = a**b (mod c) */
 int mp_exptmod(mp_int *a, mp_int *b, mp_int *c, mp_int *d);
 
+/* Y = G**X (mod P) for odd P in time independent of the bits of X,
+ * mp is from mp_montgomery_setup(P), RR is R**2 mod P or NULL
+ */
+int mp_exptmod_ct(mp_int *G, mp_int *X, mp_int *P, mp_digit mp, mp_int *RR, mp_int *Y);
+
 /* ---> Primes <--- */
 
 /* number of primes */
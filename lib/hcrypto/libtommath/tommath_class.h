@@ -41,6 +41,7 @@
 #define BN_MP_EXPT_D_C
 #define BN_MP_EXPTMOD_C
 #define BN_MP_EXPTMOD_FAST_C
+#define BN_MP_EXPTMOD_CT_C
 #define BN_MP_EXTEUCLID_C
 #define BN_MP_FIND_PRIME_C
 #define BN_MP_FREAD_C
@@ -340,6 +341,20 @@
    #define BN_MP_EXPTMOD_FAST_C
 #endif
 
+#if defined(BN_MP_EXPTMOD_CT_C)
+   #define BN_MP_EXPTMOD_C
+   #define BN_MP_INIT_MULTI_C
+   #define BN_MP_CLEAR_MULTI_C
+   #define BN_MP_MONTGOMERY_CALC_NORMALIZATION_C
+   #define BN_MP_SQRMOD_C
+   #define BN_MP_CMP_MAG_C
+   #define BN_MP_MOD_C
+   #define BN_MP_COPY_C
+   #define BN_MP_GROW_C
+   #define BN_MP_CLAMP_C
+   #define BN_MP_EXCH_C
+#endif
+
 #if defined(BN_MP_EXPTMOD_FAST_C)
    #define BN_MP_COUNT_BITS_C
    #define BN_MP_INIT_C
@@ -41,6 +41,7 @@
 #include <rsa.h>
 
 #include <roken.h>
+#include <heim_threads.h>
 
 #include "tommath.h"
 
@@ -103,6 +104,29 @@ unblind(mp_int *out, mp_int *bi, mp_int *n)
     mp_mod(out, n, out);
 }
 
+static void
+ltm_rsa_crt_combine(mp_int * vp, mp_int * vq, mp_int * p, mp_int * q,
+		    mp_int * iqmp, mp_int * out)
+{
+    mp_int u;
+
+    mp_init(&u);
+
+    /* C2 = 1/q mod p  (iqmp) */
+    /* u = (vp - vq)C2 mod p. */
+    mp_sub(vp, vq, &u);
+    if (mp_isneg(&u))
+	mp_add(&u, p, &u);
+    mp_mul(&u, iqmp, &u);
+    mp_mod(&u, p, &u);
+
+    /* c ^ d mod n = vq + u q */
+    mp_mul(&u, q, &u);
+    mp_add(&u, vq, out);
+
+    mp_clear(&u);
+}
+
 static int
 ltm_rsa_private_calculate(mp_int * in, mp_int * p,  mp_int * q,
 			  mp_int * dmp1, mp_int * dmq1, mp_int * iqmp,
@@ -119,23 +143,221 @@ ltm_rsa_private_calculate(mp_int * in, mp_int * p,  mp_int * q,
     mp_mod(in, q, &u);
     mp_exptmod(&u, dmq1, q, &vq);
 
-    /* C2 = 1/q mod p  (iqmp) */
-    /* u = (vp - vq)C2 mod p. */
-    mp_sub(&vp, &vq, &u);
-    if (mp_isneg(&u))
-	mp_add(&u, p, &u);
-    mp_mul(&u, iqmp, &u);
-    mp_mod(&u, p, &u);
-
-    /* c ^ d mod n = vq + u q */
-    mp_mul(&u, q, &u);
-    mp_add(&u, &vq, out);
+    ltm_rsa_crt_combine(&vp, &vq, p, q, iqmp, out);
 
     mp_clear_multi(&vp, &vq, &u, NULL);
 
     return 0;
 }
 
+/*
+ * Private key state kept on the RSA object (in _method_mod_n) while
+ * RSA_FLAG_CACHE_PRIVATE is set: the key converted to mp_int once,
+ * the Montgomery parameters for n, p and q, and a blinding pair, so
+ * that a private key operation is just the two constant-time
+ * exponentiations.
+ *
+ * The blinding pair (b^e, 1/b) is squared after each use and a new b
+ * is drawn every LTM_BLINDING_COUNTER uses, instead of computing an
+ * inverse mod n for every operation.
+ */
+
+#define LTM_BLINDING_COUNTER 32
+
+struct ltm_mont {
+    mp_int m;		/* the modulus, odd */
+    mp_int rr;		/* R^2 mod m */
+    mp_digit rho;	/* -1/m mod B */
+};
+
+struct ltm_rsa_key {
+    int crt;
+    mp_int e;
+    mp_int d;
+    mp_int dmp1;
+    mp_int dmq1;
+    mp_int iqmp;
+    struct ltm_mont n;
+    struct ltm_mont p;
+    struct ltm_mont q;
+    mp_int blind;	/* b^e mod n */
+    mp_int unblind;	/* 1/b mod n */
+    int blind_uses;	/* protected by ltm_rsa_mutex */
+};
+
+static HEIMDAL_MUTEX ltm_rsa_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+static int
+ltm_mont_init(struct ltm_mont *mont, const BIGNUM *bn)
+{
+    int ret;
+
+    ret = mp_init_multi(&mont->m, &mont->rr, NULL);
+    if (ret != MP_OKAY)
+	return ret;
+    BN2mpz(&mont->m, bn);
+    if (mp_iseven(&mont->m))
+	return MP_VAL;
+    ret = mp_montgomery_setup(&mont->m, &mont->rho);
+    if (ret == MP_OKAY)
+	ret = mp_montgomery_calc_normalization(&mont->rr, &mont->m);
+    if (ret == MP_OKAY)
+	ret = mp_sqrmod(&mont->rr, &mont->m, &mont->rr);
+    return ret;
+}
+
+static void
+ltm_rsa_key_free(struct ltm_rsa_key *k)
+{
+    mp_clear_multi(&k->e, &k->d, &k->dmp1, &k->dmq1, &k->iqmp,
+		   &k->n.m, &k->n.rr, &k->p.m, &k->p.rr,
+		   &k->q.m, &k->q.rr, &k->blind, &k->unblind, NULL);
+    free(k);
+}
+
+static struct ltm_rsa_key *
+ltm_rsa_key_new(RSA *rsa)
+{
+    struct ltm_rsa_key *k;
+
+    k = calloc(1, sizeof(*k));
+    if (k == NULL)
+	return NULL;
+
+    if (mp_init_multi(&k->e, &k->d, &k->dmp1, &k->dmq1, &k->iqmp,
+		      &k->blind, &k->unblind, NULL) != MP_OKAY)
+	goto fail;
+    if (rsa->n == NULL || rsa->e == NULL ||
+	ltm_mont_init(&k->n, rsa->n) != MP_OKAY)
+	goto fail;
+    BN2mpz(&k->e, rsa->e);
+
+    k->crt = rsa->p && rsa->q && rsa->dmp1 && rsa->dmq1 && rsa->iqmp;
+    if (k->crt) {
+	if (ltm_mont_init(&k->p, rsa->p) != MP_OKAY ||
+	    ltm_mont_init(&k->q, rsa->q) != MP_OKAY)
+	    goto fail;
+	BN2mpz(&k->dmp1, rsa->dmp1);
+	BN2mpz(&k->dmq1, rsa->dmq1);
+	BN2mpz(&k->iqmp, rsa->iqmp);
+    } else if (rsa->d) {
+	BN2mpz(&k->d, rsa->d);
+    } else
+	goto fail;
+
+    return k;
+
+ fail:
+    ltm_rsa_key_free(k);
+    return NULL;
+}
+
+/*
+ * Return the cached private key state, building it on first use.
+ * NULL means the per-call path should be used.
+ */
+
+static struct ltm_rsa_key *
+ltm_rsa_key_get(RSA *rsa)
+{
+    struct ltm_rsa_key *k, *unused = NULL;
+
+    if ((rsa->flags & RSA_FLAG_CACHE_PRIVATE) == 0)
+	return NULL;
+
+    HEIMDAL_MUTEX_lock(&ltm_rsa_mutex);
+    k = rsa->_method_mod_n;
+    HEIMDAL_MUTEX_unlock(&ltm_rsa_mutex);
+    if (k)
+	return k;
+
+    k = ltm_rsa_key_new(rsa);
+    if (k == NULL)
+	return NULL;
+
+    HEIMDAL_MUTEX_lock(&ltm_rsa_mutex);
+    if (rsa->_method_mod_n == NULL)
+	rsa->_method_mod_n = k;
+    else {
+	/* lost the race to another thread */
+	unused = k;
+	k = rsa->_method_mod_n;
+    }
+    HEIMDAL_MUTEX_unlock(&ltm_rsa_mutex);
+
+    if (unused)
+	ltm_rsa_key_free(unused);
+
+    return k;
+}
+
+static void
+ltm_rsa_key_drop(RSA *rsa)
+{
+    if (rsa->_method_mod_n) {
+	ltm_rsa_key_free(rsa->_method_mod_n);
+	rsa->_method_mod_n = NULL;
+    }
+}
+
+/* in = in * b^e mod n, bi = 1/b mod n */
+static int
+ltm_rsa_blind(struct ltm_rsa_key *k, mp_int *in, mp_int *bi)
+{
+    mp_int b;
+    int ret = MP_OKAY;
+
+    mp_init(&b);
+
+    HEIMDAL_MUTEX_lock(&ltm_rsa_mutex);
+    if (k->blind_uses == 0) {
+	setup_blind(&k->n.m, &b, &k->unblind);
+	ret = mp_exptmod(&b, &k->e, &k->n.m, &k->blind);
+    }
+    if (ret == MP_OKAY)
+	ret = mp_mulmod(in, &k->blind, &k->n.m, in);
+    if (ret == MP_OKAY)
+	ret = mp_copy(&k->unblind, bi);
+    if (ret == MP_OKAY)
+	ret = mp_sqrmod(&k->blind, &k->n.m, &k->blind);
+    if (ret == MP_OKAY)
+	ret = mp_sqrmod(&k->unblind, &k->n.m, &k->unblind);
+    if (ret == MP_OKAY)
+	k->blind_uses = (k->blind_uses + 1) % LTM_BLINDING_COUNTER;
+    else
+	k->blind_uses = 0;
+    HEIMDAL_MUTEX_unlock(&ltm_rsa_mutex);
+
+    mp_clear(&b);
+
+    return ret;
+}
+
+static int
+ltm_rsa_private_calculate_ct(mp_int * in, struct ltm_rsa_key *k, mp_int * out)
+{
+    mp_int vp, vq, u;
+    int ret;
+
+    if (!k->crt)
+	return mp_exptmod_ct(in, &k->d, &k->n.m, k->n.rho, &k->n.rr, out);
+
+    mp_init_multi(&vp, &vq, &u, NULL);
+
+    mp_mod(in, &k->p.m, &u);
+    ret = mp_exptmod_ct(&u, &k->dmp1, &k->p.m, k->p.rho, &k->p.rr, &vp);
+    if (ret == MP_OKAY) {
+	mp_mod(in, &k->q.m, &u);
+	ret = mp_exptmod_ct(&u, &k->dmq1, &k->q.m, k->q.rho, &k->q.rr, &vq);
+    }
+    if (ret == MP_OKAY)
+	ltm_rsa_crt_combine(&vp, &vq, &k->p.m, &k->q.m, &k->iqmp, out);
+
+    mp_clear_multi(&vp, &vq, &u, NULL);
+
+    return ret;
+}
+
 /*
  *
  */
@@ -294,6 +516,7 @@ ltm_rsa_private_encrypt(int flen, const unsigned char* from,
     int size;
     mp_int in, out, n, e;
     mp_int bi, b;
+    struct ltm_rsa_key *k;
     int blinding = (rsa->flags & RSA_FLAG_NO_BLINDING) == 0;
     int do_unblind = 0;
 
@@ -333,13 +556,26 @@ ltm_rsa_private_encrypt(int flen, const unsigned char* from,
 	goto out;
     }
 
+    k = ltm_rsa_key_get(rsa);
+
     if (blinding) {
-	setup_blind(&n, &b, &bi);
-	blind(&in, &b, &e, &n);
+	if (k == NULL) {
+	    setup_blind(&n, &b, &bi);
+	    blind(&in, &b, &e, &n);
+	} else if (ltm_rsa_blind(k, &in, &bi) != MP_OKAY) {
+	    size = -3;
+	    goto out;
+	}
 	do_unblind = 1;
     }
 
-    if (rsa->p && rsa->q && rsa->dmp1 && rsa->dmq1 && rsa->iqmp) {
+    if (k) {
+	res = ltm_rsa_private_calculate_ct(&in, k, &out);
+	if (res != 0) {
+	    size = -4;
+	    goto out;
+	}
+    } else if (rsa->p && rsa->q && rsa->dmp1 && rsa->dmq1 && rsa->iqmp) {
 	mp_int p, q, dmp1, dmq1, iqmp;
 
 	mp_init_multi(&p, &q, &dmp1, &dmq1, &iqmp, NULL);
@@ -394,6 +630,7 @@ ltm_rsa_private_decrypt(int flen, const unsigned char* from,
     unsigned char *ptr;
     int res, size;
     mp_int in, out, n, e, b, bi;
+    struct ltm_rsa_key *k;
     int blinding = (rsa->flags & RSA_FLAG_NO_BLINDING) == 0;
     int do_unblind = 0;
 
@@ -421,13 +658,26 @@ ltm_rsa_private_decrypt(int flen, const unsigned char* from,
 	goto out;
     }
 
+    k = ltm_rsa_key_get(rsa);
+
     if (blinding) {
-	setup_blind(&n, &b, &bi);
-	blind(&in, &b, &e, &n);
+	if (k == NULL) {
+	    setup_blind(&n, &b, &bi);
+	    blind(&in, &b, &e, &n);
+	} else if (ltm_rsa_blind(k, &in, &bi) != MP_OKAY) {
+	    size = -3;
+	    goto out;
+	}
 	do_unblind = 1;
     }
 
-    if (rsa->p && rsa->q && rsa->dmp1 && rsa->dmq1 && rsa->iqmp) {
+    if (k) {
+	res = ltm_rsa_private_calculate_ct(&in, k, &out);
+	if (res != 0) {
+	    size = -3;
+	    goto out;
+	}
+    } else if (rsa->p && rsa->q && rsa->dmp1 && rsa->dmq1 && rsa->iqmp) {
 	mp_int p, q, dmp1, dmq1, iqmp;
 
 	mp_init_multi(&p, &q, &dmp1, &dmq1, &iqmp, NULL);
@@ -529,6 +779,8 @@ ltm_rsa_generate_key(RSA *rsa, int bits, BIGNUM *e, BN_GENCB *cb)
 
     ret = -1;
 
+    ltm_rsa_key_drop(rsa);
+
     mp_init_multi(&el, &p, &q, &n, &d,
 		  &dmp1, &dmq1, &iqmp,
 		  &t1, &t2, &t3, NULL);
@@ -611,12 +863,14 @@ out:
 static int
 ltm_rsa_init(RSA *rsa)
 {
+    rsa->flags |= RSA_FLAG_CACHE_PRIVATE;
     return 1;
 }
 
 static int
 ltm_rsa_finish(RSA *rsa)
 {
+    ltm_rsa_key_drop(rsa);
     return 1;
 }
 
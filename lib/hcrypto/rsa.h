@@ -124,6 +124,7 @@ struct RSA {
     void *mt_blinding;
 };
 
+#define RSA_FLAG_CACHE_PRIVATE		0x0004
 #define RSA_FLAG_NO_BLINDING		0x0080
 
 #define RSA_PKCS1_PADDING		1
@@ -49,6 +49,7 @@ static int version_flag;
 static int help_flag;
 static int time_keygen;
 static char *time_key;
+static char *time_private;
 static int key_blinding = 1;
 static char *rsa_key;
 static char *id_flag;
@@ -63,6 +64,9 @@ static struct getargs args[] = {
       "time rsa generation", NULL },
     { "time-key",	0,	arg_string,	&time_key,
       "rsa key file", NULL },
+    { "time-private",	0,	arg_string,	&time_private,
+      "time private key operations with and without the cached key",
+      "rsa key file" },
     { "key-blinding",	0,	arg_negative_flag, &key_blinding,
       "key blinding", NULL },
     { "key",	0,	arg_string,	&rsa_key,
@@ -320,6 +324,51 @@ main(int argc, char **argv)
 	return 0;
     }
 
+    if (time_private) {
+	const unsigned char in[20] = "hcrypto rsa private";
+	struct timeval tv1, tv2;
+	unsigned char *sig[2];
+	int siglen[2];
+
+	rsa = read_key(engine, time_private);
+
+	/* first the per-call path, then the cached key state */
+	for (j = 0; j < 2; j++) {
+	    if (j == 0)
+		rsa->flags &= ~RSA_FLAG_CACHE_PRIVATE;
+	    else
+		rsa->flags |= RSA_FLAG_CACHE_PRIVATE;
+
+	    sig[j] = emalloc(RSA_size(rsa));
+
+	    gettimeofday(&tv1, NULL);
+	    for (i = 0; i < loops; i++) {
+		siglen[j] = RSA_private_encrypt(sizeof(in), in, sig[j],
+						rsa, RSA_PKCS1_PADDING);
+		if (siglen[j] <= 0)
+		    errx(1, "failed to private encrypt: %d", siglen[j]);
+	    }
+	    gettimeofday(&tv2, NULL);
+	    timevalsub(&tv2, &tv1);
+
+	    printf("%s %d bits %d loops time %lu.%06lu\n",
+		   j == 0 ? "uncached" : "cached",
+		   RSA_size(rsa) * 8, loops,
+		   (unsigned long)tv2.tv_sec,
+		   (unsigned long)tv2.tv_usec);
+	}
+
+	if (siglen[0] != siglen[1] || memcmp(sig[0], sig[1], siglen[0]) != 0)
+	    errx(1, "cached and uncached private key operations differ");
+
+	free(sig[0]);
+	free(sig[1]);
+	RSA_free(rsa);
+	ENGINE_finish(engine);
+
+	return 0;
+    }
+
     if (rsa_key) {
 	rsa = read_key(engine, rsa_key);
 
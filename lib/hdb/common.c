@@ -98,9 +98,25 @@ hdb_value2entry_alias(krb5_context context, krb5_data *value,
     return decode_hdb_entry_alias(value->data, value->length, ent, NULL);
 }
 
-krb5_error_code
-_hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
-		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+static void
+release_value(krb5_data *value, int borrowed)
+{
+    if (borrowed)
+	krb5_data_zero(value);
+    else
+	krb5_data_free(value);
+}
+
+/*
+ * If `borrowed' is set the backend's hdb__get() returns values it
+ * still owns (e.g. pointers into a mapped database that stay valid
+ * for the backend's current read transaction), so they are decoded in
+ * place and never freed here.
+ */
+
+static krb5_error_code
+fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+	   unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry, int borrowed)
 {
     krb5_principal enterprise_principal = NULL;
     krb5_data key, value;
@@ -130,18 +146,18 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 	return ret;
     ret = hdb_value2entry(context, &value, &entry->entry);
     if (ret == ASN1_BAD_ID && (flags & HDB_F_CANON) == 0) {
-	krb5_data_free(&value);
+	release_value(&value, borrowed);
 	return HDB_ERR_NOENTRY;
     } else if (ret == ASN1_BAD_ID) {
 	hdb_entry_alias alias;
 
 	ret = hdb_value2entry_alias(context, &value, &alias);
 	if (ret) {
-	    krb5_data_free(&value);
+	    release_value(&value, borrowed);
 	    return ret;
 	}
 	hdb_principal2key(context, alias.principal, &key);
-	krb5_data_free(&value);
+	release_value(&value, borrowed);
 	free_hdb_entry_alias(&alias);
 
 	ret = db->hdb__get(context, db, key, &value);
@@ -150,11 +166,11 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 	    return ret;
 	ret = hdb_value2entry(context, &value, &entry->entry);
 	if (ret) {
-	    krb5_data_free(&value);
+	    release_value(&value, borrowed);
 	    return ret;
 	}
     }
-    krb5_data_free(&value);
+    release_value(&value, borrowed);
     if ((flags & HDB_F_DECRYPT) && (flags & HDB_F_ALL_KVNOS)) {
 	/* Decrypt the current keys */
 	ret = hdb_unseal_keys(context, db, &entry->entry);
@@ -194,6 +210,21 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
     return 0;
 }
 
+krb5_error_code
+_hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    return fetch_kvno(context, db, principal, flags, kvno, entry, 0);
+}
+
+krb5_error_code
+_hdb_fetch_kvno_borrowed(krb5_context context, HDB *db,
+			 krb5_const_principal principal, unsigned flags,
+			 krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    return fetch_kvno(context, db, principal, flags, kvno, entry, 1);
+}
+
 static krb5_error_code
 hdb_remove_aliases(krb5_context context, HDB *db, krb5_data *key)
 {
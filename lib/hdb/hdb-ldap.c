@@ -40,21 +40,55 @@
 #include <ldap.h>
 #include <sys/un.h>
 #include <hex.h>
+#include <heim_threads.h>
 
-static krb5_error_code LDAP__connect(krb5_context context, HDB *);
 static krb5_error_code LDAP_close(krb5_context context, HDB *);
 
 static krb5_error_code
-LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
-		   int flags, hdb_entry_ex * ent);
+LDAP_message2entry(krb5_context context, HDB * db, LDAP * lp,
+		   LDAPMessage * msg, int flags, hdb_entry_ex * ent);
 
 static const char *default_structural_object = "account";
 static char *structural_object;
 static const char *default_ldap_url = "ldapi:///";
 static krb5_boolean samba_forwardable;
 
+/*
+ * A connection in the pool, h_conn[0] is the primary connection that
+ * is used for iteration and modifications, lookups are spread over
+ * all of them.  Every use holds a reference, taken with
+ * LDAP__get_conn() and dropped with LDAP__put_conn().  A connection
+ * whose server went away is marked broken and closed when the last
+ * reference is dropped, since other threads may still be using it.
+ * While a connection is being (re)connected it is marked connecting
+ * and the bind runs without h_mutex held; other threads leave it
+ * alone until it is done.
+ */
+
+struct hdbldapconn {
+    LDAP *lp;
+    int users;
+    int broken;
+    int connecting;
+};
+
+/* Slot in the fetch cache, holds the DER encoded entry */
+
+struct hdbldapcache {
+    char *name;
+    time_t expire;
+    krb5_data value;
+};
+
 struct hdbldapdb {
-    LDAP *h_lp;
+    struct hdbldapconn *h_conn;
+    size_t h_nconn;
+    size_t h_nextconn;
+    HEIMDAL_MUTEX h_mutex;
+    struct hdbldapconn *h_iter_conn; /* held while h_msgid is a search */
+    struct hdbldapcache *h_cache;
+    size_t h_cache_size;
+    time_t h_cache_ttl;
     int   h_msgid;
     char *h_base;
     char *h_url;
@@ -64,7 +98,11 @@ struct hdbldapdb {
     char *h_createbase;
 };
 
-#define HDB2LDAP(db) (((struct hdbldapdb *)(db)->hdb_db)->h_lp)
+static krb5_error_code
+LDAP__get_conn(krb5_context, HDB *, int, struct hdbldapconn **);
+static void LDAP__put_conn(HDB *, struct hdbldapconn *);
+
+#define HDB2LDAP(db) (((struct hdbldapdb *)(db)->hdb_db)->h_conn[0].lp)
 #define HDB2MSGID(db) (((struct hdbldapdb *)(db)->hdb_db)->h_msgid)
 #define HDBSETMSGID(db,msgid) \
 	do { ((struct hdbldapdb *)(db)->hdb_db)->h_msgid = msgid; } while(0)
@@ -105,6 +143,36 @@ static char * krb5kdcentry_attrs[] = {
     NULL
 };
 
+/* what the kdc needs, leaving out the audit trail attributes */
+static char * krb5kdcentry_kdc_attrs[] = {
+    "createTimestamp",
+    "krb5EncryptionType",
+    "krb5KDCFlags",
+    "krb5Key",
+    "krb5KeyVersionNumber",
+    "krb5MaxLife",
+    "krb5MaxRenew",
+    "krb5PasswordEnd",
+    "krb5PrincipalName",
+    "krb5PrincipalRealm",
+    "krb5ValidEnd",
+    "krb5ValidStart",
+    "objectClass",
+    "sambaAcctFlags",
+    "sambaKickoffTime",
+    "sambaNTPassword",
+    "sambaPwdLastSet",
+    "sambaPwdMustChange",
+    "uid",
+    NULL
+};
+
+/* only the dn is needed */
+static char *no_attrs[] = {
+    LDAP_NO_ATTRS,
+    NULL
+};
+
 static char *krb5principal_attrs[] = {
     "cn",
     "createTimestamp",
@@ -133,14 +201,40 @@ LDAP_no_size_limit(krb5_context context, LDAP *lp)
     return 0;
 }
 
+static void
+LDAP__close_conn(LDAP **lp)
+{
+    if (*lp) {
+	ldap_unbind_ext(*lp, NULL, NULL);
+	*lp = NULL;
+    }
+}
+
+static void
+LDAP__conn_broken(HDB *db, struct hdbldapconn *conn)
+{
+    struct hdbldapdb *h = db->hdb_db;
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    conn->broken = 1;
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
+}
+
+/*
+ * Check the result of a ldap operation, if the server went away and
+ * `conn' is given, the connection is marked broken so that it is
+ * reconnected once no one uses it.
+ */
+
 static int
-check_ldap(krb5_context context, HDB *db, int ret)
+check_ldap(krb5_context context, HDB *db, struct hdbldapconn *conn, int ret)
 {
     switch (ret) {
     case LDAP_SUCCESS:
 	return 0;
     case LDAP_SERVER_DOWN:
-	LDAP_close(context, db);
+	if (conn)
+	    LDAP__conn_broken(db, conn);
 	return 1;
     default:
 	return 1;
@@ -310,12 +404,12 @@ LDAP_addmod_integer(krb5_context context,
 }
 
 static krb5_error_code
-LDAP_get_string_value(HDB * db, LDAPMessage * entry,
+LDAP_get_string_value(LDAP * lp, LDAPMessage * entry,
 		      const char *attribute, char **ptr)
 {
     struct berval **vals;
 
-    vals = ldap_get_values_len(HDB2LDAP(db), entry, attribute);
+    vals = ldap_get_values_len(lp, entry, attribute);
     if (vals == NULL || vals[0] == NULL) {
 	*ptr = NULL;
 	return HDB_ERR_NOENTRY;
@@ -336,13 +430,13 @@ LDAP_get_string_value(HDB * db, LDAPMessage * entry,
 }
 
 static krb5_error_code
-LDAP_get_integer_value(HDB * db, LDAPMessage * entry,
+LDAP_get_integer_value(LDAP * lp, LDAPMessage * entry,
 		       const char *attribute, int *ptr)
 {
     krb5_error_code ret;
     char *val;
 
-    ret = LDAP_get_string_value(db, entry, attribute, &val);
+    ret = LDAP_get_string_value(lp, entry, attribute, &val);
     if (ret)
 	return ret;
     *ptr = atoi(val);
@@ -351,7 +445,7 @@ LDAP_get_integer_value(HDB * db, LDAPMessage * entry,
 }
 
 static krb5_error_code
-LDAP_get_generalized_time_value(HDB * db, LDAPMessage * entry,
+LDAP_get_generalized_time_value(LDAP * lp, LDAPMessage * entry,
 				const char *attribute, KerberosTime * kt)
 {
     char *tmp, *gentime;
@@ -360,7 +454,7 @@ LDAP_get_generalized_time_value(HDB * db, LDAPMessage * entry,
 
     *kt = 0;
 
-    ret = LDAP_get_string_value(db, entry, attribute, &gentime);
+    ret = LDAP_get_string_value(lp, entry, attribute, &gentime);
     if (ret)
 	return ret;
 
@@ -408,7 +502,7 @@ LDAP_entry2mods(krb5_context context, HDB * db, hdb_entry_ex * ent,
 
     if (msg != NULL) {
 
-	ret = LDAP_message2entry(context, db, msg, 0, &orig);
+	ret = LDAP_message2entry(context, db, HDB2LDAP(db), msg, 0, &orig);
 	if (ret)
 	    goto out;
 
@@ -744,7 +838,7 @@ LDAP_entry2mods(krb5_context context, HDB * db, hdb_entry_ex * ent,
 }
 
 static krb5_error_code
-LDAP_dn2principal(krb5_context context, HDB * db, const char *dn,
+LDAP_dn2principal(krb5_context context, LDAP * lp, const char *dn,
 		  krb5_principal * principal)
 {
     krb5_error_code ret;
@@ -753,15 +847,11 @@ LDAP_dn2principal(krb5_context context, HDB * db, const char *dn,
     LDAPMessage *res = NULL, *e;
     char *p;
 
-    ret = LDAP_no_size_limit(context, HDB2LDAP(db));
-    if (ret)
-	goto out;
-
-    rc = ldap_search_ext_s(HDB2LDAP(db), dn, LDAP_SCOPE_SUBTREE,
+    rc = ldap_search_ext_s(lp, dn, LDAP_SCOPE_SUBTREE,
 			   filter, krb5principal_attrs, 0,
 			   NULL, NULL, NULL,
-			   0, &res);
-    if (check_ldap(context, db, rc)) {
+			   LDAP_NO_LIMIT, &res);
+    if (check_ldap(context, NULL, NULL, rc)) {
 	ret = HDB_ERR_NOENTRY;
 	krb5_set_error_message(context, ret, "ldap_search_ext_s: "
 			       "filter: %s error: %s",
@@ -769,13 +859,13 @@ LDAP_dn2principal(krb5_context context, HDB * db, const char *dn,
 	goto out;
     }
 
-    e = ldap_first_entry(HDB2LDAP(db), res);
+    e = ldap_first_entry(lp, res);
     if (e == NULL) {
 	ret = HDB_ERR_NOENTRY;
 	goto out;
     }
 
-    ret = LDAP_get_string_value(db, e, "krb5PrincipalName", &p);
+    ret = LDAP_get_string_value(lp, e, "krb5PrincipalName", &p);
     if (ret) {
 	ret = HDB_ERR_NOENTRY;
 	goto out;
@@ -834,20 +924,53 @@ escape_value(krb5_context context, const char *unquoted, char **quoted)
 }
 
 
+/*
+ * Wait for the complete result of the search `msgid'.
+ */
+
+static int
+LDAP__search_result(LDAP *lp, int msgid, LDAPMessage **msg)
+{
+    int rc, err;
+
+    rc = ldap_result(lp, msgid, LDAP_MSG_ALL, NULL, msg);
+    if (rc == -1) {
+	*msg = NULL;
+	if (ldap_get_option(lp, LDAP_OPT_RESULT_CODE, &err) != LDAP_SUCCESS)
+	    err = LDAP_OTHER;
+	return err;
+    }
+    if (rc == 0) {
+	*msg = NULL;
+	return LDAP_TIMEOUT;
+    }
+    rc = ldap_parse_result(lp, *msg, &err, NULL, NULL, NULL, NULL, 0);
+    if (rc != LDAP_SUCCESS)
+	return rc;
+    return err;
+}
+
+/*
+ * Look up the principal by name, and if `userid' is given and there
+ * is no such principal, by uid.  Both searches are sent off before
+ * waiting for any of the results so that the fallback costs no
+ * extra round trip.
+ */
+
 static krb5_error_code
 LDAP__lookup_princ(krb5_context context,
 		   HDB *db,
+		   struct hdbldapconn *conn,
 		   const char *princname,
 		   const char *userid,
+		   char **attrs,
 		   LDAPMessage **msg)
 {
     krb5_error_code ret;
-    int rc;
-    char *quote, *filter = NULL;
+    int rc, msgid, uid_msgid = -1;
+    char *quote, *filter = NULL, *uid_filter = NULL;
 
-    ret = LDAP__connect(context, db);
-    if (ret)
-	return ret;
+    *msg = NULL;
 
     /*
      * Quote searches that contain filter language, this quote
@@ -864,77 +987,100 @@ LDAP__lookup_princ(krb5_context context,
     free(quote);
 
     if (rc < 0) {
+	filter = NULL;
 	ret = ENOMEM;
 	krb5_set_error_message(context, ret, "malloc: out of memory");
 	goto out;
     }
 
-    ret = LDAP_no_size_limit(context, HDB2LDAP(db));
-    if (ret)
-	goto out;
-
-    rc = ldap_search_ext_s(HDB2LDAP(db), HDB2BASE(db),
-			   LDAP_SCOPE_SUBTREE, filter,
-			   krb5kdcentry_attrs, 0,
-			   NULL, NULL, NULL,
-			   0, msg);
-    if (check_ldap(context, db, rc)) {
-	ret = HDB_ERR_NOENTRY;
-	krb5_set_error_message(context, ret, "ldap_search_ext_s: "
-			      "filter: %s - error: %s",
-			      filter, ldap_err2string(rc));
-	goto out;
-    }
-
-    if (userid && ldap_count_entries(HDB2LDAP(db), *msg) == 0) {
-	free(filter);
-	filter = NULL;
-	ldap_msgfree(*msg);
-	*msg = NULL;
-
+    if (userid) {
 	ret = escape_value(context, userid, &quote);
 	if (ret)
 	    goto out;
 
-	rc = asprintf(&filter,
+	rc = asprintf(&uid_filter,
 	    "(&(|(objectClass=sambaSamAccount)(objectClass=%s))(uid=%s))",
 		      structural_object, quote);
 	free(quote);
 	if (rc < 0) {
+	    uid_filter = NULL;
 	    ret = ENOMEM;
 	    krb5_set_error_message(context, ret, "asprintf: out of memory");
 	    goto out;
 	}
+    }
 
-	ret = LDAP_no_size_limit(context, HDB2LDAP(db));
-	if (ret)
-	    goto out;
+    rc = ldap_search_ext(conn->lp, HDB2BASE(db),
+			 LDAP_SCOPE_SUBTREE, filter,
+			 attrs, 0,
+			 NULL, NULL, NULL,
+			 LDAP_NO_LIMIT, &msgid);
+    if (check_ldap(context, db, conn, rc)) {
+	ret = HDB_ERR_NOENTRY;
+	krb5_set_error_message(context, ret, "ldap_search_ext: "
+			      "filter: %s - error: %s",
+			      filter, ldap_err2string(rc));
+	goto out;
+    }
 
-	rc = ldap_search_ext_s(HDB2LDAP(db), HDB2BASE(db), LDAP_SCOPE_SUBTREE,
-			       filter, krb5kdcentry_attrs, 0,
-			       NULL, NULL, NULL,
-			       0, msg);
-	if (check_ldap(context, db, rc)) {
+    if (uid_filter) {
+	rc = ldap_search_ext(conn->lp, HDB2BASE(db), LDAP_SCOPE_SUBTREE,
+			     uid_filter, attrs, 0,
+			     NULL, NULL, NULL,
+			     LDAP_NO_LIMIT, &uid_msgid);
+	if (rc != LDAP_SUCCESS)
+	    uid_msgid = -1;
+    }
+
+    rc = LDAP__search_result(conn->lp, msgid, msg);
+    if (check_ldap(context, db, conn, rc)) {
+	ret = HDB_ERR_NOENTRY;
+	krb5_set_error_message(context, ret, "ldap_search_ext: "
+			      "filter: %s - error: %s",
+			      filter, ldap_err2string(rc));
+	goto out;
+    }
+
+    if (uid_msgid != -1) {
+	if (ldap_count_entries(conn->lp, *msg) != 0) {
+	    ldap_abandon_ext(conn->lp, uid_msgid, NULL, NULL);
+	    uid_msgid = -1;
+	    goto done;
+	}
+	ldap_msgfree(*msg);
+	*msg = NULL;
+
+	rc = LDAP__search_result(conn->lp, uid_msgid, msg);
+	uid_msgid = -1;
+	if (check_ldap(context, db, conn, rc)) {
 	    ret = HDB_ERR_NOENTRY;
 	    krb5_set_error_message(context, ret,
-				   "ldap_search_ext_s: filter: %s error: %s",
-				   filter, ldap_err2string(rc));
+				   "ldap_search_ext: filter: %s error: %s",
+				   uid_filter, ldap_err2string(rc));
 	    goto out;
 	}
     }
 
+ done:
     ret = 0;
 
   out:
-    if (filter)
-	free(filter);
+    if (ret && *msg) {
+	ldap_msgfree(*msg);
+	*msg = NULL;
+    }
+    if (uid_msgid != -1 && conn->lp)
+	ldap_abandon_ext(conn->lp, uid_msgid, NULL, NULL);
+    free(filter);
+    free(uid_filter);
 
     return ret;
 }
 
 static krb5_error_code
-LDAP_principal2message(krb5_context context, HDB * db,
-		       krb5_const_principal princ, LDAPMessage ** msg)
+LDAP_principal2message(krb5_context context, HDB * db, struct hdbldapconn *conn,
+		       krb5_const_principal princ, char **attrs,
+		       LDAPMessage ** msg)
 {
     char *name, *name_short = NULL;
     krb5_error_code ret;
@@ -964,7 +1110,7 @@ LDAP_principal2message(krb5_context context, HDB * db,
     }
     krb5_free_host_realm(context, r0);
 
-    ret = LDAP__lookup_princ(context, db, name, name_short, msg);
+    ret = LDAP__lookup_princ(context, db, conn, name, name_short, attrs, msg);
     free(name);
     free(name_short);
 
@@ -975,8 +1121,8 @@ LDAP_principal2message(krb5_context context, HDB * db,
  * Construct an hdb_entry from a directory entry.
  */
 static krb5_error_code
-LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
-		   int flags, hdb_entry_ex * ent)
+LDAP_message2entry(krb5_context context, HDB * db, LDAP * lp,
+		   LDAPMessage * msg, int flags, hdb_entry_ex * ent)
 {
     char *unparsed_name = NULL, *dn = NULL, *ntPasswordIN = NULL;
     char *samba_acct_flags = NULL;
@@ -987,13 +1133,13 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
     memset(ent, 0, sizeof(*ent));
     ent->entry.flags = int2HDBFlags(0);
 
-    ret = LDAP_get_string_value(db, msg, "krb5PrincipalName", &unparsed_name);
+    ret = LDAP_get_string_value(lp, msg, "krb5PrincipalName", &unparsed_name);
     if (ret == 0) {
 	ret = krb5_parse_name(context, unparsed_name, &ent->entry.principal);
 	if (ret)
 	    goto out;
     } else {
-	ret = LDAP_get_string_value(db, msg, "uid",
+	ret = LDAP_get_string_value(lp, msg, "uid",
 				    &unparsed_name);
 	if (ret == 0) {
 	    ret = krb5_parse_name(context, unparsed_name, &ent->entry.principal);
@@ -1009,7 +1155,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 
     {
 	int integer;
-	ret = LDAP_get_integer_value(db, msg, "krb5KeyVersionNumber",
+	ret = LDAP_get_integer_value(lp, msg, "krb5KeyVersionNumber",
 				     &integer);
 	if (ret)
 	    ent->entry.kvno = 0;
@@ -1017,7 +1163,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	    ent->entry.kvno = integer;
     }
 
-    keys = ldap_get_values_len(HDB2LDAP(db), msg, "krb5Key");
+    keys = ldap_get_values_len(lp, msg, "krb5Key");
     if (keys != NULL) {
 	size_t l;
 
@@ -1048,7 +1194,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 #endif
     }
 
-    vals = ldap_get_values_len(HDB2LDAP(db), msg, "krb5EncryptionType");
+    vals = ldap_get_values_len(lp, msg, "krb5EncryptionType");
     if (vals != NULL) {
 	ent->entry.etypes = malloc(sizeof(*(ent->entry.etypes)));
 	if (ent->entry.etypes == NULL) {
@@ -1089,7 +1235,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
     }
 
     /* manually construct the NT (type 23) key */
-    ret = LDAP_get_string_value(db, msg, "sambaNTPassword", &ntPasswordIN);
+    ret = LDAP_get_string_value(lp, msg, "sambaNTPassword", &ntPasswordIN);
     if (ret == 0 && have_arcfour == 0) {
 	unsigned *etypes;
 
@@ -1146,7 +1292,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	}
     }
 
-    ret = LDAP_get_generalized_time_value(db, msg, "createTimestamp",
+    ret = LDAP_get_generalized_time_value(lp, msg, "createTimestamp",
 					  &ent->entry.created_by.time);
     if (ret)
 	ent->entry.created_by.time = time(NULL);
@@ -1154,9 +1300,9 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
     ent->entry.created_by.principal = NULL;
 
     if (flags & HDB_F_ADMIN_DATA) {
-	ret = LDAP_get_string_value(db, msg, "creatorsName", &dn);
+	ret = LDAP_get_string_value(lp, msg, "creatorsName", &dn);
 	if (ret == 0) {
-	    LDAP_dn2principal(context, db, dn, &ent->entry.created_by.principal);
+	    LDAP_dn2principal(context, lp, dn, &ent->entry.created_by.principal);
 	    free(dn);
 	}
 
@@ -1167,12 +1313,12 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	    goto out;
 	}
 
-	ret = LDAP_get_generalized_time_value(db, msg, "modifyTimestamp",
+	ret = LDAP_get_generalized_time_value(lp, msg, "modifyTimestamp",
 					      &ent->entry.modified_by->time);
 	if (ret == 0) {
-	    ret = LDAP_get_string_value(db, msg, "modifiersName", &dn);
+	    ret = LDAP_get_string_value(lp, msg, "modifiersName", &dn);
 	    if (ret == 0) {
-		LDAP_dn2principal(context, db, dn, &ent->entry.modified_by->principal);
+		LDAP_dn2principal(context, lp, dn, &ent->entry.modified_by->principal);
 		free(dn);
 	    } else {
 		free(ent->entry.modified_by);
@@ -1187,7 +1333,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	krb5_set_error_message(context, ret, "malloc: out of memory");
 	goto out;
     }
-    ret = LDAP_get_generalized_time_value(db, msg, "krb5ValidStart",
+    ret = LDAP_get_generalized_time_value(lp, msg, "krb5ValidStart",
 					  ent->entry.valid_start);
     if (ret) {
 	/* OPTIONAL */
@@ -1201,7 +1347,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	krb5_set_error_message(context, ret, "malloc: out of memory");
 	goto out;
     }
-    ret = LDAP_get_generalized_time_value(db, msg, "krb5ValidEnd",
+    ret = LDAP_get_generalized_time_value(lp, msg, "krb5ValidEnd",
 					  ent->entry.valid_end);
     if (ret) {
 	/* OPTIONAL */
@@ -1209,7 +1355,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	ent->entry.valid_end = NULL;
     }
 
-    ret = LDAP_get_integer_value(db, msg, "sambaKickoffTime", &tmp_time);
+    ret = LDAP_get_integer_value(lp, msg, "sambaKickoffTime", &tmp_time);
     if (ret == 0) {
  	if (ent->entry.valid_end == NULL) {
  	    ent->entry.valid_end = malloc(sizeof(*ent->entry.valid_end));
@@ -1228,7 +1374,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	krb5_set_error_message(context, ret, "malloc: out of memory");
 	goto out;
     }
-    ret = LDAP_get_generalized_time_value(db, msg, "krb5PasswordEnd",
+    ret = LDAP_get_generalized_time_value(lp, msg, "krb5PasswordEnd",
 					  ent->entry.pw_end);
     if (ret) {
 	/* OPTIONAL */
@@ -1236,7 +1382,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	ent->entry.pw_end = NULL;
     }
 
-    ret = LDAP_get_integer_value(db, msg, "sambaPwdLastSet", &tmp_time);
+    ret = LDAP_get_integer_value(lp, msg, "sambaPwdLastSet", &tmp_time);
     if (ret == 0) {
 	time_t delta;
 
@@ -1260,7 +1406,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	}
     }
 
-    ret = LDAP_get_integer_value(db, msg, "sambaPwdMustChange", &tmp_time);
+    ret = LDAP_get_integer_value(lp, msg, "sambaPwdMustChange", &tmp_time);
     if (ret == 0) {
 	if (ent->entry.pw_end == NULL) {
 	    ent->entry.pw_end = malloc(sizeof(*ent->entry.pw_end));
@@ -1274,7 +1420,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
     }
 
     /* OPTIONAL */
-    ret = LDAP_get_integer_value(db, msg, "sambaPwdLastSet", &tmp_time);
+    ret = LDAP_get_integer_value(lp, msg, "sambaPwdLastSet", &tmp_time);
     if (ret == 0)
 	hdb_entry_set_pw_change_time(context, &ent->entry, tmp_time);
 
@@ -1287,7 +1433,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	    krb5_set_error_message(context, ret, "malloc: out of memory");
 	    goto out;
 	}
-	ret = LDAP_get_integer_value(db, msg, "krb5MaxLife", &max_life);
+	ret = LDAP_get_integer_value(lp, msg, "krb5MaxLife", &max_life);
 	if (ret) {
 	    free(ent->entry.max_life);
 	    ent->entry.max_life = NULL;
@@ -1304,7 +1450,7 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	    krb5_set_error_message(context, ret, "malloc: out of memory");
 	    goto out;
 	}
-	ret = LDAP_get_integer_value(db, msg, "krb5MaxRenew", &max_renew);
+	ret = LDAP_get_integer_value(lp, msg, "krb5MaxRenew", &max_renew);
 	if (ret) {
 	    free(ent->entry.max_renew);
 	    ent->entry.max_renew = NULL;
@@ -1312,14 +1458,14 @@ LDAP_message2entry(krb5_context context, HDB * db, LDAPMessage * msg,
 	    *ent->entry.max_renew = max_renew;
     }
 
-    ret = LDAP_get_integer_value(db, msg, "krb5KDCFlags", &tmp);
+    ret = LDAP_get_integer_value(lp, msg, "krb5KDCFlags", &tmp);
     if (ret)
 	tmp = 0;
 
     ent->entry.flags = int2HDBFlags(tmp);
 
     /* Try and find Samba flags to put into the mix */
-    ret = LDAP_get_string_value(db, msg, "sambaAcctFlags", &samba_acct_flags);
+    ret = LDAP_get_string_value(lp, msg, "sambaAcctFlags", &samba_acct_flags);
     if (ret == 0) {
 	/* parse the [UXW...] string:
 
@@ -1409,13 +1555,41 @@ out:
     return ret;
 }
 
+/*
+ * Abandon the iteration if it is still running and drop the
+ * connection it holds.
+ */
+
+static void
+LDAP__iter_end(HDB * db)
+{
+    struct hdbldapdb *h = db->hdb_db;
+
+    if (h->h_iter_conn == NULL)
+	return;
+    if (HDB2MSGID(db) >= 0)
+	ldap_abandon_ext(h->h_iter_conn->lp, HDB2MSGID(db), NULL, NULL);
+    HDBSETMSGID(db, -1);
+    LDAP__put_conn(db, h->h_iter_conn);
+    h->h_iter_conn = NULL;
+}
+
 static krb5_error_code
 LDAP_close(krb5_context context, HDB * db)
 {
-    if (HDB2LDAP(db)) {
-	ldap_unbind_ext(HDB2LDAP(db), NULL, NULL);
-	((struct hdbldapdb *)db->hdb_db)->h_lp = NULL;
+    struct hdbldapdb *h = db->hdb_db;
+    size_t i;
+
+    LDAP__iter_end(db);
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    for (i = 0; i < h->h_nconn; i++) {
+	if (h->h_conn[i].users)
+	    h->h_conn[i].broken = 1;
+	else
+	    LDAP__close_conn(&h->h_conn[i].lp);
     }
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
 
     return 0;
 }
@@ -1435,16 +1609,18 @@ LDAP_unlock(krb5_context context, HDB * db)
 static krb5_error_code
 LDAP_seq(krb5_context context, HDB * db, unsigned flags, hdb_entry_ex * entry)
 {
+    struct hdbldapdb *h = db->hdb_db;
+    struct hdbldapconn *conn = h->h_iter_conn;
     int msgid, rc, parserc;
     krb5_error_code ret;
     LDAPMessage *e;
 
     msgid = HDB2MSGID(db);
-    if (msgid < 0)
+    if (msgid < 0 || conn == NULL)
 	return HDB_ERR_NOENTRY;
 
     do {
-	rc = ldap_result(HDB2LDAP(db), msgid, LDAP_MSG_ONE, NULL, &e);
+	rc = ldap_result(conn->lp, msgid, LDAP_MSG_ONE, NULL, &e);
 	switch (rc) {
 	case LDAP_RES_SEARCH_REFERENCE:
 	    ldap_msgfree(e);
@@ -1452,39 +1628,43 @@ LDAP_seq(krb5_context context, HDB * db, unsigned flags, hdb_entry_ex * entry)
 	    break;
 	case LDAP_RES_SEARCH_ENTRY:
 	    /* We have an entry. Parse it. */
-	    ret = LDAP_message2entry(context, db, e, flags, entry);
+	    ret = LDAP_message2entry(context, db, conn->lp, e, flags, entry);
 	    ldap_msgfree(e);
 	    break;
 	case LDAP_RES_SEARCH_RESULT:
 	    /* We're probably at the end of the results. If not, abandon. */
 	    parserc =
-		ldap_parse_result(HDB2LDAP(db), e, NULL, NULL, NULL,
+		ldap_parse_result(conn->lp, e, NULL, NULL, NULL,
 				  NULL, NULL, 1);
 	    ret = HDB_ERR_NOENTRY;
 	    if (parserc != LDAP_SUCCESS
 		&& parserc != LDAP_MORE_RESULTS_TO_RETURN) {
 	        krb5_set_error_message(context, ret, "ldap_parse_result: %s",
 				       ldap_err2string(parserc));
-		ldap_abandon_ext(HDB2LDAP(db), msgid, NULL, NULL);
+		ldap_abandon_ext(conn->lp, msgid, NULL, NULL);
 	    }
 	    HDBSETMSGID(db, -1);
 	    break;
 	case LDAP_SERVER_DOWN:
 	    ldap_msgfree(e);
-	    LDAP_close(context, db);
+	    LDAP__conn_broken(db, conn);
 	    HDBSETMSGID(db, -1);
 	    ret = ENETDOWN;
 	    break;
 	default:
 	    /* Some unspecified error (timeout?). Abandon. */
 	    ldap_msgfree(e);
-	    ldap_abandon_ext(HDB2LDAP(db), msgid, NULL, NULL);
+	    ldap_abandon_ext(conn->lp, msgid, NULL, NULL);
 	    ret = HDB_ERR_NOENTRY;
 	    HDBSETMSGID(db, -1);
 	    break;
 	}
     } while (rc == LDAP_RES_SEARCH_REFERENCE);
 
+    /* the search is done, let go of its connection */
+    if (HDB2MSGID(db) < 0)
+	LDAP__iter_end(db);
+
     if (ret == 0) {
 	if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
 	    ret = hdb_unseal_keys(context, db, &entry->entry);
@@ -1500,25 +1680,30 @@ static krb5_error_code
 LDAP_firstkey(krb5_context context, HDB *db, unsigned flags,
 	      hdb_entry_ex *entry)
 {
+    struct hdbldapdb *h = db->hdb_db;
+    struct hdbldapconn *conn;
     krb5_error_code ret;
-    int msgid;
+    int msgid = -1;
 
-    ret = LDAP__connect(context, db);
-    if (ret)
-	return ret;
+    LDAP__iter_end(db);
 
-    ret = LDAP_no_size_limit(context, HDB2LDAP(db));
+    ret = LDAP__get_conn(context, db, 0, &conn);
     if (ret)
 	return ret;
 
-    ret = ldap_search_ext(HDB2LDAP(db), HDB2BASE(db),
+    ret = ldap_search_ext(conn->lp, HDB2BASE(db),
 			LDAP_SCOPE_SUBTREE,
 			"(|(objectClass=krb5Principal)(objectClass=sambaSamAccount))",
 			krb5kdcentry_attrs, 0,
 			NULL, NULL, NULL, 0, &msgid);
-    if (msgid < 0)
+    if (ret != LDAP_SUCCESS || msgid < 0) {
+	check_ldap(context, db, conn, ret);
+	LDAP__put_conn(db, conn);
 	return HDB_ERR_NOENTRY;
+    }
 
+    /* the connection is held until the iteration is over */
+    h->h_iter_conn = conn;
     HDBSETMSGID(db, msgid);
 
     return LDAP_seq(context, db, flags, entry);
@@ -1532,7 +1717,7 @@ LDAP_nextkey(krb5_context context, HDB * db, unsigned flags,
 }
 
 static krb5_error_code
-LDAP__connect(krb5_context context, HDB * db)
+LDAP__connect_conn(krb5_context context, HDB * db, LDAP ** lp)
 {
     int rc, version = LDAP_VERSION3;
     /*
@@ -1544,6 +1729,7 @@ LDAP__connect(krb5_context context, HDB * db)
     struct berval bv = { 0, "" };
     const char *sasl_method = "EXTERNAL";
     const char *bind_dn = NULL;
+    krb5_error_code ret;
 
     if (HDB2BINDDN(db) != NULL && HDB2BINDPW(db) != NULL) {
 	/* A bind DN was specified; use SASL SIMPLE */
@@ -1553,64 +1739,263 @@ LDAP__connect(krb5_context context, HDB * db)
 	bv.bv_len = strlen(bv.bv_val);
     }
 
-    if (HDB2LDAP(db)) {
+    if (*lp) {
 	/* connection has been opened. ping server. */
 	struct sockaddr_un addr;
 	socklen_t len = sizeof(addr);
 	int sd;
 
-	if (ldap_get_option(HDB2LDAP(db), LDAP_OPT_DESC, &sd) == 0 &&
+	if (ldap_get_option(*lp, LDAP_OPT_DESC, &sd) == 0 &&
 	    getpeername(sd, (struct sockaddr *) &addr, &len) < 0) {
 	    /* the other end has died. reopen. */
-	    LDAP_close(context, db);
+	    LDAP__close_conn(lp);
 	}
     }
 
-    if (HDB2LDAP(db) != NULL) /* server is UP */
+    if (*lp != NULL) /* server is UP */
 	return 0;
 
-    rc = ldap_initialize(&((struct hdbldapdb *)db->hdb_db)->h_lp, HDB2URL(db));
+    rc = ldap_initialize(lp, HDB2URL(db));
     if (rc != LDAP_SUCCESS) {
 	krb5_set_error_message(context, HDB_ERR_NOENTRY, "ldap_initialize: %s",
 			       ldap_err2string(rc));
 	return HDB_ERR_NOENTRY;
     }
 
-    rc = ldap_set_option(HDB2LDAP(db), LDAP_OPT_PROTOCOL_VERSION,
+    rc = ldap_set_option(*lp, LDAP_OPT_PROTOCOL_VERSION,
 			 (const void *)&version);
     if (rc != LDAP_SUCCESS) {
 	krb5_set_error_message(context, HDB_ERR_BADVERSION,
 			       "ldap_set_option: %s", ldap_err2string(rc));
-	LDAP_close(context, db);
+	LDAP__close_conn(lp);
 	return HDB_ERR_BADVERSION;
     }
 
+    ret = LDAP_no_size_limit(context, *lp);
+    if (ret) {
+	LDAP__close_conn(lp);
+	return ret;
+    }
+
     if (((struct hdbldapdb *)db->hdb_db)->h_start_tls) {
-	rc = ldap_start_tls_s(HDB2LDAP(db), NULL, NULL);
+	rc = ldap_start_tls_s(*lp, NULL, NULL);
 
 	if (rc != LDAP_SUCCESS) {
 	    krb5_set_error_message(context, HDB_ERR_BADVERSION,
 				   "ldap_start_tls_s: %s", ldap_err2string(rc));
-	    LDAP_close(context, db);
+	    LDAP__close_conn(lp);
 	    return HDB_ERR_BADVERSION;
 	}
     }
 
-    rc = ldap_sasl_bind_s(HDB2LDAP(db), bind_dn, sasl_method, &bv,
+    rc = ldap_sasl_bind_s(*lp, bind_dn, sasl_method, &bv,
 			  NULL, NULL, NULL);
     if (rc != LDAP_SUCCESS) {
 	krb5_set_error_message(context, HDB_ERR_BADVERSION,
 			      "ldap_sasl_bind_s: %s", ldap_err2string(rc));
-	LDAP_close(context, db);
+	LDAP__close_conn(lp);
 	return HDB_ERR_BADVERSION;
     }
 
     return 0;
 }
 
+/*
+ * Take a reference to the primary connection, or with `any' to the
+ * least used connection from the pool that is not broken, connecting
+ * it if needed.  OpenLDAP handles may be shared between threads, so
+ * when every connection is busy the searches are multiplexed.
+ *
+ * Connecting and binding can block for as long as the server takes
+ * to answer, so it is done with h_mutex released; the connection is
+ * marked connecting meanwhile and skipped by everyone else.
+ */
+
+static krb5_error_code
+LDAP__get_conn(krb5_context context, HDB * db, int any,
+	       struct hdbldapconn ** conn)
+{
+    struct hdbldapdb *h = db->hdb_db;
+    struct hdbldapconn *c = NULL;
+    krb5_error_code ret;
+    size_t i;
+
+    LDAP *lp;
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    if (!any) {
+	if (!h->h_conn[0].broken && !h->h_conn[0].connecting)
+	    c = &h->h_conn[0];
+    } else {
+	for (i = 0; i < h->h_nconn; i++) {
+	    struct hdbldapconn *t;
+
+	    t = &h->h_conn[(h->h_nextconn + i) % h->h_nconn];
+	    if (t->broken || t->connecting)
+		continue;
+	    if (c == NULL || t->users < c->users)
+		c = t;
+	    if (c->users == 0)
+		break;
+	}
+	if (c)
+	    h->h_nextconn = (c - h->h_conn + 1) % h->h_nconn;
+    }
+    if (c == NULL) {
+	/*
+	 * Still in use by the requests that found the server gone, or
+	 * being connected by another thread.
+	 */
+	HEIMDAL_MUTEX_unlock(&h->h_mutex);
+	*conn = NULL;
+	krb5_set_error_message(context, HDB_ERR_NOENTRY,
+			       "LDAP connection is being reconnected");
+	return HDB_ERR_NOENTRY;
+    }
+    c->users++;
+    if (c->users > 1) {
+	HEIMDAL_MUTEX_unlock(&h->h_mutex);
+	*conn = c;
+	return 0;
+    }
+
+    /* first user, check the connection and connect it if needed */
+    c->connecting = 1;
+    lp = c->lp;
+    c->lp = NULL;
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
+
+    ret = LDAP__connect_conn(context, db, &lp);
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    c->lp = lp;
+    c->connecting = 0;
+    /* a failed connect leaves nothing behind for LDAP_close() to close */
+    if (ret && --c->users == 0)
+	c->broken = 0;
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
+
+    *conn = ret ? NULL : c;
+    return ret;
+}
+
+static void
+LDAP__put_conn(HDB * db, struct hdbldapconn * conn)
+{
+    struct hdbldapdb *h = db->hdb_db;
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    if (--conn->users == 0 && conn->broken) {
+	LDAP__close_conn(&conn->lp);
+	conn->broken = 0;
+    }
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
+}
+
+/*
+ * Cache of fetched entries, direct mapped on the principal name.
+ */
+
+static struct hdbldapcache *
+LDAP__cache_slot(struct hdbldapdb *h, const char *name)
+{
+    const unsigned char *p;
+    unsigned long hash = 5381;
+
+    for (p = (const unsigned char *)name; *p; p++)
+	hash = hash * 33 + *p;
+    return &h->h_cache[hash % h->h_cache_size];
+}
+
+static krb5_error_code
+LDAP__cache_get(krb5_context context, HDB * db, const char *name,
+		hdb_entry_ex * entry)
+{
+    struct hdbldapdb *h = db->hdb_db;
+    struct hdbldapcache *c;
+    krb5_error_code ret = HDB_ERR_NOENTRY;
+
+    if (h->h_cache == NULL)
+	return HDB_ERR_NOENTRY;
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    c = LDAP__cache_slot(h, name);
+    if (c->name && strcmp(c->name, name) == 0) {
+	if (c->expire > time(NULL)) {
+	    memset(entry, 0, sizeof(*entry));
+	    ret = hdb_value2entry(context, &c->value, &entry->entry);
+	} else {
+	    free(c->name);
+	    c->name = NULL;
+	    krb5_data_free(&c->value);
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
+
+    return ret;
+}
+
+static void
+LDAP__cache_put(krb5_context context, HDB * db, const char *name,
+		const hdb_entry * entry)
+{
+    struct hdbldapdb *h = db->hdb_db;
+    struct hdbldapcache *c;
+    krb5_data value;
+    char *n;
+
+    if (h->h_cache == NULL)
+	return;
+
+    if (hdb_entry2value(context, entry, &value))
+	return;
+    n = strdup(name);
+    if (n == NULL) {
+	krb5_data_free(&value);
+	return;
+    }
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    c = LDAP__cache_slot(h, name);
+    free(c->name);
+    krb5_data_free(&c->value);
+    c->name = n;
+    c->value = value;
+    c->expire = time(NULL) + h->h_cache_ttl;
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
+}
+
+static void
+LDAP__cache_remove(krb5_context context, HDB * db,
+		   krb5_const_principal principal)
+{
+    struct hdbldapdb *h = db->hdb_db;
+    struct hdbldapcache *c;
+    char *name;
+
+    if (h->h_cache == NULL)
+	return;
+
+    if (krb5_unparse_name(context, principal, &name))
+	return;
+
+    HEIMDAL_MUTEX_lock(&h->h_mutex);
+    c = LDAP__cache_slot(h, name);
+    if (c->name && strcmp(c->name, name) == 0) {
+	free(c->name);
+	c->name = NULL;
+	krb5_data_free(&c->value);
+    }
+    HEIMDAL_MUTEX_unlock(&h->h_mutex);
+    free(name);
+}
+
 static krb5_error_code
 LDAP_open(krb5_context context, HDB * db, int flags, mode_t mode)
 {
+    struct hdbldapconn *conn;
+    krb5_error_code ret;
+
     /* Not the right place for this. */
 #ifdef HAVE_SIGACTION
     struct sigaction sa;
@@ -1624,37 +2009,70 @@ LDAP_open(krb5_context context, HDB * db, int flags, mode_t mode)
     signal(SIGPIPE, SIG_IGN);
 #endif /* HAVE_SIGACTION */
 
-    return LDAP__connect(context, db);
+    ret = LDAP__get_conn(context, db, 0, &conn);
+    if (ret == 0)
+	LDAP__put_conn(db, conn);
+    return ret;
 }
 
 static krb5_error_code
 LDAP_fetch_kvno(krb5_context context, HDB * db, krb5_const_principal principal,
 		unsigned flags, krb5_kvno kvno, hdb_entry_ex * entry)
 {
-    LDAPMessage *msg, *e;
+    struct hdbldapconn *conn = NULL;
+    LDAPMessage *msg = NULL, *e;
     krb5_error_code ret;
+    char *name = NULL;
+    int cached = 0;
 
-    ret = LDAP_principal2message(context, db, principal, &msg);
-    if (ret)
-	return ret;
-
-    e = ldap_first_entry(HDB2LDAP(db), msg);
-    if (e == NULL) {
-	ret = HDB_ERR_NOENTRY;
-	goto out;
+    /* the cache only holds what the kdc asks for */
+    if ((flags & HDB_F_ADMIN_DATA) == 0 &&
+	((struct hdbldapdb *)db->hdb_db)->h_cache != NULL) {
+	ret = krb5_unparse_name(context, principal, &name);
+	if (ret)
+	    return ret;
+	if (LDAP__cache_get(context, db, name, entry) == 0)
+	    cached = 1;
     }
 
-    ret = LDAP_message2entry(context, db, e, flags, entry);
-    if (ret == 0) {
-	if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
-	    ret = hdb_unseal_keys(context, db, &entry->entry);
-	    if (ret)
-		hdb_free_entry(context, entry);
+    if (!cached) {
+	ret = LDAP__get_conn(context, db, 1, &conn);
+	if (ret)
+	    goto out;
+
+	ret = LDAP_principal2message(context, db, conn, principal,
+				     (flags & HDB_F_ADMIN_DATA) ?
+				     krb5kdcentry_attrs : krb5kdcentry_kdc_attrs,
+				     &msg);
+	if (ret)
+	    goto out;
+
+	e = ldap_first_entry(conn->lp, msg);
+	if (e == NULL) {
+	    ret = HDB_ERR_NOENTRY;
+	    goto out;
 	}
+
+	ret = LDAP_message2entry(context, db, conn->lp, e, flags, entry);
+	if (ret)
+	    goto out;
+
+	if (name)
+	    LDAP__cache_put(context, db, name, &entry->entry);
+    }
+
+    if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
+	ret = hdb_unseal_keys(context, db, &entry->entry);
+	if (ret)
+	    hdb_free_entry(context, entry);
     }
 
   out:
-    ldap_msgfree(msg);
+    if (msg)
+	ldap_msgfree(msg);
+    if (conn)
+	LDAP__put_conn(db, conn);
+    free(name);
 
     return ret;
 }
@@ -1671,6 +2089,7 @@ static krb5_error_code
 LDAP_store(krb5_context context, HDB * db, unsigned flags,
 	   hdb_entry_ex * entry)
 {
+    struct hdbldapconn *conn;
     LDAPMod **mods = NULL;
     krb5_error_code ret;
     const char *errfn;
@@ -1678,15 +2097,21 @@ LDAP_store(krb5_context context, HDB * db, unsigned flags,
     LDAPMessage *msg = NULL, *e = NULL;
     char *dn = NULL, *name = NULL;
 
-    ret = LDAP_principal2message(context, db, entry->entry.principal, &msg);
+    ret = LDAP__get_conn(context, db, 0, &conn);
+    if (ret)
+	return ret;
+
+    LDAP__cache_remove(context, db, entry->entry.principal);
+
+    ret = LDAP_principal2message(context, db, conn,
+				 entry->entry.principal, krb5kdcentry_attrs,
+				 &msg);
     if (ret == 0)
-	e = ldap_first_entry(HDB2LDAP(db), msg);
+	e = ldap_first_entry(conn->lp, msg);
 
     ret = krb5_unparse_name(context, entry->entry.principal, &name);
-    if (ret) {
-	free(name);
-	return ret;
-    }
+    if (ret)
+	goto out;
 
     ret = hdb_seal_keys(context, db, &entry->entry);
     if (ret)
@@ -1706,7 +2131,7 @@ LDAP_store(krb5_context context, HDB * db, unsigned flags,
 	}
     } else if (flags & HDB_F_REPLACE) {
 	/* Entry exists, and we're allowed to replace it. */
-	dn = ldap_get_dn(HDB2LDAP(db), e);
+	dn = ldap_get_dn(conn->lp, e);
     } else {
 	/* Entry exists, but we're not allowed to replace it. Bail. */
 	ret = HDB_ERR_EXISTS;
@@ -1716,17 +2141,17 @@ LDAP_store(krb5_context context, HDB * db, unsigned flags,
     /* write entry into directory */
     if (e == NULL) {
 	/* didn't exist before */
-	rc = ldap_add_ext_s(HDB2LDAP(db), dn, mods, NULL, NULL );
+	rc = ldap_add_ext_s(conn->lp, dn, mods, NULL, NULL );
 	errfn = "ldap_add_ext_s";
     } else {
 	/* already existed, send deltas only */
-	rc = ldap_modify_ext_s(HDB2LDAP(db), dn, mods, NULL, NULL );
+	rc = ldap_modify_ext_s(conn->lp, dn, mods, NULL, NULL );
 	errfn = "ldap_modify_ext_s";
     }
 
-    if (check_ldap(context, db, rc)) {
+    if (check_ldap(context, db, conn, rc)) {
 	char *ld_error = NULL;
-	ldap_get_option(HDB2LDAP(db), LDAP_OPT_ERROR_STRING,
+	ldap_get_option(conn->lp, LDAP_OPT_ERROR_STRING,
 			&ld_error);
 	ret = HDB_ERR_CANT_LOCK_DB;
 	krb5_set_error_message(context, ret, "%s: %s (DN=%s) %s: %s",
@@ -1744,6 +2169,7 @@ LDAP_store(krb5_context context, HDB * db, unsigned flags,
 	ldap_mods_free(mods, 1);
     if (name)
 	free(name);
+    LDAP__put_conn(db, conn);
 
     return ret;
 }
@@ -1751,28 +2177,36 @@ LDAP_store(krb5_context context, HDB * db, unsigned flags,
 static krb5_error_code
 LDAP_remove(krb5_context context, HDB *db, krb5_const_principal principal)
 {
+    struct hdbldapconn *conn;
     krb5_error_code ret;
-    LDAPMessage *msg, *e;
+    LDAPMessage *msg = NULL, *e;
     char *dn = NULL;
     int rc, limit = LDAP_NO_LIMIT;
 
-    ret = LDAP_principal2message(context, db, principal, &msg);
+    ret = LDAP__get_conn(context, db, 0, &conn);
+    if (ret)
+	return ret;
+
+    LDAP__cache_remove(context, db, principal);
+
+    ret = LDAP_principal2message(context, db, conn, principal,
+				 no_attrs, &msg);
     if (ret)
 	goto out;
 
-    e = ldap_first_entry(HDB2LDAP(db), msg);
+    e = ldap_first_entry(conn->lp, msg);
     if (e == NULL) {
 	ret = HDB_ERR_NOENTRY;
 	goto out;
     }
 
-    dn = ldap_get_dn(HDB2LDAP(db), e);
+    dn = ldap_get_dn(conn->lp, e);
     if (dn == NULL) {
 	ret = HDB_ERR_NOENTRY;
 	goto out;
     }
 
-    rc = ldap_set_option(HDB2LDAP(db), LDAP_OPT_SIZELIMIT, (const void *)&limit);
+    rc = ldap_set_option(conn->lp, LDAP_OPT_SIZELIMIT, (const void *)&limit);
     if (rc != LDAP_SUCCESS) {
 	ret = HDB_ERR_BADVERSION;
 	krb5_set_error_message(context, ret, "ldap_set_option: %s",
@@ -1780,8 +2214,8 @@ LDAP_remove(krb5_context context, HDB *db, krb5_const_principal principal)
 	goto out;
     }
 
-    rc = ldap_delete_ext_s(HDB2LDAP(db), dn, NULL, NULL );
-    if (check_ldap(context, db, rc)) {
+    rc = ldap_delete_ext_s(conn->lp, dn, NULL, NULL );
+    if (check_ldap(context, db, conn, rc)) {
 	ret = HDB_ERR_CANT_LOCK_DB;
 	krb5_set_error_message(context, ret, "ldap_delete_ext_s: %s",
 			       ldap_err2string(rc));
@@ -1793,6 +2227,7 @@ LDAP_remove(krb5_context context, HDB *db, krb5_const_principal principal)
 	free(dn);
     if (msg != NULL)
 	ldap_msgfree(msg);
+    LDAP__put_conn(db, conn);
 
     return ret;
 }
@@ -1800,11 +2235,20 @@ LDAP_remove(krb5_context context, HDB *db, krb5_const_principal principal)
 static krb5_error_code
 LDAP_destroy(krb5_context context, HDB * db)
 {
+    struct hdbldapdb *h = db->hdb_db;
     krb5_error_code ret;
+    size_t i;
 
     LDAP_close(context, db);
 
     ret = hdb_clear_master_key(context, db);
+    for (i = 0; i < h->h_cache_size; i++) {
+	free(h->h_cache[i].name);
+	krb5_data_free(&h->h_cache[i].value);
+    }
+    free(h->h_cache);
+    free(h->h_conn);
+    HEIMDAL_MUTEX_destroy(&h->h_mutex);
     if (HDB2BASE(db))
 	free(HDB2BASE(db));
     if (HDB2CREATE(db))
@@ -1876,8 +2320,33 @@ hdb_ldap_common(krb5_context context,
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
+    h->h_nconn = krb5_config_get_int_default(context, NULL, 1, "kdc",
+					     "hdb-ldap-connections", NULL);
+    if (h->h_nconn < 1)
+	h->h_nconn = 1;
+    h->h_conn = calloc(h->h_nconn, sizeof(h->h_conn[0]));
+    if (h->h_conn == NULL) {
+	free(h);
+	free(*db);
+	*db = NULL;
+	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	return ENOMEM;
+    }
+    HEIMDAL_MUTEX_init(&h->h_mutex);
     (*db)->hdb_db = h;
 
+    h->h_cache_ttl = krb5_config_get_time_default(context, NULL, 0, "kdc",
+						  "hdb-ldap-cache-ttl", NULL);
+    if (h->h_cache_ttl > 0) {
+	h->h_cache_size =
+	    krb5_config_get_int_default(context, NULL, 1024, "kdc",
+					"hdb-ldap-cache-size", NULL);
+	if (h->h_cache_size > 0)
+	    h->h_cache = calloc(h->h_cache_size, sizeof(h->h_cache[0]));
+	if (h->h_cache == NULL)
+	    h->h_cache_size = 0;
+    }
+
     /* XXX */
     if (asprintf(&(*db)->hdb_name, "ldap:%s", search_base) == -1) {
 	LDAP_destroy(context, *db);
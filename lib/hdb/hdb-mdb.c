@@ -39,35 +39,229 @@
 /* OpenLDAP MDB */
 
 #include <mdb.h>
+#include <heim_threads.h>
 
 #define	KILO	1024
 
+struct mdb_info;
+
+/*
+ * Per thread read state.  The env is opened MDB_NOTLS, so a read txn
+ * is not tied to a thread by LMDB, but it must not be used by two
+ * threads at once; each thread gets its own.
+ */
+
+typedef struct mdb_reader {
+    struct mdb_reader *next;
+    struct mdb_info *mi;
+    MDB_txn *rt;		/* cached read-only txn, reset when idle */
+    int rt_users;		/* lookups/iterations/snapshots using rt */
+    int borrow;			/* DB__get may hand out pointers into the map */
+    MDB_cursor *c;		/* iteration cursor, in rt */
+} mdb_reader;
+
 typedef struct mdb_info {
     MDB_env *e;
-    MDB_txn *t;
     MDB_dbi d;
-    MDB_cursor *c;
+    HEIMDAL_MUTEX mutex;	/* protects readers */
+    HEIMDAL_thread_key key;	/* this thread's mdb_reader */
+    int key_created;
+    mdb_reader *readers;
+    unsigned int eflags;	/* flags the env was opened with */
+    dev_t dev;
+    ino_t ino;
 } mdb_info;
 
+/*
+ * All read-only access goes through one cached transaction per
+ * handle and thread.  When idle it is only mdb_txn_reset(), so the
+ * next lookup is an mdb_txn_renew() instead of a full begin/abort
+ * cycle.  While it is in use (nested fetches, an iteration or an
+ * explicit snapshot) every read from that thread sees the same view
+ * of the database.
+ */
+
+static void
+reader_free(mdb_reader *r)
+{
+    if (r->c)
+	mdb_cursor_close(r->c);
+    if (r->rt)
+	mdb_txn_abort(r->rt);
+    free(r);
+}
+
+static void
+reader_destroy(void *ptr)
+{
+    mdb_reader *r = ptr, **rp;
+    mdb_info *mi;
+
+    if (r == NULL)
+	return;
+    mi = r->mi;
+    HEIMDAL_MUTEX_lock(&mi->mutex);
+    for (rp = &mi->readers; *rp != NULL; rp = &(*rp)->next) {
+	if (*rp == r) {
+	    *rp = r->next;
+	    break;
+	}
+    }
+    reader_free(r);
+    HEIMDAL_MUTEX_unlock(&mi->mutex);
+}
+
+static mdb_reader *
+reader_get(mdb_info *mi)
+{
+    mdb_reader *r;
+    int ret;
+
+    r = HEIMDAL_getspecific(mi->key);
+    if (r != NULL)
+	return r;
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+	return NULL;
+    r->mi = mi;
+    HEIMDAL_setspecific(mi->key, r, ret);
+    if (ret) {
+	free(r);
+	return NULL;
+    }
+    HEIMDAL_MUTEX_lock(&mi->mutex);
+    r->next = mi->readers;
+    mi->readers = r;
+    HEIMDAL_MUTEX_unlock(&mi->mutex);
+    return r;
+}
+
+static int
+read_begin(mdb_info *mi, mdb_reader **rp, MDB_txn **txn)
+{
+    mdb_reader *r;
+    int code;
+
+    *rp = r = reader_get(mi);
+    if (r == NULL)
+	return ENOMEM;
+    if (r->rt_users > 0) {
+	r->rt_users++;
+	*txn = r->rt;
+	return 0;
+    }
+    if (r->rt) {
+	code = mdb_txn_renew(r->rt);
+	if (code) {
+	    mdb_txn_abort(r->rt);
+	    r->rt = NULL;
+	}
+    }
+    if (r->rt == NULL) {
+	code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &r->rt);
+	if (code)
+	    return code;
+    }
+    r->rt_users = 1;
+    *txn = r->rt;
+    return 0;
+}
+
+static void
+read_end(mdb_reader *r)
+{
+    if (r == NULL || r->rt_users == 0)
+	return;
+    if (--r->rt_users == 0)
+	mdb_txn_reset(r->rt);
+}
+
+static void
+iter_end(mdb_reader *r)
+{
+    if (r && r->c) {
+	mdb_cursor_close(r->c);
+	r->c = NULL;
+	read_end(r);
+    }
+}
+
+/*
+ * Closing the env drops the read state of every thread; the readers
+ * themselves stay around for their threads to reuse.
+ */
+
+static void
+env_close(mdb_info *mi)
+{
+    mdb_reader *r;
+
+    HEIMDAL_MUTEX_lock(&mi->mutex);
+    for (r = mi->readers; r != NULL; r = r->next) {
+	if (r->c)
+	    mdb_cursor_close(r->c);
+	r->c = NULL;
+	if (r->rt)
+	    mdb_txn_abort(r->rt);
+	r->rt = NULL;
+	r->rt_users = 0;
+    }
+    HEIMDAL_MUTEX_unlock(&mi->mutex);
+    if (mi->e)
+	mdb_env_close(mi->e);
+    mi->e = NULL;
+}
+
+static int
+snapshot_held(mdb_info *mi)
+{
+    mdb_reader *r;
+    int held = 0;
+
+    HEIMDAL_MUTEX_lock(&mi->mutex);
+    for (r = mi->readers; r != NULL && !held; r = r->next)
+	held = r->rt_users > 0;
+    HEIMDAL_MUTEX_unlock(&mi->mutex);
+    return held;
+}
+
+/*
+ * The environment outlives hdb_close() so that callers that open and
+ * close the database around every lookup (like the KDC) don't pay for
+ * mdb_env_open() and the reader table setup each time.  Only the
+ * iteration cursor is released here; the env goes in DB_destroy().
+ */
+
 static krb5_error_code
 DB_close(krb5_context context, HDB *db)
 {
     mdb_info *mi = (mdb_info *)db->hdb_db;
 
-    mdb_cursor_close(mi->c);
-    mdb_txn_abort(mi->t);
-    mdb_env_close(mi->e);
-    mi->c = 0;
-    mi->t = 0;
-    mi->e = 0;
+    iter_end(HEIMDAL_getspecific(mi->key));
     return 0;
 }
 
 static krb5_error_code
 DB_destroy(krb5_context context, HDB *db)
 {
+    mdb_info *mi = (mdb_info *)db->hdb_db;
     krb5_error_code ret;
+    mdb_reader *r;
+
+    env_close(mi);
+    if (mi->key_created) {
+	int code;
 
+	/* the other threads' readers are freed from the list below */
+	HEIMDAL_setspecific(mi->key, NULL, code);
+	(void) code;
+	HEIMDAL_key_delete(mi->key);
+    }
+    while ((r = mi->readers) != NULL) {
+	mi->readers = r->next;
+	reader_free(r);
+    }
+    HEIMDAL_MUTEX_destroy(&mi->mutex);
     ret = hdb_clear_master_key (context, db);
     free(db->hdb_name);
     free(db->hdb_db);
@@ -100,15 +294,21 @@ DB_seq(krb5_context context, HDB *db,
        unsigned flags, hdb_entry_ex *entry, int flag)
 {
     mdb_info *mi = db->hdb_db;
+    mdb_reader *r = HEIMDAL_getspecific(mi->key);
     MDB_val key, value;
     krb5_data key_data, data;
     int code;
 
+    if (r == NULL || r->c == NULL)
+	return HDB_ERR_NOENTRY;
+
     key.mv_size = 0;
     value.mv_size = 0;
-    code = mdb_cursor_get(mi->c, &key, &value, flag);
-    if (code == MDB_NOTFOUND)
+    code = mdb_cursor_get(r->c, &key, &value, flag);
+    if (code == MDB_NOTFOUND) {
+	iter_end(r);
 	return HDB_ERR_NOENTRY;
+    }
     if (code)
 	return code;
 
@@ -142,19 +342,26 @@ static krb5_error_code
 DB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 {
     mdb_info *mi = db->hdb_db;
+    mdb_reader *r;
+    MDB_txn *txn;
     int code;
 
-    /* Always start with a fresh cursor to pick up latest DB state */
-    if (mi->t)
-	mdb_txn_abort(mi->t);
+    /*
+     * Restart any previous iteration; unless a snapshot is held this
+     * picks up the latest DB state.
+     */
+    iter_end(HEIMDAL_getspecific(mi->key));
 
-    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->t);
+    code = read_begin(mi, &r, &txn);
     if (code)
 	return code;
 
-    code = mdb_cursor_open(mi->t, mi->d, &mi->c);
-    if (code)
+    code = mdb_cursor_open(txn, mi->d, &r->c);
+    if (code) {
+	r->c = NULL;
+	read_end(r);
 	return code;
+    }
 
     return DB_seq(context, db, flags, entry, MDB_FIRST);
 }
@@ -178,6 +385,7 @@ DB_rename(krb5_context context, HDB *db, const char *new_name)
 		free(old);
 		return ENOMEM;
 	}
+    env_close(db->hdb_db);
     ret = rename(old, new);
     free(old);
     free(new);
@@ -189,10 +397,17 @@ DB_rename(krb5_context context, HDB *db, const char *new_name)
     return 0;
 }
 
+/*
+ * When borrow is set (only from DB_fetch_kvno, which holds this
+ * thread's read txn across the whole fetch) the reply points straight
+ * into the map and must not be freed by the caller.
+ */
+
 static krb5_error_code
 DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
     mdb_info *mi = (mdb_info*)db->hdb_db;
+    mdb_reader *r;
     MDB_txn *txn;
     MDB_val k, v;
     int code;
@@ -200,19 +415,72 @@ DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
-    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    code = read_begin(mi, &r, &txn);
     if (code)
 	return code;
 
     code = mdb_get(txn, mi->d, &k, &v);
-    if (code == 0)
-	krb5_data_copy(reply, v.mv_data, v.mv_size);
-    mdb_txn_abort(txn);
+    if (code == 0 && r->borrow) {
+	reply->data = v.mv_data;
+	reply->length = v.mv_size;
+    } else if (code == 0) {
+	code = krb5_data_copy(reply, v.mv_data, v.mv_size);
+    }
+    read_end(r);
     if(code == MDB_NOTFOUND)
 	return HDB_ERR_NOENTRY;
     return code;
 }
 
+static krb5_error_code
+DB_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+	      unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_error_code ret;
+    mdb_reader *r;
+    MDB_txn *txn;
+
+    ret = read_begin(mi, &r, &txn);
+    if (ret)
+	return ret;
+    r->borrow++;
+    ret = _hdb_fetch_kvno_borrowed(context, db, principal, flags, kvno, entry);
+    r->borrow--;
+    read_end(r);
+    return ret;
+}
+
+static krb5_error_code
+DB_snapshot_begin(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    mdb_reader *r;
+    MDB_txn *txn;
+    int code;
+
+    if (mi->e == NULL) {
+	krb5_set_error_message(context, HDB_ERR_MISUSE,
+			       "snapshot of %s requested before open",
+			       db->hdb_name);
+	return HDB_ERR_MISUSE;
+    }
+    code = read_begin(mi, &r, &txn);
+    if (code)
+	krb5_set_error_message(context, code, "snapshot of %s: %s",
+			       db->hdb_name, mdb_strerror(code));
+    return code;
+}
+
+static krb5_error_code
+DB_snapshot_end(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+
+    read_end(HEIMDAL_getspecific(mi->key));
+    return 0;
+}
+
 static krb5_error_code
 DB__put(krb5_context context, HDB *db, int replace,
 	krb5_data key, krb5_data value)
@@ -273,7 +541,8 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
     MDB_txn *txn;
     char *fn;
     krb5_error_code ret;
-    int myflags = MDB_NOSUBDIR, tmp;
+    struct stat st;
+    int myflags = MDB_NOSUBDIR | MDB_NOTLS, tmp;
 
     if((flags & O_ACCMODE) == O_RDONLY)
       myflags |= MDB_RDONLY;
@@ -282,6 +551,26 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
+
+    /*
+     * Reuse the env from a previous open unless we now want to write
+     * through a read-only env or the file was replaced underneath us.
+     */
+    if (mi->e) {
+	if (((mi->eflags & MDB_RDONLY) == 0 || (myflags & MDB_RDONLY)) &&
+	    stat(fn, &st) == 0 && st.st_dev == mi->dev && st.st_ino == mi->ino) {
+	    free(fn);
+	    return 0;
+	}
+	if (snapshot_held(mi)) {
+	    free(fn);
+	    krb5_set_error_message(context, HDB_ERR_MISUSE,
+				   "can't reopen %s while a snapshot is held",
+				   db->hdb_name);
+	    return HDB_ERR_MISUSE;
+	}
+	env_close(mi);
+    }
     if (mdb_env_create(&mi->e)) {
 	free(fn);
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
@@ -322,7 +611,13 @@ fail:
 			      db->hdb_name, mdb_strerror(ret));
 	return ret;
     }
+    if (stat(fn, &st) == 0) {
+	mi->dev = st.st_dev;
+	mi->ino = st.st_ino;
+    }
+    mi->eflags = myflags;
     free(fn);
+    fn = NULL;
 
     ret = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
     if (ret)
@@ -340,7 +635,7 @@ fail:
     if(ret == HDB_ERR_NOENTRY)
 	return 0;
     if (ret) {
-	DB_close(context, db);
+	env_close(mi);
 	krb5_set_error_message(context, ret, "hdb_open: failed %s database %s",
 			       (flags & O_ACCMODE) == O_RDONLY ?
 			       "checking format of" : "initialize",
@@ -354,21 +649,36 @@ krb5_error_code
 hdb_mdb_create(krb5_context context, HDB **db,
 	      const char *filename)
 {
+    mdb_info *mi;
+    int ret;
+
     *db = calloc(1, sizeof(**db));
     if (*db == NULL) {
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
 
-    (*db)->hdb_db = calloc(1, sizeof(mdb_info));
+    (*db)->hdb_db = mi = calloc(1, sizeof(mdb_info));
     if ((*db)->hdb_db == NULL) {
 	free(*db);
 	*db = NULL;
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
+    HEIMDAL_key_create(&mi->key, reader_destroy, ret);
+    if (ret) {
+	free(mi);
+	free(*db);
+	*db = NULL;
+	krb5_set_error_message(context, ret, "hdb-mdb: can't create thread key");
+	return ret;
+    }
+    mi->key_created = 1;
+    HEIMDAL_MUTEX_init(&mi->mutex);
     (*db)->hdb_name = strdup(filename);
     if ((*db)->hdb_name == NULL) {
+	HEIMDAL_key_delete(mi->key);
+	HEIMDAL_MUTEX_destroy(&mi->mutex);
 	free((*db)->hdb_db);
 	free(*db);
 	*db = NULL;
@@ -377,10 +687,11 @@ hdb_mdb_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags =
+	HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL | HDB_CAP_F_SNAPSHOT;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
-    (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
+    (*db)->hdb_fetch_kvno = DB_fetch_kvno;
     (*db)->hdb_store = _hdb_store;
     (*db)->hdb_remove = _hdb_remove;
     (*db)->hdb_firstkey = DB_firstkey;
@@ -392,6 +703,8 @@ hdb_mdb_create(krb5_context context, HDB **db,
     (*db)->hdb__put = DB__put;
     (*db)->hdb__del = DB__del;
     (*db)->hdb_destroy = DB_destroy;
+    (*db)->hdb_snapshot_begin = DB_snapshot_begin;
+    (*db)->hdb_snapshot_end = DB_snapshot_end;
     return 0;
 }
 #endif /* HAVE_MDB */
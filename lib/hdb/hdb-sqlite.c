@@ -33,13 +33,31 @@
 
 #include "hdb_locl.h"
 #include "sqlite3.h"
+#include <heim_threads.h>
 
 #define MAX_RETRIES 10
 
+/*
+ * Read-only connections used for fetches, each with its own prepared
+ * fetch statement.  A reader is only ever used by one thread at a
+ * time, the mutex is held for the whole lookup.
+ */
+struct hdb_sqlite_reader {
+    HEIMDAL_MUTEX mutex;
+    sqlite3 *db;
+    sqlite3_stmt *fetch;
+};
+
 typedef struct hdb_sqlite_db {
     double version;
     sqlite3 *db;
     char *db_file;
+    int wal;
+
+    struct hdb_sqlite_reader *readers;
+    size_t nreaders;
+    size_t nextreader;
+    HEIMDAL_MUTEX reader_mutex;
 
     sqlite3_stmt *get_version;
     sqlite3_stmt *fetch;
@@ -207,6 +225,26 @@ bind_principal(krb5_context context, krb5_const_principal principal, sqlite3_stm
     return 0;
 }
 
+/**
+ * Switch a connection to write-ahead logging.  Readers then work on
+ * a snapshot and are never blocked by a writer (nor block it), so the
+ * KDC keeps answering while kadmind commits.  The journal mode is
+ * persistent in the database file; the busy timeout lets SQLite wait
+ * out the rare checkpoint/writer conflicts before our retry loops.
+ *
+ * @param context The current krb5 context
+ * @param db      An open sqlite3 database handle
+ */
+static void
+hdb_sqlite_set_wal(krb5_context context, sqlite3 *db)
+{
+    sqlite3_busy_timeout(db, 5000);
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK)
+        krb5_warnx(context, "hdb-sqlite: failed to enable WAL: %s",
+                   sqlite3_errmsg(db));
+    sqlite3_exec(db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+}
+
 /**
  * Opens an sqlite3 database handle to a file, may create the
  * database file depending on flags.
@@ -238,6 +276,9 @@ hdb_sqlite_open_database(krb5_context context, HDB *db, int flags)
         return ret;
     }
 
+    if (hsdb->wal)
+        hdb_sqlite_set_wal(context, hsdb->db);
+
     return 0;
 }
 
@@ -257,6 +298,90 @@ hdb_sqlite_step(krb5_context context, sqlite3 *db, sqlite3_stmt *stmt)
     return ret;
 }
 
+/**
+ * Picks a reader connection round robin and locks it, opening it on
+ * first use.  Returns with *reader set to NULL (and nothing locked)
+ * when no reader pool is configured, in which case the main
+ * connection is to be used.
+ *
+ * @param context The current krb5 context
+ * @param db      Heimdal database handle
+ * @param reader  The locked reader, release with hdb_sqlite_put_reader()
+ *
+ * @return        0 if OK, an error code if not
+ */
+static krb5_error_code
+hdb_sqlite_get_reader(krb5_context context, HDB *db,
+                      struct hdb_sqlite_reader **reader)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    struct hdb_sqlite_reader *r;
+    krb5_error_code ret;
+
+    *reader = NULL;
+    if (hsdb->nreaders == 0)
+        return 0;
+
+    HEIMDAL_MUTEX_lock(&hsdb->reader_mutex);
+    r = &hsdb->readers[hsdb->nextreader];
+    hsdb->nextreader = (hsdb->nextreader + 1) % hsdb->nreaders;
+    HEIMDAL_MUTEX_unlock(&hsdb->reader_mutex);
+
+    HEIMDAL_MUTEX_lock(&r->mutex);
+    if (r->db == NULL) {
+        ret = sqlite3_open_v2(hsdb->db_file, &r->db,
+                              SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                              NULL);
+        if (ret) {
+            ret = ENOENT;
+            krb5_set_error_message(context, ret,
+                                   "Error opening sqlite reader %s: %s",
+                                   hsdb->db_file,
+                                   r->db ? sqlite3_errmsg(r->db) : "no memory");
+            goto fail;
+        }
+        sqlite3_busy_timeout(r->db, 5000);
+        ret = hdb_sqlite_prepare_stmt(context, r->db, &r->fetch,
+                                      HDBSQLITE_FETCH);
+        if (ret)
+            goto fail;
+    }
+    *reader = r;
+    return 0;
+
+ fail:
+    if (r->db)
+        sqlite3_close(r->db);
+    r->db = NULL;
+    HEIMDAL_MUTEX_unlock(&r->mutex);
+    return ret;
+}
+
+static void
+hdb_sqlite_put_reader(struct hdb_sqlite_reader *reader)
+{
+    if (reader)
+        HEIMDAL_MUTEX_unlock(&reader->mutex);
+}
+
+static void
+hdb_sqlite_close_readers(hdb_sqlite_db *hsdb)
+{
+    size_t i;
+
+    for (i = 0; i < hsdb->nreaders; i++) {
+        struct hdb_sqlite_reader *r = &hsdb->readers[i];
+
+        HEIMDAL_MUTEX_lock(&r->mutex);
+        sqlite3_finalize(r->fetch);
+        r->fetch = NULL;
+        if (r->db)
+            sqlite3_close(r->db);
+        r->db = NULL;
+        HEIMDAL_MUTEX_unlock(&r->mutex);
+    }
+}
+
 /**
  * Closes the database and frees memory allocated for statements.
  *
@@ -279,6 +404,7 @@ hdb_sqlite_close_database(krb5_context context, HDB *db)
     sqlite3_finalize(hsdb->remove);
     sqlite3_finalize(hsdb->get_all_entries);
 
+    hdb_sqlite_close_readers(hsdb);
     sqlite3_close(hsdb->db);
 
     return 0;
@@ -409,7 +535,9 @@ hdb_sqlite_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal princi
     int sqlite_error;
     krb5_error_code ret;
     hdb_sqlite_db *hsdb = (hdb_sqlite_db*)(db->hdb_db);
+    struct hdb_sqlite_reader *reader;
     sqlite3_stmt *fetch = hsdb->fetch;
+    sqlite3 *conn = hsdb->db;
     krb5_data value;
     krb5_principal enterprise_principal = NULL;
 
@@ -428,13 +556,24 @@ hdb_sqlite_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal princi
 	principal = enterprise_principal;
     }
 
-    ret = bind_principal(context, principal, fetch, 1);
-    if (ret)
+    ret = hdb_sqlite_get_reader(context, db, &reader);
+    if (ret) {
+	krb5_free_principal(context, enterprise_principal);
 	return ret;
+    }
+    if (reader) {
+	conn = reader->db;
+	fetch = reader->fetch;
+    }
 
+    ret = bind_principal(context, principal, fetch, 1);
     krb5_free_principal(context, enterprise_principal);
+    if (ret) {
+	hdb_sqlite_put_reader(reader);
+	return ret;
+    }
 
-    sqlite_error = hdb_sqlite_step(context, hsdb->db, fetch);
+    sqlite_error = hdb_sqlite_step(context, conn, fetch);
     if (sqlite_error != SQLITE_ROW) {
         if(sqlite_error == SQLITE_DONE) {
             ret = HDB_ERR_NOENTRY;
@@ -469,7 +608,7 @@ out:
 
     sqlite3_clear_bindings(fetch);
     sqlite3_reset(fetch);
-
+    hdb_sqlite_put_reader(reader);
 
     return ret;
 }
@@ -684,6 +823,7 @@ static krb5_error_code
 hdb_sqlite_destroy(krb5_context context, HDB *db)
 {
     int ret;
+    size_t i;
     hdb_sqlite_db *hsdb;
 
     ret = hdb_clear_master_key(context, db);
@@ -692,6 +832,10 @@ hdb_sqlite_destroy(krb5_context context, HDB *db)
 
     hsdb = (hdb_sqlite_db*)(db->hdb_db);
 
+    for (i = 0; i < hsdb->nreaders; i++)
+        HEIMDAL_MUTEX_destroy(&hsdb->readers[i].mutex);
+    HEIMDAL_MUTEX_destroy(&hsdb->reader_mutex);
+    free(hsdb->readers);
     free(hsdb->db_file);
     free(db->hdb_db);
     free(db);
@@ -842,6 +986,8 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *argument)
 {
     krb5_error_code ret;
     hdb_sqlite_db *hsdb;
+    size_t i;
+    int rv;
 
     *db = calloc(1, sizeof (**db));
     if (*db == NULL)
@@ -856,9 +1002,31 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *argument)
 
     (*db)->hdb_db = hsdb;
 
+    hsdb->wal = krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+                                             "hdb-sqlite-wal", NULL);
+    rv = krb5_config_get_int_default(context, NULL, 0, "kdc",
+                                     "hdb-sqlite-readers", NULL);
+    if (rv > 0) {
+        hsdb->readers = calloc(rv, sizeof(hsdb->readers[0]));
+        if (hsdb->readers == NULL) {
+            free(hsdb);
+            free(*db);
+            *db = NULL;
+            return krb5_enomem(context);
+        }
+        hsdb->nreaders = rv;
+        for (i = 0; i < hsdb->nreaders; i++)
+            HEIMDAL_MUTEX_init(&hsdb->readers[i].mutex);
+    }
+    HEIMDAL_MUTEX_init(&hsdb->reader_mutex);
+
     /* XXX make_database should make sure everything else is freed on error */
     ret = hdb_sqlite_make_database(context, *db, argument);
     if (ret) {
+        for (i = 0; i < hsdb->nreaders; i++)
+            HEIMDAL_MUTEX_destroy(&hsdb->readers[i].mutex);
+        HEIMDAL_MUTEX_destroy(&hsdb->reader_mutex);
+        free(hsdb->readers);
         free((*db)->hdb_db);
         free(*db);
 
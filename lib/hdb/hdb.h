@@ -70,6 +70,7 @@ enum hdb_lockop{ HDB_RLOCK, HDB_WLOCK };
 #define HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL 1
 #define HDB_CAP_F_HANDLE_PASSWORDS	2
 #define HDB_CAP_F_PASSWORD_UPDATE_KEYS	4
+#define HDB_CAP_F_SNAPSHOT		8
 
 /* auth status values */
 #define HDB_AUTH_SUCCESS		0
@@ -261,6 +262,23 @@ typedef struct HDB {
      * Check if s4u2self is allowed from this client to this server
      */
     krb5_error_code (*hdb_check_s4u2self)(krb5_context, struct HDB *, hdb_entry_ex *, krb5_const_principal);
+
+    /**
+     * Begin a read snapshot.
+     *
+     * All fetches until the matching ->hdb_snapshot_end() see the
+     * same consistent view of the database, even across
+     * ->hdb_close()/->hdb_open().  Calls may nest.  This call is
+     * optional to support, and these two members are only present
+     * when HDB_CAP_F_SNAPSHOT is set in hdb_capability_flags, so
+     * that backends built against the older, shorter struct keep
+     * working.
+     */
+    krb5_error_code (*hdb_snapshot_begin)(krb5_context, struct HDB *);
+    /**
+     * End a read snapshot started with ->hdb_snapshot_begin().
+     */
+    krb5_error_code (*hdb_snapshot_end)(krb5_context, struct HDB *);
 }HDB;
 
 #define HDB_INTERFACE_VERSION	8
@@ -65,6 +65,8 @@ struct hx509_verify_ctx_data {
     hx509_revoke_ctx revoke_ctx;
 };
 
+static void path_cache_free(struct hx509_path_cache *);
+
 #define REQUIRE_RFC3280(ctx) ((ctx)->flags & HX509_VERIFY_CTX_F_REQUIRE_RFC3280)
 #define CHECK_TA(ctx) ((ctx)->flags & HX509_VERIFY_CTX_F_CHECK_TRUST_ANCHORS)
 #define ALLOW_DEF_TA(ctx) (((ctx)->flags & HX509_VERIFY_CTX_F_NO_DEFAULT_ANCHORS) == 0)
@@ -187,6 +189,9 @@ hx509_context_free(hx509_context *context)
     free_error_table ((*context)->et_list);
     if ((*context)->querystat)
 	free((*context)->querystat);
+    if ((*context)->path_cache)
+	path_cache_free((*context)->path_cache);
+    _hx509_sig_pool_free(*context);
     memset(*context, 0, sizeof(**context));
     free(*context);
     *context = NULL;
@@ -1971,6 +1976,307 @@ free_name_constraints(hx509_name_constraints *nc)
     free(nc->val);
 }
 
+/*
+ * Cache of successfully verified paths, kept on the hx509 context so
+ * it outlives the verify contexts that are usually created per
+ * request (the KDC makes one for each PKINIT request).
+ *
+ * An entry is keyed on the end entity certificate and remembers the
+ * trust anchor the path ended in, the verify context settings and the
+ * generation of the revocation data it was checked against.  It is
+ * only used while the time being verified is within the validity of
+ * all certificates in the path and before the earliest nextUpdate of
+ * the revocation data, and only if the anchor is still one of the
+ * trust anchors.  A hit skips path building, the constraint checks,
+ * the revocation checks and the signature verifications.
+ *
+ * Paths with proxy certificates are not cached since verifying them
+ * also sets the base name on the certificate.
+ */
+
+struct path_cache_entry {
+    struct path_cache_entry *next;	/* hash chain */
+    struct path_cache_entry *prev_lru, *next_lru;
+    uint32_t hash;
+    hx509_cert cert;
+    hx509_cert anchor;
+    int flags;
+    unsigned int max_depth;
+    int context_flags;
+    unsigned long revoke_generation;
+    time_t not_before;
+    time_t not_after;
+};
+
+struct hx509_path_cache {
+    struct path_cache_entry **buckets;
+    size_t size;			/* power of two */
+    struct path_cache_entry *head, *tail; /* most recently used first */
+    size_t len;
+    size_t max;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct path_cache_key {
+    uint32_t hash;
+    unsigned long revoke_generation;
+    time_t revoke_expire;
+};
+
+static uint32_t
+path_cache_hash(const Certificate *c)
+{
+    const unsigned char *p = c->signatureValue.data;
+    size_t i, len = c->signatureValue.length / 8;
+    uint32_t h = 2166136261U;
+
+    for (i = 0; i < len; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static void
+path_cache_unlink(struct hx509_path_cache *pc, struct path_cache_entry *e)
+{
+    struct path_cache_entry **pe;
+
+    for (pe = &pc->buckets[e->hash & (pc->size - 1)]; *pe; pe = &(*pe)->next) {
+	if (*pe == e) {
+	    *pe = e->next;
+	    break;
+	}
+    }
+    if (e->prev_lru)
+	e->prev_lru->next_lru = e->next_lru;
+    else
+	pc->head = e->next_lru;
+    if (e->next_lru)
+	e->next_lru->prev_lru = e->prev_lru;
+    else
+	pc->tail = e->prev_lru;
+    pc->len--;
+
+    hx509_cert_free(e->cert);
+    hx509_cert_free(e->anchor);
+    free(e);
+}
+
+static void
+path_cache_touch(struct hx509_path_cache *pc, struct path_cache_entry *e)
+{
+    if (pc->head == e)
+	return;
+    e->prev_lru->next_lru = e->next_lru;
+    if (e->next_lru)
+	e->next_lru->prev_lru = e->prev_lru;
+    else
+	pc->tail = e->prev_lru;
+    e->prev_lru = NULL;
+    e->next_lru = pc->head;
+    pc->head->prev_lru = e;
+    pc->head = e;
+}
+
+static void
+path_cache_free(struct hx509_path_cache *pc)
+{
+    while (pc->head)
+	path_cache_unlink(pc, pc->head);
+    free(pc->buckets);
+    free(pc);
+}
+
+/*
+ * Look up the certificate, returns 0 on a hit.  The key is filled in
+ * for path_cache_add() on a miss.
+ */
+
+static int
+path_cache_lookup(hx509_context context, hx509_verify_ctx ctx,
+		  hx509_cert cert, hx509_certs anchors,
+		  struct path_cache_key *key)
+{
+    struct hx509_path_cache *pc = context->path_cache;
+    struct path_cache_entry *e, *next;
+    hx509_query q;
+    hx509_cert found;
+    int ret;
+
+    key->hash = path_cache_hash(cert->data);
+    key->revoke_generation = 0;
+    key->revoke_expire = 0;
+    if (ctx->revoke_ctx)
+	_hx509_revoke_state(context, ctx->revoke_ctx,
+			    &key->revoke_generation, &key->revoke_expire);
+
+    for (e = pc->buckets[key->hash & (pc->size - 1)]; e; e = next) {
+	next = e->next;
+
+	if (e->hash != key->hash ||
+	    _hx509_Certificate_cmp(e->cert->data, cert->data) != 0)
+	    continue;
+
+	/* revocation data only moves forward */
+	if (e->revoke_generation != key->revoke_generation) {
+	    path_cache_unlink(pc, e);
+	    continue;
+	}
+	if (e->not_after != 0 && e->not_after < ctx->time_now) {
+	    /* a caller set time might go back, the clock doesn't */
+	    if ((ctx->flags & HX509_VERIFY_CTX_F_TIME_SET) == 0)
+		path_cache_unlink(pc, e);
+	    continue;
+	}
+	if (e->not_before > ctx->time_now ||
+	    e->flags != ctx->flags ||
+	    e->max_depth != ctx->max_depth ||
+	    e->context_flags != context->flags)
+	    continue;
+
+	_hx509_query_clear(&q);
+	q.match = HX509_QUERY_MATCH_CERTIFICATE;
+	q.certificate = e->anchor->data;
+
+	ret = hx509_certs_find(context, anchors, &q, &found);
+	if (ret)
+	    continue;
+	hx509_cert_free(found);
+
+	path_cache_touch(pc, e);
+	pc->hits++;
+	hx509_clear_error_string(context);
+	return 0;
+    }
+
+    pc->misses++;
+    hx509_clear_error_string(context);
+    return HX509_CERT_NOT_FOUND;
+}
+
+static void
+path_cache_add(hx509_context context, hx509_verify_ctx ctx,
+	       const struct path_cache_key *key, hx509_path *path)
+{
+    struct hx509_path_cache *pc = context->path_cache;
+    struct path_cache_entry *e;
+    size_t i;
+    time_t t;
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+	return;
+
+    e->hash = key->hash;
+    e->flags = ctx->flags;
+    e->max_depth = ctx->max_depth;
+    e->context_flags = context->flags;
+    e->revoke_generation = key->revoke_generation;
+    e->not_before = 0;
+    e->not_after = key->revoke_expire;	/* 0 is no limit */
+
+    /* same validity checks as hx509_verify_path() */
+    for (i = 0; i < path->len; i++) {
+	Certificate *c = _hx509_get_cert(path->val[i]);
+
+	if (i + 1 == path->len && !CHECK_TA(ctx))
+	    continue;
+	t = _hx509_Time2time_t(&c->tbsCertificate.validity.notBefore);
+	if (t > e->not_before)
+	    e->not_before = t;
+	t = _hx509_Time2time_t(&c->tbsCertificate.validity.notAfter);
+	if (e->not_after == 0 || t < e->not_after)
+	    e->not_after = t;
+    }
+
+    e->cert = hx509_cert_ref(path->val[0]);
+    e->anchor = hx509_cert_ref(path->val[path->len - 1]);
+
+    e->next = pc->buckets[e->hash & (pc->size - 1)];
+    pc->buckets[e->hash & (pc->size - 1)] = e;
+    e->next_lru = pc->head;
+    if (pc->head)
+	pc->head->prev_lru = e;
+    else
+	pc->tail = e;
+    pc->head = e;
+    pc->len++;
+
+    while (pc->len > pc->max)
+	path_cache_unlink(pc, pc->tail);
+}
+
+/**
+ * Keep a cache of up to max_entries successfully verified paths in
+ * the context, so that verifying the same certificate again, for
+ * example a smartcard doing PKINIT, skips building and checking the
+ * path.  A max_entries of zero turns the cache off and drops it.
+ *
+ * @param context hx509 context to change.
+ * @param max_entries number of paths to remember.
+ *
+ * @return An hx509 error code, see hx509_get_error_string().
+ *
+ * @ingroup hx509_verify
+ */
+
+int
+hx509_context_set_path_cache(hx509_context context, size_t max_entries)
+{
+    struct hx509_path_cache *pc;
+    size_t size;
+
+    if (context->path_cache) {
+	path_cache_free(context->path_cache);
+	context->path_cache = NULL;
+    }
+    if (max_entries == 0)
+	return 0;
+
+    pc = calloc(1, sizeof(*pc));
+    if (pc == NULL) {
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    for (size = 16; size < max_entries && size < ((size_t)1 << 20); size <<= 1)
+	;
+    pc->buckets = calloc(size, sizeof(pc->buckets[0]));
+    if (pc->buckets == NULL) {
+	free(pc);
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    pc->size = size;
+    pc->max = max_entries;
+    context->path_cache = pc;
+    return 0;
+}
+
+/**
+ * Return the number of hits and misses of the path cache since it was
+ * set up with hx509_context_set_path_cache().
+ *
+ * @param context hx509 context.
+ * @param hits number of verifications answered from the cache.
+ * @param misses number of verifications that had to check the path.
+ *
+ * @ingroup hx509_verify
+ */
+
+void
+hx509_context_get_path_cache_stats(hx509_context context,
+				   unsigned long *hits,
+				   unsigned long *misses)
+{
+    if (context->path_cache) {
+	*hits = context->path_cache->hits;
+	*misses = context->path_cache->misses;
+    } else {
+	*hits = 0;
+	*misses = 0;
+    }
+}
+
 /**
  * Build and verify the path for the certificate to the trust anchor
  * specified in the verify context. The path is constructed from the
@@ -1999,6 +2305,8 @@ hx509_verify_path(hx509_context context,
     enum certtype type;
     Name proxy_issuer;
     hx509_certs anchors = NULL;
+    struct hx509_sig_batch *batch = NULL;
+    struct path_cache_key key;
 
     memset(&proxy_issuer, 0, sizeof(proxy_issuer));
 
@@ -2035,6 +2343,12 @@ hx509_verify_path(hx509_context context,
 	    goto out;
     }
 
+    if (context->path_cache) {
+	ret = path_cache_lookup(context, ctx, cert, anchors, &key);
+	if (ret == 0)
+	    goto out;
+    }
+
     /*
      * Calculate the path from the certificate user presented to the
      * to an anchor.
@@ -2341,8 +2655,14 @@ hx509_verify_path(hx509_context context,
     /*
      * Verify signatures, do this backward so public key working
      * parameter is passed up from the anchor up though the chain.
+     * The checks are collected and run as a batch, in parallel if
+     * the context has verify threads.
      */
 
+    ret = _hx509_sig_batch_init(context, HX509_SIG_BATCH_ABORT, &batch);
+    if (ret)
+	goto out;
+
     for (k = path.len; k > 0; k--) {
 	hx509_cert signer;
 	Certificate *c;
@@ -2369,29 +2689,44 @@ hx509_verify_path(hx509_context context,
 	}
 
 	/* verify signatureValue */
-	ret = _hx509_verify_signature_bitstring(context,
-						signer,
-						&c->signatureAlgorithm,
-						&c->tbsCertificate._save,
-						&c->signatureValue);
-	if (ret) {
-	    hx509_set_error_string(context, HX509_ERROR_APPEND, ret,
-				   "Failed to verify signature of certificate");
+	ret = _hx509_sig_batch_add_bitstring(context,
+					     batch,
+					     signer,
+					     &c->signatureAlgorithm,
+					     &c->tbsCertificate._save,
+					     &c->signatureValue,
+					     NULL);
+	if (ret)
 	    goto out;
-	}
-	/*
-	 * Verify that the sigature algorithm is not weak. Ignore
-	 * trust anchors since they are provisioned by the user.
-	 */
+    }
+
+    ret = _hx509_sig_batch_run(context, batch);
+    if (ret) {
+	hx509_set_error_string(context, HX509_ERROR_APPEND, ret,
+			       "Failed to verify signature of certificate");
+	goto out;
+    }
+
+    /*
+     * Verify that the sigature algorithms are not weak. Ignore
+     * trust anchors since they are provisioned by the user.
+     */
+
+    if ((ctx->flags & HX509_VERIFY_CTX_F_NO_BEST_BEFORE_CHECK) == 0) {
+	for (k = path.len; k > 1; k--) {
+	    Certificate *c = _hx509_get_cert(path.val[k - 2]);
 
-	if (i + 1 != path.len && (ctx->flags & HX509_VERIFY_CTX_F_NO_BEST_BEFORE_CHECK) == 0) {
 	    ret = _hx509_signature_is_weak(context, &c->signatureAlgorithm);
 	    if (ret)
 		goto out;
 	}
     }
 
+    if (context->path_cache && proxy_cert_depth == 0)
+	path_cache_add(context, ctx, &key, &path);
+
 out:
+    _hx509_sig_batch_free(&batch);
     hx509_certs_free(&anchors);
     free_Name(&proxy_issuer);
     free_name_constraints(&nc);
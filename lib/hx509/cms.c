@@ -761,6 +761,15 @@ find_attribute(const CMSAttributes *attr, const heim_oid *oid)
     return NULL;
 }
 
+struct cms_signer {
+    hx509_cert cert;
+    heim_octet_string signed_data;
+    int free_data;
+    size_t job;
+    int ret;
+    char *error;
+};
+
 /**
  * Decode SignedData and verify that the signature is correct.
  *
@@ -798,6 +807,8 @@ hx509_cms_verify_signed(hx509_context context,
     SignerInfo *signer_info;
     hx509_cert cert = NULL;
     hx509_certs certs = NULL;
+    struct hx509_sig_batch *batch = NULL;
+    struct cms_signer *signers = NULL;
     SignedData sd;
     size_t size;
     int ret, found_valid_sig;
@@ -862,8 +873,26 @@ hx509_cms_verify_signed(hx509_context context,
 	    goto out;
     }
 
-    for (found_valid_sig = 0, i = 0; i < sd.signerInfos.len; i++) {
-	heim_octet_string signed_data;
+    /*
+     * First check each signer up to its signature and queue the
+     * signatures in a batch, then run the batch and validate the
+     * certificates of the signers whose signature was good.
+     */
+
+    ret = _hx509_sig_batch_init(context, 0, &batch);
+    if (ret)
+	goto out;
+    if (sd.signerInfos.len) {
+	signers = calloc(sd.signerInfos.len, sizeof(signers[0]));
+	if (signers == NULL) {
+	    ret = ENOMEM;
+	    hx509_set_error_string(context, 0, ret, "malloc: out of memory");
+	    goto out;
+	}
+    }
+
+    for (i = 0; i < sd.signerInfos.len; i++) {
+	heim_octet_string *signed_data = &signers[i].signed_data;
 	const heim_oid *match_oid;
 	heim_oid decode_oid;
 
@@ -875,7 +904,7 @@ hx509_cms_verify_signed(hx509_context context,
 	    hx509_set_error_string(context, 0, ret,
 				   "SignerInfo %d in SignedData "
 				   "missing sigature", i);
-	    continue;
+	    goto next_sigature;
 	}
 
 	ret = find_CMSIdentifier(context, &signer_info->sid, certs,
@@ -888,13 +917,13 @@ hx509_cms_verify_signed(hx509_context context,
 	     * KeyUsage bits on the certificates.
 	     */
 	    if ((flags & HX509_CMS_VS_NO_KU_CHECK) == 0)
-		continue;
+		goto next_sigature;
 
 	    ret = find_CMSIdentifier(context, &signer_info->sid, certs,
 				     _hx509_verify_get_time(ctx), &cert,
 				     0);
 	    if (ret)
-		continue;
+		goto next_sigature;
 
 	}
 
@@ -977,8 +1006,8 @@ hx509_cms_verify_signed(hx509_context context,
 	    }
 
 	    ASN1_MALLOC_ENCODE(CMSAttributes,
-			       signed_data.data,
-			       signed_data.length,
+			       signed_data->data,
+			       signed_data->length,
 			       &sa,
 			       &size, ret);
 	    if (ret) {
@@ -987,12 +1016,13 @@ hx509_cms_verify_signed(hx509_context context,
 		hx509_clear_error_string(context);
 		goto next_sigature;
 	    }
-	    if (size != signed_data.length)
+	    if (size != signed_data->length)
 		_hx509_abort("internal ASN.1 encoder error");
+	    signers[i].free_data = 1;
 
 	} else {
-	    signed_data.data = content->data;
-	    signed_data.length = content->length;
+	    signed_data->data = content->data;
+	    signed_data->length = content->length;
 	    match_oid = &asn1_oid_id_pkcs7_data;
 	}
 
@@ -1013,21 +1043,49 @@ hx509_cms_verify_signed(hx509_context context,
 	if (match_oid == &decode_oid)
 	    der_free_oid(&decode_oid);
 
+	if (ret == 0)
+	    ret = _hx509_sig_batch_add(context, batch, cert,
+				       &signer_info->signatureAlgorithm,
+				       signed_data,
+				       &signer_info->signature,
+				       &signers[i].job);
 	if (ret == 0) {
-	    ret = hx509_verify_signature(context,
-					 cert,
-					 &signer_info->signatureAlgorithm,
-					 &signed_data,
-					 &signer_info->signature);
-	    if (ret)
-		hx509_set_error_string(context, HX509_ERROR_APPEND, ret,
-				       "Failed to verify signature in "
-				       "CMS SignedData");
+	    signers[i].cert = cert;
+	    cert = NULL;
+	    continue;
+	}
+
+    next_sigature:
+	/* keep the error for when this signer's turn comes below */
+	signers[i].ret = ret;
+	signers[i].error = hx509_get_error_string(context, ret);
+	hx509_clear_error_string(context);
+	if (cert)
+	    hx509_cert_free(cert);
+	cert = NULL;
+    }
+
+    ret = _hx509_sig_batch_run(context, batch);
+    if (ret)
+	goto out;
+
+    for (found_valid_sig = 0, i = 0; i < sd.signerInfos.len; i++) {
+	struct cms_signer *s = &signers[i];
+
+	if (s->ret) {
+	    ret = s->ret;
+	    hx509_set_error_string(context, 0, ret, "%s",
+				   s->error ? s->error : "");
+	    continue;
+	}
+
+	ret = _hx509_sig_batch_result(context, batch, s->job);
+	if (ret) {
+	    hx509_set_error_string(context, HX509_ERROR_APPEND, ret,
+				   "Failed to verify signature in "
+				   "CMS SignedData");
+	    continue;
 	}
-        if (signer_info->signedAttrs)
-	    free(signed_data.data);
-	if (ret)
-	    goto next_sigature;
 
 	/**
 	 * If HX509_CMS_VS_NO_VALIDATE flags is set, do not verify the
@@ -1035,21 +1093,16 @@ hx509_cms_verify_signed(hx509_context context,
 	 */
 
 	if ((flags & HX509_CMS_VS_NO_VALIDATE) == 0) {
-	    ret = hx509_verify_path(context, ctx, cert, certs);
+	    ret = hx509_verify_path(context, ctx, s->cert, certs);
 	    if (ret)
-		goto next_sigature;
+		continue;
 	}
 
-	ret = hx509_certs_add(context, *signer_certs, cert);
+	ret = hx509_certs_add(context, *signer_certs, s->cert);
 	if (ret)
-	    goto next_sigature;
+	    continue;
 
 	found_valid_sig++;
-
-    next_sigature:
-	if (cert)
-	    hx509_cert_free(cert);
-	cert = NULL;
     }
     /**
      * If HX509_CMS_VS_ALLOW_ZERO_SIGNER is set, allow empty
@@ -1078,6 +1131,17 @@ hx509_cms_verify_signed(hx509_context context,
     }
 
 out:
+    if (signers) {
+	for (i = 0; i < sd.signerInfos.len; i++) {
+	    if (signers[i].cert)
+		hx509_cert_free(signers[i].cert);
+	    if (signers[i].free_data)
+		free(signers[i].signed_data.data);
+	    free(signers[i].error);
+	}
+	free(signers);
+    }
+    _hx509_sig_batch_free(&batch);
     free_SignedData(&sd);
     if (certs)
 	hx509_certs_free(&certs);
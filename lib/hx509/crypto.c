@@ -32,6 +32,7 @@
  */
 
 #include "hx_locl.h"
+#include <heim_threads.h>
 
 struct hx509_crypto;
 
@@ -1621,6 +1622,430 @@ _hx509_verify_signature(hx509_context context,
     return (*md->verify_signature)(context, md, signer, alg, data, sig);
 }
 
+/*
+ * Batches of independent signature checks, for a certificate path or
+ * the signers of a CMS message.  The checks are run one after another
+ * in the calling thread, or on the pool of threads set up with
+ * hx509_context_set_verify_threads().  On the pool every check gets
+ * an hx509 context of its own for the error strings and the error of
+ * a failed check is copied back to the caller's context.
+ *
+ * The pool threads are started by the first batch that uses them, so
+ * an application that sets up the pool and then forks (a daemon that
+ * detaches) gets them in the process that does the work.  If the
+ * process has forked since, the child starts threads of its own.
+ *
+ * With HX509_SIG_BATCH_ABORT the batch stops at the first failure:
+ * the checks are handed out in order and the ones after a failed
+ * check are skipped, so the result is the same as running them in
+ * sequence.  Without it every check runs and the results are picked
+ * up with _hx509_sig_batch_result().
+ */
+
+struct sig_job {
+    hx509_cert signer;
+    const AlgorithmIdentifier *alg;
+    const heim_octet_string *data;
+    heim_octet_string sig;
+    int ret;
+    int done;
+    char *error;
+};
+
+struct hx509_sig_batch {
+    int flags;
+    size_t len;
+    size_t alloc;
+    struct sig_job *val;
+    size_t next;
+    size_t finished;
+    size_t failed;
+};
+
+struct sig_worker {
+    struct hx509_sig_pool *pool;
+    hx509_context context;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pthread_t thread;
+#endif
+};
+
+struct hx509_sig_pool {
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+#endif
+    struct sig_worker *workers;
+    int size;
+    int nthreads;
+    pid_t pid;
+    int shutdown;
+    struct hx509_sig_batch *batch;
+    hx509_context caller_ctx;
+};
+
+int
+_hx509_sig_batch_init(hx509_context context, int flags,
+		      struct hx509_sig_batch **batch)
+{
+    *batch = calloc(1, sizeof(**batch));
+    if (*batch == NULL) {
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    (*batch)->flags = flags;
+    return 0;
+}
+
+void
+_hx509_sig_batch_free(struct hx509_sig_batch **batch)
+{
+    size_t i;
+
+    if (*batch == NULL)
+	return;
+    for (i = 0; i < (*batch)->len; i++) {
+	hx509_cert_free((*batch)->val[i].signer);
+	free((*batch)->val[i].error);
+    }
+    free((*batch)->val);
+    free(*batch);
+    *batch = NULL;
+}
+
+/*
+ * Add a check of `sig´ over `data´, both have to stay around until
+ * the batch has run.  Returns the index of the check.
+ */
+
+int
+_hx509_sig_batch_add(hx509_context context,
+		     struct hx509_sig_batch *batch,
+		     const hx509_cert signer,
+		     const AlgorithmIdentifier *alg,
+		     const heim_octet_string *data,
+		     const heim_octet_string *sig,
+		     size_t *idx)
+{
+    struct sig_job *job;
+
+    if (batch->len == batch->alloc) {
+	size_t alloc = batch->alloc ? batch->alloc * 2 : 4;
+
+	job = realloc(batch->val, alloc * sizeof(batch->val[0]));
+	if (job == NULL) {
+	    hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	    return ENOMEM;
+	}
+	batch->val = job;
+	batch->alloc = alloc;
+    }
+    job = &batch->val[batch->len];
+    memset(job, 0, sizeof(*job));
+    job->signer = hx509_cert_ref(signer);
+    job->alg = alg;
+    job->data = data;
+    job->sig = *sig;
+    if (idx)
+	*idx = batch->len;
+    batch->len++;
+    return 0;
+}
+
+int
+_hx509_sig_batch_add_bitstring(hx509_context context,
+			       struct hx509_sig_batch *batch,
+			       const hx509_cert signer,
+			       const AlgorithmIdentifier *alg,
+			       const heim_octet_string *data,
+			       const heim_bit_string *sig,
+			       size_t *idx)
+{
+    heim_octet_string os;
+    size_t i;
+    int ret;
+
+    os.data = sig->data;
+    os.length = sig->length / 8;
+
+    ret = _hx509_sig_batch_add(context, batch, signer, alg, data, &os, &i);
+    if (ret)
+	return ret;
+
+    /* fails when its turn comes, like _hx509_verify_signature_bitstring */
+    if (sig->length & 7) {
+	batch->val[i].done = 1;
+	batch->val[i].ret = HX509_CRYPTO_SIG_INVALID_FORMAT;
+	batch->val[i].error = strdup("signature not multiple of 8 bits");
+    }
+    if (idx)
+	*idx = i;
+    return 0;
+}
+
+static void
+sig_job_run(hx509_context context, struct sig_job *job, int keep_error)
+{
+    job->ret = _hx509_verify_signature(context, job->signer, job->alg,
+				       job->data, &job->sig);
+    if (job->ret && keep_error)
+	job->error = hx509_get_error_string(context, job->ret);
+    if (keep_error)
+	hx509_clear_error_string(context);
+    job->done = 1;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+/*
+ * Run checks of the current batch until there are none left to hand
+ * out, called and returns with the pool mutex held.
+ */
+
+static void
+sig_pool_work(struct hx509_sig_pool *pool, hx509_context context)
+{
+    struct hx509_sig_batch *b = pool->batch;
+    struct sig_job *job;
+
+    while (b->next < b->len) {
+	size_t i = b->next++;
+
+	job = &b->val[i];
+	if (!job->done &&
+	    ((b->flags & HX509_SIG_BATCH_ABORT) == 0 || i < b->failed)) {
+	    pthread_mutex_unlock(&pool->mutex);
+	    sig_job_run(context, job, 1);
+	    pthread_mutex_lock(&pool->mutex);
+	}
+	if (job->done && job->ret && i < b->failed)
+	    b->failed = i;
+	if (++b->finished == b->len)
+	    pthread_cond_signal(&pool->idle);
+    }
+}
+
+static void *
+sig_pool_thread(void *arg)
+{
+    struct sig_worker *w = arg;
+    struct hx509_sig_pool *pool = w->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->shutdown) {
+	if (pool->batch == NULL || pool->batch->next >= pool->batch->len) {
+	    pthread_cond_wait(&pool->work, &pool->mutex);
+	    continue;
+	}
+	sig_pool_work(pool, w->context);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/*
+ * Start the threads unless they run in this process already.  After a
+ * fork the threads, and any lock they held, stayed with the parent, so
+ * the child starts over with the locks set up again.
+ */
+
+static void
+sig_pool_start(struct hx509_sig_pool *pool)
+{
+    pid_t pid = getpid();
+
+    if (pool->nthreads && pool->pid == pid)
+	return;
+    if (pool->nthreads) {
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pool->nthreads = 0;
+	pool->batch = NULL;
+    }
+    pool->pid = pid;
+    for (; pool->nthreads < pool->size; pool->nthreads++)
+	if (pthread_create(&pool->workers[pool->nthreads].thread, NULL,
+			   sig_pool_thread, &pool->workers[pool->nthreads]))
+	    break;
+}
+
+#endif
+
+static void
+sig_pool_free(struct hx509_sig_pool *pool, int nworkers)
+{
+    int i;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    /* threads of the parent process are not ours to join */
+    if (pool->nthreads == 0 || pool->pid == getpid()) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+	for (i = 0; i < pool->nthreads; i++)
+	    pthread_join(pool->workers[i].thread, NULL);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->idle);
+	pthread_mutex_destroy(&pool->mutex);
+    }
+#endif
+    for (i = 0; i < nworkers; i++)
+	if (pool->workers[i].context)
+	    hx509_context_free(&pool->workers[i].context);
+    free(pool->workers);
+    if (pool->caller_ctx)
+	hx509_context_free(&pool->caller_ctx);
+    free(pool);
+}
+
+void
+_hx509_sig_pool_free(hx509_context context)
+{
+    if (context->sig_pool)
+	sig_pool_free(context->sig_pool, context->sig_pool->size);
+    context->sig_pool = NULL;
+}
+
+/**
+ * Check the signatures of a certificate path, and of the signers of
+ * a CMS SignedData, on nthreads threads in parallel.  The calling
+ * thread takes part too.  Zero turns it off, the default; the
+ * signatures are then checked one after another.  The threads are
+ * started when they are first needed, in the process that needs them.
+ *
+ * @param context hx509 context to change.
+ * @param nthreads number of threads to start.
+ *
+ * @return An hx509 error code, see hx509_get_error_string().
+ *
+ * @ingroup hx509_verify
+ */
+
+int
+hx509_context_set_verify_threads(hx509_context context, int nthreads)
+{
+    struct hx509_sig_pool *pool;
+    int i, ret;
+
+    _hx509_sig_pool_free(context);
+    if (nthreads <= 0)
+	return 0;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    pool->workers = calloc(nthreads, sizeof(pool->workers[0]));
+    if (pool->workers == NULL) {
+	free(pool);
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    /* contexts are set up here, hx509_context_init() is not reentrant */
+    ret = hx509_context_init(&pool->caller_ctx);
+    for (i = 0; ret == 0 && i < nthreads; i++) {
+	pool->workers[i].pool = pool;
+	ret = hx509_context_init(&pool->workers[i].context);
+    }
+    if (ret) {
+	sig_pool_free(pool, nthreads);
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to set up verify threads");
+	return ret;
+    }
+    pool->size = nthreads;
+    context->sig_pool = pool;
+    return 0;
+#else
+    (void)pool;
+    (void)i;
+    ret = EINVAL;
+    hx509_set_error_string(context, 0, ret,
+			   "Verify threads need thread support");
+    return ret;
+#endif
+}
+
+/*
+ * Run the checks of the batch.  Returns the error of the first check,
+ * in the order they where added, that failed when the batch has
+ * HX509_SIG_BATCH_ABORT set, zero otherwise.
+ */
+
+int
+_hx509_sig_batch_run(hx509_context context, struct hx509_sig_batch *batch)
+{
+    struct hx509_sig_pool *pool = context->sig_pool;
+    size_t i;
+
+    batch->next = batch->finished = 0;
+    batch->failed = batch->len;
+
+    if (pool == NULL || batch->len < 2) {
+	for (i = 0; i < batch->len; i++) {
+	    struct sig_job *job = &batch->val[i];
+
+	    if (!job->done)
+		sig_job_run(context, job, 0);
+	    else if (job->ret)
+		hx509_set_error_string(context, 0, job->ret, "%s",
+				       job->error ? job->error : "");
+	    if (job->ret && (batch->flags & HX509_SIG_BATCH_ABORT)) {
+		batch->failed = i;
+		return job->ret;
+	    }
+	}
+	return 0;
+    }
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    sig_pool_start(pool);
+    pthread_mutex_lock(&pool->mutex);
+    pool->batch = batch;
+    pthread_cond_broadcast(&pool->work);
+    sig_pool_work(pool, pool->caller_ctx);
+    while (batch->finished < batch->len)
+	pthread_cond_wait(&pool->idle, &pool->mutex);
+    pool->batch = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+#endif
+
+    if ((batch->flags & HX509_SIG_BATCH_ABORT) && batch->failed < batch->len) {
+	struct sig_job *job = &batch->val[batch->failed];
+
+	hx509_set_error_string(context, 0, job->ret, "%s",
+			       job->error ? job->error : "");
+	return job->ret;
+    }
+    return 0;
+}
+
+/*
+ * Result of check `idx´ of a batch that has run, with its error
+ * string set in the context.
+ */
+
+int
+_hx509_sig_batch_result(hx509_context context,
+			struct hx509_sig_batch *batch,
+			size_t idx)
+{
+    struct sig_job *job = &batch->val[idx];
+
+    if (job->ret && job->error)
+	hx509_set_error_string(context, 0, job->ret, "%s", job->error);
+    return job->ret;
+}
+
 int
 _hx509_create_signature(hx509_context context,
 			const hx509_private_key signer,
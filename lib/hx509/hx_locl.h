@@ -75,6 +75,10 @@
 
 struct hx509_keyset_ops;
 struct hx509_collector;
+struct hx509_certs_index;
+struct hx509_path_cache;
+struct hx509_sig_pool;
+struct hx509_sig_batch;
 struct hx509_generate_private_context;
 typedef struct hx509_path hx509_path;
 
@@ -104,6 +108,8 @@ struct hx509_peer_info {
 
 struct hx509_name_data {
     Name der_name;
+    uint32_t *prep;		/* see hx509_name_normalize() */
+    size_t prep_len;
 };
 
 struct hx509_path {
@@ -192,8 +198,13 @@ struct hx509_context_data {
     struct et_list *et_list;
     char *querystat;
     hx509_certs default_trust_anchors;
+    struct hx509_path_cache *path_cache;
+    struct hx509_sig_pool *sig_pool;
 };
 
+/* _hx509_sig_batch_init flags */
+#define HX509_SIG_BATCH_ABORT	1
+
 /* _hx509_calculate_path flag field */
 #define HX509_CALCULATE_PATH_NO_ANCHOR 1
 
@@ -192,6 +192,11 @@ cms_verify_sd(struct cms_verify_sd_options *opt, int argc, char **argv)
 
     if (opt->missing_revoke_flag)
 	hx509_context_set_missing_revoke(context, 1);
+    if (opt->threads_integer > 0) {
+	ret = hx509_context_set_verify_threads(context, opt->threads_integer);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_context_set_verify_threads");
+    }
 
     hx509_lock_init(context, &lock);
     lock_strings(lock, &opt->pass_strings);
@@ -869,6 +874,11 @@ pcert_verify(struct verify_options *opt, int argc, char **argv)
 
     if (opt->missing_revoke_flag)
 	hx509_context_set_missing_revoke(context, 1);
+    if (opt->threads_integer > 0) {
+	ret = hx509_context_set_verify_threads(context, opt->threads_integer);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_context_set_verify_threads");
+    }
 
     ret = hx509_verify_init_ctx(context, &ctx);
     if (ret)
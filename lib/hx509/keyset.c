@@ -497,6 +497,24 @@ hx509_certs_find(hx509_context context,
 		 hx509_certs certs,
 		 const hx509_query *q,
 		 hx509_cert *r)
+{
+    *r = NULL;
+
+    _hx509_query_statistic(context, 0, q);
+
+    return _hx509_certs_find(context, certs, q, r);
+}
+
+/*
+ * hx509_certs_find() without recording the query, for keysets that
+ * pass queries on to an inner keyset.
+ */
+
+int
+_hx509_certs_find(hx509_context context,
+		  hx509_certs certs,
+		  const hx509_query *q,
+		  hx509_cert *r)
 {
     hx509_cursor cursor;
     hx509_cert c;
@@ -504,8 +522,6 @@ hx509_certs_find(hx509_context context,
 
     *r = NULL;
 
-    _hx509_query_statistic(context, 0, q);
-
     if (certs->ops->query)
 	return (*certs->ops->query)(context, certs, certs->ops_data, q, r);
 
@@ -800,3 +816,279 @@ _hx509_certs_keys_free(hx509_context context,
 	hx509_private_key_free(&keys[i]);
     free(keys);
 }
+
+/*
+ * Certificate index for keyset backends that keep their certificates
+ * in memory: the certificates in insertion order plus hash chains on
+ * subject name, subject key identifier and issuer + serial number, so
+ * that the common queries do not have to run
+ * _hx509_query_match_cert() over the whole set.  The index only
+ * narrows down the candidates, each is still checked with
+ * _hx509_query_match_cert(), and the first match in insertion order
+ * is returned just like a scan would.
+ *
+ * Queries answered through an index are recorded as type 2 in the
+ * query statistics file, "hxtool statistic-print --type=2" compared
+ * to the default type 0 shows which query shapes still end up
+ * scanning.
+ */
+
+#define INDEX_SUBJECT		0
+#define INDEX_SKI		1
+#define INDEX_ISSUER_SERIAL	2
+#define INDEX_NUM		3
+
+struct hx509_certs_index_entry {
+    hx509_cert cert;
+    int valid[INDEX_NUM];
+    uint32_t hash[INDEX_NUM];
+    size_t next[INDEX_NUM];	/* index + 1 of next entry in chain */
+};
+
+struct hx509_certs_index {
+    struct hx509_certs_index_entry *val;
+    size_t len;
+    size_t alloc;
+    size_t *buckets[INDEX_NUM];	/* index + 1 of the first entry */
+    size_t size;		/* number of buckets, power of two */
+};
+
+static uint32_t
+index_hash_data(uint32_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static int
+index_hash_issuer_serial(const Name *issuer, const heim_integer *serial,
+			 uint32_t *hash)
+{
+    int ret;
+
+    ret = _hx509_name_hash(issuer, hash);
+    if (ret)
+	return ret;
+    *hash = index_hash_data(*hash, serial->data, serial->length);
+    *hash = index_hash_data(*hash, &serial->negative, sizeof(serial->negative));
+    return 0;
+}
+
+static void
+index_link(struct hx509_certs_index *idx, size_t i)
+{
+    struct hx509_certs_index_entry *e = &idx->val[i];
+    size_t k, b;
+
+    for (k = 0; k < INDEX_NUM; k++) {
+	if (!e->valid[k])
+	    continue;
+	b = e->hash[k] & (idx->size - 1);
+	e->next[k] = idx->buckets[k][b];
+	idx->buckets[k][b] = i + 1;
+    }
+}
+
+static int
+index_resize(hx509_context context, struct hx509_certs_index *idx,
+	     size_t size)
+{
+    size_t *buckets[INDEX_NUM];
+    size_t i, k;
+
+    for (k = 0; k < INDEX_NUM; k++) {
+	buckets[k] = calloc(size, sizeof(buckets[k][0]));
+	if (buckets[k] == NULL) {
+	    while (k-- > 0)
+		free(buckets[k]);
+	    hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	    return ENOMEM;
+	}
+    }
+    for (k = 0; k < INDEX_NUM; k++) {
+	free(idx->buckets[k]);
+	idx->buckets[k] = buckets[k];
+    }
+    idx->size = size;
+
+    for (i = 0; i < idx->len; i++)
+	index_link(idx, i);
+    return 0;
+}
+
+int
+_hx509_certs_index_init(hx509_context context,
+			struct hx509_certs_index **idx)
+{
+    *idx = calloc(1, sizeof(**idx));
+    if (*idx == NULL) {
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    return 0;
+}
+
+void
+_hx509_certs_index_free(struct hx509_certs_index **idx)
+{
+    size_t i, k;
+
+    if (*idx == NULL)
+	return;
+    for (i = 0; i < (*idx)->len; i++)
+	hx509_cert_free((*idx)->val[i].cert);
+    for (k = 0; k < INDEX_NUM; k++)
+	free((*idx)->buckets[k]);
+    free((*idx)->val);
+    free(*idx);
+    *idx = NULL;
+}
+
+/*
+ * Add a certificate to the index, the index takes its own reference.
+ */
+
+int
+_hx509_certs_index_add(hx509_context context,
+		       struct hx509_certs_index *idx,
+		       hx509_cert cert)
+{
+    struct hx509_certs_index_entry *e;
+    const Certificate *c = _hx509_get_cert(cert);
+    SubjectKeyIdentifier si;
+    int ret;
+
+    if (idx->len == idx->alloc) {
+	size_t alloc = idx->alloc ? idx->alloc * 2 : 16;
+
+	e = realloc(idx->val, alloc * sizeof(idx->val[0]));
+	if (e == NULL) {
+	    hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	    return ENOMEM;
+	}
+	idx->val = e;
+	idx->alloc = alloc;
+    }
+
+    e = &idx->val[idx->len];
+    memset(e, 0, sizeof(*e));
+
+    /* certificates whose names fail stringprep never match a name query */
+    if (_hx509_name_hash(&c->tbsCertificate.subject,
+			 &e->hash[INDEX_SUBJECT]) == 0)
+	e->valid[INDEX_SUBJECT] = 1;
+    if (_hx509_find_extension_subject_key_id(c, &si) == 0) {
+	e->hash[INDEX_SKI] = index_hash_data(2166136261U, si.data, si.length);
+	e->valid[INDEX_SKI] = 1;
+	free_SubjectKeyIdentifier(&si);
+    }
+    if (index_hash_issuer_serial(&c->tbsCertificate.issuer,
+				 &c->tbsCertificate.serialNumber,
+				 &e->hash[INDEX_ISSUER_SERIAL]) == 0)
+	e->valid[INDEX_ISSUER_SERIAL] = 1;
+
+    e->cert = hx509_cert_ref(cert);
+    idx->len++;
+
+    /* keep the chains short, on average at most one entry per bucket */
+    if (idx->len > idx->size) {
+	ret = index_resize(context, idx, idx->size ? idx->size * 2 : 16);
+	if (ret) {
+	    idx->len--;
+	    hx509_cert_free(e->cert);
+	    return ret;
+	}
+    } else
+	index_link(idx, idx->len - 1);
+
+    return 0;
+}
+
+size_t
+_hx509_certs_index_len(struct hx509_certs_index *idx)
+{
+    return idx->len;
+}
+
+hx509_cert
+_hx509_certs_index_get(struct hx509_certs_index *idx, size_t i)
+{
+    return idx->val[i].cert;
+}
+
+/*
+ * Pick the chain to walk for a query, returns 0 if no index applies.
+ */
+
+static int
+index_plan(const hx509_query *q, int *kind, uint32_t *hash)
+{
+    if (q->match & HX509_QUERY_MATCH_CERTIFICATE) {
+	*kind = INDEX_ISSUER_SERIAL;
+	return index_hash_issuer_serial(&q->certificate->tbsCertificate.issuer,
+					&q->certificate->tbsCertificate.serialNumber,
+					hash) == 0;
+    }
+    if ((q->match & HX509_QUERY_MATCH_ISSUER_NAME) &&
+	(q->match & HX509_QUERY_MATCH_SERIALNUMBER)) {
+	*kind = INDEX_ISSUER_SERIAL;
+	return index_hash_issuer_serial(q->issuer_name, q->serial, hash) == 0;
+    }
+    if (q->match & HX509_QUERY_MATCH_SUBJECT_KEY_ID) {
+	*kind = INDEX_SKI;
+	*hash = index_hash_data(2166136261U, q->subject_id->data,
+				q->subject_id->length);
+	return 1;
+    }
+    if (q->match & HX509_QUERY_FIND_ISSUER_CERT) {
+	*kind = INDEX_SUBJECT;
+	return _hx509_name_hash(&q->subject->tbsCertificate.issuer, hash) == 0;
+    }
+    if (q->match & HX509_QUERY_MATCH_SUBJECT_NAME) {
+	*kind = INDEX_SUBJECT;
+	return _hx509_name_hash(q->subject_name, hash) == 0;
+    }
+    return 0;
+}
+
+int
+_hx509_certs_index_find(hx509_context context,
+			struct hx509_certs_index *idx,
+			const hx509_query *q,
+			hx509_cert *r)
+{
+    uint32_t hash;
+    size_t i, found = 0;
+    int kind;
+
+    *r = NULL;
+
+    if (idx->size && index_plan(q, &kind, &hash)) {
+	_hx509_query_statistic(context, 2, q);
+	/* chains are newest first, keep the oldest match */
+	for (i = idx->buckets[kind][hash & (idx->size - 1)];
+	     i != 0;
+	     i = idx->val[i - 1].next[kind])
+	{
+	    if (idx->val[i - 1].hash[kind] != hash)
+		continue;
+	    if (_hx509_query_match_cert(context, q, idx->val[i - 1].cert))
+		found = i;
+	}
+    } else {
+	for (i = 0; i < idx->len && found == 0; i++)
+	    if (_hx509_query_match_cert(context, q, idx->val[i].cert))
+		found = i + 1;
+    }
+
+    if (found == 0) {
+	hx509_clear_error_string(context);
+	return HX509_CERT_NOT_FOUND;
+    }
+    *r = hx509_cert_ref(idx->val[found - 1].cert);
+    return 0;
+}
@@ -35,19 +35,241 @@
 #include <dirent.h>
 
 /*
- * The DIR keyset module is strange compared to the other modules
- * since it does lazy evaluation and really doesn't keep any local
- * state except for the directory iteration and cert iteration of
- * files. DIR ignores most errors so that the consumer doesn't get
- * failes for stray files in directories.
+ * The DIR keyset module loads every file in the directory with the
+ * FILE module, keeps the parsed certificates and indexes them on
+ * subject name, subject key identifier and issuer + serial number so
+ * that hx509_certs_find() doesn't have to parse and scan the whole
+ * directory each time.
+ *
+ * The directory is rescanned when its modification time changes
+ * (files added, removed or renamed into place), only files whose
+ * mtime or size changed are parsed again.  DIR ignores most errors
+ * so that the consumer doesn't get failes for stray files in
+ * directories.
  */
 
+struct dir_file {
+    char *name;
+    time_t mtime;
+    off_t size;
+    hx509_cert *val;
+    size_t len;
+};
+
+struct ks_dir {
+    char *path;
+    time_t mtime;		/* of the directory at last scan */
+    time_t scan_time;
+    int scanned;
+    struct dir_file *files;
+    size_t nfiles;
+    struct hx509_certs_index *index;
+};
+
 struct dircursor {
-    DIR *dir;
-    hx509_certs certs;
-    void *iter;
+    hx509_cert *val;
+    size_t len;
+    size_t pos;
 };
 
+static void
+dir_file_free(struct dir_file *f)
+{
+    size_t i;
+
+    for (i = 0; i < f->len; i++)
+	hx509_cert_free(f->val[i]);
+    free(f->val);
+    free(f->name);
+    memset(f, 0, sizeof(*f));
+}
+
+static int
+dir_file_cmp(const void *a, const void *b)
+{
+    const struct dir_file *fa = a, *fb = b;
+    return strcmp(fa->name, fb->name);
+}
+
+static int
+collect_cert(hx509_context context, void *ctx, hx509_cert c)
+{
+    struct dir_file *f = ctx;
+    hx509_cert *val;
+
+    val = realloc(f->val, (f->len + 1) * sizeof(f->val[0]));
+    if (val == NULL)
+	return ENOMEM;
+    f->val = val;
+    f->val[f->len++] = hx509_cert_ref(c);
+    return 0;
+}
+
+/*
+ * Load the certificates of one file, errors are ignored and leave the
+ * file without certificates.
+ */
+
+static void
+dir_file_load(hx509_context context, const char *path, struct dir_file *f)
+{
+    hx509_certs certs;
+    char *fn;
+    size_t i;
+    int ret;
+
+    if (asprintf(&fn, "FILE:%s/%s", path, f->name) == -1)
+	return;
+
+    ret = hx509_certs_init(context, fn, 0, NULL, &certs);
+    free(fn);
+    if (ret == 0) {
+	ret = hx509_certs_iter_f(context, certs, collect_cert, f);
+	hx509_certs_free(&certs);
+    }
+    if (ret) {
+	for (i = 0; i < f->len; i++)
+	    hx509_cert_free(f->val[i]);
+	free(f->val);
+	f->val = NULL;
+	f->len = 0;
+    }
+    hx509_clear_error_string(context);
+}
+
+/*
+ * Rescan the directory if it changed since the last scan.  A
+ * directory modified in the same second as the last scan might have
+ * changed after it, so it is scanned again until its mtime is older
+ * than the scan.
+ */
+
+static int
+dir_refresh(hx509_context context, struct ks_dir *d)
+{
+    struct hx509_certs_index *index = NULL;
+    struct dir_file *files = NULL, *f, key;
+    size_t nfiles = 0, i, j;
+    struct dirent *dent;
+    struct stat sb;
+    time_t now;
+    DIR *dir;
+    int ret;
+
+    if (stat(d->path, &sb) == -1) {
+	ret = errno;
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to stat %s", d->path);
+	return ret;
+    }
+    if (d->scanned && sb.st_mtime == d->mtime && d->mtime < d->scan_time)
+	return 0;
+
+    now = time(NULL);
+
+    dir = opendir(d->path);
+    if (dir == NULL) {
+	ret = errno;
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to open directory %s", d->path);
+	return ret;
+    }
+    rk_cloexec_dir(dir);
+
+    /* the old files are sorted by name so they can be looked up */
+    qsort(d->files, d->nfiles, sizeof(d->files[0]), dir_file_cmp);
+
+    ret = 0;
+    while ((dent = readdir(dir)) != NULL) {
+	struct stat fsb;
+	char *fn;
+
+	if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+	    continue;
+
+	if (asprintf(&fn, "%s/%s", d->path, dent->d_name) == -1) {
+	    ret = ENOMEM;
+	    break;
+	}
+	if (stat(fn, &fsb) == -1 || S_ISDIR(fsb.st_mode)) {
+	    free(fn);
+	    continue;
+	}
+	free(fn);
+
+	f = realloc(files, (nfiles + 1) * sizeof(files[0]));
+	if (f == NULL) {
+	    ret = ENOMEM;
+	    break;
+	}
+	files = f;
+	f = &files[nfiles];
+
+	key.name = dent->d_name;
+	if (d->nfiles)
+	    f = bsearch(&key, d->files, d->nfiles,
+			sizeof(d->files[0]), dir_file_cmp);
+	else
+	    f = NULL;
+	files[nfiles].name = strdup(dent->d_name);
+	if (files[nfiles].name == NULL) {
+	    ret = ENOMEM;
+	    break;
+	}
+	if (f && f->mtime == fsb.st_mtime && f->size == fsb.st_size) {
+	    /* unchanged, move the certificates over */
+	    files[nfiles].val = f->val;
+	    files[nfiles].len = f->len;
+	    f->val = NULL;
+	    f->len = 0;
+	} else {
+	    files[nfiles].val = NULL;
+	    files[nfiles].len = 0;
+	    dir_file_load(context, d->path, &files[nfiles]);
+	}
+	files[nfiles].mtime = fsb.st_mtime;
+	files[nfiles].size = fsb.st_size;
+	nfiles++;
+    }
+    closedir(dir);
+
+    if (ret == 0)
+	ret = _hx509_certs_index_init(context, &index);
+    for (i = 0; ret == 0 && i < nfiles; i++)
+	for (j = 0; ret == 0 && j < files[i].len; j++)
+	    ret = _hx509_certs_index_add(context, index, files[i].val[j]);
+
+    /* certificates moved over are gone from the old list either way */
+    for (i = 0; i < d->nfiles; i++)
+	dir_file_free(&d->files[i]);
+    free(d->files);
+    d->files = NULL;
+    d->nfiles = 0;
+
+    if (ret) {
+	/* keep answering from the old index, rescan everything next time */
+	for (i = 0; i < nfiles; i++)
+	    dir_file_free(&files[i]);
+	free(files);
+	_hx509_certs_index_free(&index);
+	d->scanned = 0;
+	if (ret == ENOMEM)
+	    hx509_set_error_string(context, 0, ret, "out of memory");
+	return ret;
+    }
+
+    _hx509_certs_index_free(&d->index);
+
+    d->files = files;
+    d->nfiles = nfiles;
+    d->index = index;
+    d->mtime = sb.st_mtime;
+    d->scan_time = now;
+    d->scanned = 1;
+
+    return 0;
+}
+
 /*
  *
  */
@@ -57,6 +279,8 @@ dir_init(hx509_context context,
 	 hx509_certs certs, void **data, int flags,
 	 const char *residue, hx509_lock lock)
 {
+    struct ks_dir *d;
+
     *data = NULL;
 
     {
@@ -77,47 +301,95 @@ dir_init(hx509_context context,
 	}
     }
 
-    *data = strdup(residue);
-    if (*data == NULL) {
+    d = calloc(1, sizeof(*d));
+    if (d == NULL) {
+	hx509_clear_error_string(context);
+	return ENOMEM;
+    }
+    d->path = strdup(residue);
+    if (d->path == NULL) {
+	free(d);
 	hx509_clear_error_string(context);
 	return ENOMEM;
     }
 
+    *data = d;
     return 0;
 }
 
 static int
 dir_free(hx509_certs certs, void *data)
 {
-    free(data);
+    struct ks_dir *d = data;
+    size_t i;
+
+    for (i = 0; i < d->nfiles; i++)
+	dir_file_free(&d->files[i]);
+    free(d->files);
+    _hx509_certs_index_free(&d->index);
+    free(d->path);
+    free(d);
     return 0;
 }
 
+static int
+dir_query(hx509_context context,
+	  hx509_certs certs,
+	  void *data,
+	  const hx509_query *q,
+	  hx509_cert *r)
+{
+    struct ks_dir *d = data;
+    int ret;
+
+    *r = NULL;
+
+    ret = dir_refresh(context, d);
+    if (ret)
+	return ret;
+
+    return _hx509_certs_index_find(context, d->index, q, r);
+}
+
+/*
+ * The cursor holds its own references so that a refresh while
+ * iterating (a query from inside the loop) doesn't pull the
+ * certificates out from under it.
+ */
+
 static int
 dir_iter_start(hx509_context context,
 	       hx509_certs certs, void *data, void **cursor)
 {
-    struct dircursor *d;
+    struct ks_dir *d = data;
+    struct dircursor *c;
+    size_t i;
+    int ret;
 
     *cursor = NULL;
 
-    d = calloc(1, sizeof(*d));
-    if (d == NULL) {
+    ret = dir_refresh(context, d);
+    if (ret)
+	return ret;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
 	hx509_clear_error_string(context);
 	return ENOMEM;
     }
-
-    d->dir = opendir(data);
-    if (d->dir == NULL) {
-	hx509_clear_error_string(context);
-	free(d);
-	return errno;
+    c->len = _hx509_certs_index_len(d->index);
+    if (c->len) {
+	c->val = calloc(c->len, sizeof(c->val[0]));
+	if (c->val == NULL) {
+	    free(c);
+	    hx509_clear_error_string(context);
+	    return ENOMEM;
+	}
     }
-    rk_cloexec_dir(d->dir);
-    d->certs = NULL;
-    d->iter = NULL;
+    for (i = 0; i < c->len; i++)
+	c->val[i] = hx509_cert_ref(_hx509_certs_index_get(d->index, i));
 
-    *cursor = d;
+    *cursor = c;
     return 0;
 }
 
@@ -125,60 +397,14 @@ static int
 dir_iter(hx509_context context,
 	 hx509_certs certs, void *data, void *iter, hx509_cert *cert)
 {
-    struct dircursor *d = iter;
-    int ret = 0;
-
-    *cert = NULL;
-
-    do {
-	struct dirent *dir;
-	char *fn;
-
-	if (d->certs) {
-	    ret = hx509_certs_next_cert(context, d->certs, d->iter, cert);
-	    if (ret) {
-		hx509_certs_end_seq(context, d->certs, d->iter);
-		d->iter = NULL;
-		hx509_certs_free(&d->certs);
-		return ret;
-	    }
-	    if (*cert) {
-		ret = 0;
-		break;
-	    }
-	    hx509_certs_end_seq(context, d->certs, d->iter);
-	    d->iter = NULL;
-	    hx509_certs_free(&d->certs);
-	}
-
-	dir = readdir(d->dir);
-	if (dir == NULL) {
-	    ret = 0;
-	    break;
-	}
-	if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
-	    continue;
-
-	if (asprintf(&fn, "FILE:%s/%s", (char *)data, dir->d_name) == -1)
-	    return ENOMEM;
-
-	ret = hx509_certs_init(context, fn, 0, NULL, &d->certs);
-	if (ret == 0) {
-
-	    ret = hx509_certs_start_seq(context, d->certs, &d->iter);
-	    if (ret)
-	    hx509_certs_free(&d->certs);
-	}
-	/* ignore errors */
-	if (ret) {
-	    d->certs = NULL;
-	    ret = 0;
-	}
+    struct dircursor *c = iter;
 
-	free(fn);
-    } while(ret == 0);
-
-    return ret;
+    if (c->pos >= c->len) {
+	*cert = NULL;
+	return 0;
+    }
+    *cert = hx509_cert_ref(c->val[c->pos++]);
+    return 0;
 }
 
 
@@ -188,15 +414,13 @@ dir_iter_end(hx509_context context,
 	     void *data,
 	     void *cursor)
 {
-    struct dircursor *d = cursor;
+    struct dircursor *c = cursor;
+    size_t i;
 
-    if (d->certs) {
-	hx509_certs_end_seq(context, d->certs, d->iter);
-	d->iter = NULL;
-	hx509_certs_free(&d->certs);
-    }
-    closedir(d->dir);
-    free(d);
+    for (i = 0; i < c->len; i++)
+	hx509_cert_free(c->val[i]);
+    free(c->val);
+    free(c);
     return 0;
 }
 
@@ -208,7 +432,7 @@ static struct hx509_keyset_ops keyset_dir = {
     NULL,
     dir_free,
     NULL,
-    NULL,
+    dir_query,
     dir_iter_start,
     dir_iter,
     dir_iter_end,
@@ -590,6 +590,17 @@ file_add(hx509_context context, hx509_certs certs, void *data, hx509_cert c)
     return hx509_certs_add(context, ksf->certs, c);
 }
 
+static int
+file_query(hx509_context context,
+	   hx509_certs certs,
+	   void *data,
+	   const hx509_query *q,
+	   hx509_cert *r)
+{
+    struct ks_file *ksf = data;
+    return _hx509_certs_find(context, ksf->certs, q, r);
+}
+
 static int
 file_iter_start(hx509_context context,
 		hx509_certs certs, void *data, void **cursor)
@@ -643,7 +654,7 @@ static struct hx509_keyset_ops keyset_file = {
     file_store,
     file_free,
     file_add,
-    NULL,
+    file_query,
     file_iter_start,
     file_iter,
     file_iter_end,
@@ -659,7 +670,7 @@ static struct hx509_keyset_ops keyset_pemfile = {
     file_store,
     file_free,
     file_add,
-    NULL,
+    file_query,
     file_iter_start,
     file_iter,
     file_iter_end,
@@ -675,7 +686,7 @@ static struct hx509_keyset_ops keyset_derfile = {
     file_store,
     file_free,
     file_add,
-    NULL,
+    file_query,
     file_iter_start,
     file_iter,
     file_iter_end,
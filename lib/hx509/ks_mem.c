@@ -34,17 +34,14 @@
 #include "hx_locl.h"
 
 /*
- * Should use two hash/tree certificates intead of a array.  Criteria
- * should be subject and subjectKeyIdentifier since those two are
- * commonly seached on in CMS and path building.
+ * The certificates are kept in a keyset index (see keyset.c) so that
+ * the subject and subjectKeyIdentifier lookups done by CMS and path
+ * building don't have to walk the whole set.
  */
 
 struct mem_data {
     char *name;
-    struct {
-	unsigned long len;
-	hx509_cert *val;
-    } certs;
+    struct hx509_certs_index *certs;
     hx509_private_key *keys;
 };
 
@@ -64,6 +61,11 @@ mem_init(hx509_context context,
 	free(mem);
 	return ENOMEM;
     }
+    if (_hx509_certs_index_init(context, &mem->certs)) {
+	free(mem->name);
+	free(mem);
+	return ENOMEM;
+    }
     *data = mem;
     return 0;
 }
@@ -74,9 +76,7 @@ mem_free(hx509_certs certs, void *data)
     struct mem_data *mem = data;
     unsigned long i;
 
-    for (i = 0; i < mem->certs.len; i++)
-	hx509_cert_free(mem->certs.val[i]);
-    free(mem->certs.val);
+    _hx509_certs_index_free(&mem->certs);
     for (i = 0; mem->keys && mem->keys[i]; i++)
 	hx509_private_key_free(&mem->keys[i]);
     free(mem->keys);
@@ -90,18 +90,20 @@ static int
 mem_add(hx509_context context, hx509_certs certs, void *data, hx509_cert c)
 {
     struct mem_data *mem = data;
-    hx509_cert *val;
 
-    val = realloc(mem->certs.val,
-		  (mem->certs.len + 1) * sizeof(mem->certs.val[0]));
-    if (val == NULL)
-	return ENOMEM;
+    return _hx509_certs_index_add(context, mem->certs, c);
+}
 
-    mem->certs.val = val;
-    mem->certs.val[mem->certs.len] = hx509_cert_ref(c);
-    mem->certs.len++;
+static int
+mem_query(hx509_context context,
+	  hx509_certs certs,
+	  void *data,
+	  const hx509_query *q,
+	  hx509_cert *r)
+{
+    struct mem_data *mem = data;
 
-    return 0;
+    return _hx509_certs_index_find(context, mem->certs, q, r);
 }
 
 static int
@@ -131,12 +133,12 @@ mem_iter(hx509_context contexst,
     unsigned long *iter = cursor;
     struct mem_data *mem = data;
 
-    if (*iter >= mem->certs.len) {
+    if (*iter >= _hx509_certs_index_len(mem->certs)) {
 	*cert = NULL;
 	return 0;
     }
 
-    *cert = hx509_cert_ref(mem->certs.val[*iter]);
+    *cert = hx509_cert_ref(_hx509_certs_index_get(mem->certs, *iter));
     (*iter)++;
     return 0;
 }
@@ -207,7 +209,7 @@ static struct hx509_keyset_ops keyset_mem = {
     NULL,
     mem_free,
     mem_add,
-    NULL,
+    mem_query,
     mem_iter_start,
     mem_iter,
     mem_iter_end,
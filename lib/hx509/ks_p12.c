@@ -660,6 +660,17 @@ p12_add(hx509_context context, hx509_certs certs, void *data, hx509_cert c)
     return hx509_certs_add(context, p12->certs, c);
 }
 
+static int
+p12_query(hx509_context context,
+	  hx509_certs certs,
+	  void *data,
+	  const hx509_query *q,
+	  hx509_cert *r)
+{
+    struct ks_pkcs12 *p12 = data;
+    return _hx509_certs_find(context, p12->certs, q, r);
+}
+
 static int
 p12_iter_start(hx509_context context,
 	       hx509_certs certs,
@@ -698,7 +709,7 @@ static struct hx509_keyset_ops keyset_pkcs12 = {
     p12_store,
     p12_free,
     p12_add,
-    NULL,
+    p12_query,
     p12_iter_start,
     p12_iter,
     p12_iter_end,
@@ -455,7 +455,7 @@ _hx509_name_cmp(const Name *n1, const Name *n2, int *c)
 
 	for (j = 0; j < n1->u.rdnSequence.val[i].len; j++) {
 	    *c = der_heim_oid_cmp(&n1->u.rdnSequence.val[i].val[j].type,
-				  &n1->u.rdnSequence.val[i].val[j].type);
+				  &n2->u.rdnSequence.val[i].val[j].type);
 	    if (*c)
 		return 0;
 
@@ -472,6 +472,128 @@ _hx509_name_cmp(const Name *n1, const Name *n2, int *c)
     return 0;
 }
 
+/*
+ * Hash a Name so that names that _hx509_name_cmp() considers equal
+ * hash to the same value: the values are hashed after stringprep, the
+ * same way they are compared.
+ */
+
+int
+_hx509_name_hash(const Name *n, uint32_t *hash)
+{
+    uint32_t h = 2166136261U, *s;
+    size_t i, j, k, len;
+    int ret;
+
+#define HASH_STEP(v) h = (h ^ (uint32_t)(v)) * 16777619U
+
+    HASH_STEP(n->u.rdnSequence.len);
+    for (i = 0 ; i < n->u.rdnSequence.len; i++) {
+	HASH_STEP(n->u.rdnSequence.val[i].len);
+	for (j = 0; j < n->u.rdnSequence.val[i].len; j++) {
+	    ret = dsstringprep(&n->u.rdnSequence.val[i].val[j].value, &s, &len);
+	    if (ret)
+		return ret;
+	    HASH_STEP(len);
+	    for (k = 0; k < len; k++)
+		HASH_STEP(s[k]);
+	    free(s);
+	}
+    }
+#undef HASH_STEP
+
+    *hash = h;
+    return 0;
+}
+
+/*
+ * The whole name after stringprep as one array, so that comparing two
+ * names is one pass over two arrays: the number of RDNs, then for each
+ * RDN the number of values, and for each value the length and
+ * components of its type followed by the length and characters of the
+ * value after stringprep.  Two names compare equal here exactly when
+ * _hx509_name_cmp() says they are equal.
+ */
+
+static int
+prep_append(uint32_t **prep, size_t *len, size_t *alloc,
+	    const uint32_t *val, size_t n)
+{
+    uint32_t *p;
+
+    if (*len + n > *alloc) {
+	size_t a = (*len + n) * 2;
+
+	p = realloc(*prep, a * sizeof(p[0]));
+	if (p == NULL)
+	    return ENOMEM;
+	*prep = p;
+	*alloc = a;
+    }
+    memcpy(*prep + *len, val, n * sizeof(val[0]));
+    *len += n;
+    return 0;
+}
+
+static int
+name_prep(const Name *n, uint32_t **rprep, size_t *rlen)
+{
+    uint32_t *prep = NULL, *s, v;
+    size_t i, j, k, len = 0, alloc = 0, slen;
+    int ret;
+
+    v = n->u.rdnSequence.len;
+    ret = prep_append(&prep, &len, &alloc, &v, 1);
+    for (i = 0; ret == 0 && i < n->u.rdnSequence.len; i++) {
+	const RelativeDistinguishedName *rdn = &n->u.rdnSequence.val[i];
+
+	v = rdn->len;
+	ret = prep_append(&prep, &len, &alloc, &v, 1);
+	for (j = 0; ret == 0 && j < rdn->len; j++) {
+	    const heim_oid *type = &rdn->val[j].type;
+
+	    v = type->length;
+	    ret = prep_append(&prep, &len, &alloc, &v, 1);
+	    for (k = 0; ret == 0 && k < type->length; k++) {
+		v = type->components[k];
+		ret = prep_append(&prep, &len, &alloc, &v, 1);
+	    }
+	    if (ret)
+		break;
+
+	    ret = dsstringprep(&rdn->val[j].value, &s, &slen);
+	    if (ret)
+		break;
+	    v = slen;
+	    ret = prep_append(&prep, &len, &alloc, &v, 1);
+	    if (ret == 0)
+		ret = prep_append(&prep, &len, &alloc, s, slen);
+	    free(s);
+	}
+    }
+    if (ret) {
+	free(prep);
+	return ret;
+    }
+    *rprep = prep;
+    *rlen = len;
+    return 0;
+}
+
+static int
+prep_cmp(const struct hx509_name_data *n1, const struct hx509_name_data *n2)
+{
+    size_t i;
+
+    for (i = 0; i < n1->prep_len && i < n2->prep_len; i++) {
+	if (n1->prep[i] != n2->prep[i])
+	    return n1->prep[i] < n2->prep[i] ? -1 : 1;
+    }
+    if (n1->prep_len != n2->prep_len)
+	return n1->prep_len < n2->prep_len ? -1 : 1;
+    return 0;
+}
+
 /**
  * Compare to hx509 name object, useful for sorting.
  *
@@ -488,6 +610,15 @@ int
 hx509_name_cmp(hx509_name n1, hx509_name n2)
 {
     int ret, diff;
+
+    /* the stringprep'ed form is kept with the name for the next time */
+    if (n1->prep == NULL)
+	(void)name_prep(&n1->der_name, &n1->prep, &n1->prep_len);
+    if (n2->prep == NULL)
+	(void)name_prep(&n2->der_name, &n2->prep, &n2->prep_len);
+    if (n1->prep && n2->prep)
+	return prep_cmp(n1, n2);
+
     ret = _hx509_name_cmp(&n1->der_name, &n2->der_name, &diff);
     if (ret)
 	return ret;
@@ -686,6 +817,14 @@ hx509_name_copy(hx509_context context, const hx509_name from, hx509_name *to)
 	*to = NULL;
 	return ENOMEM;
     }
+    if (from->prep) {
+	(*to)->prep = malloc(from->prep_len * sizeof(from->prep[0]));
+	if ((*to)->prep) {
+	    memcpy((*to)->prep, from->prep,
+		   from->prep_len * sizeof(from->prep[0]));
+	    (*to)->prep_len = from->prep_len;
+	}
+    }
     return 0;
 }
 
@@ -706,10 +845,32 @@ hx509_name_to_Name(const hx509_name from, Name *to)
     return copy_Name(&from->der_name, to);
 }
 
+/**
+ * Run stringprep over the values of a name and keep the result with
+ * the name, so that hx509_name_cmp() does not redo it on every
+ * comparison.  hx509_name_cmp() does this by itself the first time a
+ * name is compared, calling this first is only needed to see the
+ * errors.
+ *
+ * @param context A hx509 cotext.
+ * @param name the name to normalize.
+ *
+ * @return An hx509 error code, see hx509_get_error_string().
+ *
+ * @ingroup hx509_name
+ */
+
 int
 hx509_name_normalize(hx509_context context, hx509_name name)
 {
-    return 0;
+    int ret;
+
+    if (name->prep)
+	return 0;
+    ret = name_prep(&name->der_name, &name->prep, &name->prep_len);
+    if (ret)
+	hx509_set_error_string(context, 0, ret, "Failed to normalize name");
+    return ret;
 }
 
 /**
@@ -736,6 +897,10 @@ hx509_name_expand(hx509_context context,
     if (env == NULL)
 	return 0;
 
+    free(name->prep);
+    name->prep = NULL;
+    name->prep_len = 0;
+
     if (n->element != choice_Name_rdnSequence) {
 	hx509_set_error_string(context, 0, EINVAL, "RDN not of supported type");
 	return EINVAL;
@@ -832,6 +997,7 @@ void
 hx509_name_free(hx509_name *name)
 {
     free_Name(&(*name)->der_name);
+    free((*name)->prep);
     memset(*name, 0, sizeof(**name));
     free(*name);
     *name = NULL;
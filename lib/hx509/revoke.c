@@ -50,19 +50,55 @@
  */
 
 #include "hx_locl.h"
+#include <heim_threads.h>
+
+/*
+ * Each CRL and OCSP file is parsed into a reference counted object.
+ * When a file changes on disk a new object is loaded and swapped into
+ * the revoke context, a verification that already holds the old one
+ * keeps using it until it is done.
+ *
+ * hx509_revoke_verify() reloads changed files itself unless the
+ * application turned that off with hx509_revoke_set_reload() and
+ * refreshes with hx509_revoke_refresh() from a thread of its own, then
+ * verifications never have to parse revocation data.
+ *
+ * One mutex covers the swaps, the reference counts and the signature
+ * state set on the objects, it is never held while parsing or
+ * verifying.
+ */
+
+static HEIMDAL_MUTEX revoke_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static unsigned long revoke_generation;
+
+/*
+ * Open addressed hash table over serial numbers, built when a CRL or
+ * OCSP response is loaded.  Each slot holds an index into
+ * revokedCertificates or responses plus one, zero marks an empty
+ * slot.
+ */
+
+struct serial_index {
+    size_t mask;
+    size_t *slots;
+};
 
 struct revoke_crl {
+    unsigned int ref;
     char *path;
     time_t last_modfied;
     CRLCertificateList crl;
+    struct serial_index index;
     int verified;
     int failed_verify;
 };
 
 struct revoke_ocsp {
+    unsigned int ref;
     char *path;
     time_t last_modfied;
     OCSPBasicOCSPResponse ocsp;
+    struct serial_index index;
     hx509_certs certs;
     hx509_cert signer;
 };
@@ -71,13 +107,15 @@ struct revoke_ocsp {
 struct hx509_revoke_ctx_data {
     unsigned int ref;
     struct {
-	struct revoke_crl *val;
+	struct revoke_crl **val;
 	size_t len;
     } crls;
     struct {
-	struct revoke_ocsp *val;
+	struct revoke_ocsp **val;
 	size_t len;
     } ocsps;
+    unsigned long generation;	/* bumped each time data is (re)loaded */
+    int reload;
 };
 
 /**
@@ -103,6 +141,7 @@ hx509_revoke_init(hx509_context context, hx509_revoke_ctx *ctx)
     (*ctx)->crls.val = NULL;
     (*ctx)->ocsps.len = 0;
     (*ctx)->ocsps.val = NULL;
+    (*ctx)->reload = 1;
 
     return 0;
 }
@@ -121,12 +160,71 @@ _hx509_revoke_ref(hx509_revoke_ctx ctx)
 }
 
 static void
-free_ocsp(struct revoke_ocsp *ocsp)
+release_ocsp(struct revoke_ocsp *ocsp)
 {
+    unsigned int ref;
+
+    if (ocsp == NULL)
+	return;
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    ref = --ocsp->ref;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+    if (ref > 0)
+	return;
+
     free(ocsp->path);
     free_OCSPBasicOCSPResponse(&ocsp->ocsp);
+    free(ocsp->index.slots);
     hx509_certs_free(&ocsp->certs);
     hx509_cert_free(ocsp->signer);
+    free(ocsp);
+}
+
+static void
+release_crl(struct revoke_crl *crl)
+{
+    unsigned int ref;
+
+    if (crl == NULL)
+	return;
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    ref = --crl->ref;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+    if (ref > 0)
+	return;
+
+    free(crl->path);
+    free_CRLCertificateList(&crl->crl);
+    free(crl->index.slots);
+    free(crl);
+}
+
+/* the current object for slot i, release with release_ocsp() */
+static struct revoke_ocsp *
+get_ocsp(hx509_revoke_ctx ctx, size_t i)
+{
+    struct revoke_ocsp *ocsp;
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    ocsp = ctx->ocsps.val[i];
+    ocsp->ref++;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+    return ocsp;
+}
+
+/* the current object for slot i, release with release_crl() */
+static struct revoke_crl *
+get_crl(hx509_revoke_ctx ctx, size_t i)
+{
+    struct revoke_crl *crl;
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    crl = ctx->crls.val[i];
+    crl->ref++;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+    return crl;
 }
 
 /**
@@ -150,28 +248,95 @@ hx509_revoke_free(hx509_revoke_ctx *ctx)
     if (--(*ctx)->ref > 0)
 	return;
 
-    for (i = 0; i < (*ctx)->crls.len; i++) {
-	free((*ctx)->crls.val[i].path);
-	free_CRLCertificateList(&(*ctx)->crls.val[i].crl);
-    }
+    for (i = 0; i < (*ctx)->crls.len; i++)
+	release_crl((*ctx)->crls.val[i]);
+    free((*ctx)->crls.val);
 
     for (i = 0; i < (*ctx)->ocsps.len; i++)
-	free_ocsp(&(*ctx)->ocsps.val[i]);
+	release_ocsp((*ctx)->ocsps.val[i]);
     free((*ctx)->ocsps.val);
 
-    free((*ctx)->crls.val);
-
     memset(*ctx, 0, sizeof(**ctx));
     free(*ctx);
     *ctx = NULL;
 }
 
+/**
+ * Select if hx509_revoke_verify() reloads CRL and OCSP files that
+ * changed on disk, the default.  Applications that turn this off
+ * should call hx509_revoke_refresh() now and then, typically from a
+ * thread of their own.
+ *
+ * @param ctx hx509 revokation context
+ * @param reload non zero to reload files when verifying
+ *
+ * @ingroup hx509_revoke
+ */
+
+void
+hx509_revoke_set_reload(hx509_revoke_ctx ctx, int reload)
+{
+    ctx->reload = reload;
+}
+
+/* called with revoke_mutex held */
+static void
+revoke_changed(hx509_revoke_ctx ctx)
+{
+    ctx->generation = ++revoke_generation;
+}
+
+static size_t
+serial_hash(const heim_integer *serial)
+{
+    const unsigned char *p = serial->data;
+    size_t i, h = 2166136261U;
+
+    for (i = 0; i < serial->length; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return h ^ serial->negative;
+}
+
+static int
+index_serials(hx509_context context, size_t len,
+	      const heim_integer *(*get)(const void *, size_t),
+	      const void *data, struct serial_index *index)
+{
+    size_t i, size, slot;
+
+    memset(index, 0, sizeof(*index));
+
+    if (len == 0)
+	return 0;
+
+    /* keep the load factor at or below one half */
+    for (size = 16; size < len * 2; size *= 2)
+	;
+
+    index->slots = calloc(size, sizeof(index->slots[0]));
+    if (index->slots == NULL) {
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    index->mask = size - 1;
+
+    for (i = 0; i < len; i++) {
+	slot = serial_hash((*get)(data, i)) & index->mask;
+	while (index->slots[slot] != 0)
+	    slot = (slot + 1) & index->mask;
+	index->slots[slot] = i + 1;
+    }
+
+    return 0;
+}
+
 static int
 verify_ocsp(hx509_context context,
 	    struct revoke_ocsp *ocsp,
 	    time_t time_now,
 	    hx509_certs certs,
-	    hx509_cert parent)
+	    hx509_cert parent,
+	    hx509_cert *ret_signer)
 {
     hx509_cert signer = NULL;
     hx509_query q;
@@ -250,7 +415,7 @@ verify_ocsp(hx509_context context,
 	goto out;
     }
 
-    ocsp->signer = signer;
+    *ret_signer = signer;
     signer = NULL;
 out:
     if (signer)
@@ -318,70 +483,132 @@ parse_ocsp_basic(const void *data, size_t length, OCSPBasicOCSPResponse *basic)
     return 0;
 }
 
+static const heim_integer *
+ocsp_serial(const void *data, size_t i)
+{
+    const OCSPBasicOCSPResponse *basic = data;
+    return &basic->tbsResponseData.responses.val[i].certID.serialNumber;
+}
+
 /*
- *
+ * Parse the OCSP response in path into a new object.
  */
 
 static int
-load_ocsp(hx509_context context, struct revoke_ocsp *ocsp)
+load_ocsp(hx509_context context, const char *path, struct revoke_ocsp **ret_ocsp)
 {
-    OCSPBasicOCSPResponse basic;
-    hx509_certs certs = NULL;
+    struct revoke_ocsp *ocsp;
     size_t length;
     struct stat sb;
     void *data;
     int ret;
 
-    ret = rk_undumpdata(ocsp->path, &data, &length);
-    if (ret)
+    *ret_ocsp = NULL;
+
+    ocsp = calloc(1, sizeof(*ocsp));
+    if (ocsp == NULL) {
+	hx509_clear_error_string(context);
+	return ENOMEM;
+    }
+    ocsp->ref = 1;
+    ocsp->path = strdup(path);
+    if (ocsp->path == NULL) {
+	release_ocsp(ocsp);
+	hx509_clear_error_string(context);
+	return ENOMEM;
+    }
+
+    ret = stat(path, &sb);
+    if (ret) {
+	ret = errno;
+	release_ocsp(ocsp);
 	return ret;
+    }
+    ocsp->last_modfied = sb.st_mtime;
 
-    ret = stat(ocsp->path, &sb);
-    if (ret)
-	return errno;
+    ret = rk_undumpdata(path, &data, &length);
+    if (ret) {
+	release_ocsp(ocsp);
+	return ret;
+    }
 
-    ret = parse_ocsp_basic(data, length, &basic);
+    ret = parse_ocsp_basic(data, length, &ocsp->ocsp);
     rk_xfree(data);
     if (ret) {
+	release_ocsp(ocsp);
 	hx509_set_error_string(context, 0, ret,
 			       "Failed to parse OCSP response");
 	return ret;
     }
 
-    if (basic.certs) {
+    if (ocsp->ocsp.certs) {
 	size_t i;
 
 	ret = hx509_certs_init(context, "MEMORY:ocsp-certs", 0,
-			       NULL, &certs);
+			       NULL, &ocsp->certs);
 	if (ret) {
-	    free_OCSPBasicOCSPResponse(&basic);
+	    release_ocsp(ocsp);
 	    return ret;
 	}
 
-	for (i = 0; i < basic.certs->len; i++) {
+	for (i = 0; i < ocsp->ocsp.certs->len; i++) {
 	    hx509_cert c;
 
-	    c = hx509_cert_init(context, &basic.certs->val[i], NULL);
+	    c = hx509_cert_init(context, &ocsp->ocsp.certs->val[i], NULL);
 	    if (c == NULL)
 		continue;
 
-	    ret = hx509_certs_add(context, certs, c);
+	    ret = hx509_certs_add(context, ocsp->certs, c);
 	    hx509_cert_free(c);
 	    if (ret)
 		continue;
 	}
     }
 
-    ocsp->last_modfied = sb.st_mtime;
+    ret = index_serials(context, ocsp->ocsp.tbsResponseData.responses.len,
+			ocsp_serial, &ocsp->ocsp, &ocsp->index);
+    if (ret) {
+	release_ocsp(ocsp);
+	return ret;
+    }
 
-    free_OCSPBasicOCSPResponse(&ocsp->ocsp);
-    hx509_certs_free(&ocsp->certs);
-    hx509_cert_free(ocsp->signer);
+    *ret_ocsp = ocsp;
+    return 0;
+}
+
+/*
+ * Reload the OCSP response in slot i if the file changed.
+ */
+
+static int
+refresh_ocsp(hx509_context context, hx509_revoke_ctx ctx, size_t i)
+{
+    struct revoke_ocsp *old, *ocsp;
+    struct stat sb;
+    int ret;
+
+    old = get_ocsp(ctx, i);
+    if (stat(old->path, &sb) != 0 || old->last_modfied == sb.st_mtime) {
+	release_ocsp(old);
+	return 0;
+    }
+
+    ret = load_ocsp(context, old->path, &ocsp);
+    if (ret) {
+	release_ocsp(old);
+	return ret;
+    }
 
-    ocsp->ocsp = basic;
-    ocsp->certs = certs;
-    ocsp->signer = NULL;
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    if (ctx->ocsps.val[i] == old) {
+	ctx->ocsps.val[i] = ocsp;
+	ocsp = old;		/* drop the context's reference */
+	revoke_changed(ctx);
+    }
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
 
+    release_ocsp(ocsp);
+    release_ocsp(old);
     return 0;
 }
 
@@ -402,6 +629,7 @@ hx509_revoke_add_ocsp(hx509_context context,
 		      hx509_revoke_ctx ctx,
 		      const char *path)
 {
+    struct revoke_ocsp *ocsp;
     void *data;
     int ret;
     size_t i;
@@ -415,36 +643,31 @@ hx509_revoke_add_ocsp(hx509_context context,
     path += 5;
 
     for (i = 0; i < ctx->ocsps.len; i++) {
-	if (strcmp(ctx->ocsps.val[0].path, path) == 0)
+	if (strcmp(ctx->ocsps.val[i]->path, path) == 0)
 	    return 0;
     }
 
+    ret = load_ocsp(context, path, &ocsp);
+    if (ret)
+	return ret;
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
     data = realloc(ctx->ocsps.val,
 		   (ctx->ocsps.len + 1) * sizeof(ctx->ocsps.val[0]));
-    if (data == NULL) {
-	hx509_clear_error_string(context);
-	return ENOMEM;
+    if (data != NULL) {
+	ctx->ocsps.val = data;
+	ctx->ocsps.val[ctx->ocsps.len++] = ocsp;
+	revoke_changed(ctx);
     }
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
 
-    ctx->ocsps.val = data;
-
-    memset(&ctx->ocsps.val[ctx->ocsps.len], 0,
-	   sizeof(ctx->ocsps.val[0]));
-
-    ctx->ocsps.val[ctx->ocsps.len].path = strdup(path);
-    if (ctx->ocsps.val[ctx->ocsps.len].path == NULL) {
+    if (data == NULL) {
+	release_ocsp(ocsp);
 	hx509_clear_error_string(context);
 	return ENOMEM;
     }
 
-    ret = load_ocsp(context, &ctx->ocsps.val[ctx->ocsps.len]);
-    if (ret) {
-	free(ctx->ocsps.val[ctx->ocsps.len].path);
-	return ret;
-    }
-    ctx->ocsps.len++;
-
-    return ret;
+    return 0;
 }
 
 /*
@@ -585,41 +808,114 @@ crl_parser(hx509_context context, const char *type,
     return 0;
 }
 
+static const heim_integer *
+crl_serial(const void *data, size_t i)
+{
+    const CRLCertificateList *crl = data;
+    return &crl->tbsCertList.revokedCertificates->val[i].userCertificate;
+}
+
+/*
+ * Parse the CRL in path into a new object.
+ */
+
 static int
-load_crl(hx509_context context, const char *path, time_t *t, CRLCertificateList *crl)
+load_crl(hx509_context context, const char *path, struct revoke_crl **ret_crl)
 {
+    struct revoke_crl *crl;
     struct stat sb;
     size_t length;
     void *data;
     FILE *f;
     int ret;
 
-    memset(crl, 0, sizeof(*crl));
+    *ret_crl = NULL;
+
+    crl = calloc(1, sizeof(*crl));
+    if (crl == NULL) {
+	hx509_clear_error_string(context);
+	return ENOMEM;
+    }
+    crl->ref = 1;
+    crl->path = strdup(path);
+    if (crl->path == NULL) {
+	release_crl(crl);
+	hx509_clear_error_string(context);
+	return ENOMEM;
+    }
 
     ret = stat(path, &sb);
-    if (ret)
-	return errno;
-    
-    *t = sb.st_mtime;
-	
-    if ((f = fopen(path, "r")) == NULL)
-	return errno;
+    if (ret) {
+	ret = errno;
+	release_crl(crl);
+	return ret;
+    }
+    crl->last_modfied = sb.st_mtime;
+
+    if ((f = fopen(path, "r")) == NULL) {
+	ret = errno;
+	release_crl(crl);
+	return ret;
+    }
 
     rk_cloexec_file(f);
 
-    ret = hx509_pem_read(context, f, crl_parser, crl);
+    ret = hx509_pem_read(context, f, crl_parser, &crl->crl);
     fclose(f);
 
     if (ret == HX509_PARSING_KEY_FAILED) {
 
 	ret = rk_undumpdata(path, &data, &length);
-	if (ret)
+	if (ret) {
+	    release_crl(crl);
 	    return ret;
+	}
 
-	ret = crl_parser(context, "X509 CRL", NULL, data, length, crl);
+	ret = crl_parser(context, "X509 CRL", NULL, data, length, &crl->crl);
 	rk_xfree(data);
     }
-    return ret;
+    if (ret == 0 && crl->crl.tbsCertList.revokedCertificates)
+	ret = index_serials(context,
+			    crl->crl.tbsCertList.revokedCertificates->len,
+			    crl_serial, &crl->crl, &crl->index);
+    if (ret) {
+	release_crl(crl);
+	return ret;
+    }
+
+    *ret_crl = crl;
+    return 0;
+}
+
+/*
+ * Reload the CRL in slot i if the file changed, a CRL that fails to
+ * load keeps the old content.
+ */
+
+static void
+refresh_crl(hx509_context context, hx509_revoke_ctx ctx, size_t i)
+{
+    struct revoke_crl *old, *crl;
+    struct stat sb;
+
+    old = get_crl(ctx, i);
+    if (stat(old->path, &sb) != 0 || old->last_modfied == sb.st_mtime ||
+	load_crl(context, old->path, &crl) != 0)
+    {
+	release_crl(old);
+	return;
+    }
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    if (ctx->crls.val[i] == old) {
+	ctx->crls.val[i] = crl;
+	crl = old;		/* drop the context's reference */
+	revoke_changed(ctx);
+    }
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+
+    release_crl(crl);
+    release_crl(old);
 }
 
 /**
@@ -639,6 +935,7 @@ hx509_revoke_add_crl(hx509_context context,
 		     hx509_revoke_ctx ctx,
 		     const char *path)
 {
+    struct revoke_crl *crl;
     void *data;
     size_t i;
     int ret;
@@ -653,38 +950,169 @@ hx509_revoke_add_crl(hx509_context context,
     path += 5;
 
     for (i = 0; i < ctx->crls.len; i++) {
-	if (strcmp(ctx->crls.val[i].path, path) == 0)
+	if (strcmp(ctx->crls.val[i]->path, path) == 0)
 	    return 0;
     }
 
+    ret = load_crl(context, path, &crl);
+    if (ret)
+	return ret;
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
     data = realloc(ctx->crls.val,
 		   (ctx->crls.len + 1) * sizeof(ctx->crls.val[0]));
+    if (data != NULL) {
+	ctx->crls.val = data;
+	ctx->crls.val[ctx->crls.len++] = crl;
+	revoke_changed(ctx);
+    }
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+
     if (data == NULL) {
+	release_crl(crl);
 	hx509_clear_error_string(context);
 	return ENOMEM;
     }
-    ctx->crls.val = data;
 
-    memset(&ctx->crls.val[ctx->crls.len], 0, sizeof(ctx->crls.val[0]));
+    return 0;
+}
 
-    ctx->crls.val[ctx->crls.len].path = strdup(path);
-    if (ctx->crls.val[ctx->crls.len].path == NULL) {
-	hx509_clear_error_string(context);
-	return ENOMEM;
+/*
+ * Look up the certificate in one OCSP response.  Returns 0 or
+ * HX509_CERT_REVOKED and sets *answered if the response has a usable
+ * answer for it.
+ */
+
+static int
+ocsp_status(hx509_context context, struct revoke_ocsp *ocsp, time_t now,
+	    const Certificate *c, const Certificate *p, int *answered)
+{
+    OCSPSingleResponse *r;
+    heim_octet_string os;
+    size_t slot;
+    int ret;
+
+    *answered = 0;
+
+    if (ocsp->index.slots == NULL)
+	return 0;
+
+    /* walk all responses with the same serial number hash */
+    for (slot = serial_hash(&c->tbsCertificate.serialNumber) & ocsp->index.mask;
+	 ocsp->index.slots[slot] != 0;
+	 slot = (slot + 1) & ocsp->index.mask)
+    {
+	r = &ocsp->ocsp.tbsResponseData.responses.val[ocsp->index.slots[slot] - 1];
+
+	ret = der_heim_integer_cmp(&r->certID.serialNumber,
+				   &c->tbsCertificate.serialNumber);
+	if (ret != 0)
+	    continue;
+
+	/* verify issuer hashes hash */
+	ret = _hx509_verify_signature(context,
+				      NULL,
+				      &r->certID.hashAlgorithm,
+				      &c->tbsCertificate.issuer._save,
+				      &r->certID.issuerNameHash);
+	if (ret != 0)
+	    continue;
+
+	os.data = p->tbsCertificate.subjectPublicKeyInfo.subjectPublicKey.data;
+	os.length = p->tbsCertificate.subjectPublicKeyInfo.subjectPublicKey.length / 8;
+
+	ret = _hx509_verify_signature(context,
+				      NULL,
+				      &r->certID.hashAlgorithm,
+				      &os,
+				      &r->certID.issuerKeyHash);
+	if (ret != 0)
+	    continue;
+
+	switch (r->certStatus.element) {
+	case choice_OCSPCertStatus_good:
+	    break;
+	case choice_OCSPCertStatus_revoked:
+	    *answered = 1;
+	    hx509_set_error_string(context, 0,
+				   HX509_CERT_REVOKED,
+				   "Certificate revoked by issuer in OCSP");
+	    return HX509_CERT_REVOKED;
+	case choice_OCSPCertStatus_unknown:
+	    continue;
+	}
+
+	/* don't allow the update to be in the future */
+	if (r->thisUpdate > now + context->ocsp_time_diff)
+	    continue;
+
+	/* don't allow the next update to be in the past */
+	if (r->nextUpdate) {
+	    if (*r->nextUpdate < now)
+		continue;
+	} /* else should force a refetch, but can we ? */
+
+	*answered = 1;
+	return 0;
     }
 
-    ret = load_crl(context,
-		   path,
-		   &ctx->crls.val[ctx->crls.len].last_modfied,
-		   &ctx->crls.val[ctx->crls.len].crl);
-    if (ret) {
-	free(ctx->crls.val[ctx->crls.len].path);
-	return ret;
+    return 0;
+}
+
+/*
+ * Look up the certificate in one CRL from its issuer.
+ */
+
+static int
+crl_status(hx509_context context, struct revoke_crl *crl, time_t now,
+	   const Certificate *c)
+{
+    size_t j, k, slot;
+    time_t t;
+    int ret;
+
+    if (crl->crl.tbsCertList.crlExtensions) {
+	for (j = 0; j < crl->crl.tbsCertList.crlExtensions->len; j++) {
+	    if (crl->crl.tbsCertList.crlExtensions->val[j].critical) {
+		hx509_set_error_string(context, 0,
+				       HX509_CRL_UNKNOWN_EXTENSION,
+				       "Unknown CRL extension");
+		return HX509_CRL_UNKNOWN_EXTENSION;
+	    }
+	}
     }
 
-    ctx->crls.len++;
+    if (crl->index.slots == NULL)
+	return 0;
 
-    return ret;
+    /* check if cert is in crl, walking all entries with the same hash */
+    for (slot = serial_hash(&c->tbsCertificate.serialNumber) & crl->index.mask;
+	 crl->index.slots[slot] != 0;
+	 slot = (slot + 1) & crl->index.mask)
+    {
+	j = crl->index.slots[slot] - 1;
+
+	ret = der_heim_integer_cmp(&crl->crl.tbsCertList.revokedCertificates->val[j].userCertificate,
+				   &c->tbsCertificate.serialNumber);
+	if (ret != 0)
+	    continue;
+
+	t = _hx509_Time2time_t(&crl->crl.tbsCertList.revokedCertificates->val[j].revocationDate);
+	if (t > now)
+	    continue;
+
+	if (crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions)
+	    for (k = 0; k < crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions->len; k++)
+		if (crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions->val[k].critical)
+		    return HX509_CRL_UNKNOWN_EXTENSION;
+
+	hx509_set_error_string(context, 0,
+			       HX509_CERT_REVOKED,
+			       "Certificate revoked by issuer in CRL");
+	return HX509_CERT_REVOKED;
+    }
+
+    return 0;
 }
 
 /**
@@ -714,172 +1142,226 @@ hx509_revoke_verify(hx509_context context,
 {
     const Certificate *c = _hx509_get_cert(cert);
     const Certificate *p = _hx509_get_cert(parent_cert);
-    unsigned long i, j, k;
-    int ret;
+    size_t i, len;
+    int ret, answered;
 
     hx509_clear_error_string(context);
 
-    for (i = 0; i < ctx->ocsps.len; i++) {
-	struct revoke_ocsp *ocsp = &ctx->ocsps.val[i];
-	struct stat sb;
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    len = ctx->ocsps.len;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
 
-	/* check this ocsp apply to this cert */
+    for (i = 0; i < len; i++) {
+	struct revoke_ocsp *ocsp;
+	hx509_cert signer;
 
 	/* check if there is a newer version of the file */
-	ret = stat(ocsp->path, &sb);
-	if (ret == 0 && ocsp->last_modfied != sb.st_mtime) {
-	    ret = load_ocsp(context, ocsp);
-	    if (ret)
-		continue;
-	}
-
-	/* verify signature in ocsp if not already done */
-	if (ocsp->signer == NULL) {
-	    ret = verify_ocsp(context, ocsp, now, certs, parent_cert);
-	    if (ret)
-		continue;
-	}
-
-	for (j = 0; j < ocsp->ocsp.tbsResponseData.responses.len; j++) {
-	    heim_octet_string os;
-
-	    ret = der_heim_integer_cmp(&ocsp->ocsp.tbsResponseData.responses.val[j].certID.serialNumber,
-				   &c->tbsCertificate.serialNumber);
-	    if (ret != 0)
-		continue;
-
-	    /* verify issuer hashes hash */
-	    ret = _hx509_verify_signature(context,
-					  NULL,
-					  &ocsp->ocsp.tbsResponseData.responses.val[i].certID.hashAlgorithm,
-					  &c->tbsCertificate.issuer._save,
-					  &ocsp->ocsp.tbsResponseData.responses.val[i].certID.issuerNameHash);
-	    if (ret != 0)
-		continue;
-
-	    os.data = p->tbsCertificate.subjectPublicKeyInfo.subjectPublicKey.data;
-	    os.length = p->tbsCertificate.subjectPublicKeyInfo.subjectPublicKey.length / 8;
+	if (ctx->reload && refresh_ocsp(context, ctx, i) != 0)
+	    continue;
 
-	    ret = _hx509_verify_signature(context,
-					  NULL,
-					  &ocsp->ocsp.tbsResponseData.responses.val[j].certID.hashAlgorithm,
-					  &os,
-					  &ocsp->ocsp.tbsResponseData.responses.val[j].certID.issuerKeyHash);
-	    if (ret != 0)
-		continue;
+	ocsp = get_ocsp(ctx, i);
 
-	    switch (ocsp->ocsp.tbsResponseData.responses.val[j].certStatus.element) {
-	    case choice_OCSPCertStatus_good:
-		break;
-	    case choice_OCSPCertStatus_revoked:
-		hx509_set_error_string(context, 0,
-				       HX509_CERT_REVOKED,
-				       "Certificate revoked by issuer in OCSP");
-		return HX509_CERT_REVOKED;
-	    case choice_OCSPCertStatus_unknown:
+	/* verify signature in ocsp if not already done */
+	HEIMDAL_MUTEX_lock(&revoke_mutex);
+	signer = ocsp->signer;
+	HEIMDAL_MUTEX_unlock(&revoke_mutex);
+	if (signer == NULL) {
+	    ret = verify_ocsp(context, ocsp, now, certs, parent_cert, &signer);
+	    if (ret) {
+		release_ocsp(ocsp);
 		continue;
 	    }
-
-	    /* don't allow the update to be in the future */
-	    if (ocsp->ocsp.tbsResponseData.responses.val[j].thisUpdate >
-		now + context->ocsp_time_diff)
-		continue;
-
-	    /* don't allow the next update to be in the past */
-	    if (ocsp->ocsp.tbsResponseData.responses.val[j].nextUpdate) {
-		if (*ocsp->ocsp.tbsResponseData.responses.val[j].nextUpdate < now)
-		    continue;
-	    } /* else should force a refetch, but can we ? */
-
-	    return 0;
+	    HEIMDAL_MUTEX_lock(&revoke_mutex);
+	    if (ocsp->signer == NULL) {
+		ocsp->signer = signer;
+		signer = NULL;
+	    }
+	    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+	    hx509_cert_free(signer);
 	}
+
+	ret = ocsp_status(context, ocsp, now, c, p, &answered);
+	release_ocsp(ocsp);
+	if (answered)
+	    return ret;
     }
 
-    for (i = 0; i < ctx->crls.len; i++) {
-	struct revoke_crl *crl = &ctx->crls.val[i];
-	struct stat sb;
-	int diff;
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    len = ctx->crls.len;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+
+    for (i = 0; i < len; i++) {
+	struct revoke_crl *crl;
+	int diff, verified, failed;
 
 	/* check if cert.issuer == crls.val[i].crl.issuer */
+	crl = get_crl(ctx, i);
 	ret = _hx509_name_cmp(&c->tbsCertificate.issuer,
 			      &crl->crl.tbsCertList.issuer, &diff);
-	if (ret || diff)
+	if (ret || diff) {
+	    release_crl(crl);
 	    continue;
+	}
 
-	ret = stat(crl->path, &sb);
-	if (ret == 0 && crl->last_modfied != sb.st_mtime) {
-	    CRLCertificateList cl;
-
-	    ret = load_crl(context, crl->path, &crl->last_modfied, &cl);
-	    if (ret == 0) {
-		free_CRLCertificateList(&crl->crl);
-		crl->crl = cl;
-		crl->verified = 0;
-		crl->failed_verify = 0;
-	    }
+	if (ctx->reload) {
+	    release_crl(crl);
+	    refresh_crl(context, ctx, i);
+	    crl = get_crl(ctx, i);
 	}
-	if (crl->failed_verify)
+
+	HEIMDAL_MUTEX_lock(&revoke_mutex);
+	verified = crl->verified;
+	failed = crl->failed_verify;
+	HEIMDAL_MUTEX_unlock(&revoke_mutex);
+
+	if (failed) {
+	    release_crl(crl);
 	    continue;
+	}
 
 	/* verify signature in crl if not already done */
-	if (crl->verified == 0) {
+	if (!verified) {
 	    ret = verify_crl(context, ctx, &crl->crl, now, certs, parent_cert);
-	    if (ret) {
+	    HEIMDAL_MUTEX_lock(&revoke_mutex);
+	    if (ret)
 		crl->failed_verify = 1;
+	    else
+		crl->verified = 1;
+	    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+	    if (ret) {
+		release_crl(crl);
 		continue;
 	    }
-	    crl->verified = 1;
 	}
 
-	if (crl->crl.tbsCertList.crlExtensions) {
-	    for (j = 0; j < crl->crl.tbsCertList.crlExtensions->len; j++) {
-		if (crl->crl.tbsCertList.crlExtensions->val[j].critical) {
-		    hx509_set_error_string(context, 0,
-					   HX509_CRL_UNKNOWN_EXTENSION,
-					   "Unknown CRL extension");
-		    return HX509_CRL_UNKNOWN_EXTENSION;
-		}
-	    }
-	}
+	ret = crl_status(context, crl, now, c);
+	release_crl(crl);
+	return ret;
+    }
 
-	if (crl->crl.tbsCertList.revokedCertificates == NULL)
-	    return 0;
 
-	/* check if cert is in crl */
-	for (j = 0; j < crl->crl.tbsCertList.revokedCertificates->len; j++) {
-	    time_t t;
+    if (context->flags & HX509_CTX_VERIFY_MISSING_OK)
+	return 0;
+    hx509_set_error_string(context, HX509_ERROR_APPEND,
+			   HX509_REVOKE_STATUS_MISSING,
+			   "No revoke status found for "
+			   "certificates");
+    return HX509_REVOKE_STATUS_MISSING;
+}
+
+/*
+ * Earliest time any of the loaded revocation data says it should be
+ * updated, 0 if none says.
+ */
 
-	    ret = der_heim_integer_cmp(&crl->crl.tbsCertList.revokedCertificates->val[j].userCertificate,
-				       &c->tbsCertificate.serialNumber);
-	    if (ret != 0)
-		continue;
+static time_t
+revoke_next_update(hx509_revoke_ctx ctx)
+{
+    size_t i, j, len;
+    time_t t, next = 0;
 
-	    t = _hx509_Time2time_t(&crl->crl.tbsCertList.revokedCertificates->val[j].revocationDate);
-	    if (t > now)
-		continue;
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    len = ctx->ocsps.len;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
 
-	    if (crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions)
-		for (k = 0; k < crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions->len; k++)
-		    if (crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions->val[k].critical)
-			return HX509_CRL_UNKNOWN_EXTENSION;
+    for (i = 0; i < len; i++) {
+	struct revoke_ocsp *ocsp = get_ocsp(ctx, i);
 
-	    hx509_set_error_string(context, 0,
-				   HX509_CERT_REVOKED,
-				   "Certificate revoked by issuer in CRL");
-	    return HX509_CERT_REVOKED;
+	for (j = 0; j < ocsp->ocsp.tbsResponseData.responses.len; j++) {
+	    if (ocsp->ocsp.tbsResponseData.responses.val[j].nextUpdate == NULL)
+		continue;
+	    t = *ocsp->ocsp.tbsResponseData.responses.val[j].nextUpdate;
+	    if (next == 0 || t < next)
+		next = t;
 	}
+	release_ocsp(ocsp);
+    }
 
-	return 0;
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    len = ctx->crls.len;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+
+    for (i = 0; i < len; i++) {
+	struct revoke_crl *crl = get_crl(ctx, i);
+
+	if (crl->crl.tbsCertList.nextUpdate) {
+	    t = _hx509_Time2time_t(crl->crl.tbsCertList.nextUpdate);
+	    if (next == 0 || t < next)
+		next = t;
+	}
+	release_crl(crl);
     }
 
+    return next;
+}
 
-    if (context->flags & HX509_CTX_VERIFY_MISSING_OK)
-	return 0;
-    hx509_set_error_string(context, HX509_ERROR_APPEND,
-			   HX509_REVOKE_STATUS_MISSING,
-			   "No revoke status found for "
-			   "certificates");
-    return HX509_REVOKE_STATUS_MISSING;
+static void
+revoke_refresh_all(hx509_context context, hx509_revoke_ctx ctx)
+{
+    size_t i, len;
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    len = ctx->ocsps.len;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+    for (i = 0; i < len; i++)
+	(void)refresh_ocsp(context, ctx, i);
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    len = ctx->crls.len;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
+    for (i = 0; i < len; i++)
+	refresh_crl(context, ctx, i);
+}
+
+/**
+ * Reload the CRL and OCSP files of the revokation context that
+ * changed on disk.  The new data replaces the old atomically, so this
+ * can run in another thread than the verifications using the context,
+ * as long as it uses a hx509 context of its own.
+ *
+ * @param context hx509 context
+ * @param ctx hx509 revokation context
+ * @param next_update returns the earliest time any of the data says
+ * it should be updated, 0 if none does, may be NULL.
+ *
+ * @return An hx509 error code, see hx509_get_error_string().
+ *
+ * @ingroup hx509_revoke
+ */
+
+int
+hx509_revoke_refresh(hx509_context context,
+		     hx509_revoke_ctx ctx,
+		     time_t *next_update)
+{
+    revoke_refresh_all(context, ctx);
+    if (next_update)
+	*next_update = revoke_next_update(ctx);
+    return 0;
+}
+
+/*
+ * Return the generation of the revocation data together with the
+ * earliest time any of it needs to be updated (0 if none says), for
+ * callers that cache the outcome of hx509_revoke_verify().  Changed
+ * files are reloaded first, unless that is left to
+ * hx509_revoke_refresh().
+ */
+
+void
+_hx509_revoke_state(hx509_context context,
+		    hx509_revoke_ctx ctx,
+		    unsigned long *generation,
+		    time_t *expire)
+{
+    if (ctx->reload)
+	revoke_refresh_all(context, ctx);
+
+    *expire = revoke_next_update(ctx);
+
+    HEIMDAL_MUTEX_lock(&revoke_mutex);
+    *generation = ctx->generation;
+    HEIMDAL_MUTEX_unlock(&revoke_mutex);
 }
 
 struct ocsp_add_ctx {
@@ -1201,11 +1683,12 @@ hx509_revoke_print(hx509_context context,
     size_t n;
 
     for (n = 0; n < ctx->ocsps.len; n++) {
-	struct revoke_ocsp *ocsp = &ctx->ocsps.val[n];
+	struct revoke_ocsp *ocsp = get_ocsp(ctx, n);
 
 	fprintf(out, "OCSP %s\n", ocsp->path);
 
 	ret = print_ocsp(context, ocsp, out);
+	release_ocsp(ocsp);
 	if (ret) {
 	    fprintf(out, "failure printing OCSP: %d\n", ret);
 	    saved_ret = ret;
@@ -1213,11 +1696,12 @@ hx509_revoke_print(hx509_context context,
     }
 
     for (n = 0; n < ctx->crls.len; n++) {
-	struct revoke_crl *crl = &ctx->crls.val[n];
+	struct revoke_crl *crl = get_crl(ctx, n);
 
 	fprintf(out, "CRL %s\n", crl->path);
 
 	ret = print_crl(context, crl, out);
+	release_crl(crl);
 	if (ret) {
 	    fprintf(out, "failure printing CRL: %d\n", ret);
 	    saved_ret = ret;
@@ -1242,27 +1726,19 @@ hx509_revoke_print(hx509_context context,
 int
 hx509_revoke_ocsp_print(hx509_context context, const char *path, FILE *out)
 {
-    struct revoke_ocsp ocsp;
+    struct revoke_ocsp *ocsp;
     int ret;
 
     if (out == NULL)
 	out = stdout;
 
-    memset(&ocsp, 0, sizeof(ocsp));
-
-    ocsp.path = strdup(path);
-    if (ocsp.path == NULL)
-	return ENOMEM;
-
-    ret = load_ocsp(context, &ocsp);
-    if (ret) {
-	free_ocsp(&ocsp);
+    ret = load_ocsp(context, path, &ocsp);
+    if (ret)
 	return ret;
-    }
 
-    ret = print_ocsp(context, &ocsp, out);
+    ret = print_ocsp(context, ocsp, out);
 
-    free_ocsp(&ocsp);
+    release_ocsp(ocsp);
     return ret;
 }
 
@@ -100,6 +100,66 @@ test_expand(hx509_context context, const char *name, const char *expected)
     return 0;
 }
 
+static int
+test_name_cmp(hx509_context context, const char *name1, const char *name2,
+	      int equal)
+{
+    hx509_name n1, n2, n3;
+    int ret;
+
+    if (hx509_parse_name(context, name1, &n1))
+	return 1;
+    if (hx509_parse_name(context, name2, &n2))
+	return 1;
+
+    ret = (hx509_name_cmp(n1, n2) == 0) != equal;
+
+    /* again with the stringprep'ed forms kept from the first time */
+    if (hx509_name_cmp(n1, n2) != hx509_name_cmp(n1, n2))
+	ret = 1;
+    if (hx509_name_cmp(n1, n2) != -hx509_name_cmp(n2, n1))
+	ret = 1;
+    if (hx509_name_normalize(context, n1))
+	ret = 1;
+    if (hx509_name_copy(context, n1, &n3))
+	return 1;
+    if (hx509_name_cmp(n1, n3) != 0)
+	ret = 1;
+
+    hx509_name_free(&n1);
+    hx509_name_free(&n2);
+    hx509_name_free(&n3);
+
+    return ret;
+}
+
+static int
+test_expand_cmp(hx509_context context)
+{
+    hx509_env env = NULL;
+    hx509_name n1, n2;
+    int ret;
+
+    hx509_env_add(context, &env, "uid", "lha");
+
+    if (hx509_parse_name(context, "UID=${uid},C=SE", &n1))
+	return 1;
+    if (hx509_parse_name(context, "UID=lha,C=SE", &n2))
+	return 1;
+
+    ret = hx509_name_cmp(n1, n2) == 0;
+    if (hx509_name_expand(context, n1, env))
+	ret = 1;
+    if (hx509_name_cmp(n1, n2) != 0)
+	ret = 1;
+
+    hx509_env_free(&env);
+    hx509_name_free(&n1);
+    hx509_name_free(&n2);
+
+    return ret;
+}
+
 char certdata1[] =
     "\x30\x82\x04\x1d\x30\x82\x03\x05\xa0\x03\x02\x01\x02\x02\x10\x4e"
     "\x81\x2d\x8a\x82\x65\xe0\x0b\x02\xee\x3e\x35\x02\x46\xe5\x3d\x30"
@@ -376,6 +436,14 @@ main(int argc, char **argv)
 
     ret += test_compare(context);
 
+    ret += test_name_cmp(context, "CN=foo,C=SE", "CN=foo,C=SE", 1);
+    ret += test_name_cmp(context, "CN=foo,C=SE", "CN=bar,C=SE", 0);
+    ret += test_name_cmp(context, "CN=foo,C=SE", "O=foo,C=SE", 0);
+    ret += test_name_cmp(context, "CN=foo,C=SE", "CN=foo,CN=foo,C=SE", 0);
+    ret += test_name_cmp(context, "CN=foo,C=SE", "CN=foo", 0);
+    ret += test_name_cmp(context, "CN=f\xc3\xa5,C=SE", "CN=f\xc3\xa5,C=SE", 1);
+    ret += test_expand_cmp(context);
+
     hx509_context_free(&context);
 
     return ret;
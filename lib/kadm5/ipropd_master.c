@@ -310,42 +310,67 @@ error:
     remove_slave(context, s, root);
 }
 
+/*
+ * The entries are collected in a chunked memory storage and written
+ * to the dump file a megabyte at a time rather than with two write(2)
+ * calls per entry.  Truncating the storage after each write keeps
+ * its chunks, so they are filled again without new allocations.
+ */
+
+#define DUMP_FLUSH_SIZE (1024 * 1024)
+
+struct dump_buffer {
+    krb5_storage *sp;
+    int fd;
+};
+
+static krb5_error_code
+dump_flush(struct dump_buffer *b)
+{
+    krb5_error_code ret;
+
+    ret = krb5_storage_to_fd(b->sp, b->fd);
+    if (ret == 0)
+	ret = krb5_storage_truncate(b->sp, 0);
+    return ret;
+}
+
 static int
 dump_one (krb5_context context, HDB *db, hdb_entry_ex *entry, void *v)
 {
     krb5_error_code ret;
-    krb5_storage *dump = (krb5_storage *)v;
-    krb5_storage *sp;
+    struct dump_buffer *b = v;
     krb5_data data;
 
     ret = hdb_entry2value (context, &entry->entry, &data);
     if (ret)
 	return ret;
-    ret = krb5_data_realloc (&data, data.length + 4);
-    if (ret)
-	goto done;
-    memmove ((char *)data.data + 4, data.data, data.length - 4);
-    sp = krb5_storage_from_data(&data);
-    if (sp == NULL) {
-	ret = ENOMEM;
-	goto done;
-    }
-    krb5_store_int32(sp, ONE_PRINC);
-    krb5_storage_free(sp);
 
-    ret = krb5_store_data(dump, data);
-
-done:
+    /* the same as krb5_store_data() of ONE_PRINC followed by the entry */
+    ret = krb5_storage_reserve(b->sp, data.length + 8);
+    if (ret == 0)
+	ret = krb5_store_uint32(b->sp, data.length + 4);
+    if (ret == 0)
+	ret = krb5_store_int32(b->sp, ONE_PRINC);
+    if (ret == 0 &&
+	krb5_storage_write(b->sp, data.data, data.length) != (ssize_t)data.length)
+	ret = ENOMEM;
     krb5_data_free (&data);
+    if (ret)
+	return ret;
+
+    if (krb5_storage_seek(b->sp, 0, SEEK_CUR) >= DUMP_FLUSH_SIZE)
+	ret = dump_flush(b);
     return ret;
 }
 
 static int
-write_dump (krb5_context context, krb5_storage *dump,
+write_dump (krb5_context context, krb5_storage *dump, int fd,
 	    const char *database, uint32_t current_version)
 {
     krb5_error_code ret;
     krb5_storage *sp;
+    struct dump_buffer b;
     HDB *db;
     krb5_data data;
     char buf[8];
@@ -388,7 +413,14 @@ write_dump (krb5_context context, krb5_storage *dump,
 	return ret;
     }
 
-    ret = hdb_foreach (context, db, HDB_F_ADMIN_DATA, dump_one, dump);
+    b.fd = fd;
+    b.sp = krb5_storage_chunked();
+    if (b.sp == NULL)
+	krb5_errx (context, 1, "krb5_storage_chunked");
+    ret = hdb_foreach (context, db, HDB_F_ADMIN_DATA, dump_one, &b);
+    if (ret == 0)
+	ret = dump_flush(&b);
+    krb5_storage_free(b.sp);
     if (ret) {
 	krb5_warn (context, ret, "write_dump: hdb_foreach");
 	return ret;
@@ -553,7 +585,7 @@ send_complete (krb5_context context, slave *s, const char *database,
 
 	/* Now, we know that we must write a new dump file.  */
 
-	ret = write_dump(context, dump, database, current_version);
+	ret = write_dump(context, dump, fd, database, current_version);
 	if (ret)
 	    goto done;
 
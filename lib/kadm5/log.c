@@ -198,21 +198,13 @@ static kadm5_ret_t
 kadm5_log_flush (kadm5_log_context *log_context,
 		 krb5_storage *sp)
 {
-    krb5_data data;
-    size_t len;
-    ssize_t ret;
-
-    krb5_storage_to_data(sp, &data);
-    len = data.length;
-    ret = write (log_context->log_fd, data.data, len);
-    if (ret < 0 || (size_t)ret != len) {
-	krb5_data_free(&data);
-	return errno;
-    }
-    if (fsync (log_context->log_fd) < 0) {
-	krb5_data_free(&data);
+    krb5_error_code ret;
+
+    ret = krb5_storage_to_fd(sp, log_context->log_fd);
+    if (ret)
+	return ret;
+    if (fsync (log_context->log_fd) < 0)
 	return errno;
-    }
 
     /*
      * Try to send a signal to any running `ipropd-master'
@@ -233,7 +225,6 @@ kadm5_log_flush (kadm5_log_context *log_context,
 	    log_context->socket_info->ai_addrlen);
 #endif
 
-    krb5_data_free(&data);
     return 0;
 }
 
@@ -262,6 +253,7 @@ kadm5_log_create (kadm5_server_context *context,
 	krb5_storage_free(sp);
 	return ret;
     }
+    krb5_storage_reserve(sp, value.length + 12);
     krb5_store_int32 (sp, value.length);
     krb5_storage_write(sp, value.data, value.length);
     krb5_store_int32 (sp, value.length);
@@ -533,6 +525,7 @@ kadm5_log_modify (kadm5_server_context *context,
 	goto failed;
 
     len = value.length + 4;
+    krb5_storage_reserve(sp, len + 12);
     ret = krb5_store_int32 (sp, len);
     if (ret)
 	goto failed;
@@ -601,6 +601,715 @@ _krb5_config_copy(krb5_context context,
 
 #endif /* HEIMDAL_SMALLER */
 
+/*
+ * Compiled configuration snapshot.
+ *
+ * The string leaves of context->cf are compiled into an immutable
+ * hash table keyed on the full path of names.  Every name is
+ * interned once, so a lookup hashes the names it is given, fails
+ * early if any of them do not occur anywhere in the configuration,
+ * and otherwise compares paths by pointer.  The boolean, time and
+ * integer interpretations of each value are computed when the
+ * snapshot is built.
+ *
+ * The snapshot only holds what a lookup from the top of the tree
+ * would find: at each level the first list with a given name is
+ * followed and the first string with a given name is recorded.
+ *
+ * A snapshot is replaced, never modified, when the configuration is
+ * reloaded.  Readers take no lock: they count themselves in
+ * snapshot_readers while they look at a snapshot, and a handle holds
+ * a reference to the snapshot its cached entry came from.  A replaced
+ * snapshot goes on the retired list and is freed once no handle
+ * refers to it and there is a moment without readers, which is
+ * checked for on every reload and whenever the last reader leaves.
+ * A reader racing a reload still sees a consistent, if stale, view.
+ * As with the tree, strings returned are only valid until the
+ * configuration is changed.
+ */
+
+#define CONFIG_MAX_DEPTH	16
+
+#define CONFIG_TIME_VALID	1
+#define CONFIG_INT_VALID	2
+
+struct config_name {
+    struct config_name *next;
+    uint32_t hash;
+    char str[1];
+};
+
+struct config_entry {
+    struct config_entry *next;
+    struct krb5_config_snapshot *snapshot;
+    uint32_t hash;
+    unsigned int flags;
+    const char *value;
+    krb5_boolean bool_value;
+    int time_value;
+    int int_value;
+    size_t depth;
+    const struct config_name *path[1];
+};
+
+struct krb5_config_snapshot {
+    struct krb5_config_snapshot *next_retired;
+    volatile unsigned int refcount;
+    size_t size;
+    struct config_name **names;
+    struct config_entry **entries;
+    struct config_entry missing;
+};
+
+struct krb5_config_handle {
+    struct config_entry * volatile cached;
+    size_t len;
+    char *names[1];
+};
+
+/*
+ * What a lookup found in the snapshot, copied out while the reader
+ * is still counted.
+ */
+
+struct config_value {
+    int found;
+    unsigned int flags;
+    krb5_boolean bool_value;
+    int time_value;
+    int int_value;
+};
+
+/* protects the retired list */
+static HEIMDAL_MUTEX snapshot_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct krb5_config_snapshot *snapshot_retired;
+static volatile unsigned int snapshot_readers;
+
+#ifdef HAVE___SYNC_ADD_AND_FETCH
+#define snapshot_barrier() __sync_synchronize()
+#define snapshot_inc(x) __sync_add_and_fetch((x), 1)
+#define snapshot_dec(x) __sync_sub_and_fetch((x), 1)
+#define snapshot_cas(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#else
+static HEIMDAL_MUTEX snapshot_count_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+#define snapshot_barrier() do { } while (0)
+
+static unsigned int
+snapshot_add(volatile unsigned int *x, int n)
+{
+    unsigned int r;
+
+    HEIMDAL_MUTEX_lock(&snapshot_count_mutex);
+    r = *x += n;
+    HEIMDAL_MUTEX_unlock(&snapshot_count_mutex);
+    return r;
+}
+
+static int
+snapshot_cas(struct config_entry * volatile *p,
+	     struct config_entry *o, struct config_entry *n)
+{
+    int r;
+
+    HEIMDAL_MUTEX_lock(&snapshot_count_mutex);
+    r = (*p == o);
+    if (r)
+	*p = n;
+    HEIMDAL_MUTEX_unlock(&snapshot_count_mutex);
+    return r;
+}
+
+#define snapshot_inc(x) snapshot_add((x), 1)
+#define snapshot_dec(x) snapshot_add((x), -1)
+#endif
+
+static uint32_t
+config_hash_string(const char *s)
+{
+    uint32_t h = 2166136261U;
+
+    while (*s) {
+	h ^= (unsigned char)*s++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static uint32_t
+config_hash_path(const struct config_name * const *path, size_t depth)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < depth; i++) {
+	h ^= path[i]->hash;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static size_t
+count_bindings(const krb5_config_binding *b)
+{
+    size_t n = 0;
+
+    for (; b != NULL; b = b->next) {
+	n++;
+	if (b->type == krb5_config_list)
+	    n += count_bindings(b->u.list);
+    }
+    return n;
+}
+
+static const struct config_name *
+snapshot_find_name(const struct krb5_config_snapshot *s, const char *str)
+{
+    const struct config_name *n;
+    uint32_t h = config_hash_string(str);
+
+    for (n = s->names[h & (s->size - 1)]; n != NULL; n = n->next)
+	if (n->hash == h && strcmp(n->str, str) == 0)
+	    return n;
+    return NULL;
+}
+
+static const struct config_name *
+snapshot_intern(struct krb5_config_snapshot *s, const char *str)
+{
+    struct config_name *n;
+    size_t len;
+
+    if ((n = rk_UNCONST(snapshot_find_name(s, str))) != NULL)
+	return n;
+
+    len = strlen(str);
+    n = malloc(sizeof(*n) + len);
+    if (n == NULL)
+	return NULL;
+    memcpy(n->str, str, len + 1);
+    n->hash = config_hash_string(str);
+    n->next = s->names[n->hash & (s->size - 1)];
+    s->names[n->hash & (s->size - 1)] = n;
+    return n;
+}
+
+static const struct config_entry *
+snapshot_find_entry(const struct krb5_config_snapshot *s,
+		    const struct config_name * const *path, size_t depth)
+{
+    const struct config_entry *e;
+    uint32_t h = config_hash_path(path, depth);
+
+    for (e = s->entries[h & (s->size - 1)]; e != NULL; e = e->next) {
+	if (e->hash == h && e->depth == depth &&
+	    memcmp(e->path, path, depth * sizeof(path[0])) == 0)
+	    return e;
+    }
+    return NULL;
+}
+
+static krb5_error_code
+snapshot_add_entry(struct krb5_config_snapshot *s,
+		   const struct config_name * const *path, size_t depth,
+		   const char *value)
+{
+    struct config_entry *e;
+    krb5_deltat t;
+    size_t len;
+    char *end;
+    long l;
+
+    if (snapshot_find_entry(s, path, depth) != NULL)
+	return 0;
+
+    len = strlen(value);
+    e = malloc(sizeof(*e) + (depth - 1) * sizeof(e->path[0]) + len + 1);
+    if (e == NULL)
+	return ENOMEM;
+    memcpy(e->path, path, depth * sizeof(path[0]));
+    e->depth = depth;
+    e->value = memcpy((char *)&e->path[depth], value, len + 1);
+    e->snapshot = s;
+    e->hash = config_hash_path(path, depth);
+    e->flags = 0;
+
+    e->bool_value = (strcasecmp(value, "yes") == 0 ||
+		     strcasecmp(value, "true") == 0 ||
+		     atoi(value)) ? TRUE : FALSE;
+    e->time_value = 0;
+    if (krb5_string_to_deltat(value, &t) == 0) {
+	e->time_value = t;
+	e->flags |= CONFIG_TIME_VALID;
+    }
+    e->int_value = 0;
+    l = strtol(value, &end, 0);
+    if (end != value) {
+	e->int_value = l;
+	e->flags |= CONFIG_INT_VALID;
+    }
+
+    e->next = s->entries[e->hash & (s->size - 1)];
+    s->entries[e->hash & (s->size - 1)] = e;
+    return 0;
+}
+
+static krb5_error_code
+snapshot_compile(struct krb5_config_snapshot *s,
+		 const krb5_config_binding *list,
+		 const struct config_name **path, size_t depth)
+{
+    const krb5_config_binding *b, *prev;
+    krb5_error_code ret;
+
+    if (depth == CONFIG_MAX_DEPTH)
+	return 0;
+
+    for (b = list; b != NULL; b = b->next) {
+	path[depth] = snapshot_intern(s, b->name);
+	if (path[depth] == NULL)
+	    return ENOMEM;
+
+	if (b->type == krb5_config_string) {
+	    ret = snapshot_add_entry(s, path, depth + 1, b->u.string);
+	    if (ret)
+		return ret;
+	} else if (b->type == krb5_config_list) {
+	    /* only the first list of a given name is ever searched */
+	    for (prev = list; prev != b; prev = prev->next)
+		if (prev->type == krb5_config_list &&
+		    strcmp(prev->name, b->name) == 0)
+		    break;
+	    if (prev != b)
+		continue;
+	    ret = snapshot_compile(s, b->u.list, path, depth + 1);
+	    if (ret)
+		return ret;
+	}
+    }
+    return 0;
+}
+
+static void
+snapshot_free(struct krb5_config_snapshot *s)
+{
+    struct config_entry *e, *enext;
+    struct config_name *n, *nnext;
+    size_t i;
+
+    for (i = 0; s->names != NULL && s->entries != NULL && i < s->size; i++) {
+	for (e = s->entries[i]; e != NULL; e = enext) {
+	    enext = e->next;
+	    free(e);
+	}
+	for (n = s->names[i]; n != NULL; n = nnext) {
+	    nnext = n->next;
+	    free(n);
+	}
+    }
+    free(s->entries);
+    free(s->names);
+    free(s);
+}
+
+static struct krb5_config_snapshot *
+snapshot_build(const krb5_config_section *cf)
+{
+    const struct config_name *path[CONFIG_MAX_DEPTH];
+    struct krb5_config_snapshot *s;
+    size_t n = count_bindings(cf);
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+	return NULL;
+    for (s->size = 16; s->size < n * 2; s->size <<= 1)
+	;
+    s->names = calloc(s->size, sizeof(s->names[0]));
+    s->entries = calloc(s->size, sizeof(s->entries[0]));
+    if (s->names == NULL || s->entries == NULL ||
+	snapshot_compile(s, cf, path, 0) != 0) {
+	snapshot_free(s);
+	return NULL;
+    }
+    s->missing.snapshot = s;
+    return s;
+}
+
+/*
+ * Free the retired snapshots no handle refers to, if no reader is
+ * looking at a snapshot right now.  A reader that comes in after a
+ * snapshot was retired can only find the current one.
+ */
+
+static void
+snapshot_reclaim(void)
+{
+    struct krb5_config_snapshot *s, **prev, *dead = NULL;
+
+    HEIMDAL_MUTEX_lock(&snapshot_mutex);
+    if (snapshot_readers == 0) {
+	prev = &snapshot_retired;
+	while ((s = *prev) != NULL) {
+	    if (s->refcount == 0) {
+		*prev = s->next_retired;
+		s->next_retired = dead;
+		dead = s;
+	    } else
+		prev = &s->next_retired;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&snapshot_mutex);
+
+    while ((s = dead) != NULL) {
+	dead = s->next_retired;
+	snapshot_free(s);
+    }
+}
+
+static void
+reader_enter(void)
+{
+    snapshot_inc(&snapshot_readers);
+}
+
+static void
+reader_exit(void)
+{
+    if (snapshot_dec(&snapshot_readers) == 0 && snapshot_retired != NULL)
+	snapshot_reclaim();
+}
+
+static void
+snapshot_replace(krb5_context context, struct krb5_config_snapshot *s)
+{
+    struct krb5_config_snapshot *old;
+
+    HEIMDAL_MUTEX_lock(&snapshot_mutex);
+    old = context->cf_snapshot;
+    context->cf_snapshot = s;
+    snapshot_barrier();
+    if (old) {
+	old->next_retired = snapshot_retired;
+	snapshot_retired = old;
+    }
+    HEIMDAL_MUTEX_unlock(&snapshot_mutex);
+    snapshot_reclaim();
+}
+
+static void
+snapshot_value(const struct config_entry *e, struct config_value *v)
+{
+    v->found = 1;
+    v->flags = e->flags;
+    v->bool_value = e->bool_value;
+    v->time_value = e->time_value;
+    v->int_value = e->int_value;
+}
+
+/*
+ * Compile context->cf into a new snapshot and make it the one
+ * lookups use.  If that fails, lookups go back to walking the tree.
+ */
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_config_snapshot_update(krb5_context context)
+{
+    snapshot_replace(context, snapshot_build(context->cf));
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_config_snapshot_free(krb5_context context)
+{
+    snapshot_replace(context, NULL);
+}
+
+static const struct config_entry *
+snapshot_lookup(const struct krb5_config_snapshot *s,
+		const char * const *names, size_t len)
+{
+    const struct config_name *path[CONFIG_MAX_DEPTH];
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	path[i] = snapshot_find_name(s, names[i]);
+	if (path[i] == NULL)
+	    return NULL;
+    }
+    return snapshot_find_entry(s, path, len);
+}
+
+/*
+ * Same search as vget_next() but over an array of names.
+ */
+
+static const void *
+get_path(const krb5_config_binding *b, const char * const *names,
+	 size_t len, int type)
+{
+    while (b != NULL) {
+	if (strcmp(b->name, names[0]) == 0) {
+	    if (b->type == (unsigned)type && len == 1)
+		return b->u.generic;
+	    else if (b->type == krb5_config_list && len > 1)
+		return get_path(b->u.list, names + 1, len - 1, type);
+	}
+	b = b->next;
+    }
+    return NULL;
+}
+
+/*
+ * Look up a string from the context configuration, through the
+ * snapshot if there is one.  If v is not NULL, v->found tells if the
+ * value came from the snapshot, with its interpretations in v.
+ */
+
+static const char *
+config_vget_context_string(krb5_context context,
+			   struct config_value *v,
+			   va_list args)
+{
+    const struct krb5_config_snapshot *s = NULL;
+    const char *stack[CONFIG_MAX_DEPTH], **names = stack;
+    const struct config_entry *entry = NULL;
+    const char *str = NULL;
+    size_t len = 0, alloc = CONFIG_MAX_DEPTH;
+    const char *p;
+
+    if (v)
+	v->found = 0;
+
+    while ((p = va_arg(args, const char *)) != NULL) {
+	if (len == alloc) {
+	    const char **tmp;
+
+	    alloc *= 2;
+	    if (names == stack) {
+		tmp = malloc(alloc * sizeof(names[0]));
+		if (tmp)
+		    memcpy(tmp, stack, sizeof(stack));
+	    } else
+		tmp = realloc(names, alloc * sizeof(names[0]));
+	    if (tmp == NULL)
+		goto out;
+	    names = tmp;
+	}
+	names[len++] = p;
+    }
+    if (len == 0)
+	goto out;
+
+    reader_enter();
+    if (len <= CONFIG_MAX_DEPTH)
+	s = context->cf_snapshot;
+    if (s != NULL) {
+	entry = snapshot_lookup(s, names, len);
+	if (entry) {
+	    str = entry->value;
+	    if (v)
+		snapshot_value(entry, v);
+	}
+    } else if (context->cf != NULL) {
+	str = get_path(context->cf, names, len, krb5_config_string);
+    }
+    reader_exit();
+
+out:
+    if (names != stack)
+	free(names);
+    return str;
+}
+
+/**
+ * Create a handle for repeated lookups of a configuration value
+ * from the context configuration.  The handle remembers where the
+ * value was found and only looks it up again when the configuration
+ * has been reloaded.  A handle is not tied to any one context and
+ * may be used from several threads.
+ *
+ * @param context A Kerberos 5 context.
+ * @param handle the returned handle, free with _krb5_config_handle_free().
+ * @param ... a list of names, terminated with NULL.
+ *
+ * @return Return an error code or 0, see krb5_get_error_message().
+ *
+ * @ingroup krb5_support
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_config_handle_create(krb5_context context,
+			   struct krb5_config_handle **handle,
+			   ...)
+{
+    struct krb5_config_handle *h;
+    const char *p;
+    va_list ap;
+    size_t len = 0;
+
+    *handle = NULL;
+
+    va_start(ap, handle);
+    while (va_arg(ap, const char *) != NULL)
+	len++;
+    va_end(ap);
+
+    if (len == 0) {
+	krb5_set_error_message(context, EINVAL,
+			       N_("Configuration handle without names", ""));
+	return EINVAL;
+    }
+
+    h = calloc(1, sizeof(*h) + (len - 1) * sizeof(h->names[0]));
+    if (h == NULL)
+	return krb5_enomem(context);
+
+    va_start(ap, handle);
+    while ((p = va_arg(ap, const char *)) != NULL) {
+	h->names[h->len] = strdup(p);
+	if (h->names[h->len++] == NULL) {
+	    va_end(ap);
+	    _krb5_config_handle_free(h);
+	    return krb5_enomem(context);
+	}
+    }
+    va_end(ap);
+
+    *handle = h;
+    return 0;
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_config_handle_free(struct krb5_config_handle *h)
+{
+    size_t i;
+
+    if (h == NULL)
+	return;
+    if (h->cached) {
+	reader_enter();
+	snapshot_dec(&h->cached->snapshot->refcount);
+	reader_exit();
+    }
+    for (i = 0; i < h->len; i++)
+	free(h->names[i]);
+    free(h);
+}
+
+/*
+ * Returns the value for the handle, v->found tells if it came from a
+ * snapshot.  The handle holds a reference to the snapshot of its
+ * cached entry and moves to the current snapshot after a reload;
+ * when two threads do that at once, one of them wins.
+ */
+
+static const char *
+handle_resolve(krb5_context context, struct krb5_config_handle *h,
+	       struct config_value *v)
+{
+    struct krb5_config_snapshot *s;
+    struct config_entry *e, *ne;
+    const char *str = NULL;
+
+    v->found = 0;
+
+    reader_enter();
+    s = context->cf_snapshot;
+    e = h->cached;
+    if (s == NULL || h->len > CONFIG_MAX_DEPTH) {
+	if (context->cf)
+	    str = get_path(context->cf, (const char * const *)h->names,
+			   h->len, krb5_config_string);
+    } else {
+	if (e == NULL || e->snapshot != s) {
+	    ne = rk_UNCONST(snapshot_lookup(s, (const char * const *)h->names,
+					    h->len));
+	    if (ne == NULL)
+		ne = &s->missing;
+	    snapshot_inc(&s->refcount);
+	    if (snapshot_cas(&h->cached, e, ne)) {
+		if (e)
+		    snapshot_dec(&e->snapshot->refcount);
+	    } else
+		snapshot_dec(&s->refcount);
+	    e = ne;
+	}
+	if (e->value) {
+	    str = e->value;
+	    snapshot_value(e, v);
+	}
+    }
+    reader_exit();
+
+    return str;
+}
+
+KRB5_LIB_FUNCTION const char * KRB5_LIB_CALL
+_krb5_config_handle_get_string(krb5_context context,
+			       struct krb5_config_handle *h)
+{
+    struct config_value v;
+
+    return handle_resolve(context, h, &v);
+}
+
+KRB5_LIB_FUNCTION krb5_boolean KRB5_LIB_CALL
+_krb5_config_handle_get_bool_default(krb5_context context,
+				     struct krb5_config_handle *h,
+				     krb5_boolean def_value)
+{
+    struct config_value v;
+    const char *str;
+
+    str = handle_resolve(context, h, &v);
+    if (str == NULL)
+	return def_value;
+    if (v.found)
+	return v.bool_value;
+    return (strcasecmp(str, "yes") == 0 ||
+	    strcasecmp(str, "true") == 0 ||
+	    atoi(str)) ? TRUE : FALSE;
+}
+
+KRB5_LIB_FUNCTION int KRB5_LIB_CALL
+_krb5_config_handle_get_time_default(krb5_context context,
+				     struct krb5_config_handle *h,
+				     int def_value)
+{
+    struct config_value v;
+    const char *str;
+    krb5_deltat t;
+
+    str = handle_resolve(context, h, &v);
+    if (str == NULL)
+	return def_value;
+    if (v.found)
+	return (v.flags & CONFIG_TIME_VALID) ? v.time_value : def_value;
+    if (krb5_string_to_deltat(str, &t))
+	return def_value;
+    return t;
+}
+
+KRB5_LIB_FUNCTION int KRB5_LIB_CALL
+_krb5_config_handle_get_int_default(krb5_context context,
+				    struct krb5_config_handle *h,
+				    int def_value)
+{
+    struct config_value v;
+    const char *str;
+    char *end;
+    long l;
+
+    str = handle_resolve(context, h, &v);
+    if (str == NULL)
+	return def_value;
+    if (v.found)
+	return (v.flags & CONFIG_INT_VALID) ? v.int_value : def_value;
+    l = strtol(str, &end, 0);
+    if (end == str)
+	return def_value;
+    return l;
+}
+
 KRB5_LIB_FUNCTION const void * KRB5_LIB_CALL
 _krb5_config_get_next (krb5_context context,
 		       const krb5_config_section *c,
@@ -700,6 +1409,9 @@ _krb5_config_vget (krb5_context context,
 {
     const krb5_config_binding *foo = NULL;
 
+    if ((c == NULL || c == context->cf) && type == krb5_config_string)
+	return config_vget_context_string(context, NULL, args);
+
     return _krb5_config_vget_next (context, c, &foo, type, args);
 }
 
@@ -1031,10 +1743,18 @@ krb5_config_vget_bool_default (krb5_context context,
 			       krb5_boolean def_value,
 			       va_list args)
 {
+    struct config_value v;
     const char *str;
-    str = krb5_config_vget_string (context, c, args);
+
+    v.found = 0;
+    if (c == NULL || c == context->cf)
+	str = config_vget_context_string(context, &v, args);
+    else
+	str = krb5_config_vget_string (context, c, args);
     if(str == NULL)
 	return def_value;
+    if (v.found)
+	return v.bool_value;
     if(strcasecmp(str, "yes") == 0 ||
        strcasecmp(str, "true") == 0 ||
        atoi(str)) return TRUE;
@@ -1145,12 +1865,19 @@ krb5_config_vget_time_default (krb5_context context,
 			       int def_value,
 			       va_list args)
 {
+    struct config_value v;
     const char *str;
     krb5_deltat t;
 
-    str = krb5_config_vget_string (context, c, args);
+    v.found = 0;
+    if (c == NULL || c == context->cf)
+	str = config_vget_context_string(context, &v, args);
+    else
+	str = krb5_config_vget_string (context, c, args);
     if(str == NULL)
 	return def_value;
+    if (v.found)
+	return (v.flags & CONFIG_TIME_VALID) ? v.time_value : def_value;
     if (krb5_string_to_deltat(str, &t))
 	return def_value;
     return t;
@@ -1236,10 +1963,18 @@ krb5_config_vget_int_default (krb5_context context,
 			      int def_value,
 			      va_list args)
 {
+    struct config_value v;
     const char *str;
-    str = krb5_config_vget_string (context, c, args);
+
+    v.found = 0;
+    if (c == NULL || c == context->cf)
+	str = config_vget_context_string(context, &v, args);
+    else
+	str = krb5_config_vget_string (context, c, args);
     if(str == NULL)
 	return def_value;
+    else if (v.found)
+	return (v.flags & CONFIG_INT_VALID) ? v.int_value : def_value;
     else {
 	char *endptr;
 	long l;
@@ -561,6 +561,7 @@ krb5_copy_context(krb5_context context, krb5_context *out)
     ret = _krb5_config_copy(context, context->cf, &p->cf);
     if (ret)
 	goto out;
+    _krb5_config_snapshot_update(p);
 
     /* XXX should copy */
     krb5_init_ets(p);
@@ -616,6 +617,7 @@ krb5_free_context(krb5_context context)
     free(context->etypes_des);
     krb5_free_host_realm (context, context->default_realms);
     krb5_config_file_free (context, context->cf);
+    _krb5_config_snapshot_free(context);
     free_error_table (context->et_list);
     free(rk_UNCONST(context->cc_ops));
     free(context->kt_types);
@@ -627,6 +629,7 @@ krb5_free_context(krb5_context context)
     krb5_set_extra_addresses(context, NULL);
     krb5_set_ignore_addresses(context, NULL);
     krb5_set_send_to_kdc_func(context, NULL, NULL);
+    _krb5_plugin_handles_free(context);
 
 #ifdef PKINIT
     if (context->hx509ctx)
@@ -681,6 +684,7 @@ krb5_set_config_files(krb5_context context, char **filenames)
 
     krb5_config_file_free(context, context->cf);
     context->cf = tmp;
+    _krb5_config_snapshot_update(context);
     ret = init_context_from_config_file(context);
     return ret;
 }
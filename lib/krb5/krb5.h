@@ -533,6 +533,9 @@ typedef struct krb5_config_binding krb5_config_binding;
 
 typedef krb5_config_binding krb5_config_section;
 
+struct krb5_config_handle;
+struct krb5_config_snapshot;
+
 typedef struct krb5_ticket {
     EncTicketPart ticket;
     krb5_principal client;
@@ -868,6 +871,7 @@ typedef krb5_error_code
 				       const krb5_data *, int *);
 
 struct krb5_plugin;
+struct krb5_plugin_handle;
 enum krb5_plugin_type {
     PLUGIN_TYPE_DATA = 1,
     PLUGIN_TYPE_FUNC
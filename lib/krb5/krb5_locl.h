@@ -266,6 +266,7 @@ typedef struct krb5_context_data {
     int32_t kdc_sec_offset;
     int32_t kdc_usec_offset;
     krb5_config_section *cf;
+    struct krb5_config_snapshot * volatile cf_snapshot;
     struct et_list *et_list;
     struct krb5_log_facility *warn_dest;
     struct krb5_log_facility *debug_dest;
@@ -308,6 +309,7 @@ typedef struct krb5_context_data {
     hx509_context hx509ctx;
 #endif
     unsigned int num_kdc_requests;
+    struct krb5_plugin_handle *plugin_handles;
 } krb5_context_data;
 
 #ifndef KRB5_USE_PATH_TOKENS
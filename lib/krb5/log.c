@@ -211,19 +211,22 @@ log_file(const char *timestr,
 	 void *data)
 {
     struct file_data *f = data;
-    char *msgclean;
+    char buf[1024], *msgclean = buf;
     size_t len = strlen(msg);
     if(f->keep_open == 0)
 	f->fd = fopen(f->filename, f->mode);
     if(f->fd == NULL)
 	return;
     /* make sure the log doesn't contain special chars */
-    msgclean = malloc((len + 1) * 4);
-    if (msgclean == NULL)
-	goto out;
+    if ((len + 1) * 4 > sizeof(buf)) {
+	msgclean = malloc((len + 1) * 4);
+	if (msgclean == NULL)
+	    goto out;
+    }
     strvisx(msgclean, rk_UNCONST(msg), len, VIS_OCTAL);
     fprintf(f->fd, "%s %s\n", timestr, msgclean);
-    free(msgclean);
+    if (msgclean != buf)
+	free(msgclean);
  out:
     if(f->keep_open == 0) {
 	fclose(f->fd);
@@ -262,6 +265,493 @@ open_file(krb5_context context, krb5_log_facility *fac, int min, int max,
     return krb5_addlog_func(context, fac, min, max, log_file, close_file, fd);
 }
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE___SYNC_ADD_AND_FETCH)
+#define HAVE_ASYNC_LOG 1
+#endif
+
+#ifdef HAVE_ASYNC_LOG
+
+/*
+ * ASYNC: and ASYNC-JSON: destinations.
+ *
+ * The caller formats the line into a slot of a fixed size ring and
+ * returns; a writer thread collects finished slots and appends them
+ * to the file with writev() in batches.  Slots are claimed with a
+ * compare-and-swap on the head index, so loggers never take a lock
+ * or wait for the disk.  When the ring is full the message is
+ * dropped and counted, and the writer logs how many were lost.
+ *
+ * The file is opened once per batch rather than per message, so
+ * logs can still be rotated by renaming the file.
+ */
+
+#define ASYNC_SLOTS	1024		/* must be a power of two */
+#define ASYNC_LINE	480
+#define ASYNC_BATCH	64
+#define ASYNC_FLUSH_MS	100
+
+struct async_slot {
+    volatile size_t seq;
+    size_t len;
+    char *ext;				/* lines that don't fit in line[] */
+    char line[ASYNC_LINE];
+};
+
+struct async_data {
+    struct async_data *next;
+    char *filename;
+    char *program;
+    int json;
+    struct async_slot *slots;
+    volatile size_t head;		/* next slot to claim */
+    size_t tail;			/* next slot to write, writer only */
+    volatile unsigned int dropped;
+    unsigned int forkgen;		/* writer is running if current */
+    int shutdown;
+    pthread_t writer;
+    HEIMDAL_MUTEX mutex;
+    pthread_cond_t cond;
+};
+
+static pthread_once_t async_once = PTHREAD_ONCE_INIT;
+static HEIMDAL_MUTEX async_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct async_data *async_list;
+static volatile unsigned int async_forkgen = 1;
+
+static void
+async_atfork_child(void)
+{
+    /* writer threads don't survive fork, restart them on next use */
+    async_forkgen++;
+    HEIMDAL_MUTEX_init(&async_mutex);
+}
+
+static void async_stop(struct async_data *);
+
+static void
+async_atexit(void)
+{
+    struct async_data *a;
+
+    HEIMDAL_MUTEX_lock(&async_mutex);
+    for (a = async_list; a != NULL; a = a->next)
+	async_stop(a);
+    HEIMDAL_MUTEX_unlock(&async_mutex);
+}
+
+static void
+async_init(void)
+{
+    pthread_atfork(NULL, NULL, async_atfork_child);
+    atexit(async_atexit);
+}
+
+static size_t
+async_vis(char *dst, const unsigned char *src, size_t len)
+{
+    char *d = dst;
+    size_t i;
+
+    /*
+     * Same output as strvisx(VIS_OCTAL) on the whole message, which
+     * is only asked about the bytes it may encode (how it encodes a
+     * backslash differs between systems).
+     */
+    for (i = 0; i < len; i++) {
+	unsigned char c = src[i];
+
+	if ((c > 0x20 && c < 0x7f && c != '\\') ||
+	    c == ' ' || c == '\t' || c == '\n') {
+	    *d++ = c;
+	} else {
+	    char tmp[5];
+	    int n;
+
+	    n = strvisx(tmp, (const char *)&src[i], 1, VIS_OCTAL);
+	    memcpy(d, tmp, n);
+	    d += n;
+	}
+    }
+    return d - dst;
+}
+
+static size_t
+async_json(char *dst, const unsigned char *src, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *d = dst;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	unsigned char c = src[i];
+
+	if (c == '"' || c == '\\') {
+	    *d++ = '\\';
+	    *d++ = c;
+	} else if (c >= 0x20 && c < 0x7f) {
+	    *d++ = c;
+	} else {
+	    /* control characters and non-ASCII bytes */
+	    memcpy(d, "\\u00", 4);
+	    d[4] = hex[c >> 4];
+	    d[5] = hex[c & 0xf];
+	    d += 6;
+	}
+    }
+    return d - dst;
+}
+
+static void
+async_format(struct async_data *a, struct async_slot *s,
+	     const char *timestr, const char *msg)
+{
+    size_t len = strlen(msg), tlen = strlen(timestr), plen = 0;
+    size_t i, special = 0, need;
+    char *p;
+
+    for (i = 0; i < len; i++) {
+	unsigned char c = msg[i];
+	if (c < 0x20 || c >= 0x7f || c == '\\' || c == '"')
+	    special++;
+    }
+    if (a->json) {
+	plen = strlen(a->program);
+	need = sizeof("{\"time\":\"\",\"program\":\"\",\"message\":\"\"}\n") +
+	    tlen + plen * 6 + len + special * 5;
+    } else {
+	need = tlen + 2 + len + special * 3;
+    }
+
+    s->ext = NULL;
+    p = s->line;
+    if (need > sizeof(s->line)) {
+	p = s->ext = malloc(need);
+	if (p == NULL) {
+	    /* say so, with nothing that could overflow line[] */
+	    p = s->line;
+	    tlen = plen = 0;
+	    msg = "log message lost (out of memory)";
+	    len = strlen(msg);
+	}
+    }
+
+    s->len = 0;
+    if (a->json) {
+	memcpy(p, "{\"time\":\"", 9);
+	s->len = 9;
+	memcpy(p + s->len, timestr, tlen);
+	s->len += tlen;
+	memcpy(p + s->len, "\",\"program\":\"", 13);
+	s->len += 13;
+	s->len += async_json(p + s->len, (const unsigned char *)a->program, plen);
+	memcpy(p + s->len, "\",\"message\":\"", 13);
+	s->len += 13;
+	s->len += async_json(p + s->len, (const unsigned char *)msg, len);
+	memcpy(p + s->len, "\"}\n", 3);
+	s->len += 3;
+    } else {
+	memcpy(p, timestr, tlen);
+	s->len = tlen;
+	p[s->len++] = ' ';
+	s->len += async_vis(p + s->len, (const unsigned char *)msg, len);
+	p[s->len++] = '\n';
+    }
+}
+
+static void
+async_writev(int fd, struct iovec *iov, int n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+	w = writev(fd, iov, n);
+	if (w < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return;
+	}
+	while (n > 0 && (size_t)w >= iov->iov_len) {
+	    w -= iov->iov_len;
+	    iov++;
+	    n--;
+	}
+	if (n > 0) {
+	    iov->iov_base = (char *)iov->iov_base + w;
+	    iov->iov_len -= w;
+	}
+    }
+}
+
+/*
+ * Write out what's in the ring, returns the number of lines written.
+ */
+
+static int
+async_flush(struct async_data *a, unsigned int *reported)
+{
+    struct iovec iov[ASYNC_BATCH + 1];
+    struct async_slot *s;
+    char dropmsg[64];
+    unsigned int dropped;
+    size_t pos = a->tail;
+    int fd, i, n = 0;
+
+    while (n < ASYNC_BATCH) {
+	s = &a->slots[pos & (ASYNC_SLOTS - 1)];
+	if (s->seq != pos + 1)
+	    break;
+	__sync_synchronize();
+	iov[n].iov_base = s->ext ? s->ext : s->line;
+	iov[n].iov_len = s->len;
+	n++;
+	pos++;
+    }
+
+    dropped = a->dropped;
+    if (dropped != *reported) {
+	iov[n].iov_base = dropmsg;
+	iov[n].iov_len = snprintf(dropmsg, sizeof(dropmsg),
+				  "%u log messages dropped\n",
+				  dropped - *reported);
+	*reported = dropped;
+	n++;
+    }
+    if (n == 0)
+	return 0;
+
+    fd = open(a->filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd >= 0) {
+	rk_cloexec(fd);
+	async_writev(fd, iov, n);
+	close(fd);
+    }
+
+    /* hand the slots back to the loggers */
+    for (i = 0; a->tail != pos; i++) {
+	s = &a->slots[a->tail & (ASYNC_SLOTS - 1)];
+	free(s->ext);
+	s->ext = NULL;
+	__sync_synchronize();
+	s->seq = a->tail + ASYNC_SLOTS;
+	a->tail++;
+    }
+    return i;
+}
+
+static void *
+async_writer(void *ptr)
+{
+    struct async_data *a = ptr;
+    unsigned int reported = 0;
+    struct timespec ts;
+    struct timeval tv;
+    int n;
+
+    for (;;) {
+	n = async_flush(a, &reported);
+	if (n == ASYNC_BATCH)
+	    continue;
+
+	HEIMDAL_MUTEX_lock(&a->mutex);
+	if (a->shutdown && n == 0) {
+	    HEIMDAL_MUTEX_unlock(&a->mutex);
+	    break;
+	}
+	if (!a->shutdown) {
+	    gettimeofday(&tv, NULL);
+	    ts.tv_sec = tv.tv_sec;
+	    ts.tv_nsec = (tv.tv_usec + ASYNC_FLUSH_MS * 1000) * 1000;
+	    if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	    }
+	    pthread_cond_timedwait(&a->cond, &a->mutex, &ts);
+	}
+	HEIMDAL_MUTEX_unlock(&a->mutex);
+    }
+    return NULL;
+}
+
+static void
+async_reset(struct async_data *a)
+{
+    size_t i;
+
+    for (i = 0; i < ASYNC_SLOTS; i++) {
+	a->slots[i].seq = i;
+	free(a->slots[i].ext);
+	a->slots[i].ext = NULL;
+    }
+    a->head = a->tail = 0;
+    a->dropped = 0;
+}
+
+/*
+ * Start the writer thread, or restart it in a forked child (where
+ * the ring still holds the parent's unwritten lines, the parent
+ * writes those).  Called with async_mutex held.
+ */
+
+static int
+async_start(struct async_data *a)
+{
+    int ret;
+
+    if (a->forkgen == async_forkgen)
+	return 0;
+    if (a->forkgen != 0) {
+	HEIMDAL_MUTEX_init(&a->mutex);
+	pthread_cond_init(&a->cond, NULL);
+	async_reset(a);
+    }
+    a->shutdown = 0;
+    ret = pthread_create(&a->writer, NULL, async_writer, a);
+    if (ret)
+	return ret;
+    a->forkgen = async_forkgen;
+    return 0;
+}
+
+/*
+ * Stop the writer after it has written everything, called with
+ * async_mutex held.
+ */
+
+static void
+async_stop(struct async_data *a)
+{
+    if (a->forkgen != async_forkgen)
+	return;
+    HEIMDAL_MUTEX_lock(&a->mutex);
+    a->shutdown = 1;
+    pthread_cond_signal(&a->cond);
+    HEIMDAL_MUTEX_unlock(&a->mutex);
+    pthread_join(a->writer, NULL);
+    a->forkgen = 0;
+}
+
+static void KRB5_CALLCONV
+log_async(const char *timestr,
+	  const char *msg,
+	  void *data)
+{
+    struct async_data *a = data;
+    struct async_slot *s;
+    size_t pos, seq;
+
+    if (a->forkgen != async_forkgen) {
+	int ret;
+
+	HEIMDAL_MUTEX_lock(&async_mutex);
+	ret = async_start(a);
+	HEIMDAL_MUTEX_unlock(&async_mutex);
+	if (ret) {
+	    __sync_add_and_fetch(&a->dropped, 1);
+	    return;
+	}
+    }
+
+    pos = a->head;
+    for (;;) {
+	s = &a->slots[pos & (ASYNC_SLOTS - 1)];
+	seq = s->seq;
+	if (seq == pos) {
+	    if (__sync_bool_compare_and_swap(&a->head, pos, pos + 1))
+		break;
+	} else if ((ssize_t)(seq - pos) < 0) {
+	    /* ring is full */
+	    __sync_add_and_fetch(&a->dropped, 1);
+	    return;
+	}
+	pos = a->head;
+    }
+
+    async_format(a, s, timestr, msg);
+    __sync_synchronize();
+    s->seq = pos + 1;
+
+    /* the writer polls, but don't let it sleep through a burst */
+    if ((pos & (ASYNC_BATCH - 1)) == ASYNC_BATCH - 1)
+	pthread_cond_signal(&a->cond);
+}
+
+static void KRB5_CALLCONV
+close_async(void *data)
+{
+    struct async_data *a = data, **ap;
+
+    HEIMDAL_MUTEX_lock(&async_mutex);
+    async_stop(a);
+    for (ap = &async_list; *ap != NULL; ap = &(*ap)->next) {
+	if (*ap == a) {
+	    *ap = a->next;
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&async_mutex);
+
+    async_reset(a);
+    HEIMDAL_MUTEX_destroy(&a->mutex);
+    pthread_cond_destroy(&a->cond);
+    free(a->slots);
+    free(a->filename);
+    free(a->program);
+    free(a);
+}
+
+static krb5_error_code
+open_async(krb5_context context, krb5_log_facility *fac, int min, int max,
+	   const char *filename, int json)
+{
+    struct async_data *a;
+    krb5_error_code ret;
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+	ret = errno;
+	krb5_set_error_message(context, ret,
+			       N_("open(%s) logfile: %s", ""), filename,
+			       strerror(ret));
+	return ret;
+    }
+    close(fd);
+
+    pthread_once(&async_once, async_init);
+
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+	return krb5_enomem(context);
+    a->json = json;
+    a->filename = strdup(filename);
+    a->program = strdup(fac->program);
+    a->slots = calloc(ASYNC_SLOTS, sizeof(a->slots[0]));
+    if (a->filename == NULL || a->program == NULL || a->slots == NULL) {
+	free(a->filename);
+	free(a->program);
+	free(a->slots);
+	free(a);
+	return krb5_enomem(context);
+    }
+    HEIMDAL_MUTEX_init(&a->mutex);
+    pthread_cond_init(&a->cond, NULL);
+    async_reset(a);
+
+    ret = krb5_addlog_func(context, fac, min, max, log_async, close_async, a);
+    if (ret) {
+	close_async(a);
+	return ret;
+    }
+
+    HEIMDAL_MUTEX_lock(&async_mutex);
+    a->next = async_list;
+    async_list = a;
+    HEIMDAL_MUTEX_unlock(&async_mutex);
+    return 0;
+}
+
+#endif /* HAVE_ASYNC_LOG */
+
 
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -337,6 +827,19 @@ krb5_addlog_dest(krb5_context context, krb5_log_facility *f, const char *orig)
 	    keep_open = 1;
 	}
 	ret = open_file(context, f, min, max, fn, "a", file, keep_open, 1);
+    }else if(strncmp(p, "ASYNC:", 6) == 0 ||
+	     strncmp(p, "ASYNC-JSON:", 11) == 0){
+	int json = (p[5] == '-');
+	const char *fn = p + (json ? 11 : 6);
+#ifdef HAVE_ASYNC_LOG
+	ret = open_async(context, f, min, max, fn, json);
+#else
+	/* no threads, log synchronously like FILE: */
+	char *s = strdup(fn);
+	if (s == NULL)
+	    return krb5_enomem(context);
+	ret = open_file(context, f, min, max, s, "a", NULL, 0, 1);
+#endif
     }else if(strncmp(p, "DEVICE", 6) == 0 && (p[6] == ':' || p[6] == '=')){
 	ret = open_file(context, f, min, max, strdup(p + 7), "w", NULL, 0, 1);
     }else if(strncmp(p, "SYSLOG", 6) == 0 && (p[6] == '\0' || p[6] == ':')){
@@ -75,6 +75,22 @@ struct krb5_pac_data {
 
 static const char zeros[PAC_ALIGNMENT] = { 0 };
 
+static uint32_t
+pac_get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+pac_put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
 /*
  * HMAC-MD5 checksum over any key (needed for the PAC routines)
  */
@@ -122,7 +138,7 @@ krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
 {
     krb5_error_code ret;
     krb5_pac p;
-    krb5_storage *sp = NULL;
+    const unsigned char *q = ptr;
     uint32_t i, tmp, tmp2, header_end;
 
     p = calloc(1, sizeof(*p));
@@ -131,15 +147,17 @@ krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
 	goto out;
     }
 
-    sp = krb5_storage_from_readonly_mem(ptr, len);
-    if (sp == NULL) {
-	ret = krb5_enomem(context);
+    /*
+     * The header is decoded straight out of the caller's buffer, the
+     * buffers themselves are never looked at here.
+     */
+    if (len < PACTYPE_SIZE) {
+	ret = EINVAL;
+	krb5_set_error_message(context, ret, N_("PAC header truncated", ""));
 	goto out;
     }
-    krb5_storage_set_flags(sp, KRB5_STORAGE_BYTEORDER_LE);
-
-    CHECK(ret, krb5_ret_uint32(sp, &tmp), out);
-    CHECK(ret, krb5_ret_uint32(sp, &tmp2), out);
+    tmp = pac_get_le32(q);
+    tmp2 = pac_get_le32(q + 4);
     if (tmp < 1) {
 	ret = EINVAL; /* Too few buffers */
 	krb5_set_error_message(context, ret, N_("PAC have too few buffer", ""));
@@ -152,6 +170,11 @@ krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
 			       (int)tmp2);
 	goto out;
     }
+    if (tmp > (len - PACTYPE_SIZE) / PAC_INFO_BUFFER_SIZE) {
+	ret = EINVAL;
+	krb5_set_error_message(context, ret, N_("PAC header truncated", ""));
+	goto out;
+    }
 
     p->pac = calloc(1,
 		    sizeof(*p->pac) + (sizeof(p->pac->buffers[0]) * (tmp - 1)));
@@ -164,16 +187,14 @@ krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
     p->pac->version = tmp2;
 
     header_end = PACTYPE_SIZE + (PAC_INFO_BUFFER_SIZE * p->pac->numbuffers);
-    if (header_end > len) {
-	ret = EINVAL;
-	goto out;
-    }
 
     for (i = 0; i < p->pac->numbuffers; i++) {
-	CHECK(ret, krb5_ret_uint32(sp, &p->pac->buffers[i].type), out);
-	CHECK(ret, krb5_ret_uint32(sp, &p->pac->buffers[i].buffersize), out);
-	CHECK(ret, krb5_ret_uint32(sp, &p->pac->buffers[i].offset_lo), out);
-	CHECK(ret, krb5_ret_uint32(sp, &p->pac->buffers[i].offset_hi), out);
+	const unsigned char *h = q + PACTYPE_SIZE + (PAC_INFO_BUFFER_SIZE * i);
+
+	p->pac->buffers[i].type = pac_get_le32(h);
+	p->pac->buffers[i].buffersize = pac_get_le32(h + 4);
+	p->pac->buffers[i].offset_lo = pac_get_le32(h + 8);
+	p->pac->buffers[i].offset_hi = pac_get_le32(h + 12);
 
 	/* consistency checks */
 	if (p->pac->buffers[i].offset_lo & (PAC_ALIGNMENT - 1)) {
@@ -240,14 +261,10 @@ krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
     if (ret)
 	goto out;
 
-    krb5_storage_free(sp);
-
     *pac = p;
     return 0;
 
 out:
-    if (sp)
-	krb5_storage_free(sp);
     if (p) {
 	if (p->pac)
 	    free(p->pac);
@@ -293,10 +310,18 @@ krb5_pac_add_buffer(krb5_context context, krb5_pac p,
     krb5_error_code ret;
     void *ptr;
     size_t len, offset, header_end, old_end;
+    ptrdiff_t server_cksum, privsvr_cksum, logon_name;
     uint32_t i;
 
     len = p->pac->numbuffers;
 
+    /* the realloc moves the buffers the pointers below refer to */
+    server_cksum = p->server_checksum ?
+	p->server_checksum - p->pac->buffers : -1;
+    privsvr_cksum = p->privsvr_checksum ?
+	p->privsvr_checksum - p->pac->buffers : -1;
+    logon_name = p->logon_name ? p->logon_name - p->pac->buffers : -1;
+
     ptr = realloc(p->pac,
 		  sizeof(*p->pac) + (sizeof(p->pac->buffers[0]) * len));
     if (ptr == NULL)
@@ -304,6 +329,13 @@ krb5_pac_add_buffer(krb5_context context, krb5_pac p,
 
     p->pac = ptr;
 
+    if (server_cksum >= 0)
+	p->server_checksum = &p->pac->buffers[server_cksum];
+    if (privsvr_cksum >= 0)
+	p->privsvr_checksum = &p->pac->buffers[privsvr_cksum];
+    if (logon_name >= 0)
+	p->logon_name = &p->pac->buffers[logon_name];
+
     for (i = 0; i < len; i++)
 	p->pac->buffers[i].offset_lo += PAC_INFO_BUFFER_SIZE;
 
@@ -433,48 +465,49 @@ krb5_pac_free(krb5_context context, krb5_pac pac)
  *
  */
 
+/*
+ * Pull the checksum type and value out of a checksum buffer, the
+ * value is copied so that the buffer can be zeroed while the
+ * checksum is computed.
+ */
+
 static krb5_error_code
-verify_checksum(krb5_context context,
-		const struct PAC_INFO_BUFFER *sig,
-		const krb5_data *data,
-		void *ptr, size_t len,
-		const krb5_keyblock *key)
+get_checksum(krb5_context context,
+	     const struct PAC_INFO_BUFFER *sig,
+	     const krb5_data *data,
+	     Checksum *cksum)
 {
-    krb5_storage *sp = NULL;
-    uint32_t type;
+    const unsigned char *p = (const unsigned char *)data->data + sig->offset_lo;
     krb5_error_code ret;
-    Checksum cksum;
-
-    memset(&cksum, 0, sizeof(cksum));
 
-    sp = krb5_storage_from_mem((char *)data->data + sig->offset_lo,
-			       sig->buffersize);
-    if (sp == NULL)
-	return krb5_enomem(context);
-
-    krb5_storage_set_flags(sp, KRB5_STORAGE_BYTEORDER_LE);
+    memset(cksum, 0, sizeof(*cksum));
 
-    CHECK(ret, krb5_ret_uint32(sp, &type), out);
-    cksum.cksumtype = type;
-    cksum.checksum.length =
-	sig->buffersize - krb5_storage_seek(sp, 0, SEEK_CUR);
-    cksum.checksum.data = malloc(cksum.checksum.length);
-    if (cksum.checksum.data == NULL) {
-	ret = krb5_enomem(context);
-	goto out;
-    }
-    ret = krb5_storage_read(sp, cksum.checksum.data, cksum.checksum.length);
-    if (ret != (int)cksum.checksum.length) {
+    if (sig->buffersize < 4) {
 	ret = EINVAL;
 	krb5_set_error_message(context, ret, "PAC checksum missing checksum");
-	goto out;
+	return ret;
     }
+    cksum->cksumtype = pac_get_le32(p);
+    ret = krb5_data_copy(&cksum->checksum, p + 4, sig->buffersize - 4);
+    if (ret)
+	return krb5_enomem(context);
+
+    return 0;
+}
 
-    if (!krb5_checksum_is_keyed(context, cksum.cksumtype)) {
+static krb5_error_code
+verify_checksum(krb5_context context,
+		const Checksum *cksum,
+		void *ptr, size_t len,
+		const krb5_keyblock *key)
+{
+    krb5_error_code ret;
+
+    if (!krb5_checksum_is_keyed(context, cksum->cksumtype)) {
 	ret = EINVAL;
 	krb5_set_error_message(context, ret, "Checksum type %d not keyed",
-			       cksum.cksumtype);
-	goto out;
+			       cksum->cksumtype);
+	return ret;
     }
 
     /* If the checksum is HMAC-MD5, the checksum type is not tied to
@@ -486,7 +519,7 @@ verify_checksum(krb5_context context,
      * http://blogs.msdn.com/b/openspecification/archive/2010/01/01/verifying-the-server-signature-in-kerberos-privilege-account-certificate.aspx
      * for Microsoft's explaination */
 
-    if (cksum.cksumtype == CKSUMTYPE_HMAC_MD5) {
+    if (cksum->cksumtype == CKSUMTYPE_HMAC_MD5) {
 	Checksum local_checksum;
 
 	memset(&local_checksum, 0, sizeof(local_checksum));
@@ -494,7 +527,7 @@ verify_checksum(krb5_context context,
 	ret = HMAC_MD5_any_checksum(context, key, ptr, len,
 				    KRB5_KU_OTHER_CKSUM, &local_checksum);
 
-	if (ret != 0 || krb5_data_ct_cmp(&local_checksum.checksum, &cksum.checksum) != 0) {
+	if (ret != 0 || krb5_data_ct_cmp(&local_checksum.checksum, &cksum->checksum) != 0) {
 	    ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
 	    krb5_set_error_message(context, ret,
 				   N_("PAC integrity check failed for "
@@ -507,22 +540,13 @@ verify_checksum(krb5_context context,
 
 	ret = krb5_crypto_init(context, key, 0, &crypto);
 	if (ret)
-		goto out;
+		return ret;
 
 	ret = krb5_verify_checksum(context, crypto, KRB5_KU_OTHER_CKSUM,
-				   ptr, len, &cksum);
+				   ptr, len, (Checksum *)cksum);
 	krb5_crypto_destroy(context, crypto);
     }
-    free(cksum.checksum.data);
-    krb5_storage_free(sp);
-
-    return ret;
 
-out:
-    if (cksum.checksum.data)
-	free(cksum.checksum.data);
-    if (sp)
-	krb5_storage_free(sp);
     return ret;
 }
 
@@ -854,44 +878,43 @@ krb5_pac_verify(krb5_context context,
      * server checksum before checking the checksum.
      */
     {
-	krb5_data *copy;
+	Checksum server_cksum, privsvr_cksum;
+	krb5_data copy;
 
-	ret = krb5_copy_data(context, &pac->data, &copy);
+	ret = get_checksum(context, pac->server_checksum, &pac->data,
+			   &server_cksum);
 	if (ret)
 	    return ret;
-
-	if (pac->server_checksum->buffersize < 4)
-	    return EINVAL;
-	if (pac->privsvr_checksum->buffersize < 4)
-	    return EINVAL;
-
-	memset((char *)copy->data + pac->server_checksum->offset_lo + 4,
-	       0,
-	       pac->server_checksum->buffersize - 4);
-
-	memset((char *)copy->data + pac->privsvr_checksum->offset_lo + 4,
-	       0,
-	       pac->privsvr_checksum->buffersize - 4);
-
-	ret = verify_checksum(context,
-			      pac->server_checksum,
-			      &pac->data,
-			      copy->data,
-			      copy->length,
-			      server);
-	krb5_free_data(context, copy);
-	if (ret)
+	ret = get_checksum(context, pac->privsvr_checksum, &pac->data,
+			   &privsvr_cksum);
+	if (ret) {
+	    free_Checksum(&server_cksum);
 	    return ret;
-    }
-    if (privsvr) {
-	/* The priv checksum covers the server checksum */
-	ret = verify_checksum(context,
-			      pac->privsvr_checksum,
-			      &pac->data,
-			      (char *)pac->data.data
-			      + pac->server_checksum->offset_lo + 4,
-			      pac->server_checksum->buffersize - 4,
-			      privsvr);
+	}
+
+	ret = krb5_data_copy(&copy, pac->data.data, pac->data.length);
+	if (ret == 0) {
+	    memset((char *)copy.data + pac->server_checksum->offset_lo + 4,
+		   0, server_cksum.checksum.length);
+	    memset((char *)copy.data + pac->privsvr_checksum->offset_lo + 4,
+		   0, privsvr_cksum.checksum.length);
+
+	    ret = verify_checksum(context, &server_cksum,
+				  copy.data, copy.length, server);
+	    krb5_data_free(&copy);
+	} else
+	    ret = krb5_enomem(context);
+
+	if (ret == 0 && privsvr) {
+	    /* The priv checksum covers the server checksum */
+	    ret = verify_checksum(context, &privsvr_cksum,
+				  (char *)pac->data.data
+				  + pac->server_checksum->offset_lo + 4,
+				  server_cksum.checksum.length,
+				  privsvr);
+	}
+	free_Checksum(&server_cksum);
+	free_Checksum(&privsvr_cksum);
 	if (ret)
 	    return ret;
     }
@@ -955,6 +978,111 @@ pac_checksum(krb5_context context,
     return 0;
 }
 
+static krb5_boolean
+buffers_overlap(const struct PAC_INFO_BUFFER *a,
+		const struct PAC_INFO_BUFFER *b)
+{
+    return a->offset_lo < b->offset_lo + b->buffersize &&
+	b->offset_lo < a->offset_lo + a->buffersize;
+}
+
+/*
+ * A PAC that already carries a logon name identical to the one we
+ * would generate, and checksum buffers of the right size that do not
+ * share bytes with any other buffer, can be re-signed without
+ * re-encoding it: only the two checksums change.
+ */
+
+static krb5_boolean
+can_sign_in_place(krb5_pac p, const krb5_data *logon,
+		  size_t server_size, size_t priv_size)
+{
+    const unsigned char *d = p->data.data;
+    const struct PAC_INFO_BUFFER *special[3];
+    size_t i, j;
+
+    if (p->logon_name == NULL || p->server_checksum == NULL ||
+	p->privsvr_checksum == NULL)
+	return FALSE;
+
+    /*
+     * krb5_pac_add_buffer() only keeps p->pac up to date, the header
+     * in p->data must describe the same buffers to be reused.
+     */
+    if (p->data.length < PACTYPE_SIZE ||
+	pac_get_le32(d) != p->pac->numbuffers ||
+	pac_get_le32(d + 4) != p->pac->version ||
+	p->pac->numbuffers > (p->data.length - PACTYPE_SIZE) / PAC_INFO_BUFFER_SIZE)
+	return FALSE;
+    for (i = 0; i < p->pac->numbuffers; i++) {
+	const unsigned char *h = d + PACTYPE_SIZE + (PAC_INFO_BUFFER_SIZE * i);
+	const struct PAC_INFO_BUFFER *b = &p->pac->buffers[i];
+
+	if (pac_get_le32(h) != b->type ||
+	    pac_get_le32(h + 4) != b->buffersize ||
+	    pac_get_le32(h + 8) != b->offset_lo ||
+	    pac_get_le32(h + 12) != b->offset_hi)
+	    return FALSE;
+    }
+    if (p->server_checksum->buffersize != server_size + 4 ||
+	p->privsvr_checksum->buffersize != priv_size + 4)
+	return FALSE;
+    if (p->logon_name->buffersize != logon->length ||
+	memcmp(d + p->logon_name->offset_lo, logon->data, logon->length) != 0)
+	return FALSE;
+
+    special[0] = p->logon_name;
+    special[1] = p->server_checksum;
+    special[2] = p->privsvr_checksum;
+    for (i = 0; i < sizeof(special)/sizeof(special[0]); i++) {
+	for (j = 0; j < p->pac->numbuffers; j++) {
+	    if (&p->pac->buffers[j] == special[i])
+		continue;
+	    if (buffers_overlap(special[i], &p->pac->buffers[j]))
+		return FALSE;
+	}
+    }
+    return TRUE;
+}
+
+static krb5_error_code
+sign_in_place(krb5_context context,
+	      krb5_pac p,
+	      const krb5_keyblock *server_key,
+	      uint32_t server_cksumtype,
+	      size_t server_size,
+	      const krb5_keyblock *priv_key,
+	      uint32_t priv_cksumtype,
+	      size_t priv_size,
+	      krb5_data *data)
+{
+    const size_t server_offset = p->server_checksum->offset_lo + 4;
+    const size_t priv_offset = p->privsvr_checksum->offset_lo + 4;
+    krb5_error_code ret;
+    unsigned char *d;
+
+    ret = krb5_data_copy(data, p->data.data, p->data.length);
+    if (ret)
+	return krb5_enomem(context);
+    d = data->data;
+
+    pac_put_le32(d + server_offset - 4, server_cksumtype);
+    memset(d + server_offset, 0, server_size);
+    pac_put_le32(d + priv_offset - 4, priv_cksumtype);
+    memset(d + priv_offset, 0, priv_size);
+
+    ret = create_checksum(context, server_key, server_cksumtype,
+			  d, data->length,
+			  d + server_offset, server_size);
+    if (ret == 0)
+	ret = create_checksum(context, priv_key, priv_cksumtype,
+			      d + server_offset, server_size,
+			      d + priv_offset, priv_size);
+    if (ret)
+	krb5_data_free(data);
+    return ret;
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 _krb5_pac_sign(krb5_context context,
 	       krb5_pac p,
@@ -1022,6 +1150,14 @@ _krb5_pac_sign(krb5_context context,
     if (ret)
 	goto out;
 
+    if (can_sign_in_place(p, &logon, server_size, priv_size)) {
+	ret = sign_in_place(context, p,
+			    server_key, server_cksumtype, server_size,
+			    priv_key, priv_cksumtype, priv_size, data);
+	krb5_data_free(&logon);
+	return ret;
+    }
+
     /* Encode PAC */
     sp = krb5_storage_emem();
     if (sp == NULL)
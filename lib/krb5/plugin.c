@@ -62,6 +62,19 @@ struct plugin {
 static HEIMDAL_MUTEX plugin_mutex = HEIMDAL_MUTEX_INITIALIZER;
 static struct plugin *registered = NULL;
 
+/*
+ * Bumped, under plugin_mutex, whenever the set of registered or
+ * loaded plugins changes; resolved plugin tables record the
+ * generation they were built for.
+ */
+static volatile unsigned long plugin_generation = 1;
+
+#ifdef HAVE___SYNC_ADD_AND_FETCH
+#define plugin_barrier() __sync_synchronize()
+#else
+#define plugin_barrier() do { } while (0)
+#endif
+
 /**
  * Register a plugin symbol name of specific type.
  * @param context a Keberos context
@@ -113,6 +126,7 @@ krb5_plugin_register(krb5_context context,
 
     e->next = registered;
     registered = e;
+    plugin_generation++;
     HEIMDAL_MUTEX_unlock(&plugin_mutex);
 
     return 0;
@@ -382,6 +396,7 @@ _krb5_load_plugins(krb5_context context, const char *name, const char **paths)
 		    p->path = heim_retain(spath);
 		    p->names = heim_dict_create(11);
 		    heim_dict_set_value(module, spath, p);
+		    plugin_generation++;
 		}
 	    }
             heim_release(p);
@@ -409,6 +424,7 @@ _krb5_unload_plugins(krb5_context context, const char *name)
     HEIMDAL_MUTEX_lock(&plugin_mutex);
     heim_release(modules);
     modules = NULL;
+    plugin_generation++;
     HEIMDAL_MUTEX_unlock(&plugin_mutex);
 }
 
@@ -437,63 +453,354 @@ plug_free(void *ptr)
     }
 }
 
-struct iter_ctx {
+/*
+ * A resolved plugin table: the plugins implementing one interface,
+ * in the order they are invoked.  A table is never modified once
+ * published, so it can be used without locks; when the generation
+ * changes a new table is built and the old one is kept until the
+ * handle is freed, as other threads may still be using it.
+ */
+
+struct plugin_entry {
+    const void *symbol;
+    void *ctx;
+    struct plug *plug;		/* loaded plugin, NULL if registered */
+    struct plugin2 *module;	/* keeps the DSO of plug loaded */
+};
+
+struct plugin_table {
+    unsigned long generation;
+    struct plugin_table *prev;
+    size_t len;
+    struct plugin_entry entries[1];
+};
+
+struct krb5_plugin_handle {
+    struct krb5_plugin_handle *next;
+    char *module;
+    char *name;
+    int min_version;
+    struct plugin_table * volatile table;
+    HEIMDAL_MUTEX mutex;	/* serializes rebuilding the table */
+};
+
+struct resolve_ctx {
     krb5_context context;
     heim_string_t n;
     const char *name;
     int min_version;
-    int flags;
-    heim_array_t result;
-    krb5_error_code (KRB5_LIB_CALL *func)(krb5_context, const void *, void *, void *);
-    void *userctx;
+    struct plugin_table *table;
+    size_t alloc;
     krb5_error_code ret;
 };
 
 static void
-search_modules(heim_object_t key, heim_object_t value, void *ctx)
+table_free(struct plugin_table *t)
+{
+    struct plugin_table *prev;
+    struct common_plugin_method *cpm;
+    size_t i;
+
+    for (; t != NULL; t = prev) {
+	prev = t->prev;
+	for (i = 0; i < t->len; i++) {
+	    if (t->entries[i].plug == NULL) {
+		cpm = (struct common_plugin_method *)t->entries[i].symbol;
+		cpm->fini(t->entries[i].ctx);
+	    } else {
+		heim_release(t->entries[i].plug);
+		heim_release(t->entries[i].module);
+	    }
+	}
+	free(t);
+    }
+}
+
+static krb5_error_code
+table_add(struct resolve_ctx *r, const void *symbol, void *ctx,
+	  struct plug *plug, struct plugin2 *module)
+{
+    struct plugin_table *t = r->table;
+    struct plugin_entry *e;
+
+    if (t->len == r->alloc) {
+	size_t alloc = r->alloc * 2;
+
+	t = realloc(t, sizeof(*t) + (alloc - 1) * sizeof(t->entries[0]));
+	if (t == NULL)
+	    return ENOMEM;
+	r->table = t;
+	r->alloc = alloc;
+    }
+    e = &t->entries[t->len++];
+    e->symbol = symbol;
+    e->ctx = ctx;
+    e->plug = heim_retain(plug);
+    e->module = heim_retain(module);
+    return 0;
+}
+
+static void
+resolve_modules(heim_object_t key, heim_object_t value, void *ctx)
 {
-    struct iter_ctx *s = ctx;
+    struct resolve_ctx *r = ctx;
     struct plugin2 *p = value;
-    struct plug *pl = heim_dict_copy_value(p->names, s->n);
+    struct plug *pl = heim_dict_copy_value(p->names, r->n);
     struct common_plugin_method *cpm;
 
+    if (r->ret)
+	goto out;
+
     if (pl == NULL) {
 	if (p->dsohandle == NULL)
 	    return;
 
 	pl = heim_alloc(sizeof(*pl), "struct-plug", plug_free);
 
-	cpm = pl->dataptr = dlsym(p->dsohandle, s->name);
+	cpm = pl->dataptr = dlsym(p->dsohandle, r->name);
 	if (cpm) {
 	    int ret;
 
-	    ret = cpm->init(s->context, &pl->ctx);
+	    ret = cpm->init(r->context, &pl->ctx);
 	    if (ret)
 		cpm = pl->dataptr = NULL;
 	}
-	heim_dict_set_value(p->names, s->n, pl);
+	heim_dict_set_value(p->names, r->n, pl);
     } else {
 	cpm = pl->dataptr;
     }
 
-    if (cpm && cpm->version >= s->min_version)
-	heim_array_append_value(s->result, pl);
+    if (cpm && cpm->version >= r->min_version)
+	r->ret = table_add(r, pl->dataptr, pl->ctx, pl, p);
+out:
     heim_release(pl);
 }
 
-static void
-eval_results(heim_object_t value, void *ctx, int *stop)
+/*
+ * Build the table for `h' as of generation `gen'.
+ */
+
+static krb5_error_code
+table_build(krb5_context context, struct krb5_plugin_handle *h,
+	    unsigned long gen, struct plugin_table **table)
 {
-    struct plug *pl = value;
-    struct iter_ctx *s = ctx;
+    heim_string_t m;
+    heim_dict_t dict;
+    struct resolve_ctx r;
+    struct krb5_plugin *registered_plugins = NULL;
+    struct krb5_plugin *p;
+    struct common_plugin_method *cpm;
+    void *plug_ctx;
+
+    memset(&r, 0, sizeof(r));
+    r.context = context;
+    r.name = h->name;
+    r.min_version = h->min_version;
+
+    *table = NULL;
+
+    r.alloc = 4;
+    r.table = calloc(1, sizeof(*r.table) +
+		     (r.alloc - 1) * sizeof(r.table->entries[0]));
+    if (r.table == NULL)
+	return krb5_enomem(context);
+    r.table->generation = gen;
+
+    /* Registered plugins (old system) first, initialized once */
+    (void) _krb5_plugin_find(context, SYMBOL, h->name, &registered_plugins);
+    for (p = registered_plugins; p && r.ret == 0; p = p->next) {
+	cpm = (struct common_plugin_method *)p->symbol;
+	if (cpm->init(context, &plug_ctx))
+	    continue;
+	r.ret = table_add(&r, p->symbol, plug_ctx, NULL, NULL);
+	if (r.ret)
+	    cpm->fini(plug_ctx);
+    }
+    _krb5_plugin_free(registered_plugins);
+
+    /* Then the loaded plugins (new system) */
+    if (r.ret == 0) {
+	m = heim_string_create(h->module);
+	r.n = heim_string_create(h->name);
 
-    if (s->ret != KRB5_PLUGIN_NO_HANDLE)
+	HEIMDAL_MUTEX_lock(&plugin_mutex);
+	dict = heim_dict_copy_value(modules, m);
+	if (dict)
+	    heim_dict_iterate_f(dict, &r, resolve_modules);
+	HEIMDAL_MUTEX_unlock(&plugin_mutex);
+
+	heim_release(dict);
+	heim_release(r.n);
+	heim_release(m);
+    }
+
+    if (r.ret) {
+	table_free(r.table);
+	return krb5_enomem(context);
+    }
+    *table = r.table;
+    return 0;
+}
+
+/**
+ * Resolve the plugins implementing interface @name of @module once,
+ * to be invoked with _krb5_plugin_run_handle().  The plugins are
+ * looked up again only when the set of registered or loaded plugins
+ * has changed.  Free the handle with _krb5_plugin_handle_free().
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_plugin_handle_create(krb5_context context,
+			   const char *module,
+			   const char *name,
+			   int min_version,
+			   struct krb5_plugin_handle **handle)
+{
+    struct krb5_plugin_handle *h;
+
+    *handle = NULL;
+
+    h = calloc(1, sizeof(*h));
+    if (h == NULL)
+	return krb5_enomem(context);
+    h->module = strdup(module);
+    h->name = strdup(name);
+    if (h->module == NULL || h->name == NULL) {
+	free(h->module);
+	free(h->name);
+	free(h);
+	return krb5_enomem(context);
+    }
+    h->min_version = min_version;
+    HEIMDAL_MUTEX_init(&h->mutex);
+    *handle = h;
+    return 0;
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_plugin_handle_free(struct krb5_plugin_handle *h)
+{
+    if (h == NULL)
 	return;
+    table_free(h->table);
+    HEIMDAL_MUTEX_destroy(&h->mutex);
+    free(h->module);
+    free(h->name);
+    free(h);
+}
 
-    s->ret = s->func(s->context, pl->dataptr, pl->ctx, s->userctx);
-    if (s->ret != KRB5_PLUGIN_NO_HANDLE
-        && !(s->flags & KRB5_PLUGIN_INVOKE_ALL))
-        *stop = 1;
+/**
+ * Run the plugins of a handle from _krb5_plugin_handle_create(), see
+ * _krb5_plugin_run_f().  Unless the plugins changed this takes no
+ * locks.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_plugin_run_handle(krb5_context context,
+			struct krb5_plugin_handle *h,
+			int flags,
+			void *userctx,
+			krb5_error_code (KRB5_LIB_CALL *func)(krb5_context, const void *, void *, void *))
+{
+    struct plugin_table *t;
+    krb5_error_code ret, ret2;
+    unsigned long gen;
+    size_t i;
+
+    gen = plugin_generation;
+    t = h->table;
+    if (t == NULL || t->generation != gen) {
+	HEIMDAL_MUTEX_lock(&h->mutex);
+	t = h->table;
+	if (t == NULL || t->generation != gen) {
+	    ret = table_build(context, h, gen, &t);
+	    if (ret) {
+		HEIMDAL_MUTEX_unlock(&h->mutex);
+		return ret;
+	    }
+	    t->prev = h->table;
+	    plugin_barrier();
+	    h->table = t;
+	}
+	HEIMDAL_MUTEX_unlock(&h->mutex);
+    }
+
+    /*
+     * The first result other than KRB5_PLUGIN_NO_HANDLE is returned;
+     * with KRB5_PLUGIN_INVOKE_ALL the remaining plugins are still
+     * invoked.
+     */
+    ret = KRB5_PLUGIN_NO_HANDLE;
+    for (i = 0; i < t->len; i++) {
+	ret2 = func(context, t->entries[i].symbol, t->entries[i].ctx, userctx);
+	if (ret2 == KRB5_PLUGIN_NO_HANDLE)
+	    continue;
+	if (ret == KRB5_PLUGIN_NO_HANDLE)
+	    ret = ret2;
+	if (!(flags & KRB5_PLUGIN_INVOKE_ALL))
+	    break;
+    }
+    return ret;
+}
+
+/*
+ * Find, or create, the handle for an interface in the per context
+ * cache.  Handles are only ever added to the front of the list, so
+ * readers need no lock.
+ */
+
+static krb5_error_code
+context_handle(krb5_context context, const char *module, const char *name,
+	       int min_version, struct krb5_plugin_handle **handle)
+{
+    struct krb5_plugin_handle *h, *head;
+    krb5_error_code ret;
+
+    head = context->plugin_handles;
+    for (h = head; h != NULL; h = h->next) {
+	if (h->min_version == min_version &&
+	    strcmp(h->name, name) == 0 && strcmp(h->module, module) == 0) {
+	    *handle = h;
+	    return 0;
+	}
+    }
+
+    HEIMDAL_MUTEX_lock(context->mutex);
+    for (h = context->plugin_handles; h != head; h = h->next) {
+	if (h->min_version == min_version &&
+	    strcmp(h->name, name) == 0 && strcmp(h->module, module) == 0)
+	    break;
+    }
+    if (h == head) {
+	ret = _krb5_plugin_handle_create(context, module, name,
+					 min_version, &h);
+	if (ret) {
+	    HEIMDAL_MUTEX_unlock(context->mutex);
+	    return ret;
+	}
+	h->next = context->plugin_handles;
+	plugin_barrier();
+	context->plugin_handles = h;
+    }
+    HEIMDAL_MUTEX_unlock(context->mutex);
+    *handle = h;
+    return 0;
+}
+
+/*
+ * Free the per context plugin handles, from krb5_free_context().
+ */
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_plugin_handles_free(krb5_context context)
+{
+    struct krb5_plugin_handle *h, *next;
+
+    for (h = context->plugin_handles; h != NULL; h = next) {
+	next = h->next;
+	_krb5_plugin_handle_free(h);
+    }
+    context->plugin_handles = NULL;
 }
 
 /**
@@ -512,6 +819,10 @@ eval_results(heim_object_t value, void *ctx, int *stop)
  * have nothing to do for the given arguments should return
  * KRB5_PLUGIN_NO_HANDLE.
  *
+ * The plugins are resolved once per context and interface, and only
+ * looked up again when plugins are registered, loaded or unloaded,
+ * see _krb5_plugin_run_handle().
+ *
  * Inputs:
  *
  * @context     A krb5_context
@@ -534,73 +845,11 @@ _krb5_plugin_run_f(krb5_context context,
 		   void *userctx,
 		   krb5_error_code (KRB5_LIB_CALL *func)(krb5_context, const void *, void *, void *))
 {
-    heim_string_t m = heim_string_create(module);
-    heim_dict_t dict;
-    void *plug_ctx;
-    struct common_plugin_method *cpm;
-    struct iter_ctx s;
-    struct krb5_plugin *registered_plugins = NULL;
-    struct krb5_plugin *p;
-
-    /* Get registered plugins */
-    (void) _krb5_plugin_find(context, SYMBOL, name, &registered_plugins);
-
-    HEIMDAL_MUTEX_lock(&plugin_mutex);
-
-    s.context = context;
-    s.name = name;
-    s.n = heim_string_create(name);
-    s.flags = flags;
-    s.min_version = min_version;
-    s.result = heim_array_create();
-    s.func = func;
-    s.userctx = userctx;
-    s.ret = KRB5_PLUGIN_NO_HANDLE;
-
-    /* Get loaded plugins */
-    dict = heim_dict_copy_value(modules, m);
-    heim_release(m);
-
-    /* Add loaded plugins to s.result array */
-    if (dict)
-	heim_dict_iterate_f(dict, &s, search_modules);
-
-    /* We don't need to hold plugin_mutex during plugin invocation */
-    HEIMDAL_MUTEX_unlock(&plugin_mutex);
-
-    /* Invoke registered plugins (old system) */
-    for (p = registered_plugins; p; p = p->next) {
-	/*
-	 * XXX This is the wrong way to handle registered plugins, as we
-	 * call init/fini on each invocation!  We do this because we
-	 * have nowhere in the struct plugin registered list to store
-	 * the context allocated by the plugin's init function.  (But at
-	 * least we do call init/fini!)
-	 *
-	 * What we should do is adapt the old plugin system to the new
-	 * one and change how we register plugins so that we use the new
-	 * struct plug to keep track of their context structures, that
-	 * way we can init once, invoke many times, then fini.
-	 */
-	cpm = (struct common_plugin_method *)p->symbol;
-	s.ret = cpm->init(context, &plug_ctx);
-	if (s.ret)
-	    continue;
-	s.ret = s.func(s.context, p->symbol, plug_ctx, s.userctx);
-	cpm->fini(plug_ctx);
-	if (s.ret != KRB5_PLUGIN_NO_HANDLE &&
-            !(flags & KRB5_PLUGIN_INVOKE_ALL))
-	    break;
-    }
-    _krb5_plugin_free(registered_plugins);
-
-    /* Invoke loaded plugins (new system) */
-    if (s.ret == KRB5_PLUGIN_NO_HANDLE)
-	heim_array_iterate_f(s.result, &s, eval_results);
-
-    heim_release(s.result);
-    heim_release(s.n);
-    heim_release(dict);
+    struct krb5_plugin_handle *h;
+    krb5_error_code ret;
 
-    return s.ret;
+    ret = context_handle(context, module, name, min_version, &h);
+    if (ret)
+	return ret;
+    return _krb5_plugin_run_handle(context, h, flags, userctx, func);
 }
@@ -42,6 +42,8 @@ struct krb5_storage_data {
     int (*trunc)(struct krb5_storage_data*, off_t);
     int (*fsync)(struct krb5_storage_data*);
     void (*free)(struct krb5_storage_data*);
+    int (*reserve)(struct krb5_storage_data*, size_t);
+    int (*iov)(struct krb5_storage_data*, struct iovec**, int*);
     krb5_flags flags;
     int eof_code;
     size_t max_alloc;
@@ -333,6 +333,95 @@ krb5_storage_to_data(krb5_storage *sp, krb5_data *data)
     return 0;
 }
 
+/**
+ * Write the content of a storage to a file descriptor.  Memory
+ * storages are written directly from their buffers, other storages
+ * are first copied with krb5_storage_to_data().
+ *
+ * @param sp the storage to write out
+ * @param fd the file descriptor to write to
+ *
+ * @return 0 for success, or an errno on failure.
+ *
+ * @ingroup krb5_storage
+ *
+ * @sa krb5_storage_chunked()
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_storage_to_fd(krb5_storage *sp, int fd)
+{
+    krb5_error_code ret = 0;
+    struct iovec *iov;
+    krb5_data data;
+    int i, n;
+
+    if (sp->iov) {
+	ret = (*sp->iov)(sp, &iov, &n);
+	if (ret)
+	    return ret;
+    } else {
+	ret = krb5_storage_to_data(sp, &data);
+	if (ret)
+	    return ret;
+	iov = malloc(sizeof(*iov));
+	if (iov == NULL) {
+	    krb5_data_free(&data);
+	    return ENOMEM;
+	}
+	iov->iov_base = data.data;
+	iov->iov_len = data.length;
+	n = 1;
+    }
+
+    i = 0;
+    while (i < n) {
+	ssize_t w;
+
+	w = writev(fd, &iov[i], n - i > 64 ? 64 : n - i);
+	if (w < 0) {
+	    if (errno == EINTR)
+		continue;
+	    ret = errno;
+	    break;
+	}
+	while (i < n && (size_t)w >= iov[i].iov_len) {
+	    w -= iov[i].iov_len;
+	    i++;
+	}
+	if (i < n) {
+	    iov[i].iov_base = (char *)iov[i].iov_base + w;
+	    iov[i].iov_len -= w;
+	}
+    }
+
+    if (sp->iov == NULL)
+	krb5_data_free(&data);
+    free(iov);
+    return ret;
+}
+
+/**
+ * Hint that `size' more bytes are about to be stored at the current
+ * offset, so that memory storages can allocate them at once.  Other
+ * storages ignore the hint.
+ *
+ * @param sp the storage
+ * @param size the number of bytes about to be stored
+ *
+ * @return 0 for success, or a Kerberos 5 error code on failure.
+ *
+ * @ingroup krb5_storage
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_storage_reserve(krb5_storage *sp, size_t size)
+{
+    if (sp->reserve)
+	return (*sp->reserve)(sp, size);
+    return 0;
+}
+
 static krb5_error_code
 krb5_store_int(krb5_storage *sp,
 	       int32_t value,
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include "store-int.h"
+
+/*
+ * An elastic memory storage kept as a list of chunks, each twice the
+ * size of the previous one up to CHUNK_MAX.  Growing never moves
+ * data already stored, and the content can be written out with
+ * writev() without first flattening it, see krb5_storage_to_fd().
+ */
+
+#define CHUNK_MIN	1024
+#define CHUNK_MAX	(1024 * 1024)
+
+struct chunk {
+    unsigned char *data;
+    size_t size;
+};
+
+typedef struct chunk_storage {
+    struct chunk *chunks;
+    size_t nchunks;
+    size_t cap;			/* sum of the chunk sizes */
+    size_t len;			/* bytes stored */
+    size_t off;			/* current offset */
+    size_t cur;			/* index of the chunk holding off */
+    size_t cur_start;		/* offset of chunk cur */
+} chunk_storage;
+
+/*
+ * Find the chunk holding offset `off', returns nchunks if off is at
+ * the end of the last chunk.
+ */
+
+static size_t
+chunk_find(chunk_storage *s, size_t off, size_t *start)
+{
+    size_t i = 0, st = 0;
+
+    if (s->cur < s->nchunks && s->cur_start <= off) {
+	i = s->cur;
+	st = s->cur_start;
+    }
+    while (i < s->nchunks && off >= st + s->chunks[i].size) {
+	st += s->chunks[i].size;
+	i++;
+    }
+    s->cur = i;
+    s->cur_start = st;
+    *start = st;
+    return i;
+}
+
+static int
+chunk_add(chunk_storage *s, size_t want)
+{
+    struct chunk *c;
+    size_t sz;
+
+    sz = s->nchunks ? s->chunks[s->nchunks - 1].size * 2 : CHUNK_MIN;
+    if (sz > CHUNK_MAX)
+	sz = CHUNK_MAX;
+    if (sz < want)
+	sz = want;
+
+    c = realloc(s->chunks, (s->nchunks + 1) * sizeof(s->chunks[0]));
+    if (c == NULL)
+	return ENOMEM;
+    s->chunks = c;
+    c = &s->chunks[s->nchunks];
+    c->data = malloc(sz);
+    if (c->data == NULL)
+	return ENOMEM;
+    c->size = sz;
+    s->nchunks++;
+    s->cap += sz;
+    return 0;
+}
+
+static ssize_t
+chunk_fetch(krb5_storage *sp, void *data, size_t size)
+{
+    chunk_storage *s = (chunk_storage*)sp->data;
+    unsigned char *p = data;
+    size_t i, start, n, done = 0;
+
+    if (size > s->len - s->off)
+	size = s->len - s->off;
+    while (done < size) {
+	i = chunk_find(s, s->off, &start);
+	n = s->chunks[i].size - (s->off - start);
+	if (n > size - done)
+	    n = size - done;
+	memcpy(p + done, s->chunks[i].data + (s->off - start), n);
+	s->off += n;
+	done += n;
+    }
+    return done;
+}
+
+static ssize_t
+chunk_store(krb5_storage *sp, const void *data, size_t size)
+{
+    chunk_storage *s = (chunk_storage*)sp->data;
+    const unsigned char *p = data;
+    size_t i, start, n, done = 0;
+
+    while (done < size) {
+	i = chunk_find(s, s->off, &start);
+	if (i == s->nchunks) {
+	    if (chunk_add(s, 0))
+		break;
+	    continue;
+	}
+	n = s->chunks[i].size - (s->off - start);
+	if (n > size - done)
+	    n = size - done;
+	memcpy(s->chunks[i].data + (s->off - start), p + done, n);
+	s->off += n;
+	done += n;
+    }
+    if (s->off > s->len)
+	s->len = s->off;
+    if (done == 0 && size != 0)
+	return -1;
+    return done;
+}
+
+static off_t
+chunk_seek(krb5_storage *sp, off_t offset, int whence)
+{
+    chunk_storage *s = (chunk_storage*)sp->data;
+    switch(whence){
+    case SEEK_SET:
+	break;
+    case SEEK_CUR:
+	offset += s->off;
+	break;
+    case SEEK_END:
+	offset += s->len;
+	break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+    if (offset < 0)
+	offset = 0;
+    if ((size_t)offset > s->len)
+	offset = s->len;
+    s->off = offset;
+    return offset;
+}
+
+/*
+ * Shrinking keeps the chunks, so a storage that is filled, written
+ * out and truncated again and again, like a write buffer, allocates
+ * nothing after the first round.  They are released by chunk_free().
+ */
+
+static int
+chunk_trunc(krb5_storage *sp, off_t offset)
+{
+    chunk_storage *s = (chunk_storage*)sp->data;
+
+    if (offset < 0)
+	return EINVAL;
+
+    if ((size_t)offset > s->len) {
+	static const unsigned char zeros[512];
+	size_t off = s->off, n;
+
+	s->off = s->len;
+	while (s->len < (size_t)offset) {
+	    n = offset - s->len;
+	    if (n > sizeof(zeros))
+		n = sizeof(zeros);
+	    if (chunk_store(sp, zeros, n) != (ssize_t)n) {
+		s->off = off;
+		return ENOMEM;
+	    }
+	}
+	s->off = off;
+	return 0;
+    }
+
+    s->len = offset;
+    if (s->off > s->len)
+	s->off = s->len;
+    return 0;
+}
+
+static int
+chunk_reserve(krb5_storage *sp, size_t size)
+{
+    chunk_storage *s = (chunk_storage*)sp->data;
+
+    if (s->off + size <= s->cap)
+	return 0;
+    return chunk_add(s, s->off + size - s->cap);
+}
+
+static int
+chunk_iov(krb5_storage *sp, struct iovec **iov, int *niov)
+{
+    chunk_storage *s = (chunk_storage*)sp->data;
+    size_t i, left = s->len;
+
+    *niov = 0;
+    *iov = malloc((s->nchunks ? s->nchunks : 1) * sizeof(**iov));
+    if (*iov == NULL)
+	return ENOMEM;
+    for (i = 0; i < s->nchunks && left; i++) {
+	(*iov)[i].iov_base = (void *)s->chunks[i].data;
+	(*iov)[i].iov_len = left < s->chunks[i].size ? left : s->chunks[i].size;
+	left -= (*iov)[i].iov_len;
+    }
+    *niov = i;
+    return 0;
+}
+
+static void
+chunk_free(krb5_storage *sp)
+{
+    chunk_storage *s = sp->data;
+    size_t i;
+
+    for (i = 0; i < s->nchunks; i++) {
+	memset(s->chunks[i].data, 0, s->chunks[i].size);
+	free(s->chunks[i].data);
+    }
+    free(s->chunks);
+}
+
+/**
+ * Create an elastic memory storage backend made of a list of
+ * chunks.  Unlike krb5_storage_emem() growing it never copies what
+ * has already been stored, which makes it the better choice for
+ * large buffers that are written out with krb5_storage_to_fd().
+ * Free returned krb5_storage with krb5_storage_free().
+ *
+ * Seeking past the end of the stored data is not possible, use
+ * krb5_storage_truncate() to extend it.  Truncating keeps the memory
+ * for reuse, it is only released by krb5_storage_free().
+ *
+ * @return A krb5_storage on success, or NULL on out of memory error.
+ *
+ * @ingroup krb5_storage
+ *
+ * @sa krb5_storage_emem()
+ * @sa krb5_storage_to_fd()
+ * @sa krb5_storage_reserve()
+ */
+
+KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
+krb5_storage_chunked(void)
+{
+    krb5_storage *sp;
+    chunk_storage *s;
+
+    sp = malloc(sizeof(krb5_storage));
+    if (sp == NULL)
+	return NULL;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+	free(sp);
+	return NULL;
+    }
+    sp->data = s;
+    sp->flags = 0;
+    sp->eof_code = HEIM_ERR_EOF;
+    sp->fetch = chunk_fetch;
+    sp->store = chunk_store;
+    sp->seek = chunk_seek;
+    sp->trunc = chunk_trunc;
+    sp->fsync = NULL;
+    sp->free = chunk_free;
+    sp->reserve = chunk_reserve;
+    sp->iov = chunk_iov;
+    sp->max_alloc = UINT_MAX/8;
+    return sp;
+}
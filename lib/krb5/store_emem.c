@@ -52,24 +52,50 @@ emem_fetch(krb5_storage *sp, void *data, size_t size)
     return size;
 }
 
+static int
+emem_grow(emem_storage *s, size_t sz)
+{
+    void *base;
+    size_t off;
+
+    off = s->ptr - s->base;
+    base = realloc(s->base, sz);
+    if(base == NULL)
+	return ENOMEM;
+    s->size = sz;
+    s->base = base;
+    s->ptr = (unsigned char*)base + off;
+    return 0;
+}
+
+/*
+ * Make room for `size' more bytes at the current offset.  Grow by at
+ * least doubling, otherwise building a large buffer with many small
+ * stores is quadratic.
+ */
+
+static int
+emem_reserve(krb5_storage *sp, size_t size)
+{
+    emem_storage *s = (emem_storage*)sp->data;
+    size_t sz;
+
+    if(size <= (size_t)(s->base + s->size - s->ptr))
+	return 0;
+    sz = (s->ptr - s->base) + size;
+    if (sz < s->size * 2)
+	sz = s->size * 2;
+    if (sz < 1024)
+	sz = 1024;
+    return emem_grow(s, sz);
+}
+
 static ssize_t
 emem_store(krb5_storage *sp, const void *data, size_t size)
 {
     emem_storage *s = (emem_storage*)sp->data;
-    if(size > (size_t)(s->base + s->size - s->ptr)){
-	void *base;
-	size_t sz, off;
-	off = s->ptr - s->base;
-	sz = off + size;
-	if (sz < 4096)
-	    sz *= 2;
-	base = realloc(s->base, sz);
-	if(base == NULL)
-	    return -1;
-	s->size = sz;
-	s->base = base;
-	s->ptr = (unsigned char*)base + off;
-    }
+    if(emem_reserve(sp, size))
+	return -1;
     memmove(s->ptr, data, size);
     sp->seek(sp, size, SEEK_CUR);
     return size;
@@ -134,6 +160,19 @@ emem_trunc(krb5_storage *sp, off_t offset)
     return 0;
 }
 
+static int
+emem_iov(krb5_storage *sp, struct iovec **iov, int *niov)
+{
+    emem_storage *s = (emem_storage*)sp->data;
+
+    *iov = malloc(sizeof(**iov));
+    if (*iov == NULL)
+	return ENOMEM;
+    (*iov)->iov_base = (void *)s->base;
+    (*iov)->iov_len = s->len;
+    *niov = 1;
+    return 0;
+}
 
 static void
 emem_free(krb5_storage *sp)
@@ -157,6 +196,8 @@ emem_free(krb5_storage *sp)
  * @sa krb5_storage_from_fd()
  * @sa krb5_storage_from_data()
  * @sa krb5_storage_from_socket()
+ * @sa krb5_storage_chunked()
+ * @sa krb5_storage_reserve()
  */
 
 KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
@@ -192,6 +233,8 @@ krb5_storage_emem(void)
     sp->trunc = emem_trunc;
     sp->fsync = NULL;
     sp->free = emem_free;
+    sp->reserve = emem_reserve;
+    sp->iov = emem_iov;
     sp->max_alloc = UINT_MAX/8;
     return sp;
 }
@@ -177,6 +177,8 @@ krb5_storage_from_fd(int fd_in)
     sp->seek = fd_seek;
     sp->trunc = fd_trunc;
     sp->fsync = fd_sync;
+    sp->reserve = NULL;
+    sp->iov = NULL;
     sp->free = fd_free;
     sp->max_alloc = UINT_MAX/8;
     return sp;
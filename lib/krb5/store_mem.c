@@ -146,6 +146,8 @@ krb5_storage_from_mem(void *buf, size_t len)
     sp->seek = mem_seek;
     sp->trunc = mem_trunc;
     sp->fsync = NULL;
+    sp->reserve = NULL;
+    sp->iov = NULL;
     sp->free = NULL;
     sp->max_alloc = UINT_MAX/8;
     return sp;
@@ -206,6 +208,8 @@ krb5_storage_from_readonly_mem(const void *buf, size_t len)
     sp->seek = mem_seek;
     sp->trunc = mem_no_trunc;
     sp->fsync = NULL;
+    sp->reserve = NULL;
+    sp->iov = NULL;
     sp->free = NULL;
     sp->max_alloc = UINT_MAX/8;
     return sp;
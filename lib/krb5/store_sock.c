@@ -149,6 +149,8 @@ krb5_storage_from_socket(krb5_socket_t sock_in)
     sp->seek = socket_seek;
     sp->trunc = socket_trunc;
     sp->fsync = socket_sync;
+    sp->reserve = NULL;
+    sp->iov = NULL;
     sp->free = socket_free;
     sp->max_alloc = UINT_MAX/8;
     return sp;
@@ -237,10 +237,146 @@ check_escaped_strings(void)
     krb5_free_context(context);
 }
 
+/*
+ * Lookups from the context go through the compiled snapshot, they
+ * must find the same thing as a walk of the parsed tree.
+ */
+
+static const char snapshot_conf[] =
+    "[libdefaults]\n"
+    "\tdefault_realm = FOO.TEST\n"
+    "\tforwardable = yes\n"
+    "\tticket_lifetime = 1h 30m\n"
+    "\tkdc_timeout = 0x10\n"
+    "\tdefault_realm = BAR.TEST\n"
+    "[capaths]\n"
+    "\tA.TEST = {\n"
+    "\t\tB.TEST = C.TEST\n"
+    "\t\tB.TEST = D.TEST\n"
+    "\t}\n"
+    "\tA.TEST = {\n"
+    "\t\tE.TEST = F.TEST\n"
+    "\t}\n"
+    "\tA.TEST = G.TEST\n"
+    "[realms]\n"
+    "\tFOO.TEST = {\n"
+    "\t\tkdc = kdc.foo.test\n"
+    "\t\tsub = {\n"
+    "\t\t\ta = {\n"
+    "\t\t\t\tb = deep\n"
+    "\t\t\t}\n"
+    "\t\t}\n"
+    "\t}\n";
+
+static const char *snapshot_paths[][5] = {
+    { "libdefaults", "default_realm" },
+    { "libdefaults", "forwardable" },
+    { "libdefaults", "ticket_lifetime" },
+    { "libdefaults", "kdc_timeout" },
+    { "libdefaults", "missing" },
+    { "libdefaults" },
+    { "capaths", "A.TEST" },
+    { "capaths", "A.TEST", "B.TEST" },
+    { "capaths", "A.TEST", "E.TEST" },
+    { "realms", "FOO.TEST", "kdc" },
+    { "realms", "FOO.TEST", "sub", "a", "b" },
+    { "nosuch", "FOO.TEST", "kdc" }
+};
+
+static void
+write_conf(const char *fn, const char *conf)
+{
+    FILE *f;
+
+    f = fopen(fn, "w");
+    if (f == NULL)
+	err(1, "%s", fn);
+    fputs(conf, f);
+    fclose(f);
+}
+
+static void
+check_snapshot(void)
+{
+    const char *fn = "test_config_snapshot.conf";
+    char *files[] = { rk_UNCONST(fn), NULL };
+    struct krb5_config_handle *h;
+    krb5_config_section *c = NULL;
+    krb5_context context;
+    krb5_error_code ret;
+    const char *s1, *s2;
+    size_t i;
+
+    write_conf(fn, snapshot_conf);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context %d", ret);
+    ret = krb5_set_config_files(context, files);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config_files");
+    ret = krb5_config_parse_file(context, fn, &c);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_config_parse_file");
+
+    for (i = 0; i < sizeof(snapshot_paths)/sizeof(snapshot_paths[0]); i++) {
+	const char **p = snapshot_paths[i];
+
+	s1 = krb5_config_get_string(context, NULL, p[0], p[1], p[2], p[3], p[4], NULL);
+	s2 = krb5_config_get_string(context, c, p[0], p[1], p[2], p[3], p[4], NULL);
+	if ((s1 == NULL) != (s2 == NULL) || (s1 && strcmp(s1, s2) != 0))
+	    krb5_errx(context, 1, "snapshot %s/%s: %s != %s", p[0],
+		      p[1] ? p[1] : "", s1 ? s1 : "<none>", s2 ? s2 : "<none>");
+
+	if (krb5_config_get_bool_default(context, NULL, 2, p[0], p[1], p[2], p[3], p[4], NULL) !=
+	    krb5_config_get_bool_default(context, c, 2, p[0], p[1], p[2], p[3], p[4], NULL))
+	    krb5_errx(context, 1, "snapshot bool %s/%s", p[0], p[1] ? p[1] : "");
+	if (krb5_config_get_time_default(context, NULL, -2, p[0], p[1], p[2], p[3], p[4], NULL) !=
+	    krb5_config_get_time_default(context, c, -2, p[0], p[1], p[2], p[3], p[4], NULL))
+	    krb5_errx(context, 1, "snapshot time %s/%s", p[0], p[1] ? p[1] : "");
+	if (krb5_config_get_int_default(context, NULL, -2, p[0], p[1], p[2], p[3], p[4], NULL) !=
+	    krb5_config_get_int_default(context, c, -2, p[0], p[1], p[2], p[3], p[4], NULL))
+	    krb5_errx(context, 1, "snapshot int %s/%s", p[0], p[1] ? p[1] : "");
+    }
+    krb5_config_file_free(context, c);
+
+    /* a handle follows the configuration across a reload */
+    ret = _krb5_config_handle_create(context, &h, "libdefaults",
+				     "ticket_lifetime", NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "_krb5_config_handle_create");
+    if (_krb5_config_handle_get_time_default(context, h, 0) != 5400)
+	krb5_errx(context, 1, "handle ticket_lifetime");
+    if (_krb5_config_handle_get_time_default(context, h, 0) != 5400)
+	krb5_errx(context, 1, "handle ticket_lifetime (cached)");
+
+    write_conf(fn, "[libdefaults]\n\tticket_lifetime = 2h\n");
+    ret = krb5_set_config_files(context, files);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config_files");
+    if (_krb5_config_handle_get_time_default(context, h, 0) != 7200)
+	krb5_errx(context, 1, "handle ticket_lifetime after reload");
+    s1 = _krb5_config_handle_get_string(context, h);
+    if (s1 == NULL || strcmp(s1, "2h") != 0)
+	krb5_errx(context, 1, "handle string after reload");
+
+    write_conf(fn, "[libdefaults]\n\tforwardable = no\n");
+    ret = krb5_set_config_files(context, files);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config_files");
+    if (_krb5_config_handle_get_time_default(context, h, 42) != 42)
+	krb5_errx(context, 1, "handle default after reload");
+    _krb5_config_handle_free(h);
+
+    krb5_free_context(context);
+    unlink(fn);
+}
+
 int
 main(int argc, char **argv)
 {
     check_config_files();
     check_escaped_strings();
+    check_snapshot();
     return 0;
 }
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of KTH nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY KTH AND ITS CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL KTH OR ITS CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+
+/*
+ * Log the same messages to a FILE:, an ASYNC: and an ASYNC-JSON:
+ * destination.  Closing the log facility has the writer thread write
+ * out everything it holds, after which the ASYNC: file must be the
+ * same as the FILE: one, and the ASYNC-JSON: file must have one line
+ * per message with the same time stamp.
+ */
+
+#define FILE_LOG	"test_log_file.log"
+#define ASYNC_LOG	"test_log_async.log"
+#define JSON_LOG	"test_log_json.log"
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE___SYNC_ADD_AND_FETCH)
+/* without these ASYNC-JSON: falls back to writing FILE: lines */
+#define CHECK_JSON 1
+#endif
+
+#define NMSGS 300
+
+static const char special[] = "tab\there \"quoted\" \001 \377 back\\slash end";
+static const char special_json[] =
+    "tab\\u0009here \\\"quoted\\\" \\u0001 \\u00ff back\\\\slash end";
+
+static char long_msg[2000];
+
+static void
+log_all(krb5_context context, krb5_log_facility *fac)
+{
+    int i;
+
+    for (i = 0; i < NMSGS; i++)
+	krb5_log(context, fac, 0, "message %d", i);
+    krb5_log(context, fac, 0, "%s", long_msg);
+    krb5_log(context, fac, 0, "%s", special);
+}
+
+static char *
+read_log(krb5_context context, const char *fn, size_t *len)
+{
+    void *data;
+    int ret;
+
+    ret = rk_undumpdata(fn, &data, len);
+    if (ret)
+	krb5_err(context, 1, ret, "%s", fn);
+    /* make it a string, so lines can be split at '\n' */
+    data = realloc(data, *len + 1);
+    if (data == NULL)
+	krb5_errx(context, 1, "out of memory");
+    ((char *)data)[*len] = '\0';
+    return data;
+}
+
+#ifdef CHECK_JSON
+
+static void
+check_json(krb5_context context, char *file, char *json)
+{
+    char *fl, *jl, *fnext, *jnext, *expect;
+    char num[32];
+    const char *msg;
+    int i, tlen;
+
+    for (i = 0; i < NMSGS + 2; i++, file = fnext, json = jnext) {
+	fl = file;
+	jl = json;
+	fnext = strchr(fl, '\n');
+	jnext = strchr(jl, '\n');
+	if (fnext == NULL || jnext == NULL)
+	    krb5_errx(context, 1, "line %d missing", i);
+	*fnext++ = '\0';
+	*jnext++ = '\0';
+
+	/* the time stamp is what the FILE: line has before the message */
+	tlen = strcspn(fl, " ");
+
+	if (i < NMSGS) {
+	    snprintf(num, sizeof(num), "message %d", i);
+	    msg = num;
+	} else
+	    msg = (i == NMSGS) ? long_msg : special_json;
+
+	if (asprintf(&expect,
+		     "{\"time\":\"%.*s\",\"program\":\"test_log\","
+		     "\"message\":\"%s\"}", tlen, fl, msg) < 0 || expect == NULL)
+	    krb5_errx(context, 1, "out of memory");
+	if (strcmp(jl, expect) != 0)
+	    krb5_errx(context, 1, "json line %d is wrong: %s", i, jl);
+	free(expect);
+    }
+    if (*json != '\0')
+	krb5_errx(context, 1, "json log has trailing data: %s", json);
+}
+
+#endif
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    krb5_log_facility *fac;
+    char *file, *async;
+    size_t flen, alen;
+
+    setprogname(argv[0]);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context %d", ret);
+
+    memset(long_msg, 'x', sizeof(long_msg) - 1);
+
+    unlink(FILE_LOG);
+    unlink(ASYNC_LOG);
+    unlink(JSON_LOG);
+
+    ret = krb5_initlog(context, "test_log", &fac);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_initlog");
+    ret = krb5_addlog_dest(context, fac, "FILE:" FILE_LOG);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_addlog_dest: FILE");
+    ret = krb5_addlog_dest(context, fac, "ASYNC:" ASYNC_LOG);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_addlog_dest: ASYNC");
+    ret = krb5_addlog_dest(context, fac, "ASYNC-JSON:" JSON_LOG);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_addlog_dest: ASYNC-JSON");
+
+    log_all(context, fac);
+
+    /* waits for the writers to write everything out */
+    krb5_closelog(context, fac);
+
+    file = read_log(context, FILE_LOG, &flen);
+    async = read_log(context, ASYNC_LOG, &alen);
+    if (flen == 0 || flen != alen || memcmp(file, async, flen) != 0)
+	krb5_errx(context, 1, "ASYNC: log differs from FILE: log");
+    free(async);
+
+#ifdef CHECK_JSON
+    async = read_log(context, JSON_LOG, &alen);
+    check_json(context, file, async);
+    free(async);
+#endif
+    free(file);
+
+    unlink(FILE_LOG);
+    unlink(ASYNC_LOG);
+    unlink(JSON_LOG);
+
+    krb5_free_context(context);
+
+    return 0;
+}
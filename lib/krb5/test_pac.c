@@ -251,7 +251,6 @@ main(int argc, char **argv)
 	krb5_pac_free(context, pac2);
 
 	ret = krb5_pac_parse(context, data.data, data.length, &pac2);
-	krb5_data_free(&data);
 	if (ret)
 	    krb5_err(context, 1, ret, "krb5_pac_parse 4");
 
@@ -260,6 +259,59 @@ main(int argc, char **argv)
 	if (ret)
 	    krb5_err(context, 1, ret, "krb5_pac_verify 4");
 
+	/*
+	 * Re-signing the parsed PAC is done in place, it must come
+	 * out the same as the fully encoded one.
+	 */
+	{
+	    krb5_data data2;
+
+	    ret = _krb5_pac_sign(context, pac2, authtime, p,
+				 &member_keyblock, &kdc_keyblock, &data2);
+	    if (ret)
+		krb5_err(context, 1, ret, "_krb5_pac_sign 5");
+	    if (krb5_data_cmp(&data, &data2) != 0)
+		krb5_errx(context, 1, "PAC re-signed in place differs");
+	    krb5_data_free(&data2);
+	}
+
+	/*
+	 * A buffer added to a parsed PAC must make it into the
+	 * signed PAC, the parsed bytes can not be reused as is.
+	 */
+	{
+	    krb5_data cdata, data2;
+	    krb5_pac pac3;
+
+	    cdata.length = 2;
+	    cdata.data = "\x03\x04";
+
+	    ret = krb5_pac_add_buffer(context, pac2, 3, &cdata);
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_pac_add_buffer 6");
+	    ret = _krb5_pac_sign(context, pac2, authtime, p,
+				 &member_keyblock, &kdc_keyblock, &data2);
+	    if (ret)
+		krb5_err(context, 1, ret, "_krb5_pac_sign 6");
+
+	    ret = krb5_pac_parse(context, data2.data, data2.length, &pac3);
+	    krb5_data_free(&data2);
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_pac_parse 6");
+	    ret = krb5_pac_verify(context, pac3, authtime, p,
+				  &member_keyblock, &kdc_keyblock);
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_pac_verify 6");
+	    ret = krb5_pac_get_buffer(context, pac3, 3, &data2);
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_pac_get_buffer 6");
+	    if (krb5_data_cmp(&data2, &cdata) != 0)
+		krb5_errx(context, 1, "added PAC buffer differs");
+	    krb5_data_free(&data2);
+	    krb5_pac_free(context, pac3);
+	}
+
+	krb5_data_free(&data);
 	krb5_pac_free(context, pac2);
     }
 
@@ -81,6 +81,84 @@ krb5plugin_service_locate_ftable resolve = {
     NULL
 };
 
+/*
+ * Check that plugins are resolved once and looked up again when a
+ * plugin is registered.
+ */
+
+struct count_ftable {
+    int minor_version;
+    krb5_error_code (*init)(krb5_context, void **);
+    void (*fini)(void *);
+};
+
+static int count_inits, count_finis, count_calls;
+
+static krb5_error_code
+count_init(krb5_context context, void **ctx)
+{
+    count_inits++;
+    *ctx = &count_calls;
+    return 0;
+}
+
+static void
+count_fini(void *ctx)
+{
+    count_finis++;
+}
+
+static struct count_ftable count1 = { 0, count_init, count_fini };
+static struct count_ftable count2 = { 0, count_init, count_fini };
+
+static krb5_error_code KRB5_LIB_CALL
+count_call(krb5_context context, const void *plug, void *plugctx, void *userctx)
+{
+    (*(int *)plugctx)++;
+    return KRB5_PLUGIN_NO_HANDLE;
+}
+
+static void
+test_resolve_once(void)
+{
+    krb5_error_code ret;
+    krb5_context context;
+    int i;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_contex");
+
+    ret = krb5_plugin_register(context, PLUGIN_TYPE_DATA,
+			       "test_count", &count1);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_plugin_register");
+
+    for (i = 0; i < 10; i++) {
+	ret = _krb5_plugin_run_f(context, "krb5", "test_count", 0, 0,
+				 NULL, count_call);
+	if (ret != KRB5_PLUGIN_NO_HANDLE)
+	    krb5_errx(context, 1, "test_count handled");
+    }
+    if (count_inits != 1 || count_calls != 10)
+	krb5_errx(context, 1, "resolved %d times, called %d times",
+		  count_inits, count_calls);
+
+    ret = krb5_plugin_register(context, PLUGIN_TYPE_DATA,
+			       "test_count", &count2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_plugin_register");
+
+    (void)_krb5_plugin_run_f(context, "krb5", "test_count", 0, 0,
+			     NULL, count_call);
+    if (count_calls != 12)
+	krb5_errx(context, 1, "new plugin not picked up");
+
+    krb5_free_context(context);
+    if (count_finis != count_inits)
+	errx(1, "%d inits but %d finis", count_inits, count_finis);
+}
+
 
 int
 main(int argc, char **argv)
@@ -123,5 +201,8 @@ main(int argc, char **argv)
     krb5_krbhst_free(context, handle);
 
     krb5_free_context(context);
+
+    test_resolve_once();
+
     return 0;
 }
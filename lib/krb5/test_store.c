@@ -235,14 +235,141 @@ check_too_large(krb5_context context, krb5_storage *sp)
     }
 }
 
+/*
+ * Store records shaped like an iprop dump, write them out with
+ * krb5_storage_to_fd() and read them back.
+ */
+
+static void
+test_records(krb5_context context, krb5_storage *sp, const char *fn)
+{
+    krb5_error_code ret;
+    krb5_storage *in;
+    unsigned char buf[3000];
+    krb5_data data;
+    uint32_t i, n = 2000;
+    int fd;
+
+    for (i = 0; i < sizeof(buf); i++)
+	buf[i] = i * 7;
+
+    krb5_storage_truncate(sp, 0);
+    for (i = 0; i < n; i++) {
+	data.data = buf;
+	data.length = (i * 31) % sizeof(buf);
+	krb5_storage_reserve(sp, data.length + 4);
+	ret = krb5_store_data(sp, data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_store_data");
+    }
+
+    fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0)
+	krb5_err(context, 1, errno, "open(%s)", fn);
+    ret = krb5_storage_to_fd(sp, fd);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_storage_to_fd");
+    if (lseek(fd, 0, SEEK_SET) != 0)
+	krb5_err(context, 1, errno, "lseek");
+
+    in = krb5_storage_from_fd(fd);
+    if (in == NULL)
+	krb5_errx(context, 1, "krb5_storage_from_fd: %s no mem", fn);
+    for (i = 0; i < n; i++) {
+	ret = krb5_ret_data(in, &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_ret_data: %u", (unsigned)i);
+	if (data.length != (i * 31) % sizeof(buf) ||
+	    memcmp(data.data, buf, data.length) != 0)
+	    krb5_errx(context, 1, "record %u mismatch", (unsigned)i);
+	krb5_data_free(&data);
+    }
+    ret = krb5_ret_data(in, &data);
+    if (ret != HEIM_ERR_EOF)
+	krb5_errx(context, 1, "trailing data after records");
+    krb5_storage_free(in);
+    close(fd);
+    unlink(fn);
+
+    /* truncate into the middle, then extend with zeros */
+    krb5_storage_truncate(sp, 5000);
+    if (krb5_storage_seek(sp, 0, SEEK_END) != 5000)
+	krb5_errx(context, 1, "length not 5000");
+    krb5_storage_truncate(sp, 9000);
+    ret = krb5_storage_to_data(sp, &data);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_storage_to_data");
+    if (data.length != 9000)
+	krb5_errx(context, 1, "length not 9000");
+    for (i = 5000; i < 9000; i++)
+	if (((unsigned char *)data.data)[i] != 0)
+	    krb5_errx(context, 1, "extension not zero");
+    krb5_data_free(&data);
+}
+
+/*
+ * Time building and writing out a buffer of `n' records of around
+ * the size of a principal in an iprop dump.
+ */
+
+static void
+time_records(krb5_context context, const char *name,
+	     krb5_storage *(*create)(void), int reserve, int n)
+{
+    struct timeval tv1, tv2;
+    krb5_storage *sp;
+    krb5_error_code ret;
+    unsigned char buf[1024];
+    krb5_data data;
+    int i, fd;
+
+    memset(buf, 0x55, sizeof(buf));
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+	krb5_err(context, 1, errno, "open(/dev/null)");
+
+    gettimeofday(&tv1, NULL);
+
+    sp = (*create)();
+    if (sp == NULL)
+	krb5_errx(context, 1, "%s: no mem", name);
+    for (i = 0; i < n; i++) {
+	data.data = buf;
+	data.length = 400 + (i % 600);
+	if (reserve)
+	    krb5_storage_reserve(sp, data.length + 8);
+	krb5_store_int32(sp, i);
+	ret = krb5_store_data(sp, data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_store_data");
+    }
+    ret = krb5_storage_to_fd(sp, fd);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_storage_to_fd");
+    krb5_storage_free(sp);
+
+    gettimeofday(&tv2, NULL);
+    close(fd);
+
+    timevalsub(&tv2, &tv1);
+
+    printf("%-8s%s records: %7d time: %3ld.%06ld\n",
+	   name, reserve ? " reserve" : "        ", n,
+	   (long)tv2.tv_sec, (long)tv2.tv_usec);
+}
+
 /*
  *
  */
 
 static int version_flag = 0;
 static int help_flag	= 0;
+static int speed_flag	= 0;
 
 static struct getargs args[] = {
+    {"speed",	0,	arg_flag,	&speed_flag,
+     "time memory storages", NULL },
     {"version",	0,	arg_flag,	&version_flag,
      "print version", NULL },
     {"help",	0,	arg_flag,	&help_flag,
@@ -288,6 +415,19 @@ main(int argc, char **argv)
     if (ret)
 	errx (1, "krb5_init_context failed: %d", ret);
 
+    if (speed_flag) {
+	int n;
+
+	for (n = 10000; n <= 100000; n *= 10) {
+	    time_records(context, "emem", krb5_storage_emem, 0, n);
+	    time_records(context, "emem", krb5_storage_emem, 1, n);
+	    time_records(context, "chunked", krb5_storage_chunked, 0, n);
+	    time_records(context, "chunked", krb5_storage_chunked, 1, n);
+	}
+	krb5_free_context(context);
+	return 0;
+    }
+
     /*
      * Test encoding/decoding of primotive types on diffrent backends
      */
@@ -298,6 +438,18 @@ main(int argc, char **argv)
 
     test_storage(context, sp);
     check_too_large(context, sp);
+    test_records(context, sp, fn);
+    krb5_storage_free(sp);
+
+    sp = krb5_storage_chunked();
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_chunked: no mem");
+
+    test_storage(context, sp);
+    check_too_large(context, sp);
+    test_records(context, sp, fn);
+    /* again, into the chunks the truncation kept */
+    test_records(context, sp, fn);
     krb5_storage_free(sp);
 
 
@@ -321,6 +321,8 @@ check_log(krb5_context context, const char *path, char *data)
     if(strcmp(p, "STDERR") == 0 ||
        strcmp(p, "CONSOLE") == 0 ||
        (strncmp(p, "FILE", 4) == 0 && (p[4] == ':' || p[4] == '=')) ||
+       strncmp(p, "ASYNC:", 6) == 0 ||
+       strncmp(p, "ASYNC-JSON:", 11) == 0 ||
        (strncmp(p, "DEVICE", 6) == 0 && p[6] == '='))
 	return 0;
     if(strncmp(p, "SYSLOG", 6) == 0){
@@ -556,10 +558,17 @@ struct entry kdc_entries[] = {
     { "enable-pkinit", krb5_config_string, check_boolean, 0 },
     { "encode_as_rep_as_tgs_rep", krb5_config_string, check_boolean, 0 },
     { "enforce-transited-policy", krb5_config_string, NULL, 1 },
+    { "hdb-ldap-cache-size", krb5_config_string, check_numeric, 0 },
+    { "hdb-ldap-cache-ttl", krb5_config_string, check_time, 0 },
+    { "hdb-ldap-connections", krb5_config_string, check_numeric, 0 },
     { "hdb-ldap-create-base", krb5_config_string, NULL, 0 },
+    { "hdb-sqlite-readers", krb5_config_string, check_numeric, 0 },
+    { "hdb-sqlite-wal", krb5_config_string, check_boolean, 0 },
     { "iprop-acl", krb5_config_string, NULL, 0 },
     { "iprop-stats", krb5_config_string, NULL, 0 },
     { "kdc-request-log", krb5_config_string, NULL, 0 },
+    { "kdc-request-log-ring-size", krb5_config_string, check_bytes, 0 },
+    { "kdc-request-log-sample", krb5_config_string, check_numeric, 0 },
     { "kdc_warn_pwexpire", krb5_config_string, check_time, 0 },
     { "key-file", krb5_config_string, NULL, 0 },
     { "kx509_ca", krb5_config_string, NULL, 0 },
@@ -570,7 +579,11 @@ struct entry kdc_entries[] = {
     { "max-request", krb5_config_string, check_bytes, 0 },
     { "pkinit_allow_proxy_certificate", krb5_config_string, check_boolean, 0 },
     { "pkinit_anchors", krb5_config_string, NULL, 0 },
+    { "pkinit_chain_cache_size", krb5_config_string, check_numeric, 0 },
+    { "pkinit_check_revocation", krb5_config_string, check_boolean, 0 },
     { "pkinit_dh_min_bits", krb5_config_string, check_numeric, 0 },
+    { "pkinit_dh_pool_size", krb5_config_string, check_numeric, 0 },
+    { "pkinit_dh_pool_threads", krb5_config_string, check_numeric, 0 },
     { "pkinit_identity", krb5_config_string, NULL, 0 },
     { "pkinit_kdc_friendly_name", krb5_config_string, NULL, 0 },
     { "pkinit_kdc_ocsp", krb5_config_string, NULL, 0 },
@@ -578,9 +591,14 @@ struct entry kdc_entries[] = {
     { "pkinit_pool", krb5_config_string, NULL, 0 },
     { "pkinit_principal_in_certificate", krb5_config_string, check_boolean, 0 },
     { "pkinit_revoke", krb5_config_string, NULL, 0 },
+    { "pkinit_revoke_refresh_interval", krb5_config_string, check_numeric, 0 },
+    { "pkinit_verify_threads", krb5_config_string, check_numeric, 0 },
     { "pkinit_win2k_require_binding", krb5_config_string, check_boolean, 0 },
     { "ports", krb5_config_string, NULL, 0 },
+    { "preauth-cache-size", krb5_config_string, check_numeric, 0 },
     { "preauth-use-strongest-session-key", krb5_config_string, check_boolean, 0 },
+    { "reply-cache-lifetime", krb5_config_string, check_time, 0 },
+    { "reply-cache-size", krb5_config_string, check_bytes, 0 },
     { "require_initial_kca_tickets", krb5_config_string, check_boolean, 0 },
     { "require-preauth", krb5_config_string, check_boolean, 0 },
     { "svc-use-strongest-session-key", krb5_config_string, check_boolean, 0 },
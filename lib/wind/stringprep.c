@@ -39,6 +39,53 @@
 #include <string.h>
 #include <errno.h>
 
+/*
+ * Printable US-ASCII is left as is by normalization, is not
+ * prohibited in any profile and has no bidi properties, so the only
+ * step that can change it is the case mapping.  test-ldap checks this
+ * against the tables.
+ */
+
+static int
+ascii_printable_p(const uint32_t *in, size_t in_len)
+{
+    uint32_t bad = 0;
+    size_t i;
+
+    /* no early exit, the loop is simple enough to be vectorized */
+    for (i = 0; i < in_len; i++)
+	bad |= (uint32_t)(in[i] - 0x20) > 0x5e;
+    return bad == 0;
+}
+
+static int
+stringprep_ascii(const uint32_t *in, size_t in_len,
+		 uint32_t *out, size_t *out_len,
+		 wind_profile_flags flags)
+{
+    size_t i;
+    int ret;
+
+    /* the case mapping does not touch spaces, so it can go last */
+    if (flags & WIND_PROFILE_LDAP_CASE_EXACT_ATTRIBUTE) {
+	ret = _wind_ldap_case_exact_attribute(in, in_len, out, out_len);
+	if (ret)
+	    return ret;
+    } else {
+	if (in_len > *out_len)
+	    return WIND_ERR_OVERRUN;
+	memcpy(out, in, sizeof(out[0]) * in_len);
+	*out_len = in_len;
+    }
+
+    if (flags & (WIND_PROFILE_NAME|WIND_PROFILE_LDAP_CASE)) {
+	for (i = 0; i < *out_len; i++)
+	    if (out[i] >= 0x41 && out[i] <= 0x5a)
+		out[i] += 0x20;
+    }
+    return 0;
+}
+
 /**
  * Process a input UCS4 string according a string-prep profile.
  *
@@ -67,6 +114,9 @@ wind_stringprep(const uint32_t *in, size_t in_len,
 	return 0;
     }
 
+    if (ascii_printable_p(in, in_len))
+	return stringprep_ascii(in, in_len, out, out_len, flags);
+
     tmp = malloc(tmp_len * sizeof(uint32_t));
     if (tmp == NULL)
 	return ENOMEM;
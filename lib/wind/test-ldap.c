@@ -61,6 +61,70 @@ static const struct testcase testcases2[] = {
     { { 0x20, 0x41 }, 2, { 0x20, 0x61}, 2 }
 };
 
+static const wind_profile_flags profiles[] = {
+    WIND_PROFILE_NAME,
+    WIND_PROFILE_SASL,
+    WIND_PROFILE_LDAP,
+    WIND_PROFILE_LDAP_CASE,
+    WIND_PROFILE_LDAP|WIND_PROFILE_LDAP_CASE_EXACT_ATTRIBUTE
+};
+
+/* all of stringprep the long way, to compare the US-ASCII shortcut with */
+
+static int
+stringprep_tables(const uint32_t *in, size_t in_len,
+		  uint32_t *out, size_t *out_len,
+		  wind_profile_flags flags)
+{
+    uint32_t tmp[MAX_LENGTH * 3];
+    size_t tmp_len = sizeof(tmp)/sizeof(tmp[0]), olen;
+    int ret;
+
+    ret = _wind_stringprep_map(in, in_len, tmp, &tmp_len, flags);
+    if (ret)
+	return ret;
+    olen = tmp_len;
+    ret = _wind_stringprep_normalize(tmp, tmp_len, tmp, &olen);
+    if (ret)
+	return ret;
+    if (_wind_stringprep_prohibited(tmp, olen, flags) ||
+	_wind_stringprep_testbidi(tmp, olen, flags))
+	return 1;
+    if (flags & WIND_PROFILE_LDAP_CASE_EXACT_ATTRIBUTE)
+	return _wind_ldap_case_exact_attribute(tmp, olen, out, out_len);
+    memcpy(out, tmp, sizeof(out[0]) * olen);
+    *out_len = olen;
+    return 0;
+}
+
+static unsigned
+check_ascii(const uint32_t *in, size_t in_len)
+{
+    uint32_t out[MAX_LENGTH * 3], out2[MAX_LENGTH * 3];
+    size_t olen, olen2;
+    unsigned failures = 0;
+    unsigned i;
+    int ret;
+
+    for (i = 0; i < sizeof(profiles)/sizeof(profiles[0]); i++) {
+	olen = olen2 = sizeof(out)/sizeof(out[0]);
+	ret = wind_stringprep(in, in_len, out, &olen, profiles[i]);
+	if (ret) {
+	    printf("ascii: 0x%x profile %x: %d\n",
+		   (unsigned)in[0], (unsigned)profiles[i], ret);
+	    failures++;
+	    continue;
+	}
+	ret = stringprep_tables(in, in_len, out2, &olen2, profiles[i]);
+	if (ret || olen != olen2 ||
+	    memcmp(out, out2, sizeof(out[0]) * olen) != 0) {
+	    printf("ascii: 0x%x profile %x: differs from tables\n",
+		   (unsigned)in[0], (unsigned)profiles[i]);
+	    failures++;
+	}
+    }
+    return failures;
+}
 
 int
 main(void)
@@ -68,6 +132,7 @@ main(void)
     uint32_t out[MAX_LENGTH];
     unsigned failures = 0;
     unsigned i;
+    uint32_t c;
     size_t olen;
     int ret;
 
@@ -124,5 +189,13 @@ main(void)
 	}
     }
 
+    for (c = 0x20; c < 0x7f; c++)
+	failures += check_ascii(&c, 1);
+    {
+	const uint32_t s[] = { 0x20, 0x20, 0x48, 0x35, 0x4c, 0x20, 0x20,
+			       0x7e, 0x20, 0x7a };
+	failures += check_ascii(s, sizeof(s)/sizeof(s[0]));
+    }
+
     return failures != 0;
 }
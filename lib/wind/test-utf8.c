@@ -65,6 +65,8 @@ static const char *failing_testcases[] = {
     "\xF0\x80\x80",
     "\xF0\x80\x80\x01",
     "\xF0\x80\x80\xFF",
+    "12345678\x80",
+    "1234567\xC0\x01",
     NULL
 };
 
@@ -97,6 +99,13 @@ static const struct testcase testcases[] = {
     {"\xF0\x81\x80\x80", 1, {0x1000}, 0},
     {"\xF1\x80\x80\x80", 1, {0x40000}, 0},
     {"\xF7\xBF\xBF\xBF", 1, {0X1FFFFF}, 1},
+    {"12345678", 8, {0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38}, 0},
+    {"123456789", 9,
+     {0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39}, 0},
+    {"\xC3\xA5" "12345678", 9,
+     {0xE5, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38}, 0},
+    {"12345678\xC3\xA5", 9,
+     {0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0xE5}, 0},
 };
 
 int
@@ -114,12 +114,35 @@ utf8toutf32(const unsigned char **pp, uint32_t *out)
 int
 wind_utf8ucs4(const char *in, uint32_t *out, size_t *out_len)
 {
-    const unsigned char *p;
+    const unsigned char *p, *end;
     size_t o = 0;
     int ret;
 
-    for (p = (const unsigned char *)in; *p != '\0'; ++p) {
+    p = (const unsigned char *)in;
+    end = p + strlen(in);
+
+    for (; p < end; ++p) {
 	uint32_t u;
+	uint64_t w;
+
+	/* runs of US-ASCII are converted eight bytes at a time */
+	while (end - p >= 8) {
+	    size_t i;
+
+	    memcpy(&w, p, sizeof(w));
+	    if (w & 0x8080808080808080ULL)
+		break;
+	    if (out) {
+		if (o + 8 > *out_len)
+		    return WIND_ERR_OVERRUN;
+		for (i = 0; i < 8; i++)
+		    out[o + i] = p[i];
+	    }
+	    o += 8;
+	    p += 8;
+	}
+	if (p == end)
+	    break;
 
 	ret = utf8toutf32(&p, &u);
 	if (ret)